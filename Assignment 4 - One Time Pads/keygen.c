@@ -18,6 +18,17 @@
 //						key file of 256 characters called “mykey” (note that mykey is 257 characters long 
 //						because of the newline): $ keygen 256 > mykey
 //
+//				The key is generated a block at a time into a fixed buffer and written to stdout in large
+//				writes, so memory use does not grow with the key length. Options:
+//
+//				[x]		--secure - draw from the kernel CSPRNG (getrandom) instead of the fast xoshiro256**
+//						generator
+//				[x]		--threads N - fill independent blocks on N threads; the blocks are still written in
+//						order, so each thread needs only its own block buffer
+//				[x]		--seed S - seed the fast generator with S instead of the kernel, so the same key
+//						can be made again. Every block is seeded from S and its index, so the key is the
+//						same whatever the thread count.
+//
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
 
 #include <stdlib.h>
@@ -26,6 +37,8 @@
 #include <unistd.h>
 #include <assert.h>
 #include <time.h>
+#include <getopt.h>
+#include <pthread.h>
 
 /**********************************************************
 // GLOBAL DEFINITIONS
@@ -37,6 +50,37 @@
 #define TRUE 1				// TRUE == 1
 #define FALSE 0				// FALSE == 0
 
+#define KEY_BLOCK	(1 << 20)	// characters generated and written at a time
+#define MAX_THREADS	64			// upper bound on --threads
+
+#include "otpRand.c"
+
+// keygenShared
+// ......................
+struct keygenShared
+{
+	unsigned long long length;	// characters in the key
+	unsigned long long blocks;	// KEY_BLOCK sized blocks in the key
+	unsigned long long next;	// the block whose turn it is to be written
+	uint64_t seed;				// the seed every block's stream comes from
+	int seeded;					// 1 if the seed came from --seed
+	int source;					// RAND_FAST or RAND_SECURE
+	int threads;				// threads filling blocks
+	int failed;					// set when any thread fails, so the others stop
+	pthread_mutex_t lock;		// guards next and failed
+	pthread_cond_t turn;		// signalled whenever next moves on
+};
+
+// keygenWorker
+// ......................
+struct keygenWorker
+{
+	int index;					// this thread's first block
+	struct otpRand rng;			// the generator for the block being filled
+	char* block;				// this thread's block buffer
+	struct keygenShared* shared;
+};
+
 /**********************************************************
 // HELPER FUNCTIONS
 // ********************************************************/
@@ -49,57 +93,82 @@
 //..........................................................
 void usageMessage()
 {
-	fprintf(stderr, "%sUsage\n-----\n%skeygen [keylength]\n%swhere %s[keylength] %sis the length of the key file in characters%s\n\n", GRN, CYN, GRN, CYN, GRN, NRM);
-}
-
-// genRandCharacter
-//
-// description: generates a random character in the range
-//				A-Z (inclusive) plus the SPACE character
-//	
-//	@return		randC - a random character in the range
-//				A-Z (inclusive) plus the SPACE character
-//..........................................................
-char genRandCharacter()
-{
-	char randC = 'b';				// initialize a random character variable
-
-	randC = 'A' + (rand() %27);		// generate a random character in the range A-[ (inclusive)
-	if(randC == '[')
-	{
-		randC = ' ';				// if the character generated is '[', replace it with a SPACE
-	}
-
-	return randC;					// return the random character
+	fprintf(stderr, "%sUsage\n-----\n%skeygen [keylength] [--secure] [--threads N] [--seed S]\n%swhere %s[keylength] %sis the length of the key file in characters%s\n\n", GRN, CYN, GRN, CYN, GRN, NRM);
 }
 
 // validateArguments
 //
-// description: validates that a single argument is passed
-//				to keygen and that it is an integer in the
-//				range 1-10000 (inclusive)
+// description: reads keygen's options and validates that a
+//				single argument is passed to keygen and that it
+//				is an integer in the range 1-2,000,000,000
+//				(inclusive)
 //
 // @param:		argc - the number of arguments passed to
 //				keygen
 // @param:		argv[] - an array holding the arguments
 //				passed to keygen
-// @param:		correctNum - the correct number of
-//				arguments expected
+// @param:		shared - filled with the key length, source
+//				thread count and seed
 // @return:		TRUE - if the arguments are valid
 //				FALSE - if the arguments are invalid
 //..........................................................
-int validateArguments(int argc, char* argv[], int correctNum)
+int validateArguments(int argc, char* argv[], struct keygenShared* shared)
 {
+	static struct option longOptions[] =
+	{
+		{ "secure",		no_argument,		0, 's' },
+		{ "threads",	required_argument,	0, 't' },
+		{ "seed",		required_argument,	0, 'S' },
+		{ 0, 0, 0, 0 }
+	};
+	int opt;
+	char* end;
+
 	assert(argv);	// ensure argv exists
 
-	// validate the number of arguments passed (argc) against the correct number of arguments expected (correctNum)
-	if(argc != correctNum)
+	shared->source = RAND_FAST;
+	shared->threads = 1;
+	while ((opt = getopt_long(argc, argv, "st:", longOptions, NULL)) != -1)
 	{
-		if (argc < correctNum)	// let the user know that they passed too few arguments
+		switch (opt)
+		{
+			case 's': shared->source = RAND_SECURE; break;
+			case 't': shared->threads = atoi(optarg); break;
+			case 'S':
+				errno = 0;
+				shared->seed = strtoull(optarg, &end, 0);
+				if (errno != 0 || end == optarg || *end != '\0')
+				{
+					fprintf(stderr, "\n%sERROR: --seed must be an unsigned 64-bit integer!%s\n\n", RED, NRM);
+					usageMessage();
+					return FALSE;
+				}
+				shared->seeded = TRUE;
+				break;
+			default:  usageMessage(); return FALSE;
+		}
+	}
+	if (shared->seeded && shared->source == RAND_SECURE)
+	{
+		fprintf(stderr, "\n%sERROR: --seed cannot be used with --secure!%s\n\n", RED, NRM);
+		usageMessage();
+		return FALSE;
+	}
+	if (shared->threads < 1 || shared->threads > MAX_THREADS)
+	{
+		fprintf(stderr, "\n%sERROR: --threads must be between 1 and %d!%s\n\n", RED, MAX_THREADS, NRM);
+		usageMessage();
+		return FALSE;
+	}
+
+	// validate the number of arguments passed against the single key length expected
+	if(optind != argc - 1)
+	{
+		if (optind > argc - 1)	// let the user know that they passed too few arguments
 		{
 			fprintf(stderr, "\n%sERROR: too few arguments passed!%s\n\n", RED, NRM);
 		}
-		else // (argc > correctNum)	let the user know they passed too many arguments
+		else // let the user know they passed too many arguments
 		{
 			fprintf(stderr, "\n%sERROR: too many arguments passed!%s\n\n", RED, NRM);
 		}
@@ -110,16 +179,108 @@ int validateArguments(int argc, char* argv[], int correctNum)
 	}
 
 	// validate that the argument passed (argv) is greater than 0 and less than 2,000,000,000 (just under the size of an int)
-	if(atoi(argv[1]) < 1 || atoi(argv[1]) > 2000000000)
+	if(atoi(argv[optind]) < 1 || atoi(argv[optind]) > 2000000000)
 	{
 		fprintf(stderr, "\n%sERROR: enter an integer between 1 and 2,000,000,000 (inclusive)!%s\n\n", RED, NRM);
 		usageMessage();
 		return FALSE;
 	}
 
+	shared->length = atoi(argv[optind]);
+	shared->blocks = (shared->length + KEY_BLOCK - 1) / KEY_BLOCK;
 	return TRUE;
 }
 
+// writeOut
+//
+// description: writes a buffer to stdout, retrying short
+//				writes
+//
+// @param		buffer - the bytes to write
+// @param		length - the number of bytes
+// @return		0, or -1 if stdout could not be written
+//..........................................................
+int writeOut(const char* buffer, size_t length)
+{
+	ssize_t written;
+
+	while (length > 0)
+	{
+		written = write(STDOUT_FILENO, buffer, length);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		buffer += written;
+		length -= written;
+	}
+	return 0;
+}
+
+// keygenThread
+//
+// description: fills every threads'th block of the key. A
+//				block is generated without holding the lock,
+//				then written once every block before it is out,
+//				so the key comes out in order while the threads
+//				generate in parallel.
+//
+// @param		arg - the thread's keygenWorker
+//..........................................................
+void* keygenThread(void* arg)
+{
+	struct keygenWorker* worker = arg;
+	struct keygenShared* shared = worker->shared;
+	unsigned long long block;
+	size_t length;
+	int failed;
+
+	for (block = worker->index; block < shared->blocks; block += shared->threads)
+	{
+		length = KEY_BLOCK;
+		if (block == shared->blocks - 1)
+		{
+			length = shared->length - block * KEY_BLOCK;
+		}
+		randSeedBlock(&worker->rng, shared->seed, block);
+		failed = randFill(shared->source, &worker->rng, worker->block, length) < 0;
+		if (failed)
+		{
+			fprintf(stderr, "%sERROR: getrandom failed: %s%s\n", RED, strerror(errno), NRM);
+		}
+
+		// wait for this block's turn, then write it
+		pthread_mutex_lock(&shared->lock);
+		while (shared->next != block && !shared->failed)
+		{
+			pthread_cond_wait(&shared->turn, &shared->lock);
+		}
+		failed |= shared->failed;
+		pthread_mutex_unlock(&shared->lock);
+
+		if (!failed && writeOut(worker->block, length) < 0)
+		{
+			fprintf(stderr, "%sERROR: writing the key to stdout: %s%s\n", RED, strerror(errno), NRM);
+			failed = 1;
+		}
+
+		pthread_mutex_lock(&shared->lock);
+		shared->next++;
+		shared->failed |= failed;
+		pthread_cond_broadcast(&shared->turn);
+		pthread_mutex_unlock(&shared->lock);
+		if (failed)
+		{
+			break;
+		}
+	}
+	return NULL;
+}
+
 /**********************************************************
 // MAIN FUNCTION
 // ********************************************************/
@@ -136,34 +297,68 @@ int validateArguments(int argc, char* argv[], int correctNum)
 //..........................................................
 int main(int argc, char* argv[])
 {
-	// initialize rand
-	srand(time(NULL));
+	struct keygenShared shared;
+	struct keygenWorker workers[MAX_THREADS];
+	pthread_t threads[MAX_THREADS];
+	int i;
 
 	// validate that a single, numeric argument was passed to keygen
-	if(validateArguments(argc, argv, 2) == 0)
+	memset(&shared, 0, sizeof(shared));
+	if(validateArguments(argc, argv, &shared) == 0)
 	{
 		// if the arguments passed are invalid, exit the program and return 1
 		return 1;
 	}
+	if ((unsigned long long)shared.threads > shared.blocks)
+	{
+		shared.threads = shared.blocks;		// no point in threads with no block to fill
+	}
+	pthread_mutex_init(&shared.lock, NULL);
+	pthread_cond_init(&shared.turn, NULL);
 
-	// initialize variables
-	int keyLength = atoi(argv[1]);					// set keyLength to the argument passed to keygen
-	int i = 0;										// a looping variable
-	char* key = calloc(keyLength+1, sizeof(char));	// holds a keyLength size key plus a null terminator
-	char randC[2] = "a";							// holds a random character to add to key
+	if (!shared.seeded)
+	{
+		shared.seed = randEntropy();
+	}
 
-	// generate random characters in the range A-Z (inclusive) and SPACE to enter into the key
-	for(i=0; i<keyLength; i++)
+	// give every thread its own block buffer
+	for (i = 0; i < shared.threads; i++)
 	{
-		randC[0] = genRandCharacter();
-		key = strcat(key, randC);
+		workers[i].index = i;
+		workers[i].shared = &shared;
+		workers[i].block = malloc(KEY_BLOCK);
+		if (workers[i].block == NULL)
+		{
+			fprintf(stderr, "%sERROR: allocating the key buffer%s\n", RED, NRM);
+			return 1;
+		}
 	}
 
-	// print the key, plus a newline, to stdout
-	printf("%s\n", key);
+	// generate and write the key, then the newline
+	for (i = 1; i < shared.threads; i++)
+	{
+		if (pthread_create(&threads[i], NULL, keygenThread, &workers[i]) != 0)
+		{
+			fprintf(stderr, "%sERROR: creating a keygen thread%s\n", RED, NRM);
+			return 1;
+		}
+	}
+	keygenThread(&workers[0]);
+	for (i = 1; i < shared.threads; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	if (!shared.failed && writeOut("\n", 1) < 0)
+	{
+		fprintf(stderr, "%sERROR: writing the key to stdout: %s%s\n", RED, strerror(errno), NRM);
+		shared.failed = 1;
+	}
 
 	// garbage collection
-	free(key);
+	for (i = 0; i < shared.threads; i++)
+	{
+		free(workers[i].block);
+	}
 
-	return 0;
-}
\ No newline at end of file
+	return shared.failed ? 1 : 0;
+}
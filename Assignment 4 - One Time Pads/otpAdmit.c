@@ -0,0 +1,167 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpAdmit.c - admission control for the daemons. Two things are bounded across every worker,
+//				forked child and event loop thread of a daemon:
+//
+//				[x]		connections - connections being served at once (--max-conns)
+//				[x]		bytes - request bytes held in memory at once, i.e. text messages waiting for
+//						their key and binary chunk buffers (--max-bytes)
+//
+//				Both are gauges in one shared anonymous mapping made before any fork, taken and given
+//				back with atomic adds. A connection over the connection limit is still accepted, but
+//				only to be told OTP_BUSY (or BUSY_FAIL in the text framing) with a retry-after time, so
+//				the client learns to back off instead of waiting in an ever longer queue or being reset.
+//				A request that would go over the byte limit is refused the same way. Work already
+//				admitted keeps its latency while the daemon is overloaded, and the excess costs only
+//				the refusal.
+//
+//				A limit of 0 means no limit.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <sys/mman.h>
+
+/**********************************************************
+// ADMISSION GLOBALS
+// ********************************************************/
+
+#define ADMIT_RETRY_MS	100		// default retry-after for refused clients, in milliseconds
+
+// otpAdmission
+// ......................
+struct otpAdmission
+{
+	long long maxConnections;	// connections served at once, 0 for no limit
+	long long maxBytes;			// request bytes held at once, 0 for no limit
+	unsigned int retryAfterMs;	// retry-after sent to refused clients
+	long long connections __attribute__((aligned(64)));	// connections being served
+	long long bytes __attribute__((aligned(64)));		// request bytes held
+};
+
+/**********************************************************
+// ADMISSION FUNCTIONS
+// ********************************************************/
+
+// admitOpen
+//
+// description: maps the gauges, shared with every process
+//				forked afterwards, and sets the limits
+//
+// @param		maxConnections - connection limit, 0 for none
+// @param		maxBytes - byte limit, 0 for none
+// @param		retryAfterMs - retry-after for refused clients
+// @return		the admission state, or NULL if the mapping
+//				failed
+//..........................................................
+struct otpAdmission* admitOpen(long long maxConnections, long long maxBytes, unsigned int retryAfterMs)
+{
+	struct otpAdmission* admit = mmap(NULL, sizeof(struct otpAdmission), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (admit == MAP_FAILED)
+	{
+		return NULL;
+	}
+	admit->maxConnections = maxConnections;
+	admit->maxBytes = maxBytes;
+	admit->retryAfterMs = retryAfterMs;
+	return admit;
+}
+
+// admitTake
+//
+// description: takes n units of a gauge if that keeps it
+//				within its limit
+//
+// @param		gauge - the gauge
+// @param		limit - its limit, 0 for none
+// @param		n - units to take
+// @return		1 if taken, 0 if over the limit
+//..........................................................
+int admitTake(long long* gauge, long long limit, long long n)
+{
+	if (__atomic_add_fetch(gauge, n, __ATOMIC_RELAXED) > limit && limit > 0)
+	{
+		__atomic_sub_fetch(gauge, n, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
+
+// admitConnection
+//
+// description: admits a newly accepted connection
+//
+// @param		admit - the admission state, or NULL
+// @return		1 if admitted (admitLeave() later), 0 if the
+//				client should be told to retry
+//..........................................................
+int admitConnection(struct otpAdmission* admit)
+{
+	return admit == NULL || admitTake(&admit->connections, admit->maxConnections, 1);
+}
+
+// admitLeave
+//
+// description: gives back an admitted connection
+//
+// @param		admit - the admission state, or NULL
+//..........................................................
+void admitLeave(struct otpAdmission* admit)
+{
+	if (admit != NULL)
+	{
+		__atomic_sub_fetch(&admit->connections, 1, __ATOMIC_RELAXED);
+	}
+}
+
+// admitBytes
+//
+// description: reserves request buffer bytes
+//
+// @param		admit - the admission state, or NULL
+// @param		n - bytes to hold
+// @return		1 if reserved (admitReturn() later), 0 if the
+//				request should be told to retry
+//..........................................................
+int admitBytes(struct otpAdmission* admit, size_t n)
+{
+	return admit == NULL || n == 0 || admitTake(&admit->bytes, admit->maxBytes, (long long)n);
+}
+
+// admitReturn
+//
+// description: gives back reserved bytes
+//
+// @param		admit - the admission state, or NULL
+// @param		n - bytes no longer held
+//..........................................................
+void admitReturn(struct otpAdmission* admit, size_t n)
+{
+	if (admit != NULL && n > 0)
+	{
+		__atomic_sub_fetch(&admit->bytes, (long long)n, __ATOMIC_RELAXED);
+	}
+}
+
+// admitExpose
+//
+// description: writes the gauges and limits in the
+//				Prometheus text exposition format
+//
+// @param		admit - the admission state
+// @param		out - where to write
+//..........................................................
+void admitExpose(struct otpAdmission* admit, FILE* out)
+{
+	fprintf(out, "# HELP otp_connections_active Connections being served.\n# TYPE otp_connections_active gauge\n");
+	fprintf(out, "otp_connections_active %lld\n", __atomic_load_n(&admit->connections, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP otp_bytes_held Request bytes held in memory.\n# TYPE otp_bytes_held gauge\n");
+	fprintf(out, "otp_bytes_held %lld\n", __atomic_load_n(&admit->bytes, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP otp_connections_limit The --max-conns limit, 0 for none.\n# TYPE otp_connections_limit gauge\n");
+	fprintf(out, "otp_connections_limit %lld\n", admit->maxConnections);
+	fprintf(out, "# HELP otp_bytes_limit The --max-bytes limit, 0 for none.\n# TYPE otp_bytes_limit gauge\n");
+	fprintf(out, "otp_bytes_limit %lld\n", admit->maxBytes);
+}
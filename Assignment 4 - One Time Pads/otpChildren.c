@@ -0,0 +1,262 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpChildren.c - the daemon parent's record of the processes it has forked: pool workers,
+//				fork per connection children and the metrics process. Each live child is kept in an open
+//				addressing hash table by pid, with what it is and when it was forked, so when it is reaped
+//				its exit status and lifetime can go into the stats (see statsChild() in otpStats.c) and
+//				the parent knows what to do about it.
+//
+//				The table grows with the number of live children, not with the number ever forked, and
+//				deletes shift entries back instead of leaving tombstones, so a daemon that forks for every
+//				connection for months keeps a table the size of its busiest moment.
+//
+//				Modes whose parent has other things to wait on (fork per connection, the event loop, io_uring)
+//				block SIGCHLD and read it from a signalfd alongside their sockets, so children are
+//				reaped as soon as they exit rather than whenever the next connection arrives.
+//
+//				Included by otpServer.c.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <pthread.h>
+#include <sys/signalfd.h>
+
+/**********************************************************
+// CHILD TABLE GLOBALS
+// ********************************************************/
+
+// child kinds
+// ......................
+#define CHILD_NONE			0		// not one of ours
+#define CHILD_WORKER		1		// a pool worker
+#define CHILD_CONNECTION	2		// a fork per connection child
+#define CHILD_METRICS		3		// the metrics process
+
+#define CHILD_TABLE_MIN		64		// initial table size, a power of two
+
+// otpChild
+// ......................
+struct otpChild
+{
+	pid_t pid;					// the child, or 0 for an empty slot
+	int kind;					// one of the CHILD_ kinds
+	int index;					// a worker's place in the pool
+	unsigned long long forkedAt;	// statsNow() when it was forked
+};
+
+// otpChildTable
+// ......................
+struct otpChildTable
+{
+	struct otpChild* slots;		// the table, size a power of two
+	size_t size;				// number of slots
+	size_t count;				// live children
+};
+
+struct otpChildTable serverChildren;	// the daemon parent's children
+
+/**********************************************************
+// CHILD TABLE FUNCTIONS
+// ********************************************************/
+
+// childHome
+//
+// description: the slot a pid hashes to
+//
+// @param		table - the table
+// @param		pid - the pid
+// @return		the slot index
+//..........................................................
+size_t childHome(struct otpChildTable* table, pid_t pid)
+{
+	return ((unsigned long long)pid * 0x9E3779B97F4A7C15ULL >> 32) & (table->size - 1);
+}
+
+// childGrow
+//
+// description: doubles the table, rehashing every child
+//
+// @param		table - the table
+// @return		0, or -1 if memory ran out
+//..........................................................
+int childGrow(struct otpChildTable* table)
+{
+	struct otpChild* old = table->slots;
+	size_t oldSize = table->size;
+	size_t i, j;
+
+	table->size = oldSize ? oldSize * 2 : CHILD_TABLE_MIN;
+	table->slots = calloc(table->size, sizeof(struct otpChild));
+	if (table->slots == NULL)
+	{
+		table->slots = old;
+		table->size = oldSize;
+		return -1;
+	}
+	for (i = 0; i < oldSize; i++)
+	{
+		if (old[i].pid != 0)
+		{
+			for (j = childHome(table, old[i].pid); table->slots[j].pid != 0; j = (j + 1) & (table->size - 1))
+			{
+			}
+			table->slots[j] = old[i];
+		}
+	}
+	free(old);
+	return 0;
+}
+
+// childTrack
+//
+// description: records a newly forked child. If the table
+//				cannot grow the child still runs; it is just
+//				reaped without stats.
+//
+// @param		table - the table
+// @param		pid - the child
+// @param		kind - one of the CHILD_ kinds
+// @param		index - a worker's place in the pool, else 0
+//..........................................................
+void childTrack(struct otpChildTable* table, pid_t pid, int kind, int index)
+{
+	size_t i;
+
+	if (pid <= 0 || ((table->count + 1) * 2 > table->size && childGrow(table) < 0))
+	{
+		return;
+	}
+	for (i = childHome(table, pid); table->slots[i].pid != 0; i = (i + 1) & (table->size - 1))
+	{
+	}
+	table->slots[i].pid = pid;
+	table->slots[i].kind = kind;
+	table->slots[i].index = index;
+	table->slots[i].forkedAt = statsNow();
+	table->count++;
+}
+
+// childForget
+//
+// description: takes a reaped child out of the table,
+//				shifting the entries after it back so no probe
+//				sequence is broken
+//
+// @param		table - the table
+// @param		pid - the reaped child
+// @param		child - receives its entry; kind CHILD_NONE if
+//				it was not in the table
+//..........................................................
+void childForget(struct otpChildTable* table, pid_t pid, struct otpChild* child)
+{
+	size_t i, j, home;
+
+	memset(child, 0, sizeof(*child));
+	if (table->size == 0)
+	{
+		return;
+	}
+	for (i = childHome(table, pid); table->slots[i].pid != pid; i = (i + 1) & (table->size - 1))
+	{
+		if (table->slots[i].pid == 0)
+		{
+			return;
+		}
+	}
+	*child = table->slots[i];
+	table->count--;
+
+	// backward shift: pull later entries of the same run into the gap if their home allows it
+	for (j = (i + 1) & (table->size - 1); table->slots[j].pid != 0; j = (j + 1) & (table->size - 1))
+	{
+		home = childHome(table, table->slots[j].pid);
+		if (((j - home) & (table->size - 1)) >= ((j - i) & (table->size - 1)))
+		{
+			table->slots[i] = table->slots[j];
+			i = j;
+		}
+	}
+	table->slots[i].pid = 0;
+}
+
+// childReaped
+//
+// description: forgets a reaped child and records its exit
+//				status and lifetime in the stats
+//
+// @param		stats - the counters, or NULL
+// @param		pid - the reaped child
+// @param		status - its status from waitpid()
+// @param		child - receives its entry
+//..........................................................
+void childReaped(struct otpStats* stats, pid_t pid, int status, struct otpChild* child)
+{
+	childForget(&serverChildren, pid, child);
+	if (child->kind != CHILD_NONE)
+	{
+		statsChild(stats, WIFSIGNALED(status) ? STATS_EXIT_SIGNAL : (WEXITSTATUS(status) == 0 ? STATS_EXIT_OK : STATS_EXIT_ERROR),
+			statsNow() - child->forkedAt);
+	}
+}
+
+// childSignals
+//
+// description: blocks SIGCHLD in the calling thread (and any
+//				thread it creates afterwards) and opens a
+//				non-blocking signalfd that becomes readable
+//				when a child exits
+//
+// @return		the signalfd
+//..........................................................
+int childSignals()
+{
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+	{
+		error("SERVER: ERROR blocking SIGCHLD");
+	}
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0)
+	{
+		error("SERVER: ERROR opening the SIGCHLD signalfd");
+	}
+	return fd;
+}
+
+// childUnblock
+//
+// description: unblocks SIGCHLD in a newly forked child,
+//				which inherits its parent's mask
+//..........................................................
+void childUnblock()
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+// childDrain
+//
+// description: empties a SIGCHLD signalfd. Exits are
+//				collected with waitpid() afterwards, since
+//				several can merge into one signal.
+//
+// @param		fd - the signalfd
+//..........................................................
+void childDrain(int fd)
+{
+	struct signalfd_siginfo info[8];
+
+	while (read(fd, info, sizeof(info)) > 0)
+	{
+	}
+}
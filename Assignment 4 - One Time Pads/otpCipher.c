@@ -0,0 +1,405 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpCipher.c - the mod 27 one-time pad kernel shared by the encryption and decryption daemons.
+//				The 27 characters A-Z and SPACE map to 0-26, with SPACE taking the place of '['; a message
+//				character is combined with a key character by adding (encryption) or subtracting
+//				(decryption) modulo 27.
+//
+//				Every version of the kernel is branch-free: SPACE is mapped with a compare and a blend, and
+//				the modulo is a single conditional subtract (or add) of 27, since the sum or difference of
+//				two values in 0-26 is never more than one step away from the range. The vector versions do
+//				16 (SSE2), 32 (AVX2) or 64 (AVX-512BW) characters per step and finish the tail with the
+//				scalar code. The best level the CPU supports is picked on the first call; cipherUse() forces
+//				a level, for the benchmark.
+//
+//				Only valid characters give a meaningful result. The clients check their files with
+//				cipherValid(), which has the same levels (AVX-512 machines use the AVX2 check), and invalid
+//				input still produces some character without touching anything outside the buffers.
+//
+//				Expects OP_ENC from otpProtocol.c.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <immintrin.h>
+
+/**********************************************************
+// CIPHER GLOBALS
+// ********************************************************/
+
+// kernel levels
+// ......................
+#define CIPHER_SCALAR	0		// one character at a time
+#define CIPHER_SSE2		1		// 16 characters per step
+#define CIPHER_AVX2		2		// 32 characters per step
+#define CIPHER_AVX512	3		// 64 characters per step, needs AVX-512BW
+#define CIPHER_LEVELS	4
+
+const char* cipherLevelNames[CIPHER_LEVELS] = { "scalar", "sse2", "avx2", "avx512" };
+
+// cipherKernel
+// ......................
+typedef void (*cipherKernel)(int op, char* message, const char* key, size_t n);
+typedef int (*validKernel)(const char* text, size_t n);
+
+void cipherResolve(int op, char* message, const char* key, size_t n);
+int validResolve(const char* text, size_t n);
+
+cipherKernel cipherBlock = cipherResolve;	// the kernel in use, picked on the first call
+validKernel cipherValid = validResolve;		// the character check in use, picked on the first call
+
+/**********************************************************
+// CIPHER FUNCTIONS
+// ********************************************************/
+
+// cipherChar
+//
+// description: combines one message character with one key
+//				character
+//
+// @param		op - OP_ENC or OP_DEC
+// @param		message - the message character
+// @param		key - the key character
+// @return		result - the encrypted or decrypted character
+//..........................................................
+char cipherChar(int op, int message, int key)
+{
+	int result;
+
+	message = (message == ' ') ? 26 : message - 'A';	// compiles to a conditional move
+	key = (key == ' ') ? 26 : key - 'A';
+
+	if (op == OP_ENC)
+	{
+		result = message + key;
+		result -= (result >= 27) * 27;
+	}
+	else
+	{
+		result = message - key;
+		result += (result < 0) * 27;
+	}
+	return (result == 26) ? ' ' : result + 'A';
+}
+
+// cipherScalar
+//
+// description: the portable kernel. Replaces n message
+//				characters in place with their combination
+//				with the key.
+//
+// @param		op - OP_ENC or OP_DEC
+// @param		message - the message, overwritten with the reply
+// @param		key - n key characters
+// @param		n - the number of characters
+//..........................................................
+void cipherScalar(int op, char* message, const char* key, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+	{
+		message[i] = cipherChar(op, message[i], key[i]);
+	}
+}
+
+// cipherSSE2
+//
+// description: the SSE2 kernel, 16 characters per step
+//
+// @param		op - OP_ENC or OP_DEC
+// @param		message - the message, overwritten with the reply
+// @param		key - n key characters
+// @param		n - the number of characters
+//..........................................................
+__attribute__((target("sse2")))
+void cipherSSE2(int op, char* message, const char* key, size_t n)
+{
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i letterA = _mm_set1_epi8('A');
+	const __m128i twentySix = _mm_set1_epi8(26);
+	const __m128i twentySeven = _mm_set1_epi8(27);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i m, k, isSpace, r;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		m = _mm_loadu_si128((const __m128i*)(message + i));
+		k = _mm_loadu_si128((const __m128i*)(key + i));
+
+		isSpace = _mm_cmpeq_epi8(m, space);				// map to 0-26
+		m = _mm_or_si128(_mm_andnot_si128(isSpace, _mm_sub_epi8(m, letterA)), _mm_and_si128(isSpace, twentySix));
+		isSpace = _mm_cmpeq_epi8(k, space);
+		k = _mm_or_si128(_mm_andnot_si128(isSpace, _mm_sub_epi8(k, letterA)), _mm_and_si128(isSpace, twentySix));
+
+		if (op == OP_ENC)
+		{
+			r = _mm_add_epi8(m, k);
+			r = _mm_sub_epi8(r, _mm_and_si128(_mm_cmpgt_epi8(r, twentySix), twentySeven));
+		}
+		else
+		{
+			r = _mm_sub_epi8(m, k);
+			r = _mm_add_epi8(r, _mm_and_si128(_mm_cmpgt_epi8(zero, r), twentySeven));
+		}
+
+		isSpace = _mm_cmpeq_epi8(r, twentySix);			// map back to characters
+		r = _mm_or_si128(_mm_andnot_si128(isSpace, _mm_add_epi8(r, letterA)), _mm_and_si128(isSpace, space));
+		_mm_storeu_si128((__m128i*)(message + i), r);
+	}
+	cipherScalar(op, message + i, key + i, n - i);
+}
+
+// cipherAVX2
+//
+// description: the AVX2 kernel, 32 characters per step
+//
+// @param		op - OP_ENC or OP_DEC
+// @param		message - the message, overwritten with the reply
+// @param		key - n key characters
+// @param		n - the number of characters
+//..........................................................
+__attribute__((target("avx2")))
+void cipherAVX2(int op, char* message, const char* key, size_t n)
+{
+	const __m256i space = _mm256_set1_epi8(' ');
+	const __m256i letterA = _mm256_set1_epi8('A');
+	const __m256i twentySix = _mm256_set1_epi8(26);
+	const __m256i twentySeven = _mm256_set1_epi8(27);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i m, k, r;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32)
+	{
+		m = _mm256_loadu_si256((const __m256i*)(message + i));
+		k = _mm256_loadu_si256((const __m256i*)(key + i));
+
+		m = _mm256_blendv_epi8(_mm256_sub_epi8(m, letterA), twentySix, _mm256_cmpeq_epi8(m, space));
+		k = _mm256_blendv_epi8(_mm256_sub_epi8(k, letterA), twentySix, _mm256_cmpeq_epi8(k, space));
+
+		if (op == OP_ENC)
+		{
+			r = _mm256_add_epi8(m, k);
+			r = _mm256_sub_epi8(r, _mm256_and_si256(_mm256_cmpgt_epi8(r, twentySix), twentySeven));
+		}
+		else
+		{
+			r = _mm256_sub_epi8(m, k);
+			r = _mm256_add_epi8(r, _mm256_and_si256(_mm256_cmpgt_epi8(zero, r), twentySeven));
+		}
+
+		r = _mm256_blendv_epi8(_mm256_add_epi8(r, letterA), space, _mm256_cmpeq_epi8(r, twentySix));
+		_mm256_storeu_si256((__m256i*)(message + i), r);
+	}
+	cipherScalar(op, message + i, key + i, n - i);
+}
+
+// cipherAVX512
+//
+// description: the AVX-512BW kernel, 64 characters per
+//				step, using mask registers for the blends
+//
+// @param		op - OP_ENC or OP_DEC
+// @param		message - the message, overwritten with the reply
+// @param		key - n key characters
+// @param		n - the number of characters
+//..........................................................
+__attribute__((target("avx512f,avx512bw")))
+void cipherAVX512(int op, char* message, const char* key, size_t n)
+{
+	const __m512i space = _mm512_set1_epi8(' ');
+	const __m512i letterA = _mm512_set1_epi8('A');
+	const __m512i twentySix = _mm512_set1_epi8(26);
+	const __m512i twentySeven = _mm512_set1_epi8(27);
+	const __m512i zero = _mm512_setzero_si512();
+	__m512i m, k, r;
+	size_t i;
+
+	for (i = 0; i + 64 <= n; i += 64)
+	{
+		m = _mm512_loadu_si512((const void*)(message + i));
+		k = _mm512_loadu_si512((const void*)(key + i));
+
+		m = _mm512_mask_blend_epi8(_mm512_cmpeq_epi8_mask(m, space), _mm512_sub_epi8(m, letterA), twentySix);
+		k = _mm512_mask_blend_epi8(_mm512_cmpeq_epi8_mask(k, space), _mm512_sub_epi8(k, letterA), twentySix);
+
+		if (op == OP_ENC)
+		{
+			r = _mm512_add_epi8(m, k);
+			r = _mm512_mask_sub_epi8(r, _mm512_cmpgt_epi8_mask(r, twentySix), r, twentySeven);
+		}
+		else
+		{
+			r = _mm512_sub_epi8(m, k);
+			r = _mm512_mask_add_epi8(r, _mm512_cmpgt_epi8_mask(zero, r), r, twentySeven);
+		}
+
+		r = _mm512_mask_blend_epi8(_mm512_cmpeq_epi8_mask(r, twentySix), _mm512_add_epi8(r, letterA), space);
+		_mm512_storeu_si512((void*)(message + i), r);
+	}
+	cipherScalar(op, message + i, key + i, n - i);
+}
+
+// validScalar
+//
+// description: the portable character check
+//
+// @param		text - the characters to check
+// @param		n - the number of characters
+// @return		1 if every character is A-Z or SPACE, else 0
+//..........................................................
+int validScalar(const char* text, size_t n)
+{
+	size_t i;
+	int bad = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		bad |= (unsigned char)(text[i] - 'A') > 25 && text[i] != ' ';
+	}
+	return !bad;
+}
+
+// validSSE2
+//
+// description: the SSE2 character check, 16 per step
+//
+// @param		text - the characters to check
+// @param		n - the number of characters
+// @return		1 if every character is A-Z or SPACE, else 0
+//..........................................................
+__attribute__((target("sse2")))
+int validSSE2(const char* text, size_t n)
+{
+	const __m128i beforeA = _mm_set1_epi8('A' - 1);
+	const __m128i afterZ = _mm_set1_epi8('Z' + 1);
+	const __m128i space = _mm_set1_epi8(' ');
+	__m128i c, good;
+	__m128i bad = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		c = _mm_loadu_si128((const __m128i*)(text + i));		// bytes above 127 are negative, so fail
+		good = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi8(c, beforeA), _mm_cmpgt_epi8(afterZ, c)), _mm_cmpeq_epi8(c, space));
+		bad = _mm_or_si128(bad, _mm_xor_si128(good, _mm_set1_epi8(-1)));
+	}
+	return _mm_movemask_epi8(bad) == 0 && validScalar(text + i, n - i);
+}
+
+// validAVX2
+//
+// description: the AVX2 character check, 32 per step
+//
+// @param		text - the characters to check
+// @param		n - the number of characters
+// @return		1 if every character is A-Z or SPACE, else 0
+//..........................................................
+__attribute__((target("avx2")))
+int validAVX2(const char* text, size_t n)
+{
+	const __m256i beforeA = _mm256_set1_epi8('A' - 1);
+	const __m256i afterZ = _mm256_set1_epi8('Z' + 1);
+	const __m256i space = _mm256_set1_epi8(' ');
+	__m256i c, good;
+	__m256i bad = _mm256_setzero_si256();
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32)
+	{
+		c = _mm256_loadu_si256((const __m256i*)(text + i));
+		good = _mm256_or_si256(_mm256_and_si256(_mm256_cmpgt_epi8(c, beforeA), _mm256_cmpgt_epi8(afterZ, c)), _mm256_cmpeq_epi8(c, space));
+		bad = _mm256_or_si256(bad, _mm256_xor_si256(good, _mm256_set1_epi8(-1)));
+	}
+	return _mm256_testz_si256(bad, bad) && validScalar(text + i, n - i);
+}
+
+// cipherSupported
+//
+// description: checks whether this CPU can run a kernel level
+//
+// @param		level - one of the CIPHER_ levels
+// @return		1 if it can, else 0
+//..........................................................
+int cipherSupported(int level)
+{
+	__builtin_cpu_init();
+	switch (level)
+	{
+		case CIPHER_SCALAR:	return 1;
+		case CIPHER_SSE2:	return __builtin_cpu_supports("sse2");
+		case CIPHER_AVX2:	return __builtin_cpu_supports("avx2");
+		case CIPHER_AVX512:	return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+	}
+	return 0;
+}
+
+// cipherUse
+//
+// description: makes cipherBlock and cipherValid use a
+//				kernel level
+//
+// @param		level - one of the CIPHER_ levels, which the
+//				CPU must support
+//..........................................................
+void cipherUse(int level)
+{
+	static const cipherKernel kernels[CIPHER_LEVELS] = { cipherScalar, cipherSSE2, cipherAVX2, cipherAVX512 };
+	static const validKernel checks[CIPHER_LEVELS] = { validScalar, validSSE2, validAVX2, validAVX2 };
+
+	cipherBlock = kernels[level];
+	cipherValid = checks[level];
+}
+
+// cipherBestLevel
+//
+// description: finds the fastest kernel this CPU supports
+//
+// @return		one of the CIPHER_ levels
+//..........................................................
+int cipherBestLevel()
+{
+	int level = CIPHER_LEVELS - 1;
+
+	while (!cipherSupported(level))
+	{
+		level--;
+	}
+	return level;
+}
+
+// cipherResolve
+//
+// description: the initial value of cipherBlock. Picks the
+//				best kernel, then runs it. Threads that race
+//				here all pick the same one.
+//
+// @param		op - OP_ENC or OP_DEC
+// @param		message - the message, overwritten with the reply
+// @param		key - n key characters
+// @param		n - the number of characters
+//..........................................................
+void cipherResolve(int op, char* message, const char* key, size_t n)
+{
+	cipherUse(cipherBestLevel());
+	cipherBlock(op, message, key, n);
+}
+
+// validResolve
+//
+// description: the initial value of cipherValid. Picks the
+//				best kernels, then runs the check.
+//
+// @param		text - the characters to check
+// @param		n - the number of characters
+// @return		1 if every character is A-Z or SPACE, else 0
+//..........................................................
+int validResolve(const char* text, size_t n)
+{
+	cipherUse(cipherBestLevel());
+	return cipherValid(text, n);
+}
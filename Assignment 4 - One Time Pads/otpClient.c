@@ -0,0 +1,1654 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpClient.c - the parts of otp_enc and otp_dec that do not depend on the operation:
+//				argument parsing, mapping and checking the input files, connecting to the daemon, and
+//				sending requests in either framing.
+//
+//				The message and key files are mapped rather than read, checked in a single vectorized pass,
+//				and handed to the socket with writev() straight from the mapping: header, message and key
+//				regions go out as one gather list, with no copy into a request buffer and nothing on the
+//				heap that grows with the file size.
+//
+//				A binary request is sent and its reply read at the same time from one poll loop. The
+//				daemon sends each reply chunk as soon as the matching key chunk has arrived and stops
+//				reading until it has, so a client that sent everything before reading could deadlock
+//				with it once both socket buffers fill up.
+//
+//				Binary connections are persistent. With --batch filelist the client sends every job in
+//				the list down one connection, pipelining requests ahead of their replies and matching
+//				each reply back to its job by request id, so a batch of small records pays for one TCP
+//				handshake instead of one per record.
+//
+//				With --key-id the key argument (or batch list column) is id[:offset], naming a key the
+//				daemon holds (see otpKeys.c) and where in it to start. Only the message is read and sent,
+//				which halves the bytes on the wire and the file I/O on the client. otp_enc may give the
+//				offset as next, asking a daemon with a key ledger (see otpLedger.c) for the first unused
+//				byte of the key; the offset it used is printed to stderr as id:offset, the key argument
+//				otp_dec needs for the reply.
+//
+//				A message argument of - streams stdin instead of a file, so the clients can sit in the middle
+//				of a pipeline. Stdin is read in blocks of up to OTP_CHUNK bytes, and each block is sent as a
+//				request of its own down the one connection, using the next stretch of the key, pipelined
+//				like a batch. Each reply goes to stdout as soon as it arrives. At most STREAM_SLOTS blocks are
+//				held at once, and key pages are dropped as the stream passes them, so memory stays the same
+//				however long the stream is. Every block must hold message characters only, and
+//				a single trailing newline is allowed at the very end, as in a file. The output is byte for
+//				byte what the same input would give as a file.
+//
+//				With --container the message argument is a container of many records (see otpContainer.c),
+//				sent whole as one request, and the reply goes to stdout as a container with the same index.
+//				The key is a key file, a key id with --key-id, or a container whose key slices line up with
+//				the records, such as one otp_pack packed with its keys.
+//
+//				With --resume a single job (a file, a key id or a container) goes as a checked request
+//				(protocol version 5): every chunk each way carries a sequence number and a CRC-32C, and
+//				only reply chunks that check out are written. If the connection drops, stalls or returns
+//				a damaged chunk, the client reconnects and sends the rest from the first chunk it has no
+//				good reply for, resuming a key id encryption with the token the daemon gave it, so a
+//				multi-gigabyte job does not start again from byte zero. The output is the same as from
+//				an unbroken run.
+//
+//				The port argument may instead be unix:/path or @name, for a daemon listening on a Unix
+//				domain socket (see otpEndpoint.c). With --psk file every byte to and from the daemon goes through
+//				the sealed transport of otpSeal.c, in either framing; the daemon must hold the same file.
+//
+//				Included by otp_enc.c and otp_dec.c.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "otpProtocol.c"
+#include "otpCipher.c"
+#include "otpCrc.c"
+#include "otpEndpoint.c"
+#include "otpSeal.c"
+#include "otpContainer.c"
+
+/**********************************************************
+// CLIENT GLOBALS
+// ********************************************************/
+
+// clientConfig
+// ......................
+struct clientConfig
+{
+	char* messageFile;				// the plaintext or ciphertext file
+	char* keyFile;					// the key file
+	struct otpEndpoint endpoint;	// the daemon's port or unix: path
+	unsigned char* psk;				// the pre-shared key with --psk, else NULL
+	size_t pskLen;					// its length
+	int textFraming;				// 1 to speak the original text framing (--text)
+	char* batchFile;				// the file list for --batch, or NULL
+	int keyIds;						// 1 if keys are id[:offset] references to daemon keys (--key-id)
+	int stream;						// 1 if the message is read from stdin (a message argument of -)
+	int container;					// 1 if the message is a container (--container)
+	int resume;						// 1 to send the job checked, resuming it if the connection is lost (--resume)
+};
+
+// otpJob
+// ......................
+struct otpJob
+{
+	char* messageFile;				// the plaintext or ciphertext file
+	char* keyFile;					// the key file
+	char* outputFile;				// where the reply goes, or NULL for stdout
+	const char* message;			// the mapped message, NULL until the job starts
+	const char* key;				// the mapped key
+	size_t messageLen;				// message characters
+	size_t keyLen;					// key characters
+	size_t messageMapped;			// size of the message mapping
+	size_t keyMapped;				// size of the key mapping
+	char header[OTP_HEADER_SIZE];	// the packed request header
+	FILE* output;					// open while the job is in flight
+	int keyRef;						// 1 if keyFile is an id[:offset] reference to a daemon key
+	int keyNext;					// 1 if its offset is next, chosen by the daemon's ledger
+	char keyRefBytes[OTP_KEY_REF_MAX];	// the packed key reference
+	size_t keyRefLen;				// size of keyRefBytes
+	int streamed;					// 1 if the message is a block of stdin, whose reply runs on into the next
+	struct otpContainer* container;	// the container the message is the data of, whose index heads the reply, or NULL
+};
+
+#define MAX_IOVECS		16		// request regions handed to one writev
+#define MAX_INFLIGHT	64		// requests sent ahead of their replies
+#define STREAM_STDIN	"-"		// the message argument that reads stdin
+#define KEY_NEXT		"next"	// the key offset that asks the daemon's ledger for one
+#define STREAM_SLOTS	16		// stdin blocks read ahead of their replies
+#define RESUME_TRIES	8		// connections a --resume job may lose in a row without progress
+#define RESUME_WAIT		200		// ms before the first reconnect, doubled after each one in a row
+#define RESUME_STALL	30000	// ms without a byte either way before a connection counts as lost
+
+// otpStream
+// ......................
+struct otpStream
+{
+	struct otpJob slots[STREAM_SLOTS];	// one job per block in flight, reused in turn
+	char* blocks;					// STREAM_SLOTS blocks of OTP_CHUNK bytes read from stdin
+	char keyNames[STREAM_SLOTS][OTP_KEY_ID_MAX + 22];	// with --key-id, each slot's id:offset
+	char* keyFile;					// the key file, or with --key-id the id[:offset] argument
+	const char* key;				// the mapped key, or NULL with --key-id
+	size_t keyLen;					// key characters
+	size_t keyMapped;				// size of the key mapping
+	int keyRef;						// 1 with --key-id
+	size_t keyIdLen;				// with --key-id, the length of the id in keyFile
+	unsigned long long keyOffset;	// with --key-id, where in the key the stream starts
+	size_t keyReleased;				// key bytes dropped from the mapping, a whole number of pages
+	unsigned long long used;		// message characters read so far
+	int started;					// 1 once the first block has been read
+	int newline;					// 1 once the trailing newline has been read
+};
+
+// otpResume
+// ......................
+struct otpResume
+{
+	struct otpJob* job;				// the job, started
+	int op;							// OP_ENC or OP_DEC
+	unsigned long long done;		// message characters whose reply is written out, whole chunks
+	unsigned long long from;		// done when the request on the current connection was packed
+	int answered;					// 1 once a reply header has been accepted
+	unsigned long long keyOffset;	// with a key id, where in the key the job starts, once answered
+	char token[OTP_TOKEN_SIZE];		// the job's resume token, once answered
+	char header[OTP_HEADER_SIZE];	// the request header for the rest of the job
+	char keyRef[OTP_RESUME_REF_MAX];	// and its key reference
+	size_t keyRefLen;				// size of keyRef
+	char trailer[OTP_TRAILER_SIZE];	// the trailer of the chunk being sent
+	unsigned long long trailerChunk;	// that chunk, plus 1; 0 for none yet
+	unsigned long long waitMs;		// a busy server's retry-after
+};
+
+struct otpSeal* clientSeal = NULL;	// the connection's sealed transport with --psk, set by connectToServer
+
+/**********************************************************
+// CLIENT FUNCTIONS
+// ********************************************************/
+
+// parseClientArgs
+//
+// description: reads the command line into a clientConfig,
+//				exiting with the usage text on bad input
+//
+// @param		argc - argument count
+// @param		argv - argument vector
+// @param		config - the configuration to fill in
+// @param		messageName - what the message file is called
+//				in the usage text
+//..........................................................
+void parseClientArgs(int argc, char* argv[], struct clientConfig* config, const char* messageName)
+{
+	static struct option longOptions[] =
+	{
+		{ "text",	no_argument,		0, 't' },
+		{ "batch",	required_argument,	0, 'b' },
+		{ "key-id",	no_argument,		0, 'k' },
+		{ "psk",	required_argument,	0, 'P' },
+		{ "container",	no_argument,	0, 'c' },
+		{ "resume",	no_argument,		0, 'r' },
+		{ 0, 0, 0, 0 }
+	};
+	char* pskFile = NULL;
+	int opt;
+
+	memset(config, 0, sizeof(*config));
+	while ((opt = getopt_long(argc, argv, "tb:kP:cr", longOptions, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 't': config->textFraming = 1; break;
+			case 'b': config->batchFile = optarg; break;
+			case 'k': config->keyIds = 1; break;
+			case 'P': pskFile = optarg; break;
+			case 'c': config->container = 1; break;
+			case 'r': config->resume = 1; break;
+			default:  optind = argc + 1;
+		}
+	}
+	if ((config->keyIds || config->container) && config->textFraming)	// key references and containers need the binary framing
+	{
+		optind = argc + 1;
+	}
+	if ((config->container || config->resume) && config->batchFile != NULL)
+	{
+		optind = argc + 1;
+	}
+	if (config->resume && config->textFraming)							// only the binary framing has checked requests
+	{
+		optind = argc + 1;
+	}
+	if (config->batchFile == NULL && optind == argc - 3 && endpointParse(argv[optind + 2], &config->endpoint) == 0 &&
+		!((config->textFraming || config->resume) && strcmp(argv[optind], STREAM_STDIN) == 0 && !config->container))	// text framing sends the whole message first, and resuming reads it again
+	{
+		config->messageFile = argv[optind];
+		config->keyFile = argv[optind + 1];
+		config->stream = strcmp(config->messageFile, STREAM_STDIN) == 0 && !config->container;
+	}
+	else if (config->batchFile != NULL && !config->textFraming && optind == argc - 1 &&	// text framing is one request per connection
+		endpointParse(argv[optind], &config->endpoint) == 0)
+	{
+	}
+	else
+	{
+		fprintf(stderr,"%sUSAGE: %s%s %s key port|unix:/path|@name [--text | --resume] [--psk file]%s\n", RED, CYN, argv[0], messageName, NRM);
+		fprintf(stderr,"%s       %s%s %s keyid[:offset] port|unix:/path|@name --key-id [--resume] [--psk file]%s\n", RED, CYN, argv[0], messageName, NRM);
+		fprintf(stderr,"%s       %s%s - key|keyid[:offset] port|unix:/path|@name [--key-id] [--psk file]%s\n", RED, CYN, argv[0], NRM);
+		fprintf(stderr,"%s       %s%s --batch filelist port|unix:/path|@name [--key-id] [--psk file]%s\n", RED, CYN, argv[0], NRM);
+		fprintf(stderr,"%s       %s%s container key|keyid[:offset]|keycontainer port|unix:/path|@name --container [--key-id] [--resume] [--psk file]%s\n", RED, CYN, argv[0], NRM);
+		exit(1);
+	}
+	if (pskFile != NULL)
+	{
+		config->psk = sealLoadKey(pskFile, &config->pskLen);
+	}
+}
+
+// openConnection
+//
+// description: connects a socket to the daemon, on localhost
+//				or a Unix domain socket, and starts the sealed
+//				transport on it with --psk
+//
+// @param		config - the client configuration
+// @return		the connected socket, or -1 after reporting
+//				why not
+//..........................................................
+int openConnection(struct clientConfig* config)
+{
+	int socketFD;
+
+	signal(SIGPIPE, SIG_IGN);									// writev has no MSG_NOSIGNAL; a closed socket is an error instead
+	socketFD = endpointConnect(&config->endpoint);				// Create the socket and connect
+	if (socketFD < 0)
+	{
+		fprintf(stderr, "%sCLIENT: ERROR connecting on %s%s\n", RED, config->endpoint.name, NRM);
+		return -1;
+	}
+	if (config->psk != NULL && (clientSeal = sealOpen(socketFD, config->psk, config->pskLen, 0)) == NULL)
+	{
+		fprintf(stderr, "%sCLIENT: ERROR starting the sealed transport on %s%s\n", RED, config->endpoint.name, NRM);
+		close(socketFD);
+		return -1;
+	}
+	return socketFD;
+}
+
+// connectToServer
+//
+// description: openConnection, exiting with 2 if it fails
+//
+// @param		config - the client configuration
+// @return		the connected socket
+//..........................................................
+int connectToServer(struct clientConfig* config)
+{
+	int socketFD = openConnection(config);
+
+	if (socketFD < 0)
+	{
+		exit(2);
+	}
+	return socketFD;
+}
+
+// mapFileUnchecked
+//
+// description: maps a whole file into memory without reading
+//				it, exiting with 1 if it cannot. The trailing
+//				newline is not counted.
+//
+// @param		fileName - the file to map
+// @param		length - receives the number of characters
+// @param		mapped - receives the size of the mapping,
+//				for unmapFile
+// @return		the contents, mapped read only
+//..........................................................
+const char* mapFileUnchecked(const char* fileName, size_t* length, size_t* mapped)
+{
+	int fd;
+	struct stat st;
+	const char* contents;
+
+	if (stat(fileName, &st) < 0)							// send error if the file is non-existant
+	{
+		fprintf(stderr,"%sCLIENT: ERROR %s does not exist%s\n", RED, fileName, NRM);
+		exit(1);
+	}
+	fd = open(fileName, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		fprintf(stderr,"%sCLIENT: ERROR opening %s%s\n", RED, fileName, NRM);
+		exit(1);
+	}
+	if (st.st_size == 0)
+	{
+		close(fd);
+		*length = 0;
+		*mapped = 0;
+		return "";										// an empty file cannot be mapped
+	}
+
+	contents = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (contents == MAP_FAILED)
+	{
+		fprintf(stderr,"%sCLIENT: ERROR mapping %s%s\n", RED, fileName, NRM);
+		exit(1);
+	}
+	close(fd);											// the mapping keeps the file open
+	madvise((void*)contents, st.st_size, MADV_SEQUENTIAL);
+
+	*length = st.st_size;
+	*mapped = st.st_size;
+	if (contents[*length - 1] == '\n')					// the newline is not part of the message
+	{
+		(*length)--;
+	}
+	return contents;
+}
+
+// mapFile
+//
+// description: maps a whole file into memory and checks it
+//				for ANY bad characters. if there are any, it
+//				sends an error text to stderr, sets the exit
+//				value to 1, and terminates the program. The
+//				trailing newline is not counted.
+//
+// @param		fileName - the file to map
+// @param		length - receives the number of characters
+// @param		mapped - receives the size of the mapping,
+//				for unmapFile
+// @return		the contents, mapped read only
+//..........................................................
+const char* mapFile(const char* fileName, size_t* length, size_t* mapped)
+{
+	const char* contents = mapFileUnchecked(fileName, length, mapped);
+
+	if (!cipherValid(contents, *length))
+	{
+		fprintf(stderr,"%sCLIENT: ERROR invalid characters in %s%s\n", RED, fileName, NRM);
+		exit(1);
+	}
+	return contents;
+}
+
+// unmapFile
+//
+// description: releases a file mapped by mapFile
+//
+// @param		contents - the contents mapFile returned
+// @param		mapped - the size of the mapping
+//..........................................................
+void unmapFile(const char* contents, size_t mapped)
+{
+	if (mapped > 0)
+	{
+		munmap((void*)contents, mapped);
+	}
+}
+
+// writeAll
+//
+// description: writes a whole gather list to a blocking
+//				socket, however many calls it takes
+//
+// @param		socketFD - the connected socket
+// @param		iov - the regions to write, advanced in place
+// @param		count - the number of regions
+// @return		0 once it is all written, or -1 if the server
+//				closed the connection first, as it does after
+//				answering busy
+//..........................................................
+int writeAll(int socketFD, struct iovec* iov, int count)
+{
+	ssize_t n;
+
+	while (count > 0)
+	{
+		n = sealWritev(clientSeal, socketFD, iov, count, 0);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno == EPIPE || errno == ECONNRESET)
+			{
+				return -1;
+			}
+			error("CLIENT: ERROR writing to socket");
+		}
+		while (count > 0 && (size_t)n >= iov->iov_len)	// drop the regions that went out whole
+		{
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0)
+		{
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+// runTextRequest
+//
+// description: sends one request in the original text
+//				framing and writes the reply to stdout as it
+//				streams in. A CON_FAIL or BUSY_FAIL reply is
+//				reported to stderr and exits with 2, even when
+//				the server closed before the request was all
+//				sent.
+//
+//	Request Contents:
+//	[ code word 	| message 		| middle sentinel 	| key 			| end sentinel  ]
+//	[ 2 chars   	| messageLen 	| 2 chars         	| messageLen 	| 2 chars 		]
+//
+// @param		socketFD - the connected socket
+// @param		codeWord - ENC_CLIENT or DEC_CLIENT
+// @param		message - the message
+// @param		key - the key, at least messageLen long
+// @param		messageLen - message length
+// @param		endpointName - the daemon's endpoint, for error text
+//..........................................................
+void runTextRequest(int socketFD, const char* codeWord, const char* message, const char* key, size_t messageLen, const char* endpointName)
+{
+	struct iovec iov[5];
+	char buffer[OTP_CHUNK];
+	ssize_t charsRead;
+	size_t replyLen = 0;
+	int cutOff;
+
+	iov[0].iov_base = (void*)codeWord;			iov[0].iov_len = 2;
+	iov[1].iov_base = (void*)message;			iov[1].iov_len = messageLen;
+	iov[2].iov_base = (void*)MID_SENTINEL;		iov[2].iov_len = 2;
+	iov[3].iov_base = (void*)key;				iov[3].iov_len = messageLen;		// only the key that will be used
+	iov[4].iov_base = (void*)END_SENTINEL;		iov[4].iov_len = 2;
+	cutOff = writeAll(socketFD, iov, 5) < 0;	// a refused request is answered busy without being read
+	shutdown(socketFD, SHUT_WR);				// the request is complete; the server closes after the reply
+
+	// Get return message from server, writing it out as it streams in
+	while ((charsRead = sealRecv(clientSeal, socketFD, buffer, sizeof(buffer), 0)) > 0)		// Read until the server closes
+	{
+		if (replyLen == 0 && buffer[0] == BUSY_FAIL[0] && charsRead < (ssize_t)sizeof(buffer))		// nor the busy one
+		{
+			buffer[charsRead] = '\0';
+			fprintf(stderr, "%sCLIENT: ERROR, server busy on %s, retry after %d ms%s\n", RED, endpointName, atoi(buffer + 1), NRM);
+			exit(2);
+		}
+		if (replyLen == 0 && buffer[0] == CON_FAIL[0])						// the reply never contains the fail sentinel
+		{
+			fprintf(stderr, "%sCLIENT: ERROR, connection rejected on %s%s\n", RED, endpointName, NRM);
+			exit(2);
+		}
+		fwrite(buffer, 1, charsRead, stdout);
+		replyLen += charsRead;
+	}
+	if (cutOff)
+	{
+		fprintf(stderr, "%sCLIENT: ERROR, server closed the connection early on %s%s\n", RED, endpointName, NRM);
+		exit(1);
+	}
+	if (charsRead < 0)
+	{
+		error("CLIENT: ERROR reading from socket");
+	}
+	printf("\n");
+}
+
+// requestSpan
+//
+// description: finds the bytes of a job's request stream
+//				that start at a given offset: the header, then
+//				each message chunk followed by its key chunk,
+//				or for a key reference the reference and then
+//				the whole message
+//
+// @param		job - a started job
+// @param		offset - offset into the request stream
+// @param		span - receives a pointer to the bytes
+// @return		how many bytes follow span contiguously
+//..........................................................
+size_t requestSpan(struct otpJob* job, size_t offset, const char** span)
+{
+	size_t chunk, within, chunkSize;
+
+	if (offset < OTP_HEADER_SIZE)
+	{
+		*span = job->header + offset;
+		return OTP_HEADER_SIZE - offset;
+	}
+	offset -= OTP_HEADER_SIZE;
+	if (job->keyRef && offset < job->keyRefLen)
+	{
+		*span = job->keyRefBytes + offset;
+		return job->keyRefLen - offset;
+	}
+	if (job->keyRef)
+	{
+		*span = job->message + offset - job->keyRefLen;
+		return job->messageLen - (offset - job->keyRefLen);
+	}
+	chunk = offset / (2 * OTP_CHUNK) * OTP_CHUNK;				// where this chunk starts in the message
+	within = offset % (2 * OTP_CHUNK);
+	chunkSize = job->messageLen - chunk < OTP_CHUNK ? job->messageLen - chunk : OTP_CHUNK;
+
+	if (within < chunkSize)
+	{
+		*span = job->message + chunk + within;
+		return chunkSize - within;
+	}
+	*span = job->key + chunk + within - chunkSize;
+	return 2 * chunkSize - within;
+}
+
+// loadJobs
+//
+// description: reads a batch file list. Each line names a
+//				message file, a key file and, optionally, an
+//				output file; blank lines and lines starting
+//				with '#' are skipped.
+//
+// @param		listFile - the file list
+// @param		keyRef - 1 if the key column holds key ids
+// @param		jobCount - receives the number of jobs
+// @return		the jobs (never freed, they live until exit)
+//..........................................................
+struct otpJob* loadJobs(const char* listFile, int keyRef, size_t* jobCount)
+{
+	FILE* fp;
+	struct otpJob* jobs = NULL;
+	size_t capacity = 0;
+	char* line = NULL;
+	size_t lineCap = 0;
+	int lineNumber = 0;
+	char* fields[3];
+	int i;
+
+	fp = fopen(listFile, "r");
+	if (fp == NULL)
+	{
+		fprintf(stderr,"%sCLIENT: ERROR opening %s%s\n", RED, listFile, NRM);
+		exit(1);
+	}
+
+	*jobCount = 0;
+	while (getline(&line, &lineCap, fp) >= 0)
+	{
+		lineNumber++;
+		fields[0] = strtok(line, " \t\r\n");
+		if (fields[0] == NULL || fields[0][0] == '#')
+		{
+			continue;
+		}
+		for (i = 1; i < 3; i++)
+		{
+			fields[i] = strtok(NULL, " \t\r\n");
+		}
+		if (fields[1] == NULL || strtok(NULL, " \t\r\n") != NULL)
+		{
+			fprintf(stderr,"%sCLIENT: ERROR, line %d of %s is not \"message key [output]\"%s\n", RED, lineNumber, listFile, NRM);
+			exit(1);
+		}
+		if (*jobCount > 0xFFFFFFFFu)						// request ids are 32 bits
+		{
+			fprintf(stderr,"%sCLIENT: ERROR, too many jobs in %s%s\n", RED, listFile, NRM);
+			exit(1);
+		}
+
+		if (*jobCount == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 64;
+			jobs = realloc(jobs, capacity * sizeof(*jobs));
+			if (jobs == NULL)
+			{
+				error("CLIENT: ERROR allocating jobs");
+			}
+		}
+		memset(&jobs[*jobCount], 0, sizeof(*jobs));
+		jobs[*jobCount].messageFile = strdup(fields[0]);
+		jobs[*jobCount].keyFile = strdup(fields[1]);
+		jobs[*jobCount].outputFile = fields[2] ? strdup(fields[2]) : NULL;
+		jobs[*jobCount].keyRef = keyRef;
+		(*jobCount)++;
+	}
+
+	free(line);
+	fclose(fp);
+	return jobs;
+}
+
+// parseKeyRef
+//
+// description: packs a job's id[:offset] key argument as a
+//				key reference, exiting with 1 if it is not one.
+//				An offset of next becomes OTP_KEY_NEXT.
+//
+// @param		job - the job
+//..........................................................
+void parseKeyRef(struct otpJob* job)
+{
+	char id[OTP_KEY_ID_MAX + 1];
+	const char* colon = strchr(job->keyFile, ':');
+	size_t idLen = colon ? (size_t)(colon - job->keyFile) : strlen(job->keyFile);
+	unsigned long long offset = 0;
+	char* end;
+
+	if (colon != NULL && strcmp(colon + 1, KEY_NEXT) == 0)
+	{
+		offset = OTP_KEY_NEXT;
+		job->keyNext = 1;
+	}
+	else if (colon != NULL)
+	{
+		errno = 0;
+		offset = strtoull(colon + 1, &end, 10);
+		if (errno != 0 || end == colon + 1 || *end != '\0')
+		{
+			idLen = 0;									// reported below
+		}
+	}
+	if (!validKeyId(job->keyFile, idLen))
+	{
+		fprintf(stderr,"%sCLIENT: ERROR, %s is not a key id[:offset|:next]%s\n", RED, job->keyFile, NRM);
+		exit(1);
+	}
+	memcpy(id, job->keyFile, idLen);
+	id[idLen] = '\0';
+	job->keyRefLen = packKeyRef(job->keyRefBytes, offset, id);
+}
+
+// startJob
+//
+// description: readies a job to be sent: maps and checks
+//				its files unless the caller already has,
+//				packs its request header, and opens its output
+//
+// @param		op - OP_ENC or OP_DEC
+// @param		job - the job
+// @param		requestId - the id its reply will carry
+//..........................................................
+void startJob(int op, struct otpJob* job, unsigned int requestId)
+{
+	struct otpHeader header;
+
+	if (job->message == NULL)
+	{
+		job->message = mapFile(job->messageFile, &job->messageLen, &job->messageMapped);
+		if (!job->keyRef)
+		{
+			job->key = mapFile(job->keyFile, &job->keyLen, &job->keyMapped);
+			if (job->messageLen > job->keyLen)
+			{
+				fprintf(stderr,"%sCLIENT: ERROR, key %s is too short for %s%s\n", RED, job->keyFile, job->messageFile, NRM);
+				exit(1);
+			}
+		}
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.version = OTP_VERSION;
+	header.code = op;
+	header.requestId = requestId;
+	header.messageLen = job->messageLen;
+	header.keyLen = job->messageLen;					// only the key bytes that will be used are sent
+	if (job->keyRef)
+	{
+		parseKeyRef(job);								// the daemon checks the key length
+		if (job->keyNext && op != OP_ENC)
+		{
+			fprintf(stderr,"%sCLIENT: ERROR, only encryption can take the next key offset; decrypt with the offset it printed%s\n", RED, NRM);
+			exit(1);
+		}
+		header.code = op | OP_KEY_REF;
+		header.keyLen = job->keyRefLen;
+	}
+	packHeader(job->header, &header);
+
+	job->output = stdout;
+	if (job->outputFile != NULL)
+	{
+		job->output = fopen(job->outputFile, "w");
+		if (job->output == NULL)
+		{
+			fprintf(stderr,"%sCLIENT: ERROR opening %s%s\n", RED, job->outputFile, NRM);
+			exit(1);
+		}
+	}
+}
+
+// finishJob
+//
+// description: ends a job once its whole reply is written.
+//				A block of stdin is only flushed: its reply runs
+//				on into the next block's.
+//
+// @param		job - the job
+//..........................................................
+void finishJob(struct otpJob* job)
+{
+	if (job->streamed)
+	{
+		fflush(job->output);							// pass each block on down the pipeline
+		job->output = NULL;
+		return;
+	}
+	if (job->container == NULL)							// a container is not a text file
+	{
+		fputc('\n', job->output);
+	}
+	if (job->output != stdout)
+	{
+		fclose(job->output);
+	}
+	job->output = NULL;
+	unmapFile(job->message, job->messageMapped);
+	unmapFile(job->key, job->keyMapped);
+}
+
+// containerJob
+//
+// description: readies a --container job: maps and checks
+//				the container, whose data area is the message,
+//				and finds its key in a key file, a container
+//				with matching key slices, or with --key-id the
+//				daemon. Exits with 1 on any bad input.
+//
+// @param		config - the client configuration
+// @param		job - the job, zeroed
+// @param		container - receives the message container
+// @param		keys - receives the key container, if the key
+//				is one
+//..........................................................
+void containerJob(struct clientConfig* config, struct otpJob* job, struct otpContainer* container, struct otpContainer* keys)
+{
+	int result;
+
+	if (containerMap(config->messageFile, container) != CONTAINER_OK)
+	{
+		fprintf(stderr,"%sCLIENT: ERROR, %s is not a valid container%s\n", RED, config->messageFile, NRM);
+		exit(1);
+	}
+	job->messageFile = config->messageFile;
+	job->message = container->data;
+	job->messageLen = container->dataLen;
+	job->container = container;
+	job->keyFile = config->keyFile;
+	if (config->keyIds)
+	{
+		job->keyRef = 1;
+		return;
+	}
+
+	result = containerMap(config->keyFile, keys);
+	if (result == CONTAINER_BAD)
+	{
+		fprintf(stderr,"%sCLIENT: ERROR, %s is not a valid container%s\n", RED, config->keyFile, NRM);
+		exit(1);
+	}
+	if (result == CONTAINER_OK)
+	{
+		if (keys->keys == NULL || !containerSameIndex(container, keys))
+		{
+			fprintf(stderr,"%sCLIENT: ERROR, %s holds no key slices for the records of %s%s\n", RED, config->keyFile, config->messageFile, NRM);
+			exit(1);
+		}
+		job->key = keys->keys;
+		job->keyLen = keys->dataLen;
+		return;
+	}
+	job->key = mapFile(config->keyFile, &job->keyLen, &job->keyMapped);
+	if (job->messageLen > job->keyLen)
+	{
+		fprintf(stderr,"%sCLIENT: ERROR, key %s is too short for %s%s\n", RED, config->keyFile, config->messageFile, NRM);
+		exit(1);
+	}
+}
+
+// jobLength
+//
+// description: the size of a job's request on the wire
+//
+// @param		job - a started job
+// @return		header plus message and key bytes
+//..........................................................
+size_t jobLength(struct otpJob* job)
+{
+	if (job->keyRef)
+	{
+		return OTP_HEADER_SIZE + job->keyRefLen + job->messageLen;
+	}
+	return OTP_HEADER_SIZE + 2 * job->messageLen;
+}
+
+// endStream
+//
+// description: sends OP_END on a binary connection and
+//				waits for the server's ack and then EOF, so
+//				every reply is known to have been delivered
+//				before the socket closes
+//
+// @param		socketFD - the connected socket
+// @param		requestId - the id for the OP_END request
+// @param		endpointName - the daemon's endpoint, for error text
+//..........................................................
+void endStream(int socketFD, unsigned int requestId, const char* endpointName)
+{
+	struct otpHeader header;
+	char packed[OTP_HEADER_SIZE];
+	struct iovec iov;
+	size_t received = 0;
+	ssize_t n;
+
+	fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL, 0) & ~O_NONBLOCK);
+
+	memset(&header, 0, sizeof(header));
+	header.version = OTP_VERSION;
+	header.code = OP_END;
+	header.requestId = requestId;
+	packHeader(packed, &header);
+	iov.iov_base = packed;
+	iov.iov_len = OTP_HEADER_SIZE;
+	writeAll(socketFD, &iov, 1);				// if the server is gone, the ack below is missing
+
+	while (received < OTP_HEADER_SIZE)
+	{
+		n = sealRecv(clientSeal, socketFD, packed + received, OTP_HEADER_SIZE - received, 0);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			fprintf(stderr, "%sCLIENT: ERROR, no end of stream ack on %s%s\n", RED, endpointName, NRM);
+			exit(1);
+		}
+		received += n;
+	}
+	if (unpackHeader(packed, &header) < 0 || header.code != OTP_OK || header.requestId != requestId)
+	{
+		fprintf(stderr, "%sCLIENT: ERROR, bad end of stream ack on %s%s\n", RED, endpointName, NRM);
+		exit(1);
+	}
+	while ((n = sealRecv(clientSeal, socketFD, packed, sizeof(packed), 0)) > 0 || (n < 0 && errno == EINTR))
+	{
+		continue;									// wait for the server's FIN
+	}
+}
+
+// streamOpen
+//
+// description: readies stdin to be streamed: maps the key
+//				file, which is checked as the stream reaches
+//				it, or with --key-id checks the key reference,
+//				and sets up the blocks
+//
+// @param		stream - the stream to set up
+// @param		config - the client configuration
+//..........................................................
+void streamOpen(struct otpStream* stream, struct clientConfig* config)
+{
+	struct otpJob check;
+	const char* colon;
+
+	memset(stream, 0, sizeof(*stream));
+	stream->keyFile = config->keyFile;
+	stream->keyRef = config->keyIds;
+	if (stream->keyRef)
+	{
+		memset(&check, 0, sizeof(check));
+		check.keyFile = config->keyFile;
+		parseKeyRef(&check);							// exits if it is not an id[:offset]
+		if (check.keyNext)
+		{
+			fprintf(stderr,"%sCLIENT: ERROR, a stream cannot take the next key offset%s\n", RED, NRM);
+			exit(1);
+		}
+		colon = strchr(config->keyFile, ':');
+		stream->keyIdLen = colon ? (size_t)(colon - config->keyFile) : strlen(config->keyFile);
+		stream->keyOffset = colon ? strtoull(colon + 1, NULL, 10) : 0;
+	}
+	else
+	{
+		stream->key = mapFileUnchecked(config->keyFile, &stream->keyLen, &stream->keyMapped);	// checked a block at a time
+	}
+	stream->blocks = malloc((size_t)STREAM_SLOTS * OTP_CHUNK);
+	if (stream->blocks == NULL)
+	{
+		error("CLIENT: ERROR allocating stream blocks");
+	}
+}
+
+// streamRead
+//
+// description: reads the next block of stdin into a job,
+//				with the stretch of key that goes with it, in
+//				one read() so that it never waits on stdin
+//				once poll() has found it readable. Exits with
+//				1 on characters that are not message
+//				characters, or a key that runs out.
+//
+// @param		stream - the stream
+// @param		job - the job, in the slot for its request id
+// @param		slot - the slot
+// @return		1 if the job was filled, else 0 at the end of
+//				stdin. An empty stdin still fills one job, as
+//				an empty message, so it gets the reply an empty
+//				file would.
+//..........................................................
+int streamRead(struct otpStream* stream, struct otpJob* job, int slot)
+{
+	char* block = stream->blocks + (size_t)slot * OTP_CHUNK;
+	ssize_t n;
+
+	while ((n = read(STDIN_FILENO, block, OTP_CHUNK)) < 0)
+	{
+		if (errno != EINTR)
+		{
+			error("CLIENT: ERROR reading stdin");
+		}
+	}
+	if (n == 0 && stream->started)
+	{
+		return 0;
+	}
+	if (n > 0 && (stream->newline || !cipherValid(block, block[n - 1] == '\n' ? n - 1 : n)))	// a newline may only end the stream
+	{
+		fprintf(stderr,"%sCLIENT: ERROR invalid characters in stdin%s\n", RED, NRM);
+		exit(1);
+	}
+	if (n > 0 && block[n - 1] == '\n')					// the newline is not part of the message
+	{
+		stream->newline = 1;
+		n--;
+	}
+	stream->started = 1;
+
+	memset(job, 0, sizeof(*job));
+	job->messageFile = STREAM_STDIN;
+	job->keyFile = stream->keyFile;
+	job->message = block;
+	job->messageLen = n;
+	job->streamed = 1;
+	if (stream->keyRef)
+	{
+		job->keyRef = 1;
+		job->keyFile = stream->keyNames[slot];			// each block starts where the last one ended in the key
+		snprintf(stream->keyNames[slot], sizeof(stream->keyNames[slot]), "%.*s:%llu", (int)stream->keyIdLen, stream->keyFile,
+			stream->keyOffset + stream->used);
+	}
+	else
+	{
+		if (stream->used + n > stream->keyLen)
+		{
+			fprintf(stderr,"%sCLIENT: ERROR, key %s is too short for stdin%s\n", RED, stream->keyFile, NRM);
+			exit(1);
+		}
+		job->key = stream->key + stream->used;
+		job->keyLen = n;
+		if (!cipherValid(job->key, n))
+		{
+			fprintf(stderr,"%sCLIENT: ERROR invalid characters in %s%s\n", RED, stream->keyFile, NRM);
+			exit(1);
+		}
+	}
+	stream->used += n;
+	return 1;
+}
+
+// streamRelease
+//
+// description: once a block's reply is done, drops the key
+//				pages before it from the mapping, so a long
+//				stream does not keep its whole key resident
+//
+// @param		stream - the stream
+// @param		job - the finished block
+//..........................................................
+void streamRelease(struct otpStream* stream, struct otpJob* job)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t upTo;
+
+	if (stream->key == NULL || stream->keyMapped == 0)
+	{
+		return;
+	}
+	upTo = (job->key + job->messageLen - stream->key) / page * page;
+	if (upTo > stream->keyReleased)
+	{
+		madvise((void*)(stream->key + stream->keyReleased), upTo - stream->keyReleased, MADV_DONTNEED);
+		stream->keyReleased = upTo;
+	}
+}
+
+// jobAt
+//
+// description: job i of runBinaryJobs: the ith job, or for a
+//				stream the slot it is read into
+//
+// @param		jobs - the jobs, or a stream's slots
+// @param		stream - the stream, or NULL
+// @param		i - the job's request id
+// @return		the job
+//..........................................................
+struct otpJob* jobAt(struct otpJob* jobs, struct otpStream* stream, size_t i)
+{
+	return stream != NULL ? &jobs[i % STREAM_SLOTS] : &jobs[i];
+}
+
+// runBinaryJobs
+//
+// description: sends binary protocol requests down one
+//				connection and writes each reply out as it
+//				streams in. Requests are pipelined: up to
+//				MAX_INFLIGHT of them are sent ahead of their
+//				replies, and every reply is matched back to
+//				its job by request id. A reply status other
+//				than OTP_OK is reported to stderr and exits
+//				with 2 for a rejection, as the text framing
+//				does, or 1 otherwise. The stream is ended with
+//				OP_END when the server speaks version 2.
+//
+//				Given a stream, the jobs are instead blocks of
+//				stdin, read into the stream's slots as they
+//				are sent, until stdin runs out.
+//
+// @param		socketFD - the connected socket
+// @param		op - OP_ENC or OP_DEC
+// @param		jobs - the jobs, sent in order, or NULL
+// @param		jobCount - the number of jobs
+// @param		stream - stdin to stream, or NULL
+// @param		endpointName - the daemon's endpoint, for error text
+//..........................................................
+void runBinaryJobs(int socketFD, int op, struct otpJob* jobs, size_t jobCount, struct otpStream* stream, const char* endpointName)
+{
+	struct otpHeader header;
+	char headerIn[OTP_HEADER_SIZE];
+	char buffer[OTP_CHUNK];
+	struct iovec iov[MAX_IOVECS];
+	struct pollfd pfd[2];
+	struct otpJob* job = NULL;				// the job whose reply is arriving
+	size_t startedJobs = 0;					// jobs mapped and ready to send
+	size_t sendJob = 0;						// the job being sent
+	size_t sent = 0;						// how much of it has been sent
+	size_t doneJobs = 0;					// jobs whose replies are complete
+	size_t received = 0;					// bytes of the current reply received
+	unsigned long long replyLen = 0;
+	int serverVersion = 0;					// the version the server answers with
+	int cutOff = 0;							// 1 once the server has closed our sending side
+	size_t inflight = MAX_INFLIGHT;			// requests sent ahead of their replies
+	size_t sendable;						// jobs that may be sent now
+	size_t offset, want, j;
+	int count;
+	ssize_t n;
+
+	if (stream != NULL)
+	{
+		jobs = stream->slots;
+		jobCount = (size_t)-1;					// until stdin runs out
+		inflight = STREAM_SLOTS;				// a slot is reused once its reply is done
+	}
+	fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL, 0) | O_NONBLOCK);
+	pfd[0].fd = socketFD;
+	pfd[1].events = POLLIN;
+
+	while (doneJobs < jobCount)
+	{
+		// a stream's jobs are started as stdin has blocks for them, and files' as they are sent
+		pfd[1].fd = stream != NULL && startedJobs < jobCount && startedJobs - doneJobs < inflight ? STDIN_FILENO : -1;
+		sendable = stream != NULL ? startedJobs : jobCount;
+		pfd[0].events = POLLIN | (!cutOff && ((sendJob < sendable && sendJob - doneJobs < inflight) || sealPending(clientSeal) > 0) ? POLLOUT : 0);
+		if (poll(pfd, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			error("CLIENT: ERROR polling socket");
+		}
+
+		// read a block of stdin, which may be sent with the rest below
+		if (pfd[1].fd >= 0 && pfd[1].revents != 0)
+		{
+			if (streamRead(stream, jobAt(jobs, stream, startedJobs), startedJobs % STREAM_SLOTS))
+			{
+				startJob(op, jobAt(jobs, stream, startedJobs), startedJobs);
+				startedJobs++;
+				sendable++;
+			}
+			else
+			{
+				jobCount = startedJobs;					// stdin is done
+			}
+		}
+
+		// send as much as the socket takes, running on into the following requests
+		if ((pfd[0].events & POLLOUT) && (pfd[0].revents & (POLLOUT | POLLERR)))
+		{
+			count = 0;
+			j = sendJob;
+			offset = sent;
+			while (count < MAX_IOVECS && j < sendable && j - doneJobs < inflight)
+			{
+				if (j == startedJobs)
+				{
+					startJob(op, jobAt(jobs, stream, j), j);
+					startedJobs++;
+				}
+				if (offset == jobLength(jobAt(jobs, stream, j)))
+				{
+					j++;
+					offset = 0;
+					continue;
+				}
+				iov[count].iov_len = requestSpan(jobAt(jobs, stream, j), offset, (const char**)&iov[count].iov_base);
+				offset += iov[count].iov_len;
+				count++;
+			}
+			n = count > 0 ? sealWritev(clientSeal, socketFD, iov, count, MSG_DONTWAIT) : sealFlush(clientSeal, socketFD, MSG_DONTWAIT);
+			if (n < 0 && (errno == EPIPE || errno == ECONNRESET))
+			{
+				cutOff = 1;									// answered busy, or gone: the replies tell which
+			}
+			else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				error("CLIENT: ERROR writing to socket");
+			}
+			for (sent += n > 0 ? n : 0; sendJob < startedJobs && sent >= jobLength(jobAt(jobs, stream, sendJob)); sendJob++)
+			{
+				sent -= jobLength(jobAt(jobs, stream, sendJob));
+			}
+		}
+
+		// read every reply byte that has arrived
+		while (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			if (received < OTP_HEADER_SIZE)
+			{
+				n = sealRecv(clientSeal, socketFD, headerIn + received, OTP_HEADER_SIZE - received, 0);
+			}
+			else
+			{
+				want = replyLen - (received - OTP_HEADER_SIZE);		// never read into the next reply
+				n = sealRecv(clientSeal, socketFD, buffer, want < sizeof(buffer) ? want : sizeof(buffer), 0);
+			}
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			{
+				break;
+			}
+			if (n < 0)
+			{
+				error("CLIENT: ERROR reading from socket");
+			}
+			if (n == 0)
+			{
+				fprintf(stderr, "%sCLIENT: ERROR, server closed the connection early on %s%s\n", RED, endpointName, NRM);
+				exit(1);
+			}
+			if (received >= OTP_HEADER_SIZE)
+			{
+				fwrite(buffer, 1, n, job->output);				// the reply from the server
+			}
+			received += n;
+
+			if (received == OTP_HEADER_SIZE)					// the header is complete: find the job
+			{
+				if (unpackHeader(headerIn, &header) < 0)
+				{
+					fprintf(stderr, "%sCLIENT: ERROR, connection rejected on %s%s\n", RED, endpointName, NRM);
+					exit(2);
+				}
+				if (header.code == OTP_BUSY)
+				{
+					fprintf(stderr, "%sCLIENT: ERROR, server busy on %s, retry after %llu ms%s\n", RED, endpointName, header.keyLen, NRM);
+					exit(2);
+				}
+				if (header.code != OTP_OK)
+				{
+					fprintf(stderr, "%sCLIENT: ERROR, %s on %s%s\n", RED, statusMessage(header.code), endpointName, NRM);
+					exit(header.code == OTP_KEY_SHORT || header.code == OTP_NO_KEY || header.code == OTP_KEY_USED ? 1 : 2);
+				}
+				if (header.requestId >= startedJobs || jobAt(jobs, stream, header.requestId)->output == NULL)
+				{
+					fprintf(stderr, "%sCLIENT: ERROR, reply for unknown request %u on %s%s\n", RED, header.requestId, endpointName, NRM);
+					exit(1);
+				}
+				job = jobAt(jobs, stream, header.requestId);
+				replyLen = header.messageLen;
+				serverVersion = header.version;
+				if (job->keyNext)
+				{
+					fprintf(stderr, "%s%s: key %.*s:%llu%s\n", GRN, job->messageFile,
+						(int)(strchr(job->keyFile, ':') - job->keyFile), job->keyFile, header.keyLen, NRM);
+				}
+				if (job->container != NULL)
+				{
+					containerWriteIndex(job->container, job->output);	// the reply's index, once it is known to come
+				}
+			}
+			if (received >= OTP_HEADER_SIZE && received - OTP_HEADER_SIZE == replyLen)
+			{
+				if (stream != NULL)
+				{
+					streamRelease(stream, job);
+				}
+				finishJob(job);
+				doneJobs++;
+				received = 0;
+				if (doneJobs == jobCount)
+				{
+					break;
+				}
+			}
+		}
+	}
+
+	if (stream != NULL)
+	{
+		fputc('\n', stdout);							// after the whole stream, as after a file
+	}
+	if (serverVersion >= 2)
+	{
+		endStream(socketFD, jobCount, endpointName);
+	}
+}
+
+// resumeRequest
+//
+// description: packs the header, and key reference, of a
+//				checked request for the rest of a --resume job.
+//				Until a reply has been accepted that is the
+//				job's own request; after it, a key id starts
+//				that much further into the key, and an
+//				encryption by key id sends back its token,
+//				since a ledger already holds the range for it.
+//
+// @param		resume - the job's resume state
+//..........................................................
+void resumeRequest(struct otpResume* resume)
+{
+	struct otpJob* job = resume->job;
+	struct otpHeader header;
+	char id[OTP_KEY_ID_MAX + 1];
+	const char* colon;
+	size_t idLen;
+
+	memset(&header, 0, sizeof(header));
+	header.version = OTP_VERSION;
+	header.code = resume->op | OP_CHECKED;
+	header.messageLen = job->messageLen - resume->done;
+	header.keyLen = header.messageLen;
+	resume->from = resume->done;
+	resume->keyRefLen = 0;
+	resume->trailerChunk = 0;
+	if (job->keyRef && !resume->answered)
+	{
+		memcpy(resume->keyRef, job->keyRefBytes, job->keyRefLen);		// as the job asked, next included
+		resume->keyRefLen = job->keyRefLen;
+	}
+	else if (job->keyRef)
+	{
+		colon = strchr(job->keyFile, ':');						// checked by parseKeyRef when the job started
+		idLen = colon ? (size_t)(colon - job->keyFile) : strlen(job->keyFile);
+		memcpy(id, job->keyFile, idLen);
+		id[idLen] = '\0';
+		if (resume->op == OP_ENC)
+		{
+			header.code |= OP_RESUME;
+			resume->keyRefLen = packResumeRef(resume->keyRef, resume->keyOffset + resume->done, resume->token, id);
+		}
+		else
+		{
+			resume->keyRefLen = packKeyRef(resume->keyRef, resume->keyOffset + resume->done, id);
+		}
+	}
+	if (job->keyRef)
+	{
+		header.code |= OP_KEY_REF;
+		header.keyLen = resume->keyRefLen;
+	}
+	packHeader(resume->header, &header);
+}
+
+// resumeLength
+//
+// description: the size on the wire of the request
+//				resumeRequest packed
+//
+// @param		resume - the job's resume state
+// @return		header, key reference, chunks and trailers
+//..........................................................
+unsigned long long resumeLength(struct otpResume* resume)
+{
+	unsigned long long rest = resume->job->messageLen - resume->from;
+	unsigned long long chunks = rest / OTP_CHUNK + (rest % OTP_CHUNK != 0);
+
+	return OTP_HEADER_SIZE + resume->keyRefLen + rest * (resume->job->keyRef ? 1 : 2) + chunks * OTP_TRAILER_SIZE;
+}
+
+// resumeSpan
+//
+// description: requestSpan for a checked request: finds the
+//				bytes that start at a given offset, packing a
+//				chunk's trailer when it is reached. The trailer
+//				is kept until the next chunk's, so nothing may
+//				be gathered after it in the same write.
+//
+// @param		resume - the job's resume state
+// @param		offset - offset into the request
+// @param		span - receives a pointer to the bytes
+// @param		trailer - set to 1 if they are a trailer
+// @return		how many bytes follow span contiguously
+//..........................................................
+size_t resumeSpan(struct otpResume* resume, unsigned long long offset, const char** span, int* trailer)
+{
+	struct otpJob* job = resume->job;
+	unsigned long long stride = (job->keyRef ? 1 : 2) * OTP_CHUNK + OTP_TRAILER_SIZE;
+	unsigned long long chunk, within, start;
+	size_t size;
+	unsigned int crc;
+
+	*trailer = 0;
+	if (offset < OTP_HEADER_SIZE)
+	{
+		*span = resume->header + offset;
+		return OTP_HEADER_SIZE - offset;
+	}
+	offset -= OTP_HEADER_SIZE;
+	if (offset < resume->keyRefLen)
+	{
+		*span = resume->keyRef + offset;
+		return resume->keyRefLen - offset;
+	}
+	offset -= resume->keyRefLen;
+
+	chunk = offset / stride;
+	within = offset % stride;
+	start = resume->from + chunk * OTP_CHUNK;					// where the chunk starts in the message
+	size = job->messageLen - start < OTP_CHUNK ? job->messageLen - start : OTP_CHUNK;
+	if (within < size)
+	{
+		*span = job->message + start + within;
+		return size - within;
+	}
+	within -= size;
+	if (!job->keyRef && within < size)
+	{
+		*span = job->key + start + within;
+		return size - within;
+	}
+	within -= job->keyRef ? 0 : size;
+
+	if (resume->trailerChunk != chunk + 1)
+	{
+		crc = crc32c(0, job->message + start, size);
+		if (!job->keyRef)
+		{
+			crc = crc32c(crc, job->key + start, size);
+		}
+		packTrailer(resume->trailer, start / OTP_CHUNK, crc);	// sequence numbers count chunks from the job's start
+		resume->trailerChunk = chunk + 1;
+	}
+	*trailer = 1;
+	*span = resume->trailer + within;
+	return OTP_TRAILER_SIZE - within;
+}
+
+// resumeAnswer
+//
+// description: checks a checked reply header and takes in
+//				its resume token. The first one accepted also
+//				gives a key id job its key offset, prints it
+//				for next, and starts a container's reply.
+//				Refusals exit as in runBinaryJobs, except
+//				busy, which is waited out and retried.
+//
+// @param		resume - the job's resume state
+// @param		reply - the reply header and token
+// @param		endpointName - the daemon's endpoint, for error text
+// @return		1 if the reply goes on, else 0 for busy
+//..........................................................
+int resumeAnswer(struct otpResume* resume, const char* reply, const char* endpointName)
+{
+	struct otpJob* job = resume->job;
+	struct otpHeader header;
+
+	if (unpackHeader(reply, &header) < 0)
+	{
+		fprintf(stderr, "%sCLIENT: ERROR, connection rejected on %s%s\n", RED, endpointName, NRM);
+		exit(2);
+	}
+	if (header.code == OTP_BUSY)
+	{
+		resume->waitMs = header.keyLen;
+		return 0;
+	}
+	if (header.code != OTP_OK)
+	{
+		fprintf(stderr, "%sCLIENT: ERROR, %s on %s%s\n", RED, statusMessage(header.code), endpointName, NRM);
+		exit(header.code == OTP_KEY_SHORT || header.code == OTP_NO_KEY || header.code == OTP_KEY_USED ||
+			header.code == OTP_NO_RESUME ? 1 : 2);
+	}
+	if (header.version < 5 || header.messageLen != job->messageLen - resume->done)
+	{
+		fprintf(stderr, "%sCLIENT: ERROR, bad reply on %s%s\n", RED, endpointName, NRM);
+		exit(1);
+	}
+
+	if (!resume->answered)
+	{
+		resume->keyOffset = header.keyLen;
+		if (job->keyNext)
+		{
+			fprintf(stderr, "%s%s: key %.*s:%llu%s\n", GRN, job->messageFile,
+				(int)(strchr(job->keyFile, ':') - job->keyFile), job->keyFile, header.keyLen, NRM);
+		}
+		if (job->container != NULL)
+		{
+			containerWriteIndex(job->container, job->output);
+		}
+		resume->answered = 1;
+	}
+	memcpy(resume->token, reply + OTP_HEADER_SIZE, OTP_TOKEN_SIZE);
+	return 1;
+}
+
+// resumeAttempt
+//
+// description: sends the rest of a --resume job down one
+//				connection as a checked request while reading
+//				the reply, and writes out each reply chunk
+//				once its trailer checks out
+//
+// @param		resume - the job's resume state
+// @param		socketFD - the connected socket
+// @param		endpointName - the daemon's endpoint, for error text
+// @return		1 once the whole reply is written, else 0 if
+//				the connection was lost, stalled, or brought a
+//				damaged chunk or a busy reply first
+//..........................................................
+int resumeAttempt(struct otpResume* resume, int socketFD, const char* endpointName)
+{
+	struct otpJob* job = resume->job;
+	char reply[OTP_HEADER_SIZE + OTP_TOKEN_SIZE];
+	char buffer[OTP_CHUNK + OTP_TRAILER_SIZE];
+	struct iovec iov[MAX_IOVECS];
+	struct pollfd pfd;
+	unsigned long long total, sent = 0, offset;
+	size_t received = 0;					// bytes of the reply header and token
+	size_t have = 0;						// bytes of the current reply chunk and its trailer
+	size_t chunkLen = 0;
+	unsigned int seq, crc;
+	int count, trailer, ready;
+	ssize_t n;
+
+	resumeRequest(resume);
+	total = resumeLength(resume);
+	fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL, 0) | O_NONBLOCK);
+	pfd.fd = socketFD;
+
+	while (received < sizeof(reply) || resume->done < job->messageLen)
+	{
+		pfd.events = POLLIN | (sent < total || sealPending(clientSeal) > 0 ? POLLOUT : 0);
+		ready = poll(&pfd, 1, RESUME_STALL);
+		if (ready < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (ready <= 0)
+		{
+			fprintf(stderr, "%sCLIENT: ERROR, connection stalled on %s%s\n", RED, endpointName, NRM);
+			return 0;
+		}
+
+		// send as much as the socket takes, up to the end of the next trailer
+		if ((pfd.events & POLLOUT) && (pfd.revents & (POLLOUT | POLLERR)))
+		{
+			for (count = 0, offset = sent, trailer = 0; count < MAX_IOVECS && offset < total && !trailer; count++)
+			{
+				iov[count].iov_len = resumeSpan(resume, offset, (const char**)&iov[count].iov_base, &trailer);
+				offset += iov[count].iov_len;
+			}
+			n = count > 0 ? sealWritev(clientSeal, socketFD, iov, count, MSG_DONTWAIT) : sealFlush(clientSeal, socketFD, MSG_DONTWAIT);
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				fprintf(stderr, "%sCLIENT: ERROR, connection lost on %s%s\n", RED, endpointName, NRM);
+				return 0;
+			}
+			sent += n > 0 ? n : 0;
+		}
+
+		// read every reply byte that has arrived
+		while (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			if (received < sizeof(reply))
+			{
+				n = sealRecv(clientSeal, socketFD, reply + received, (received < OTP_HEADER_SIZE ? OTP_HEADER_SIZE : sizeof(reply)) - received, 0);
+			}
+			else
+			{
+				n = sealRecv(clientSeal, socketFD, buffer + have, chunkLen + OTP_TRAILER_SIZE - have, 0);
+			}
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			{
+				break;
+			}
+			if (n <= 0)
+			{
+				fprintf(stderr, "%sCLIENT: ERROR, connection lost on %s%s\n", RED, endpointName, NRM);
+				return 0;
+			}
+
+			if (received < sizeof(reply))
+			{
+				received += n;
+				if (received == OTP_HEADER_SIZE && (unsigned char)reply[3] != OTP_OK)
+				{
+					return resumeAnswer(resume, reply, endpointName);	// a refusal has no token: exits, or 0 for busy
+				}
+				if (received == sizeof(reply))
+				{
+					resumeAnswer(resume, reply, endpointName);
+					chunkLen = job->messageLen - resume->done < OTP_CHUNK ? job->messageLen - resume->done : OTP_CHUNK;
+				}
+				continue;
+			}
+
+			have += n;
+			if (have == chunkLen + OTP_TRAILER_SIZE)
+			{
+				unpackTrailer(buffer + chunkLen, &seq, &crc);
+				if (seq != resume->done / OTP_CHUNK || crc != crc32c(0, buffer, chunkLen))
+				{
+					fprintf(stderr, "%sCLIENT: ERROR, damaged reply chunk %llu on %s%s\n", RED, resume->done / OTP_CHUNK, endpointName, NRM);
+					return 0;
+				}
+				fwrite(buffer, 1, chunkLen, job->output);
+				resume->done += chunkLen;
+				have = 0;
+				chunkLen = job->messageLen - resume->done < OTP_CHUNK ? job->messageLen - resume->done : OTP_CHUNK;
+				if (resume->done == job->messageLen)
+				{
+					break;
+				}
+			}
+		}
+	}
+	return 1;											// every reply chunk checked out, so no end of stream is needed
+}
+
+// runCheckedJob
+//
+// description: runs one job as a checked request, and each
+//				time the connection is lost, reconnects and
+//				resumes it from the first chunk without a good
+//				reply. It gives up with 2 after RESUME_TRIES
+//				connections in a row that make no progress,
+//				waiting twice as long before each.
+//
+//				An encryption by key id that loses its first
+//				connection before any reply asks again as it
+//				did the first time: with next the daemon hands
+//				out a fresh range, leaving the first one unused,
+//				and with an offset its ledger may refuse it.
+//
+// @param		config - the client configuration
+// @param		op - OP_ENC or OP_DEC
+// @param		job - the job, its files mapped or not
+//..........................................................
+void runCheckedJob(struct clientConfig* config, int op, struct otpJob* job)
+{
+	struct otpResume resume;
+	unsigned long long wait = RESUME_WAIT;
+	unsigned long long before;
+	int tries = 0, finished = 0;
+	int socketFD;
+
+	startJob(op, job, 0);
+	memset(&resume, 0, sizeof(resume));
+	resume.job = job;
+	resume.op = op;
+
+	while (!finished)
+	{
+		before = resume.done;
+		socketFD = openConnection(config);
+		if (socketFD >= 0)
+		{
+			finished = resumeAttempt(&resume, socketFD, config->endpoint.name);
+			close(socketFD);
+			sealClose(clientSeal);
+			clientSeal = NULL;
+		}
+		if (finished)
+		{
+			break;
+		}
+		if (resume.done > before)
+		{
+			tries = 0;										// progress: start the count again
+			wait = RESUME_WAIT;
+		}
+		if (++tries > RESUME_TRIES)
+		{
+			fprintf(stderr, "%sCLIENT: ERROR, giving up on %s after %d tries on %s%s\n", RED, job->messageFile, tries, config->endpoint.name, NRM);
+			exit(2);
+		}
+		fprintf(stderr, "%sCLIENT: resuming %s at %llu of %zu characters on %s%s\n", CYN, job->messageFile, resume.done,
+			job->messageLen, config->endpoint.name, NRM);
+		poll(NULL, 0, resume.waitMs > wait ? resume.waitMs : wait);	// a busy server's retry-after, if longer
+		resume.waitMs = 0;
+		wait *= 2;
+	}
+	finishJob(job);
+}
@@ -0,0 +1,266 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpContainer.c - the container file, which packs many messages, and optionally the key slice
+//				for each, into one file with an index for random access. otp_pack builds and reads them;
+//				otp_enc and otp_dec --container send a whole container as a single request and write the
+//				reply as a matching container.
+//
+//				Layout (integers in network byte order, like otpProtocol.c's headers):
+//				[ magic "OTPC" | version | flags  | reserved | records | data length | key length	]
+//				[ 4 bytes      | 1 byte  | 1 byte | 2 bytes  | 8 bytes | 8 bytes     | 8 bytes		]
+//				[ index: one { offset, length } of 8 bytes each per record, offsets into the data		]
+//				[ data: the messages, back to back, message characters only							]
+//				[ keys: with CONTAINER_KEYS, each record's key slice at the same offset as its message	]
+//
+//				Since the cipher works on each character alone, the whole data area can be ciphered as
+//				one message with the whole key area as its key, and every record comes out the same as
+//				if it had been sent alone. A reply container has the same index and no keys, so a record
+//				is found in the ciphertext exactly where it was in the plaintext.
+//
+//				Expects cipherValid() from otpCipher.c.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**********************************************************
+// CONTAINER GLOBALS
+// ********************************************************/
+
+#define CONTAINER_MAGIC		"OTPC"	// the first four bytes of every container
+#define CONTAINER_VERSION	1		// the layout written here
+#define CONTAINER_HEADER	32		// size of the header
+#define CONTAINER_ENTRY		16		// size of one index entry
+#define CONTAINER_KEYS		1		// flag: a key area follows the data
+
+// containerMap() results
+// ......................
+#define CONTAINER_OK		0		// mapped and checked
+#define CONTAINER_NOT		1		// the file is not a container at all
+#define CONTAINER_BAD		(-1)	// unreadable, or a damaged container
+
+// otpContainer
+// ......................
+struct otpContainer
+{
+	const char* base;				// the mapped file
+	size_t mapped;					// size of the mapping
+	int flags;						// CONTAINER_ flags
+	unsigned long long count;		// records
+	const char* index;				// the index, in file format
+	const char* data;				// the data area
+	unsigned long long dataLen;		// its size
+	const char* keys;				// the key area, or NULL without CONTAINER_KEYS
+};
+
+/**********************************************************
+// CONTAINER FUNCTIONS
+// ********************************************************/
+
+// containerPackHeader
+//
+// description: writes a container header
+//
+// @param		buf - CONTAINER_HEADER bytes to write into
+// @param		flags - CONTAINER_ flags
+// @param		count - records
+// @param		dataLen - size of the data area
+//..........................................................
+void containerPackHeader(char* buf, int flags, unsigned long long count, unsigned long long dataLen)
+{
+	unsigned long long wireCount = htobe64(count);
+	unsigned long long wireData = htobe64(dataLen);
+	unsigned long long wireKeys = htobe64((flags & CONTAINER_KEYS) ? dataLen : 0);
+
+	memcpy(buf, CONTAINER_MAGIC, 4);
+	buf[4] = CONTAINER_VERSION;
+	buf[5] = (char)flags;
+	buf[6] = buf[7] = 0;
+	memcpy(buf + 8, &wireCount, 8);
+	memcpy(buf + 16, &wireData, 8);
+	memcpy(buf + 24, &wireKeys, 8);
+}
+
+// containerPackEntry
+//
+// description: writes one index entry
+//
+// @param		buf - CONTAINER_ENTRY bytes to write into
+// @param		offset - where the record starts in the data
+// @param		length - its size
+//..........................................................
+void containerPackEntry(char* buf, unsigned long long offset, unsigned long long length)
+{
+	unsigned long long wireOffset = htobe64(offset);
+	unsigned long long wireLength = htobe64(length);
+
+	memcpy(buf, &wireOffset, 8);
+	memcpy(buf + 8, &wireLength, 8);
+}
+
+// containerRecord
+//
+// description: finds one record through the index
+//
+// @param		container - a checked container
+// @param		i - the record, below count
+// @param		length - receives its size
+// @return		the record's message characters
+//..........................................................
+const char* containerRecord(struct otpContainer* container, unsigned long long i, size_t* length)
+{
+	unsigned long long offset, size;
+
+	memcpy(&offset, container->index + i * CONTAINER_ENTRY, 8);
+	memcpy(&size, container->index + i * CONTAINER_ENTRY + 8, 8);
+	*length = be64toh(size);
+	return container->data + be64toh(offset);
+}
+
+// containerCheck
+//
+// description: checks a mapped container: its header, that
+//				the areas add up to the file size exactly, that
+//				every index entry lies inside the data, and
+//				that data and keys are all message characters
+//
+// @param		container - the container, base and mapped
+//				set; the rest is filled in
+// @return		CONTAINER_OK, CONTAINER_NOT or CONTAINER_BAD
+//..........................................................
+int containerCheck(struct otpContainer* container)
+{
+	unsigned long long count, dataLen, keyLen, offset, length, i;
+	const char* entry;
+
+	if (container->mapped < 4 || memcmp(container->base, CONTAINER_MAGIC, 4) != 0)
+	{
+		return CONTAINER_NOT;
+	}
+	if (container->mapped < CONTAINER_HEADER || container->base[4] != CONTAINER_VERSION)
+	{
+		return CONTAINER_BAD;
+	}
+	memcpy(&count, container->base + 8, 8);
+	memcpy(&dataLen, container->base + 16, 8);
+	memcpy(&keyLen, container->base + 24, 8);
+	count = be64toh(count);
+	dataLen = be64toh(dataLen);
+	keyLen = be64toh(keyLen);
+	container->flags = (unsigned char)container->base[5];
+	if (keyLen != ((container->flags & CONTAINER_KEYS) ? dataLen : 0) ||
+		count > (container->mapped - CONTAINER_HEADER) / CONTAINER_ENTRY ||
+		dataLen > container->mapped - CONTAINER_HEADER - count * CONTAINER_ENTRY ||
+		keyLen != container->mapped - CONTAINER_HEADER - count * CONTAINER_ENTRY - dataLen)
+	{
+		return CONTAINER_BAD;
+	}
+
+	container->count = count;
+	container->index = container->base + CONTAINER_HEADER;
+	container->data = container->index + count * CONTAINER_ENTRY;
+	container->dataLen = dataLen;
+	container->keys = (container->flags & CONTAINER_KEYS) ? container->data + dataLen : NULL;
+	for (i = 0, entry = container->index; i < count; i++, entry += CONTAINER_ENTRY)
+	{
+		memcpy(&offset, entry, 8);
+		memcpy(&length, entry + 8, 8);
+		offset = be64toh(offset);
+		length = be64toh(length);
+		if (offset > dataLen || length > dataLen - offset)
+		{
+			return CONTAINER_BAD;
+		}
+	}
+	if (!cipherValid(container->data, dataLen) || (container->keys && !cipherValid(container->keys, keyLen)))
+	{
+		return CONTAINER_BAD;
+	}
+	return CONTAINER_OK;
+}
+
+// containerMap
+//
+// description: maps a file and, if it is a container,
+//				checks it
+//
+// @param		fileName - the file
+// @param		container - receives the container
+// @return		CONTAINER_OK; CONTAINER_NOT, with the file
+//				unmapped, if it is some other file or cannot
+//				be opened, for the caller to report; or
+//				CONTAINER_BAD if it is a damaged container
+//				or cannot be mapped
+//..........................................................
+int containerMap(const char* fileName, struct otpContainer* container)
+{
+	struct stat st;
+	int fd, result;
+
+	memset(container, 0, sizeof(*container));
+	fd = open(fileName, O_RDONLY);
+	if (fd < 0)
+	{
+		return CONTAINER_NOT;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+	{
+		close(fd);
+		return CONTAINER_NOT;
+	}
+	container->base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);											// the mapping keeps the file open
+	if (container->base == MAP_FAILED)
+	{
+		container->base = NULL;
+		return CONTAINER_BAD;
+	}
+	container->mapped = st.st_size;
+	madvise((void*)container->base, container->mapped, MADV_SEQUENTIAL);
+
+	result = containerCheck(container);
+	if (result == CONTAINER_NOT)
+	{
+		munmap((void*)container->base, container->mapped);
+		container->base = NULL;
+	}
+	return result;
+}
+
+// containerSameIndex
+//
+// description: whether two containers hold records of the
+//				same sizes at the same offsets
+//
+// @param		a - a checked container
+// @param		b - another
+// @return		1 if so, else 0
+//..........................................................
+int containerSameIndex(struct otpContainer* a, struct otpContainer* b)
+{
+	return a->count == b->count && a->dataLen == b->dataLen && memcmp(a->index, b->index, a->count * CONTAINER_ENTRY) == 0;
+}
+
+// containerWriteIndex
+//
+// description: writes the header and index of a reply
+//				container, which has the same records as the
+//				request's and no keys
+//
+// @param		container - the request container
+// @param		output - where the reply goes
+//..........................................................
+void containerWriteIndex(struct otpContainer* container, FILE* output)
+{
+	char header[CONTAINER_HEADER];
+
+	containerPackHeader(header, 0, container->count, container->dataLen);
+	fwrite(header, 1, CONTAINER_HEADER, output);
+	fwrite(container->index, CONTAINER_ENTRY, container->count, output);
+}
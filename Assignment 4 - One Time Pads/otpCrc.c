@@ -0,0 +1,178 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpCrc.c - CRC-32C (Castagnoli), for the chunk trailers of checked requests (protocol version
+//				5) and the key ledger's records.
+//
+//				CPUs with SSE4.2 run the crc32 instruction eight bytes at a time. Others use slicing-by-8,
+//				with tables built on the first call. As with otpCipher.c's kernels, the version is picked on
+//				the first call, and crcUse() forces one for the benchmark.
+//
+//				crc32c() takes and returns the finished checksum, so a checksum can be carried across
+//				pieces: crc32c(crc32c(0, a, n), b, m) is the checksum of a followed by b.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <stdint.h>
+#include <immintrin.h>
+
+/**********************************************************
+// CRC GLOBALS
+// ********************************************************/
+
+#define CRC_POLY		0x82F63B78U		// the Castagnoli polynomial, bit reflected
+
+// crc levels
+// ......................
+#define CRC_TABLE		0		// slicing-by-8
+#define CRC_SSE42		1		// the crc32 instruction
+#define CRC_LEVELS		2
+
+const char* crcLevelNames[CRC_LEVELS] = { "table", "sse4.2" };
+
+// crcKernel
+// ......................
+typedef unsigned int (*crcKernel)(unsigned int crc, const void* data, size_t n);
+
+unsigned int crcResolve(unsigned int crc, const void* data, size_t n);
+
+crcKernel crc32c = crcResolve;			// the version in use, picked on the first call
+unsigned int crcTables[8][256];			// slicing-by-8 tables, built by crcUse(CRC_TABLE)
+
+/**********************************************************
+// CRC FUNCTIONS
+// ********************************************************/
+
+// crcTable
+//
+// description: CRC-32C eight bytes at a time through the
+//				slicing tables, and a byte at a time for the
+//				rest
+//
+// @param		crc - the checksum so far, 0 to start
+// @param		data - the bytes
+// @param		n - the number of bytes
+// @return		the checksum with the bytes added
+//..........................................................
+unsigned int crcTable(unsigned int crc, const void* data, size_t n)
+{
+	const unsigned char* p = data;
+	uint64_t word;
+
+	crc = ~crc;
+	while (n >= 8)
+	{
+		memcpy(&word, p, 8);
+		word = htole64(word) ^ crc;
+		crc = crcTables[7][word & 0xFF] ^ crcTables[6][(word >> 8) & 0xFF] ^
+			crcTables[5][(word >> 16) & 0xFF] ^ crcTables[4][(word >> 24) & 0xFF] ^
+			crcTables[3][(word >> 32) & 0xFF] ^ crcTables[2][(word >> 40) & 0xFF] ^
+			crcTables[1][(word >> 48) & 0xFF] ^ crcTables[0][word >> 56];
+		p += 8;
+		n -= 8;
+	}
+	while (n-- > 0)
+	{
+		crc = (crc >> 8) ^ crcTables[0][(crc ^ *p++) & 0xFF];
+	}
+	return ~crc;
+}
+
+// crcSSE42
+//
+// description: CRC-32C with the crc32 instruction, eight
+//				bytes at a time
+//
+// @param		crc - the checksum so far, 0 to start
+// @param		data - the bytes
+// @param		n - the number of bytes
+// @return		the checksum with the bytes added
+//..........................................................
+__attribute__((target("sse4.2")))
+unsigned int crcSSE42(unsigned int crc, const void* data, size_t n)
+{
+	const unsigned char* p = data;
+	unsigned long long wide = ~crc & 0xFFFFFFFFU;
+	uint64_t word;
+
+	while (n >= 8)
+	{
+		memcpy(&word, p, 8);
+		wide = _mm_crc32_u64(wide, word);
+		p += 8;
+		n -= 8;
+	}
+	crc = (unsigned int)wide;
+	while (n-- > 0)
+	{
+		crc = _mm_crc32_u8(crc, *p++);
+	}
+	return ~crc;
+}
+
+// crcSupported
+//
+// description: checks whether this CPU can run a version
+//
+// @param		level - one of the CRC_ levels
+// @return		1 if it can, else 0
+//..........................................................
+int crcSupported(int level)
+{
+	__builtin_cpu_init();
+	return level == CRC_TABLE || (level == CRC_SSE42 && __builtin_cpu_supports("sse4.2"));
+}
+
+// crcUse
+//
+// description: makes crc32c use a version, building the
+//				tables first if it is the table one
+//
+// @param		level - one of the CRC_ levels, which the CPU
+//				must support
+//..........................................................
+void crcUse(int level)
+{
+	unsigned int crc;
+	int i, j, bit;
+
+	if (level == CRC_TABLE && crcTables[0][1] == 0)
+	{
+		for (i = 0; i < 256; i++)
+		{
+			crc = i;
+			for (bit = 0; bit < 8; bit++)
+			{
+				crc = (crc >> 1) ^ (CRC_POLY & (0U - (crc & 1)));
+			}
+			crcTables[0][i] = crc;
+		}
+		for (i = 0; i < 256; i++)
+		{
+			for (j = 1; j < 8; j++)
+			{
+				crcTables[j][i] = (crcTables[j - 1][i] >> 8) ^ crcTables[0][crcTables[j - 1][i] & 0xFF];
+			}
+		}
+	}
+	crc32c = level == CRC_SSE42 ? crcSSE42 : crcTable;
+}
+
+// crcResolve
+//
+// description: the initial value of crc32c. Picks the best
+//				version, then runs it. Threads that race here
+//				all build the same tables and pick the same one.
+//
+// @param		crc - the checksum so far, 0 to start
+// @param		data - the bytes
+// @param		n - the number of bytes
+// @return		the checksum with the bytes added
+//..........................................................
+unsigned int crcResolve(unsigned int crc, const void* data, size_t n)
+{
+	crcUse(crcSupported(CRC_SSE42) ? CRC_SSE42 : CRC_TABLE);
+	return crc32c(crc, data, n);
+}
@@ -0,0 +1,144 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpEndpoint.c - where a daemon listens and a client connects, written the same way on both
+//				command lines:
+//
+//				[x]		port - a TCP port on the loopback address, as in the original assignment
+//				[x]		unix:/path - a Unix domain stream socket at path. Traffic never enters the TCP stack,
+//						and the daemon learns each client's uid from SO_PEERCRED, so it can refuse any
+//						user it was not told to serve.
+//				[x]		@name - the same, in Linux's abstract socket namespace: no file to create, clean up
+//						or leave behind after a crash, and the name is freed when the daemon exits. It is
+//						scoped to the network namespace rather than guarded by file permissions, so
+//						SO_PEERCRED is all that decides who is served.
+//
+//				endpointParse() resolves an endpoint once into a ready sockaddr, with no name service
+//				lookup; clients then only need socket() and connect(). An endpoint's name ("port 5000",
+//				"unix:/path" or "@name") is what error messages print.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <stddef.h>
+#include <sys/un.h>
+
+/**********************************************************
+// ENDPOINT GLOBALS
+// ********************************************************/
+
+#define ENDPOINT_UNIX		"unix:"		// prefix of a Unix domain socket path
+#define ENDPOINT_ABSTRACT	'@'			// first character of an abstract socket name
+
+// otpEndpoint
+// ......................
+struct otpEndpoint
+{
+	int family;						// AF_INET or AF_UNIX
+	int abstract;					// 1 for an @name socket, which has no file
+	int port;						// the TCP port, or 0
+	struct sockaddr_storage address;	// the resolved address
+	socklen_t addressLen;			// its length
+	char name[sizeof(ENDPOINT_UNIX) + sizeof(((struct sockaddr_un*)0)->sun_path)];	// for messages
+};
+
+/**********************************************************
+// ENDPOINT FUNCTIONS
+// ********************************************************/
+
+// endpointParse
+//
+// description: reads a port, unix:/path or @name argument.
+//				A port is the loopback address for clients;
+//				the daemons bind it on every address.
+//
+// @param		text - the argument
+// @param		endpoint - receives the endpoint
+// @return		0, or -1 if text is none of them
+//..........................................................
+int endpointParse(const char* text, struct otpEndpoint* endpoint)
+{
+	struct sockaddr_un* unixAddress = (struct sockaddr_un*)&endpoint->address;
+	struct sockaddr_in* inetAddress = (struct sockaddr_in*)&endpoint->address;
+	const char* path;
+	char* end;
+	long port;
+
+	memset(endpoint, 0, sizeof(*endpoint));
+	if (strncmp(text, ENDPOINT_UNIX, strlen(ENDPOINT_UNIX)) == 0)
+	{
+		path = text + strlen(ENDPOINT_UNIX);
+		if (path[0] == '\0' || strlen(path) >= sizeof(unixAddress->sun_path))
+		{
+			return -1;
+		}
+		endpoint->family = AF_UNIX;
+		unixAddress->sun_family = AF_UNIX;
+		strcpy(unixAddress->sun_path, path);
+		endpoint->addressLen = offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+		snprintf(endpoint->name, sizeof(endpoint->name), "%s%s", ENDPOINT_UNIX, path);
+		return 0;
+	}
+	if (text[0] == ENDPOINT_ABSTRACT)
+	{
+		path = text + 1;
+		if (path[0] == '\0' || strlen(path) >= sizeof(unixAddress->sun_path))
+		{
+			return -1;
+		}
+		endpoint->family = AF_UNIX;
+		endpoint->abstract = 1;
+		unixAddress->sun_family = AF_UNIX;
+		memcpy(unixAddress->sun_path + 1, path, strlen(path));		// sun_path[0] stays '\0'
+		endpoint->addressLen = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(path);	// no terminator: every byte is the name
+		snprintf(endpoint->name, sizeof(endpoint->name), "%s", text);
+		return 0;
+	}
+
+	port = strtol(text, &end, 10);
+	if (end == text || *end != '\0' || port < 0 || port > 65535)
+	{
+		return -1;
+	}
+	endpoint->family = AF_INET;
+	endpoint->port = (int)port;
+	inetAddress->sin_family = AF_INET;
+	inetAddress->sin_port = htons(endpoint->port);
+	inetAddress->sin_addr.s_addr = htonl(INADDR_LOOPBACK);		// localhost, without reading /etc/hosts on every run
+	endpoint->addressLen = sizeof(struct sockaddr_in);
+	snprintf(endpoint->name, sizeof(endpoint->name), "port %d", endpoint->port);
+	return 0;
+}
+
+// endpointSocket
+//
+// description: opens an unconnected stream socket of the
+//				endpoint's family
+//
+// @param		endpoint - the endpoint
+// @return		the socket, or -1
+//..........................................................
+int endpointSocket(struct otpEndpoint* endpoint)
+{
+	return socket(endpoint->family, SOCK_STREAM, 0);
+}
+
+// endpointConnect
+//
+// description: connects a socket to the endpoint
+//
+// @param		endpoint - the endpoint
+// @return		the connected socket, or -1
+//..........................................................
+int endpointConnect(struct otpEndpoint* endpoint)
+{
+	int socketFD = endpointSocket(endpoint);
+
+	if (socketFD >= 0 && connect(socketFD, (struct sockaddr*)&endpoint->address, endpoint->addressLen) < 0)
+	{
+		close(socketFD);
+		return -1;
+	}
+	return socketFD;
+}
@@ -0,0 +1,511 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpEvent.c - the --event-loop server mode. Each thread owns a non-blocking SO_REUSEPORT
+//				listener (or shares the one unix: listener) and an epoll instance, and drives every
+//				connection it accepts through the same otpParser the blocking workers use. A connection
+//				moves through two phases:
+//
+//				[x]		reading - bytes are fed to the parser as fast as it wants them, and the reply
+//						streams out as it becomes ready and the socket allows
+//				[x]		closing - once the whole reply is out, the write side is shut down and the socket
+//						is closed when the client hangs up, so no reply bytes are lost to a reset
+//
+//				Each thread keeps its connections in a list, least recently active first, and every
+//				event on a connection moves it to the back. With --idle-timeout, epoll_wait sleeps no
+//				longer than until the front one runs out, and connections that had no event for that
+//				long are closed from the front, so a quiet client, or one that never hangs up after its
+//				reply, does not hold its --max-conns slot for good. That is one clock read per event.
+//
+//				The thread that claims eventChildFD also watches the daemon's SIGCHLD signalfd, so the
+//				metrics process is reaped, counted and restarted when it dies.
+//
+//				Included by otpServer.c.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+/**********************************************************
+// EVENT LOOP GLOBALS
+// ********************************************************/
+
+#define MAX_EVENTS		64		// events handled per epoll_wait
+
+int eventThreadCount = 0;		// event loop threads started, which numbers their stats slots
+int eventChildFD = -1;			// the SIGCHLD signalfd, until a thread claims it
+__thread struct eventConn* eventOldest;		// this thread's connections, least recently active first
+__thread struct eventConn* eventNewest;		// and the most recently active one
+
+// connection phases
+// ......................
+#define CONN_READING	0		// the request is arriving and the reply streaming out
+#define CONN_CLOSING	1		// the reply is out, waiting for the client to hang up
+
+// eventConn
+// ......................
+struct eventConn
+{
+	int fd;						// the client socket
+	int phase;					// one of the CONN_ phases
+	unsigned int events;		// the epoll events the connection waits for
+	int admitted;				// 1 if the connection counts against --max-conns
+	struct otpParser parser;	// this connection's request parser
+	struct otpSeal* seal;		// the sealed transport with --psk, else NULL
+	unsigned long long activeAt;	// statsNow() at its last event, for --idle-timeout
+	struct eventConn* older;	// its neighbours in the thread's list
+	struct eventConn* newer;
+};
+
+/**********************************************************
+// EVENT LOOP FUNCTIONS
+// ********************************************************/
+
+// setNonBlocking
+//
+// description: puts a socket into non-blocking mode
+//
+// @param		fd - the socket
+//..........................................................
+void setNonBlocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+	{
+		error("SERVER: ERROR setting O_NONBLOCK");
+	}
+}
+
+// eventUnlink
+//
+// description: takes a connection out of its thread's
+//				list, if it is in it
+//
+// @param		conn - the connection
+//..........................................................
+void eventUnlink(struct eventConn* conn)
+{
+	if (conn->older != NULL)
+	{
+		conn->older->newer = conn->newer;
+	}
+	else if (eventOldest == conn)
+	{
+		eventOldest = conn->newer;
+	}
+	if (conn->newer != NULL)
+	{
+		conn->newer->older = conn->older;
+	}
+	else if (eventNewest == conn)
+	{
+		eventNewest = conn->older;
+	}
+	conn->older = conn->newer = NULL;
+}
+
+// eventTouch
+//
+// description: notes an event on a connection, moving it to
+//				the back of its thread's list. Does nothing
+//				without --idle-timeout.
+//
+// @param		conn - the connection
+//..........................................................
+void eventTouch(struct eventConn* conn)
+{
+	if (serverConfig->idleTimeout <= 0)
+	{
+		return;
+	}
+	conn->activeAt = statsNow();
+	if (eventNewest == conn)
+	{
+		return;
+	}
+	eventUnlink(conn);
+	conn->older = eventNewest;
+	if (eventNewest != NULL)
+	{
+		eventNewest->newer = conn;
+	}
+	else
+	{
+		eventOldest = conn;
+	}
+	eventNewest = conn;
+}
+
+// eventClose
+//
+// description: removes a connection from the loop and frees it
+//
+// @param		conn - the connection to close
+// @return		-1, so callers can return it directly
+//..........................................................
+int eventClose(struct eventConn* conn)
+{
+	eventUnlink(conn);
+	close(conn->fd);						// closing also removes it from the epoll set
+	if (conn->admitted)
+	{
+		admitLeave(serverAdmit);
+	}
+	parserFree(&conn->parser);
+	sealClose(conn->seal);
+	free(conn);
+	return -1;
+}
+
+// eventSweep
+//
+// description: closes the thread's connections that have
+//				had no event for --idle-timeout
+//
+// @return		milliseconds until the next one would run
+//				out, for epoll_wait, or -1 if none can
+//..........................................................
+int eventSweep()
+{
+	unsigned long long idleNs = (unsigned long long)serverConfig->idleTimeout * 1000000000ULL;
+	unsigned long long now;
+
+	if (eventOldest == NULL)
+	{
+		return -1;
+	}
+	now = statsNow();
+	while (eventOldest != NULL && now - eventOldest->activeAt >= idleNs)
+	{
+		if (eventOldest->phase == CONN_READING)
+		{
+			fprintf(stderr, "%sSERVER: ERROR reading from socket, the client went idle%s\n", RED, NRM);
+		}
+		eventClose(eventOldest);
+	}
+	if (eventOldest == NULL)
+	{
+		return -1;
+	}
+	return (int)((eventOldest->activeAt + idleNs - now + 999999) / 1000000);	// round up, so it has run out on waking
+}
+
+// eventWatch
+//
+// description: sets which events a connection waits for
+//
+// @param		epollFD - the thread's epoll instance
+// @param		conn - the connection
+// @param		wantRead - 1 to wait for EPOLLIN
+// @param		wantWrite - 1 to wait for EPOLLOUT
+//..........................................................
+void eventWatch(int epollFD, struct eventConn* conn, int wantRead, int wantWrite)
+{
+	struct epoll_event ev;
+	unsigned int events = (wantRead ? EPOLLIN : 0) | (wantWrite ? EPOLLOUT : 0);
+
+	if (conn->events == events)
+	{
+		return;
+	}
+	ev.events = events;
+	ev.data.ptr = conn;
+	epoll_ctl(epollFD, EPOLL_CTL_MOD, conn->fd, &ev);
+	conn->events = events;
+}
+
+// eventPump
+//
+// description: moves a connection along as far as it can
+//				go without blocking. While the request is
+//				being read, ready reply bytes are sent and
+//				input is fed to the parser for as long as it
+//				wants more; once the whole reply is out, the
+//				write side is shut down and input is discarded
+//				until the client hangs up. Afterwards the
+//				connection waits for input only if the parser
+//				wants some, and for output only if reply bytes
+//				are still waiting.
+//
+// @param		epollFD - the thread's epoll instance
+// @param		conn - the connection
+// @return		0, or -1 if the connection was closed
+//..........................................................
+int eventPump(int epollFD, struct eventConn* conn)
+{
+	char buffer[OTP_CHUNK];
+	const char* pending;
+	ssize_t charsRead;
+	size_t want;
+
+	while (conn->phase == CONN_READING)
+	{
+		if (sendReply(conn->fd, conn->seal, &conn->parser, 0) < 0)
+		{
+			fprintf(stderr, "%sSERVER: ERROR writing to socket%s\n", RED, NRM);
+			return eventClose(conn);
+		}
+		if (parserFinished(&conn->parser))
+		{
+			if (sealPending(conn->seal) > 0)
+			{
+				break;								// the last sealed record has to go out first
+			}
+			if (conn->parser.state == PARSE_REJECTED && !conn->parser.busy)
+			{
+				fprintf(stderr, "%sSERVER: ERROR, client handshake unsuccessful%s\n", RED, NRM);
+			}
+			conn->phase = CONN_CLOSING;				// the reply is out: half close and wait for the client's EOF
+			shutdown(conn->fd, SHUT_WR);
+			break;
+		}
+
+		want = parserWant(&conn->parser);
+		if (want == 0)
+		{
+			break;									// the reply has to go out before more is read
+		}
+		if (want > sizeof(buffer))
+		{
+			want = sizeof(buffer);
+		}
+		charsRead = sealRecv(conn->seal, conn->fd, buffer, want, 0);
+		if (charsRead < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				break;								// wait for more input
+			}
+			fprintf(stderr, "%sSERVER: ERROR reading from socket%s%s\n", RED, errno == EBADMSG ? ", a record failed to authenticate" : "", NRM);
+			return eventClose(conn);
+		}
+		if (charsRead == 0)
+		{
+			if (!parserIdle(&conn->parser) && (conn->parser.state != PARSE_SKIP || conn->parser.skipState != PARSE_REJECTED))
+			{
+				fprintf(stderr, "%sSERVER: ERROR, client disconnected mid-transmission%s\n", RED, NRM);
+			}
+			return eventClose(conn);
+		}
+		if (parserFeed(&conn->parser, buffer, charsRead) == PARSE_ERROR)
+		{
+			fprintf(stderr, "%sSERVER: ERROR, malformed request%s\n", RED, NRM);
+			statsMalformed(serverStats);
+			return eventClose(conn);
+		}
+	}
+
+	while (conn->phase == CONN_CLOSING)
+	{
+		charsRead = recv(conn->fd, buffer, sizeof(buffer), 0);	// discard anything after the request
+		if (charsRead < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (charsRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			break;
+		}
+		if (charsRead <= 0)
+		{
+			return eventClose(conn);
+		}
+	}
+
+	eventWatch(epollFD, conn,
+		conn->phase == CONN_CLOSING || parserWant(&conn->parser) > 0,
+		conn->phase == CONN_READING && (parserReply(&conn->parser, &pending) > 0 || sealPending(conn->seal) > 0));
+	return 0;
+}
+
+// eventAccept
+//
+// description: accepts every pending connection on the
+//				listener and adds it to the epoll set
+//
+// @param		epollFD - the thread's epoll instance
+// @param		listenSocketFD - the thread's listener
+//..........................................................
+void eventAccept(int epollFD, int listenSocketFD)
+{
+	int establishedConnectionFD;
+	struct eventConn* conn;
+	struct epoll_event ev;
+
+	while (1)
+	{
+		establishedConnectionFD = accept(listenSocketFD, NULL, NULL);
+		if (establishedConnectionFD < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+			{
+				fprintf(stderr, "%sSERVER: ERROR on accept: %s%s\n", RED, strerror(errno), NRM);
+			}
+			if (errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+			return;
+		}
+		if (!allowPeer(establishedConnectionFD))
+		{
+			close(establishedConnectionFD);
+			continue;
+		}
+		setNonBlocking(establishedConnectionFD);
+		configureConnection(establishedConnectionFD);
+		statsConnection(serverStats);
+
+		conn = calloc(1, sizeof(*conn));
+		if (conn == NULL)
+		{
+			fprintf(stderr, "%sSERVER: ERROR allocating connection%s\n", RED, NRM);
+			close(establishedConnectionFD);
+			continue;
+		}
+		conn->fd = establishedConnectionFD;
+		conn->phase = CONN_READING;
+		if (serverPsk != NULL && (conn->seal = sealOpen(establishedConnectionFD, serverPsk, serverPskLen, 1)) == NULL)
+		{
+			fprintf(stderr, "%sSERVER: ERROR starting the sealed transport%s\n", RED, NRM);
+			close(establishedConnectionFD);
+			free(conn);
+			continue;
+		}
+		conn->admitted = admitConnection(serverAdmit);
+		parserInit(&conn->parser, serverOps, serverStats, serverKeys, serverAdmit);
+		conn->parser.overloaded = !conn->admitted;		// over --max-conns: it only gets told to retry
+
+		conn->events = EPOLLIN;
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (epoll_ctl(epollFD, EPOLL_CTL_ADD, establishedConnectionFD, &ev) < 0)
+		{
+			fprintf(stderr, "%sSERVER: ERROR adding connection to epoll%s\n", RED, NRM);
+			eventClose(conn);
+			continue;
+		}
+		eventTouch(conn);
+	}
+}
+
+// eventThread
+//
+// description: one event loop thread. The listener is
+//				registered with a NULL pointer and the SIGCHLD
+//				signalfd, in the one thread that claims it,
+//				with &eventChildFD; every other entry points at
+//				its eventConn. Idle connections are swept out
+//				before each wait.
+//
+// @param		arg - the thread's listening socket
+//..........................................................
+void* eventThread(void* arg)
+{
+	int listenSocketFD = (int)(long)arg;
+	int epollFD;
+	int childFD;
+	int n, i;
+	struct epoll_event ev;
+	struct epoll_event events[MAX_EVENTS];
+	struct eventConn* conn;
+
+	statsBind(serverStats, __atomic_fetch_add(&eventThreadCount, 1, __ATOMIC_RELAXED));
+	epollFD = epoll_create1(0);
+	if (epollFD < 0)
+	{
+		error("SERVER: ERROR creating epoll instance");
+	}
+	ev.events = EPOLLIN | (serverConfig->endpoint.family == AF_UNIX ? EPOLLEXCLUSIVE : 0);	// a shared listener wakes one thread
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epollFD, EPOLL_CTL_ADD, listenSocketFD, &ev) < 0)
+	{
+		error("SERVER: ERROR adding listener to epoll");
+	}
+	childFD = __atomic_exchange_n(&eventChildFD, -1, __ATOMIC_RELAXED);
+	if (childFD >= 0)
+	{
+		ev.events = EPOLLIN;
+		ev.data.ptr = &eventChildFD;
+		if (epoll_ctl(epollFD, EPOLL_CTL_ADD, childFD, &ev) < 0)
+		{
+			error("SERVER: ERROR adding the SIGCHLD signalfd to epoll");
+		}
+	}
+
+	while (1)
+	{
+		n = epoll_wait(epollFD, events, MAX_EVENTS, eventSweep());
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				statsPoll(serverStats);					// SIGUSR1 asked for the stats
+				continue;
+			}
+			error("SERVER: epoll_wait error");
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			conn = events[i].data.ptr;
+			if (conn == NULL)
+			{
+				eventAccept(epollFD, listenSocketFD);
+			}
+			else if ((void*)conn == (void*)&eventChildFD)
+			{
+				childDrain(childFD);
+				reapChildren();
+			}
+			else
+			{
+				eventTouch(conn);
+				eventPump(epollFD, conn);
+			}
+		}
+	}
+	return NULL;
+}
+
+// runEventLoop
+//
+// description: opens one non-blocking listener per thread
+//				and runs an event loop on each. The calling
+//				thread runs the first loop, so this does not
+//				return.
+//
+// @param		config - the server configuration
+//..........................................................
+void runEventLoop(struct serverConfig* config)
+{
+	int listeners[MAX_WORKERS];
+	pthread_t thread;
+	int i;
+
+	signal(SIGPIPE, SIG_IGN);
+	eventChildFD = childSignals();				// blocked before any thread starts, so every thread inherits the mask
+
+	// bind every listener first, so port errors are reported at start up
+	for (i = 0; i < config->eventThreads; i++)
+	{
+		listeners[i] = openServerListener(config, 1, config->backlog ? config->backlog : SOMAXCONN);	// one thread accepts for thousands of clients
+		setNonBlocking(listeners[i]);
+	}
+	for (i = 1; i < config->eventThreads; i++)
+	{
+		if (pthread_create(&thread, NULL, eventThread, (void*)(long)listeners[i]) != 0)
+		{
+			error("SERVER: ERROR creating event loop thread");
+		}
+	}
+	eventThread((void*)(long)listeners[0]);
+}
@@ -0,0 +1,505 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpKeys.c - the daemon side key cache for key reference requests (protocol version 3). The
+//				daemon is started with --keys dir; a key id names the file dir/id. A key is mapped read
+//				only the first time it is asked for, checked once for bad characters, and kept mapped
+//				for the requests that follow, so its bytes never cross the socket and are read straight
+//				from the page cache.
+//
+//				At most KEY_CACHE_SLOTS keys stay mapped once no request is using them, in least
+//				recently used order. A key in use by a request is pinned and is never unmapped under it,
+//				even when more keys than that are busy at once. Each worker process has its own cache
+//				(the mappings of one file share the same pages), and the event loop threads of one
+//				process share theirs under a mutex.
+//
+//				Key files are treated as fixed while the daemon runs, the way a one-time pad should be:
+//				a file that is replaced is only seen again once its key has left the cache.
+//
+//				Whoever can send the daemon requests can read its keys out through it, so otpServer.c only
+//				serves --keys beyond the host with --psk.
+//
+//				With a ledger directory each key also gets a ledger (see otpLedger.c) the first time an
+//				encryption asks for it, kept and dropped along with the mapping.
+//
+//				The cache also signs the resume tokens of checked key reference requests (protocol version
+//				5) with HMAC-SHA256 under a KEY_SECRET byte secret: the op, the range handed out and the
+//				key id, so a client can only resume inside a range it was given. The secret is made when
+//				the cache opens, before any worker forks, so every worker accepts every other's tokens.
+//				With a ledger it is kept in the ledger directory as .resume, which no key id can name, so
+//				tokens also outlive a restart of the daemon.
+//
+//				A token holds no state, so it can be presented any number of times. A resumed request must
+//				start on one of the chunk boundaries of the request the token was made for, and with a
+//				ledger every chunk of a checked encryption is recorded before it is sent (see
+//				otpLedger.c), so a resumption can only resend the message it resumes, never combine
+//				another one with key that was already sent. Without a ledger nothing is recorded and a
+//				token holder can reuse its range, as any client can reuse any key then.
+//
+//				Expects cipherValid() from otpCipher.c and validKeyId() from otpProtocol.c.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "otpLedger.c"
+
+/**********************************************************
+// KEY CACHE GLOBALS
+// ********************************************************/
+
+#define KEY_CACHE_SLOTS	32		// idle keys kept mapped
+#define KEY_SECRET		32		// bytes in the resume token secret
+#define KEY_SECRET_FILE	".resume"	// where the secret is kept in a ledger directory
+
+// otpKey
+// ......................
+struct otpKey
+{
+	char id[OTP_KEY_ID_MAX + 1];	// the key id, i.e. the file name
+	const char* data;			// the mapped key
+	size_t length;				// key characters, not counting a trailing newline
+	size_t mapped;				// size of the mapping
+	int users;					// requests using the key right now
+	struct otpLedger* ledger;	// its used ranges, or NULL until an encryption asks
+	struct otpKey* prev;		// more recently used
+	struct otpKey* next;		// less recently used
+};
+
+// otpKeyCache
+// ......................
+struct otpKeyCache
+{
+	int dirFD;					// the key directory
+	int ledgerFD;				// the ledger directory, or -1 without one
+	struct otpKey* head;		// most recently used
+	struct otpKey* tail;		// least recently used
+	int count;					// keys mapped
+	unsigned char secret[KEY_SECRET];	// signs resume tokens
+	pthread_mutex_t lock;		// guards the list and the users counts
+};
+
+/**********************************************************
+// KEY CACHE FUNCTIONS
+// ********************************************************/
+
+// keyReadSecret
+//
+// description: reads the secret file of a ledger directory
+//
+// @param		cache - the cache, ledgerFD open
+// @return		0 on success, else -1 with errno set
+//..........................................................
+int keyReadSecret(struct otpKeyCache* cache)
+{
+	int fd = openat(cache->ledgerFD, KEY_SECRET_FILE, O_RDONLY | O_CLOEXEC);
+	ssize_t n;
+
+	if (fd < 0)
+	{
+		return -1;
+	}
+	n = read(fd, cache->secret, KEY_SECRET);
+	close(fd);
+	if (n != KEY_SECRET)
+	{
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+// keySecret
+//
+// description: fills in the cache's token secret: fresh
+//				from the kernel without a ledger directory,
+//				else the one kept there, made the first time.
+//				A new file is written whole under a temporary
+//				name and linked into place, so two daemons
+//				starting at once agree on one secret.
+//
+// @param		cache - the cache
+// @return		0 on success, else -1
+//..........................................................
+int keySecret(struct otpKeyCache* cache)
+{
+	char temp[64];
+	int fd, written;
+
+	if (cache->ledgerFD < 0)
+	{
+		return getrandom(cache->secret, KEY_SECRET, 0) == KEY_SECRET ? 0 : -1;
+	}
+	if (keyReadSecret(cache) == 0)
+	{
+		return 0;
+	}
+	if (errno != ENOENT)
+	{
+		return -1;
+	}
+
+	snprintf(temp, sizeof(temp), "%s.%ld", KEY_SECRET_FILE, (long)getpid());
+	fd = openat(cache->ledgerFD, temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0 || getrandom(cache->secret, KEY_SECRET, 0) != KEY_SECRET)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return -1;
+	}
+	written = write(fd, cache->secret, KEY_SECRET) == KEY_SECRET && fsync(fd) == 0;
+	close(fd);
+	if (written && linkat(cache->ledgerFD, temp, cache->ledgerFD, KEY_SECRET_FILE, 0) < 0 && errno != EEXIST)
+	{
+		written = 0;
+	}
+	unlinkat(cache->ledgerFD, temp, 0);
+	return written ? keyReadSecret(cache) : -1;			// whichever daemon linked first
+}
+
+// keyCacheOpen
+//
+// description: opens the key directory, and the ledger
+//				directory if there is one, and makes an empty
+//				cache for them
+//
+// @param		dir - the key directory
+// @param		ledgerDir - the ledger directory, or NULL
+// @return		the cache, or NULL if a directory cannot be
+//				opened
+//..........................................................
+struct otpKeyCache* keyCacheOpen(const char* dir, const char* ledgerDir)
+{
+	struct otpKeyCache* cache = calloc(1, sizeof(*cache));
+
+	if (cache == NULL)
+	{
+		return NULL;
+	}
+	cache->dirFD = open(dir, O_RDONLY | O_DIRECTORY);
+	if (cache->dirFD < 0)
+	{
+		free(cache);
+		return NULL;
+	}
+	cache->ledgerFD = -1;
+	if (ledgerDir != NULL && (cache->ledgerFD = open(ledgerDir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+	{
+		close(cache->dirFD);
+		free(cache);
+		return NULL;
+	}
+	if (keySecret(cache) < 0)
+	{
+		if (cache->ledgerFD >= 0)
+		{
+			close(cache->ledgerFD);
+		}
+		close(cache->dirFD);
+		free(cache);
+		return NULL;
+	}
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+}
+
+// keyUnlink
+//
+// description: takes a key out of the use order list
+//
+// @param		cache - the cache
+// @param		key - a key in the list
+//..........................................................
+void keyUnlink(struct otpKeyCache* cache, struct otpKey* key)
+{
+	if (key->prev)
+	{
+		key->prev->next = key->next;
+	}
+	else
+	{
+		cache->head = key->next;
+	}
+	if (key->next)
+	{
+		key->next->prev = key->prev;
+	}
+	else
+	{
+		cache->tail = key->prev;
+	}
+	key->prev = key->next = NULL;
+}
+
+// keyPushFront
+//
+// description: puts a key at the most recently used end
+//
+// @param		cache - the cache
+// @param		key - a key not in the list
+//..........................................................
+void keyPushFront(struct otpKeyCache* cache, struct otpKey* key)
+{
+	key->prev = NULL;
+	key->next = cache->head;
+	if (cache->head)
+	{
+		cache->head->prev = key;
+	}
+	cache->head = key;
+	if (cache->tail == NULL)
+	{
+		cache->tail = key;
+	}
+}
+
+// keyLoad
+//
+// description: maps a key file and checks its characters
+//
+// @param		cache - the cache
+// @param		id - a valid key id
+// @return		the key, not yet in the list, or NULL if the
+//				file is missing, unreadable or not a key
+//..........................................................
+struct otpKey* keyLoad(struct otpKeyCache* cache, const char* id)
+{
+	struct otpKey* key;
+	struct stat st;
+	int fd;
+
+	fd = openat(cache->dirFD, id, O_RDONLY);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || (key = calloc(1, sizeof(*key))) == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+	key->data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);											// the mapping keeps the file open
+	if (key->data == MAP_FAILED)
+	{
+		free(key);
+		return NULL;
+	}
+	key->mapped = st.st_size;
+	key->length = st.st_size;
+	if (key->data[key->length - 1] == '\n')			// the newline is not part of the key
+	{
+		key->length--;
+	}
+	if (!cipherValid(key->data, key->length))
+	{
+		fprintf(stderr, "%sSERVER: ERROR, invalid characters in key %s%s\n", RED, id, NRM);
+		munmap((void*)key->data, key->mapped);
+		free(key);
+		return NULL;
+	}
+	strcpy(key->id, id);
+	return key;
+}
+
+// keyTrim
+//
+// description: unmaps idle keys from the least recently
+//				used end until no more than KEY_CACHE_SLOTS
+//				are mapped, or only pinned keys are left.
+//				Called with the lock held.
+//
+// @param		cache - the cache
+//..........................................................
+void keyTrim(struct otpKeyCache* cache)
+{
+	struct otpKey* key = cache->tail;
+	struct otpKey* prev;
+
+	while (key != NULL && cache->count > KEY_CACHE_SLOTS)
+	{
+		prev = key->prev;
+		if (key->users == 0)
+		{
+			keyUnlink(cache, key);
+			munmap((void*)key->data, key->mapped);
+			ledgerClose(key->ledger);
+			free(key);
+			cache->count--;
+		}
+		key = prev;
+	}
+}
+
+// keyAcquire
+//
+// description: finds a key by id, mapping it if it is not
+//				cached, and pins it for one request
+//
+// @param		cache - the cache
+// @param		id - a valid key id
+// @return		the pinned key, or NULL if there is no such
+//				key
+//..........................................................
+struct otpKey* keyAcquire(struct otpKeyCache* cache, const char* id)
+{
+	struct otpKey* key;
+
+	pthread_mutex_lock(&cache->lock);
+	for (key = cache->head; key != NULL; key = key->next)
+	{
+		if (strcmp(key->id, id) == 0)
+		{
+			keyUnlink(cache, key);
+			break;
+		}
+	}
+	if (key == NULL)
+	{
+		key = keyLoad(cache, id);
+		if (key != NULL)
+		{
+			cache->count++;
+		}
+	}
+	if (key != NULL)
+	{
+		key->users++;
+		keyPushFront(cache, key);
+		keyTrim(cache);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return key;
+}
+
+// keyRelease
+//
+// description: unpins a key once its request is over
+//
+// @param		cache - the cache
+// @param		key - a key from keyAcquire
+//..........................................................
+void keyRelease(struct otpKeyCache* cache, struct otpKey* key)
+{
+	pthread_mutex_lock(&cache->lock);
+	key->users--;
+	keyTrim(cache);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+// keyLedger
+//
+// description: the ledger of a pinned key, made the first
+//				time it is asked for
+//
+// @param		cache - the cache
+// @param		key - a key from keyAcquire
+// @return		the ledger, or NULL without a ledger directory
+//				or if out of memory
+//..........................................................
+struct otpLedger* keyLedger(struct otpKeyCache* cache, struct otpKey* key)
+{
+	struct otpLedger* ledger;
+
+	if (cache->ledgerFD < 0)
+	{
+		return NULL;
+	}
+	pthread_mutex_lock(&cache->lock);
+	if (key->ledger == NULL)
+	{
+		key->ledger = ledgerOpen(cache->ledgerFD, key->id);
+	}
+	ledger = key->ledger;
+	pthread_mutex_unlock(&cache->lock);
+	return ledger;
+}
+
+// keySign
+//
+// description: the signature of a resume token
+//
+// @param		cache - the cache
+// @param		op - OP_ENC or OP_DEC
+// @param		id - the key id
+// @param		range - the token's first 16 bytes, its range
+// @param		signature - receives the last 16 bytes
+//..........................................................
+void keySign(struct otpKeyCache* cache, int op, const char* id, const char* range, char* signature)
+{
+	unsigned char input[1 + 16 + OTP_KEY_ID_MAX];
+	unsigned char mac[EVP_MAX_MD_SIZE];
+	unsigned int macLen = 0;
+	size_t idLen = strlen(id);
+
+	input[0] = (unsigned char)op;
+	memcpy(input + 1, range, 16);
+	memcpy(input + 17, id, idLen);
+	HMAC(EVP_sha256(), cache->secret, KEY_SECRET, input, 17 + idLen, mac, &macLen);
+	memcpy(signature, mac, OTP_TOKEN_SIZE - 16);
+}
+
+// keyToken
+//
+// description: makes the resume token for a range of a key
+//				handed out to a checked request
+//
+// @param		cache - the cache
+// @param		op - OP_ENC or OP_DEC
+// @param		id - the key id
+// @param		offset - where the range starts
+// @param		length - its size
+// @param		token - receives OTP_TOKEN_SIZE bytes
+//..........................................................
+void keyToken(struct otpKeyCache* cache, int op, const char* id, unsigned long long offset, unsigned long long length, char* token)
+{
+	unsigned long long wireOffset = htobe64(offset);
+	unsigned long long wireLength = htobe64(length);
+
+	memcpy(token, &wireOffset, 8);
+	memcpy(token + 8, &wireLength, 8);
+	keySign(cache, op, id, token, token + 16);
+}
+
+// keyTokenCovers
+//
+// description: whether a resume token is one this daemon
+//				signed for the op and key, and its range holds
+//				the one a resumed request asks for, starting on
+//				one of its chunk boundaries
+//
+// @param		cache - the cache
+// @param		op - OP_ENC or OP_DEC
+// @param		id - the key id
+// @param		token - the OTP_TOKEN_SIZE byte token
+// @param		offset - where the resumed request starts
+// @param		length - its message length
+// @return		1 if so, else 0
+//..........................................................
+int keyTokenCovers(struct otpKeyCache* cache, int op, const char* id, const char* token, unsigned long long offset, unsigned long long length)
+{
+	char signature[OTP_TOKEN_SIZE - 16];
+	unsigned long long start, size;
+
+	keySign(cache, op, id, token, signature);
+	if (CRYPTO_memcmp(signature, token + 16, sizeof(signature)) != 0)
+	{
+		return 0;
+	}
+	memcpy(&start, token, 8);
+	memcpy(&size, token + 8, 8);
+	start = be64toh(start);
+	size = be64toh(size);
+	return offset >= start && offset - start <= size && length <= size - (offset - start) && (offset - start) % OTP_CHUNK == 0;
+}
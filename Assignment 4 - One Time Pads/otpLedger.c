@@ -0,0 +1,916 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpLedger.c - the daemon's record of which stretches of each key have already encrypted
+//				something, so no pad byte is ever used twice (protocol version 4). The daemon is started
+//				with --ledger dir alongside --keys; the ledger for key id is the file dir/id.ledger.
+//
+//				On disk a ledger is an append-only log of fixed size records, each a used range
+//				[offset, offset + length) and a CRC-32C of it. A range is appended and fdatasync()ed
+//				before the reply that uses it goes out, so a crash can lose a reservation only for a
+//				reply that never left. A record torn by a crash fails its check and is cut off the next
+//				time the log is read. Only the last record can be torn that way; a bad record with more
+//				behind it means the log was damaged some other way, and rather than guess which ranges it
+//				held, every reservation of that key is refused OTP_KEY_USED until the log is repaired.
+//				Once the log holds many more records than there are separate
+//				ranges it is rewritten as one record per range into a new file that is renamed over it.
+//
+//				In memory the used ranges are a treap (a binary search tree kept balanced by random
+//				priorities) keyed by offset, with touching or overlapping ranges merged into one node.
+//				Checking a range, or adding one, is a walk from the root, O(log n) in the number of
+//				separate ranges however many reservations made them, and the usual case of encrypting
+//				at the next unused offset only ever grows the last node.
+//
+//				Encryption requests either ask for OTP_KEY_NEXT, the end of the highest range used so
+//				far, or name an offset, which is refused OTP_KEY_USED if any byte of the range is already
+//				in the ledger. Decryption never consults it.
+//
+//				A checked encryption can be resumed over its range with the token it was given (see
+//				otpKeys.c), so the ledger also records each chunk such a request sends back: its key
+//				offset, its length and the CRC-32C of its message, appended and fdatasync()ed before the
+//				reply chunk goes out, much as a range is. A resumed chunk that lands on one sent before
+//				must carry the same message, and so makes the same reply; anything else would combine a
+//				second message with key whose first ciphertext may already be out, and is refused. The
+//				sent chunks are kept in memory in a hash table keyed by offset. That is one more record,
+//				and one more fdatasync(), per OTP_CHUNK of every checked encryption.
+//
+//				Worker processes each have their own copy of a ledger and take turns with flock() on the
+//				file; whoever holds the lock first reads any records the others appended since it last
+//				looked, and starts again from the new file if the log was rewritten. The event loop
+//				threads of one process share a copy under its mutex.
+//
+//				Included by otpKeys.c. Expects crc32c() from otpCrc.c.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <stdint.h>
+#include <sys/file.h>
+
+/**********************************************************
+// LEDGER GLOBALS
+// ********************************************************/
+
+#define LEDGER_SUFFIX		".ledger"	// a ledger's file name is the key id and this
+#define LEDGER_RECORD		24			// bytes per record: offset, length, check, magic
+#define LEDGER_MAGIC		0x4C54504FU	// "OPTL", the last field of a range record
+#define LEDGER_SENT_MAGIC	0x5354504FU	// "OPTS", the last field of a sent chunk record
+#define LEDGER_RANGE		0			// ledgerUnpack(): a used range
+#define LEDGER_SENT			1			// ledgerUnpack(): a chunk a checked encryption sent
+#define LEDGER_SENT_MIN		64			// smallest sent chunk table
+#define LEDGER_READ			1024		// records read at a time
+#define LEDGER_COMPACT_MIN	4096		// records before a log is worth rewriting
+
+// ledgerNode
+// ......................
+struct ledgerNode
+{
+	unsigned long long start;		// the first used byte
+	unsigned long long end;			// one past the last used byte
+	unsigned int priority;			// the treap's heap order
+	struct ledgerNode* left;		// ranges below start
+	struct ledgerNode* right;		// ranges at or above end
+};
+
+// ledgerSent
+// ......................
+struct ledgerSent
+{
+	unsigned long long offset;		// where the chunk starts in the key
+	unsigned int length;			// its size, or 0 for an empty slot
+	unsigned int crc;				// the CRC-32C of its message
+};
+
+// otpLedger
+// ......................
+struct otpLedger
+{
+	int dirFD;						// the ledger directory, borrowed from the key cache
+	char name[OTP_KEY_ID_MAX + sizeof(LEDGER_SUFFIX)];	// the file name in it
+	int fd;							// the log, or -1
+	ino_t inode;					// the log's inode, to notice a rewrite
+	off_t readPos;					// bytes of the log already applied
+	off_t damagedAt;				// where a corrupt record stops the log, as last reported, or -1
+	unsigned long long records;		// records in the log
+	unsigned long long ranges;		// nodes in the tree
+	unsigned long long high;		// the end of the highest range, OTP_KEY_NEXT's offset
+	struct ledgerNode* root;		// the used ranges
+	struct ledgerSent* sent;		// the sent chunks, open addressed by offset
+	size_t sentCount;				// sent chunks held
+	size_t sentSlots;				// size of sent, a power of two
+	unsigned int seed;				// for priorities
+	pthread_mutex_t lock;			// guards all of the above
+};
+
+/**********************************************************
+// LEDGER FUNCTIONS
+// ********************************************************/
+
+// ledgerCheck
+//
+// description: the CRC-32C of a record's first 16 bytes
+//
+// @param		buf - the record
+// @return		the checksum
+//..........................................................
+unsigned int ledgerCheck(const unsigned char* buf)
+{
+	return crc32c(0, buf, 16);
+}
+
+// ledgerPack
+//
+// description: writes a range as a record
+//
+// @param		buf - LEDGER_RECORD bytes to write into
+// @param		start - the first used byte
+// @param		end - one past the last
+//..........................................................
+void ledgerPack(unsigned char* buf, unsigned long long start, unsigned long long end)
+{
+	unsigned long long offset = htole64(start);
+	unsigned long long length = htole64(end - start);
+	unsigned int check, magic = htole32(LEDGER_MAGIC);
+
+	memcpy(buf, &offset, 8);
+	memcpy(buf + 8, &length, 8);
+	check = htole32(ledgerCheck(buf));
+	memcpy(buf + 16, &check, 4);
+	memcpy(buf + 20, &magic, 4);
+}
+
+// ledgerPackSent
+//
+// description: writes a sent chunk as a record
+//
+// @param		buf - LEDGER_RECORD bytes to write into
+// @param		start - where the chunk starts in the key
+// @param		length - its size
+// @param		crc - the CRC-32C of its message
+//..........................................................
+void ledgerPackSent(unsigned char* buf, unsigned long long start, unsigned int length, unsigned int crc)
+{
+	unsigned long long offset = htole64(start);
+	unsigned int size = htole32(length), sum = htole32(crc);
+	unsigned int check, magic = htole32(LEDGER_SENT_MAGIC);
+
+	memcpy(buf, &offset, 8);
+	memcpy(buf + 8, &size, 4);
+	memcpy(buf + 12, &sum, 4);
+	check = htole32(ledgerCheck(buf));
+	memcpy(buf + 16, &check, 4);
+	memcpy(buf + 20, &magic, 4);
+}
+
+// ledgerUnpack
+//
+// description: reads a record
+//
+// @param		buf - LEDGER_RECORD bytes
+// @param		start - receives the first used byte
+// @param		end - receives one past the last
+// @param		crc - receives a sent chunk's CRC-32C
+// @return		LEDGER_RANGE or LEDGER_SENT, or -1 if the
+//				record is torn or corrupt
+//..........................................................
+int ledgerUnpack(const unsigned char* buf, unsigned long long* start, unsigned long long* end, unsigned int* crc)
+{
+	unsigned long long offset, length;
+	unsigned int check, magic, size, sum;
+	int kind;
+
+	memcpy(&offset, buf, 8);
+	memcpy(&length, buf + 8, 8);
+	memcpy(&size, buf + 8, 4);
+	memcpy(&sum, buf + 12, 4);
+	memcpy(&check, buf + 16, 4);
+	memcpy(&magic, buf + 20, 4);
+	offset = le64toh(offset);
+	kind = le32toh(magic) == LEDGER_SENT_MAGIC ? LEDGER_SENT : LEDGER_RANGE;
+	length = kind == LEDGER_SENT ? le32toh(size) : le64toh(length);
+	if ((kind == LEDGER_RANGE && le32toh(magic) != LEDGER_MAGIC) || le32toh(check) != ledgerCheck(buf) ||
+		length == 0 || offset + length < offset)
+	{
+		return -1;
+	}
+	*start = offset;
+	*end = offset + length;
+	*crc = le32toh(sum);
+	return kind;
+}
+
+// ledgerSplit
+//
+// description: splits a tree into the ranges starting below
+//				key and the rest
+//
+// @param		tree - the tree, consumed
+// @param		key - the split point
+// @param		below - receives the ranges starting below key
+// @param		rest - receives the others
+//..........................................................
+void ledgerSplit(struct ledgerNode* tree, unsigned long long key, struct ledgerNode** below, struct ledgerNode** rest)
+{
+	if (tree == NULL)
+	{
+		*below = *rest = NULL;
+	}
+	else if (tree->start < key)
+	{
+		ledgerSplit(tree->right, key, &tree->right, rest);
+		*below = tree;
+	}
+	else
+	{
+		ledgerSplit(tree->left, key, below, &tree->left);
+		*rest = tree;
+	}
+}
+
+// ledgerJoin
+//
+// description: joins two trees, every range of the first
+//				below every range of the second
+//
+// @param		low - the lower tree
+// @param		high - the higher tree
+// @return		the joined tree
+//..........................................................
+struct ledgerNode* ledgerJoin(struct ledgerNode* low, struct ledgerNode* high)
+{
+	if (low == NULL || high == NULL)
+	{
+		return low ? low : high;
+	}
+	if (low->priority > high->priority)
+	{
+		low->right = ledgerJoin(low->right, high);
+		return low;
+	}
+	high->left = ledgerJoin(low, high->left);
+	return high;
+}
+
+// ledgerDropLast
+//
+// description: takes the highest range out of a tree,
+//				leaving it a tree of one
+//
+// @param		tree - the tree, not empty
+// @return		the node taken out
+//..........................................................
+struct ledgerNode* ledgerDropLast(struct ledgerNode** tree)
+{
+	struct ledgerNode* node;
+
+	while ((*tree)->right != NULL)
+	{
+		tree = &(*tree)->right;
+	}
+	node = *tree;
+	*tree = node->left;
+	node->left = NULL;
+	return node;
+}
+
+// ledgerDropFirst
+//
+// description: takes the lowest range out of a tree,
+//				leaving it a tree of one
+//
+// @param		tree - the tree, not empty
+// @return		the node taken out
+//..........................................................
+struct ledgerNode* ledgerDropFirst(struct ledgerNode** tree)
+{
+	struct ledgerNode* node;
+
+	while ((*tree)->left != NULL)
+	{
+		tree = &(*tree)->left;
+	}
+	node = *tree;
+	*tree = node->right;
+	node->right = NULL;
+	return node;
+}
+
+// ledgerFree
+//
+// description: frees a tree
+//
+// @param		tree - the tree
+//..........................................................
+void ledgerFree(struct ledgerNode* tree)
+{
+	if (tree != NULL)
+	{
+		ledgerFree(tree->left);
+		ledgerFree(tree->right);
+		free(tree);
+	}
+}
+
+// ledgerUsed
+//
+// description: whether any byte of a range is in the
+//				ledger. Ranges never overlap, so only the last
+//				one starting before end can.
+//
+// @param		ledger - the ledger
+// @param		start - the first byte
+// @param		end - one past the last
+// @return		1 if the range is used, else 0
+//..........................................................
+int ledgerUsed(struct otpLedger* ledger, unsigned long long start, unsigned long long end)
+{
+	struct ledgerNode* node = ledger->root;
+	struct ledgerNode* before = NULL;
+
+	while (node != NULL)
+	{
+		if (node->start < end)
+		{
+			before = node;
+			node = node->right;
+		}
+		else
+		{
+			node = node->left;
+		}
+	}
+	return before != NULL && before->end > start;
+}
+
+// ledgerAdd
+//
+// description: adds a range to the tree, merging it with
+//				every range it touches or overlaps
+//
+// @param		ledger - the ledger
+// @param		start - the first byte
+// @param		end - one past the last
+// @return		0, or -1 if out of memory
+//..........................................................
+int ledgerAdd(struct otpLedger* ledger, unsigned long long start, unsigned long long end)
+{
+	struct ledgerNode* below;
+	struct ledgerNode* rest;
+	struct ledgerNode* node = NULL;
+	struct ledgerNode* merged;
+
+	ledgerSplit(ledger->root, start, &below, &rest);
+	while (below != NULL)									// ranges below that reach start
+	{
+		merged = ledgerDropLast(&below);
+		if (merged->end < start)
+		{
+			below = ledgerJoin(below, merged);				// too far below; put it back
+			break;
+		}
+		start = merged->start;
+		end = merged->end > end ? merged->end : end;
+		free(node);
+		node = merged;
+		ledger->ranges--;
+	}
+	while (rest != NULL)									// ranges above that start by end
+	{
+		merged = ledgerDropFirst(&rest);
+		if (merged->start > end)
+		{
+			rest = ledgerJoin(merged, rest);
+			break;
+		}
+		end = merged->end > end ? merged->end : end;
+		free(node);
+		node = merged;
+		ledger->ranges--;
+	}
+
+	if (node == NULL && (node = malloc(sizeof(*node))) == NULL)
+	{
+		ledger->root = ledgerJoin(below, rest);
+		return -1;
+	}
+	ledger->seed = ledger->seed * 1103515245U + 12345U;
+	node->start = start;
+	node->end = end;
+	node->priority = ledger->seed;
+	node->left = node->right = NULL;
+	ledger->root = ledgerJoin(ledgerJoin(below, node), rest);
+	ledger->ranges++;
+	if (end > ledger->high)
+	{
+		ledger->high = end;
+	}
+	return 0;
+}
+
+// ledgerSentFind
+//
+// description: the slot of the sent chunk at an offset, or
+//				the empty slot where it would go
+//
+// @param		ledger - the ledger, with a table
+// @param		offset - where the chunk starts in the key
+// @return		the slot
+//..........................................................
+struct ledgerSent* ledgerSentFind(struct otpLedger* ledger, unsigned long long offset)
+{
+	size_t i = (size_t)((offset * 0x9E3779B97F4A7C15ULL) >> 32);	// Fibonacci hashing spreads chunk aligned offsets
+
+	for (i &= ledger->sentSlots - 1; ledger->sent[i].length != 0 && ledger->sent[i].offset != offset; i = (i + 1) & (ledger->sentSlots - 1))
+	{
+	}
+	return &ledger->sent[i];
+}
+
+// ledgerSentAdd
+//
+// description: adds a sent chunk to the table, growing it
+//				to keep it no more than half full
+//
+// @param		ledger - the ledger
+// @param		offset - where the chunk starts in the key
+// @param		length - its size
+// @param		crc - the CRC-32C of its message
+// @return		0, or -1 if out of memory
+//..........................................................
+int ledgerSentAdd(struct otpLedger* ledger, unsigned long long offset, unsigned int length, unsigned int crc)
+{
+	struct ledgerSent* old = ledger->sent;
+	struct ledgerSent* slot;
+	size_t oldSlots = ledger->sentSlots;
+	size_t i;
+
+	if (2 * (ledger->sentCount + 1) > ledger->sentSlots)
+	{
+		ledger->sentSlots = oldSlots ? 2 * oldSlots : LEDGER_SENT_MIN;
+		if ((ledger->sent = calloc(ledger->sentSlots, sizeof(struct ledgerSent))) == NULL)
+		{
+			ledger->sent = old;
+			ledger->sentSlots = oldSlots;
+			return -1;
+		}
+		for (i = 0; i < oldSlots; i++)
+		{
+			if (old[i].length != 0)
+			{
+				*ledgerSentFind(ledger, old[i].offset) = old[i];
+			}
+		}
+		free(old);
+	}
+	slot = ledgerSentFind(ledger, offset);
+	if (slot->length == 0)
+	{
+		ledger->sentCount++;
+	}
+	slot->offset = offset;
+	slot->length = length;
+	slot->crc = crc;
+	return 0;
+}
+
+// ledgerReset
+//
+// description: forgets everything read from the log, to
+//				read a rewritten one from the start
+//
+// @param		ledger - the ledger
+//..........................................................
+void ledgerReset(struct otpLedger* ledger)
+{
+	ledgerFree(ledger->root);
+	ledger->root = NULL;
+	free(ledger->sent);
+	ledger->sent = NULL;
+	ledger->sentCount = 0;
+	ledger->sentSlots = 0;
+	ledger->readPos = 0;
+	ledger->records = 0;
+	ledger->ranges = 0;
+	ledger->high = 0;
+	ledger->damagedAt = -1;
+}
+
+// ledgerCatchUp
+//
+// description: applies the records appended since the log
+//				was last read. Every writer holds the lock,
+//				so a bad last record, or part of one, can only
+//				be left by a crash, and the log is cut off
+//				there. A bad record with more behind it is
+//				damage, and the log is left as it is and not
+//				read past. Called with the file locked.
+//
+// @param		ledger - the ledger
+// @return		0, or -1 if the log cannot be read or is
+//				damaged (errno EBADMSG)
+//..........................................................
+int ledgerCatchUp(struct otpLedger* ledger)
+{
+	unsigned char buf[LEDGER_READ * LEDGER_RECORD];
+	unsigned long long start, end;
+	unsigned int crc;
+	struct stat st;
+	ssize_t got;
+	size_t i;
+	int kind;
+
+	if (fstat(ledger->fd, &st) < 0)
+	{
+		return -1;
+	}
+	while ((got = pread(ledger->fd, buf, sizeof(buf), ledger->readPos)) > 0)
+	{
+		for (i = 0; i + LEDGER_RECORD <= (size_t)got; i += LEDGER_RECORD)
+		{
+			if ((kind = ledgerUnpack(buf + i, &start, &end, &crc)) < 0)
+			{
+				break;
+			}
+			if ((kind == LEDGER_RANGE ? ledgerAdd(ledger, start, end) : ledgerSentAdd(ledger, start, (unsigned int)(end - start), crc)) < 0)
+			{
+				return -1;
+			}
+			ledger->readPos += LEDGER_RECORD;
+			ledger->records++;
+		}
+		if (i < (size_t)got && st.st_size > ledger->readPos + LEDGER_RECORD)
+		{
+			if (ledger->damagedAt != ledger->readPos)
+			{
+				fprintf(stderr, "%sLEDGER: ERROR, corrupt record at byte %lld of %s with records behind it; refusing every reservation of this key until it is repaired%s\n",
+					RED, (long long)ledger->readPos, ledger->name, NRM);
+				ledger->damagedAt = ledger->readPos;
+			}
+			errno = EBADMSG;
+			return -1;
+		}
+		if (i < (size_t)got)
+		{
+			fprintf(stderr, "%sLEDGER: ERROR, dropping a torn record at byte %lld of %s%s\n", RED, (long long)ledger->readPos, ledger->name, NRM);
+			return ftruncate(ledger->fd, ledger->readPos) < 0 || fdatasync(ledger->fd) < 0 ? -1 : 0;
+		}
+	}
+	return got < 0 ? -1 : 0;
+}
+
+// ledgerLock
+//
+// description: locks the log file and brings the tree up
+//				to date with it, reopening the file if it was
+//				rewritten since it was opened
+//
+// @param		ledger - the ledger
+// @return		0 with the file locked, or -1
+//..........................................................
+int ledgerLock(struct otpLedger* ledger)
+{
+	struct stat st, named;
+
+	while (1)
+	{
+		if (ledger->fd < 0)
+		{
+			ledger->fd = openat(ledger->dirFD, ledger->name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+			if (ledger->fd < 0 || fstat(ledger->fd, &st) < 0)
+			{
+				return -1;
+			}
+			if (st.st_ino != ledger->inode)
+			{
+				ledgerReset(ledger);
+				ledger->inode = st.st_ino;
+			}
+		}
+		if (flock(ledger->fd, LOCK_EX) < 0)
+		{
+			return -1;
+		}
+		if (fstatat(ledger->dirFD, ledger->name, &named, 0) == 0 && named.st_ino == ledger->inode)
+		{
+			break;
+		}
+		close(ledger->fd);									// rewritten under us; drops the lock
+		ledger->fd = -1;
+	}
+	if (ledgerCatchUp(ledger) < 0)
+	{
+		flock(ledger->fd, LOCK_UN);
+		return -1;
+	}
+	return 0;
+}
+
+// ledgerWriteTree
+//
+// description: writes every range of a tree as a record, in
+//				order
+//
+// @param		fd - the file
+// @param		tree - the tree
+// @return		0, or -1 on a write error
+//..........................................................
+int ledgerWriteTree(int fd, struct ledgerNode* tree)
+{
+	unsigned char buf[LEDGER_RECORD];
+
+	if (tree == NULL)
+	{
+		return 0;
+	}
+	if (ledgerWriteTree(fd, tree->left) < 0)
+	{
+		return -1;
+	}
+	ledgerPack(buf, tree->start, tree->end);
+	if (write(fd, buf, LEDGER_RECORD) != LEDGER_RECORD)
+	{
+		return -1;
+	}
+	return ledgerWriteTree(fd, tree->right);
+}
+
+// ledgerWriteSent
+//
+// description: writes every sent chunk as a record
+//
+// @param		fd - the file
+// @param		ledger - the ledger
+// @return		0, or -1 on a write error
+//..........................................................
+int ledgerWriteSent(int fd, struct otpLedger* ledger)
+{
+	unsigned char buf[LEDGER_RECORD];
+	size_t i;
+
+	for (i = 0; i < ledger->sentSlots; i++)
+	{
+		if (ledger->sent[i].length != 0)
+		{
+			ledgerPackSent(buf, ledger->sent[i].offset, ledger->sent[i].length, ledger->sent[i].crc);
+			if (write(fd, buf, LEDGER_RECORD) != LEDGER_RECORD)
+			{
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+// ledgerCompact
+//
+// description: rewrites the log as one record per range and
+//				per sent chunk and renames it over the old one. Called with the
+//				old file locked; anyone waiting on it finds the
+//				new file once it is their turn. A failure just
+//				leaves the old log in place.
+//
+// @param		ledger - the ledger
+//..........................................................
+void ledgerCompact(struct otpLedger* ledger)
+{
+	char temp[sizeof(ledger->name) + 8];
+	struct stat st;
+	int fd;
+
+	snprintf(temp, sizeof(temp), "%s.%d", ledger->name, (int)getpid());
+	fd = openat(ledger->dirFD, temp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+	if (fd < 0)
+	{
+		return;
+	}
+	if (ledgerWriteTree(fd, ledger->root) < 0 || ledgerWriteSent(fd, ledger) < 0 || fdatasync(fd) < 0 || fstat(fd, &st) < 0 ||
+		renameat(ledger->dirFD, temp, ledger->dirFD, ledger->name) < 0)
+	{
+		close(fd);
+		unlinkat(ledger->dirFD, temp, 0);
+		return;
+	}
+	fsync(ledger->dirFD);									// make the rename itself durable
+
+	close(ledger->fd);										// drops the lock on the old file
+	ledger->fd = fd;
+	ledger->inode = st.st_ino;
+	ledger->readPos = (off_t)((ledger->ranges + ledger->sentCount) * LEDGER_RECORD);
+	ledger->records = ledger->ranges + ledger->sentCount;
+}
+
+// ledgerOpen
+//
+// description: makes the ledger for a key. The log is read
+//				on first use.
+//
+// @param		dirFD - the ledger directory
+// @param		id - the key id
+// @return		the ledger, or NULL if out of memory
+//..........................................................
+struct otpLedger* ledgerOpen(int dirFD, const char* id)
+{
+	struct otpLedger* ledger = calloc(1, sizeof(*ledger));
+
+	if (ledger == NULL)
+	{
+		return NULL;
+	}
+	ledger->dirFD = dirFD;
+	snprintf(ledger->name, sizeof(ledger->name), "%s%s", id, LEDGER_SUFFIX);
+	ledger->fd = -1;
+	ledger->damagedAt = -1;
+	ledger->seed = (unsigned int)getpid() ^ (unsigned int)(uintptr_t)ledger;
+	pthread_mutex_init(&ledger->lock, NULL);
+	return ledger;
+}
+
+// ledgerClose
+//
+// description: frees a ledger
+//
+// @param		ledger - the ledger, or NULL
+//..........................................................
+void ledgerClose(struct otpLedger* ledger)
+{
+	if (ledger != NULL)
+	{
+		if (ledger->fd >= 0)
+		{
+			close(ledger->fd);
+		}
+		ledgerFree(ledger->root);
+		free(ledger->sent);
+		pthread_mutex_destroy(&ledger->lock);
+		free(ledger);
+	}
+}
+
+// ledgerAppend
+//
+// description: appends a record and makes it durable. On a
+//				failure the log is cut back so no half record is
+//				left for the next reader. Called with the file
+//				locked.
+//
+// @param		ledger - the ledger
+// @param		buf - the LEDGER_RECORD byte record
+// @return		0, or -1 if it could not be recorded
+//..........................................................
+int ledgerAppend(struct otpLedger* ledger, const unsigned char* buf)
+{
+	if (write(ledger->fd, buf, LEDGER_RECORD) != LEDGER_RECORD || fdatasync(ledger->fd) < 0)
+	{
+		fprintf(stderr, "%sLEDGER: ERROR writing %s: %s%s\n", RED, ledger->name, strerror(errno), NRM);
+		if (ftruncate(ledger->fd, ledger->readPos) < 0)			// no half record for the next reader
+		{
+			close(ledger->fd);
+			ledger->fd = -1;
+			ledger->inode = 0;
+		}
+		return -1;
+	}
+	ledger->readPos += LEDGER_RECORD;
+	ledger->records++;
+	return 0;
+}
+
+// ledgerUnlock
+//
+// description: compacts the log if it is worth it, and
+//				unlocks the file and the ledger
+//
+// @param		ledger - the ledger
+//..........................................................
+void ledgerUnlock(struct otpLedger* ledger)
+{
+	if (ledger->fd >= 0 && ledger->records >= LEDGER_COMPACT_MIN && ledger->records > 4 * (ledger->ranges + ledger->sentCount))
+	{
+		ledgerCompact(ledger);
+	}
+	if (ledger->fd >= 0)
+	{
+		flock(ledger->fd, LOCK_UN);
+	}
+	pthread_mutex_unlock(&ledger->lock);
+}
+
+// ledgerReserve
+//
+// description: marks a stretch of key as used for one
+//				encryption, durably, before its reply is sent
+//
+// @param		ledger - the key's ledger
+// @param		offset - where to start, or OTP_KEY_NEXT for
+//				the next unused offset
+// @param		length - the message length
+// @param		keyLength - the key length
+// @param		used - receives the offset reserved
+// @return		OTP_OK, OTP_KEY_SHORT if the key ends first,
+//				or OTP_KEY_USED if any byte was used before or
+//				the reservation could not be recorded
+//..........................................................
+int ledgerReserve(struct otpLedger* ledger, unsigned long long offset, unsigned long long length,
+	unsigned long long keyLength, unsigned long long* used)
+{
+	unsigned char buf[LEDGER_RECORD];
+	int status = OTP_OK;
+
+	pthread_mutex_lock(&ledger->lock);
+	if (ledgerLock(ledger) < 0)
+	{
+		fprintf(stderr, "%sLEDGER: ERROR reading %s: %s%s\n", RED, ledger->name, strerror(errno), NRM);
+		pthread_mutex_unlock(&ledger->lock);
+		return OTP_KEY_USED;
+	}
+
+	if (offset == OTP_KEY_NEXT)
+	{
+		offset = ledger->high;
+	}
+	if (offset > keyLength || length > keyLength - offset)
+	{
+		status = OTP_KEY_SHORT;
+	}
+	else if (length > 0 && ledgerUsed(ledger, offset, offset + length))
+	{
+		status = OTP_KEY_USED;
+	}
+	else if (length > 0)
+	{
+		ledgerPack(buf, offset, offset + length);
+		if (ledgerAppend(ledger, buf) < 0)
+		{
+			status = OTP_KEY_USED;
+		}
+		else if (ledgerAdd(ledger, offset, offset + length) < 0)	// out of memory: read the whole log again next time
+		{
+			close(ledger->fd);
+			ledger->fd = -1;
+			ledger->inode = 0;
+		}
+	}
+	*used = offset;
+
+	ledgerUnlock(ledger);
+	return status;
+}
+
+// ledgerSend
+//
+// description: records, durably, that a checked encryption
+//				is about to send back the chunk of key at an
+//				offset, unless a chunk was sent there before:
+//				then it must be the same chunk of the same
+//				message
+//
+// @param		ledger - the key's ledger
+// @param		offset - where the chunk starts in the key
+// @param		length - its size
+// @param		crc - the CRC-32C of its message
+// @return		OTP_OK, or OTP_KEY_USED if a different chunk
+//				was sent there or it could not be recorded
+//..........................................................
+int ledgerSend(struct otpLedger* ledger, unsigned long long offset, unsigned int length, unsigned int crc)
+{
+	unsigned char buf[LEDGER_RECORD];
+	struct ledgerSent* sent;
+	int status = OTP_OK;
+
+	pthread_mutex_lock(&ledger->lock);
+	if (ledgerLock(ledger) < 0)
+	{
+		fprintf(stderr, "%sLEDGER: ERROR reading %s: %s%s\n", RED, ledger->name, strerror(errno), NRM);
+		pthread_mutex_unlock(&ledger->lock);
+		return OTP_KEY_USED;
+	}
+
+	sent = ledger->sentSlots > 0 ? ledgerSentFind(ledger, offset) : NULL;
+	if (sent != NULL && sent->length != 0)
+	{
+		if (sent->length != length || sent->crc != crc)
+		{
+			fprintf(stderr, "%sLEDGER: ERROR, a resumed chunk at byte %llu of %s differs from the one sent there before%s\n",
+				RED, offset, ledger->name, NRM);
+			status = OTP_KEY_USED;
+		}
+	}
+	else
+	{
+		ledgerPackSent(buf, offset, length, crc);
+		if (ledgerAppend(ledger, buf) < 0)
+		{
+			status = OTP_KEY_USED;
+		}
+		else if (ledgerSentAdd(ledger, offset, length, crc) < 0)	// out of memory: read the whole log again next time
+		{
+			close(ledger->fd);
+			ledger->fd = -1;
+			ledger->inode = 0;
+		}
+	}
+
+	ledgerUnlock(ledger);
+	return status;
+}
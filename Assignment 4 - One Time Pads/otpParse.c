@@ -0,0 +1,1262 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpParse.c - an incremental parser for both otp request framings, shared by the blocking
+//				workers and the event loop. Every connection owns one otpParser. Callers drive it with
+//				three calls:
+//
+//				[x]		parserWant() - how many bytes the parser can take right now. Zero means the reply
+//						built so far has to be sent before any more input is read.
+//				[x]		parserFeed() - hands it up to parserWant() bytes, in whatever pieces recv() returns.
+//				[x]		parserReply() / parserReplySent() - the next piece of reply that is ready to send,
+//						and how much of it went out.
+//
+//				Text framing (version 0):
+//				[ code word 	| message 		| middle sentinel 	| key 			| end sentinel	]
+//				[ !! or $$		| n chars		| ##				| >= n chars	| @@			]
+//
+//				The whole message has to be held until the key arrives; key characters are then combined
+//				with it as they come in and the reply streams back. The parser asks for the rest of the
+//				key at once, so a caller with a large receive buffer hands it large blocks, which
+//				parserCipher() splits across cipherSplit's threads (see otpSplit.c) when it is set.
+//
+//				Binary framing (see otpProtocol.c): the parser preallocates a single chunk from the header
+//				lengths, reads message and key straight into it with no scanning, and sends each chunk
+//				back before reading the next, so memory stays constant whatever the message size. Binary
+//				connections are persistent: once a reply is out the parser waits for the next request
+//				header, so a client can pipeline any number of requests, and the connection ends when the
+//				client hangs up between requests (see parserIdle()).
+//
+//				A binary request may reference a key held by the daemon instead of carrying one (see
+//				otpKeys.c); each message chunk is then combined with the mapped key as soon as it is
+//				read. With a ledger, an encryption's key range is reserved in it (see otpLedger.c)
+//				before the reply header is queued, and each chunk of a checked encryption is recorded
+//				in it before that chunk is sent back, so a resumed one can be held to the same message.
+//
+//				A chunk of OTP_CHUNK bytes is too small to be worth splitting, so while cipherSplit is set
+//				an unchecked request of SPLIT_MIN bytes or more is gathered SPLIT_BATCH message bytes at a
+//				time instead, its in-band key chunks held behind the message, and each batch is ciphered in
+//				one call and sent back whole. The client must keep reading replies while it sends, as every
+//				client here does. Checked requests stay a chunk at a time, each with its own trailer.
+//
+//				A checked request (version 5) has a trailer behind each chunk. The CRC-32C of the chunk
+//				is carried along as it is read, before the key is combined into it, so checking the
+//				trailer costs no second pass over the request. The reply trailer is written into the
+//				chunk buffer behind the combined chunk, and the two go out together. A chunk whose
+//				trailer does not match is never sent back: the request ends in PARSE_ERROR and the
+//				connection closes. Every reply chunk that did go out is good, and the client resumes
+//				from the first one that did not.
+//
+//				Every request that finishes is counted in the otpStats the parser was given, under the
+//				operation it asked for, once its reply is out. The parser also times the phases of each
+//				request for the stats' histograms: the wait from accept() to a connection's first byte,
+//				reading the request, the cipher kernel, and sending the reply. That is a few reads of the
+//				vDSO clock per request and per received block, none per character.
+//
+//				Request buffers are reserved against the daemon's byte limit (see otpAdmit.c) as they
+//				grow. A request that would go over it, or any request on a connection the server marked
+//				overloaded, is answered busy with a retry-after instead of being served.
+//
+//				Expects the includer to define the transmission sentinels and BUFFERSIZE.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include "otpProtocol.c"
+#include "otpCipher.c"
+#include "otpSplit.c"
+#include "otpStats.c"
+#include "otpCrc.c"
+#include "otpKeys.c"
+#include "otpAdmit.c"
+
+/**********************************************************
+// PARSER GLOBALS
+// ********************************************************/
+
+// parser states
+// ......................
+#define PARSE_HANDSHAKE	0		// reading the two character code word
+#define PARSE_MESSAGE	1		// text: reading message characters up to the middle sentinel
+#define PARSE_MID		2		// text: read the first '#', expecting the second
+#define PARSE_KEY		3		// text: reading key characters up to the end sentinel
+#define PARSE_END		4		// text: read the first '@', expecting the second
+#define PARSE_DRAIN		5		// text: handshake failed, discarding input up to the end sentinel
+#define PARSE_HEADER	6		// binary: reading the request header
+#define PARSE_CHUNK		7		// binary: reading a message chunk
+#define PARSE_CHUNK_KEY	8		// binary: reading the key chunk that goes with it
+#define PARSE_FLUSH		9		// binary: waiting for the combined chunk to be sent
+#define PARSE_SKIP		10		// binary: skipping unused key bytes, or the body of a refused request
+#define PARSE_KEY_REF	11		// binary: reading the key reference
+#define PARSE_TRAILER	12		// binary: reading a checked chunk's trailer
+#define PARSE_DONE		13		// request complete
+#define PARSE_REJECTED	14		// request complete, but refused
+#define PARSE_ERROR		15		// malformed request, damaged chunk, or out of memory
+
+// otpParser
+// ......................
+struct otpParser
+{
+	int state;					// one of the PARSE_ states
+	int allowedOps;				// OP_ flags this daemon accepts
+	int op;						// the operation the client asked for
+	char header[OTP_HEADER_SIZE];	// the code word, or binary header, read so far
+	int headerLen;				// number of header bytes read
+	char replyHeader[OTP_HEADER_SIZE + OTP_TOKEN_SIZE];	// reply header and any resume token, or CON_FAIL, waiting to be sent
+	int replyHeaderLen;			// size of replyHeader
+	int replyHeaderSent;		// how much of replyHeader has been sent
+	char* message;				// the message (binary: the current chunk), replaced in place by the reply
+	size_t messageLen;			// number of message characters held
+	size_t messageCap;			// allocated size of message
+	size_t keyLen;				// number of key characters applied, i.e. reply characters ready
+	size_t keyHeld;				// binary: in-band key characters held behind a batch, not yet applied
+	size_t batch;				// binary: message characters gathered per chunk, OTP_CHUNK unless split
+	size_t replySent;			// how much of the ready reply has been sent
+	unsigned long long remaining;	// binary: message bytes not yet read
+	unsigned long long skip;	// binary: bytes left to skip
+	int skipState;				// binary: final state once skipping is done
+	char lastDrain;				// text: previous character seen while draining
+	int binary;					// 1 once the connection has used the binary framing
+	int ending;					// binary: 1 once the client has sent OP_END
+	unsigned long requests;		// binary: requests completed on this connection
+	unsigned long long requestLen;	// binary: message bytes in the current request
+	struct otpStats* stats;		// where finished requests are counted, or NULL
+	struct otpKeyCache* keys;	// the daemon's key cache, or NULL without --keys
+	struct otpAdmission* admit;	// the daemon's admission limits, or NULL for none
+	int overloaded;				// 1 = the connection was over the limit; refuse its request busy
+	int busy;					// 1 = the current request is being refused busy
+	struct otpKey* key;			// binary: the referenced key, pinned for this request
+	const char* keyData;		// binary: the referenced key bytes for the next chunk
+	unsigned long long keyOffset;	// binary: where in the referenced key this request starts
+	struct otpLedger* sentLedger;	// binary: where a checked encryption records its chunks, or NULL
+	char keyRef[OTP_RESUME_REF_MAX];	// binary: the key reference read so far
+	size_t keyRefLen;			// number of key reference bytes read
+	size_t keyRefWant;			// size of the key reference
+	int checked;				// binary: 1 if the request's chunks carry trailers (OP_CHECKED)
+	int resume;					// binary: 1 if its key reference carries a resume token (OP_RESUME)
+	unsigned int crc;			// binary: CRC-32C of the checked chunk read so far
+	unsigned int seq;			// binary: the sequence number the next trailer must carry
+	unsigned long chunks;		// binary: checked chunks of the request so far
+	char trailer[OTP_TRAILER_SIZE];	// binary: the chunk trailer read so far
+	int trailerLen;				// number of trailer bytes read
+	char token[OTP_TOKEN_SIZE];	// binary: the resume token for a checked reply
+	int counted;				// text: 1 once the request has been counted
+	unsigned long long acceptedAt;	// when the connection was accepted, in statsNow() nanoseconds
+	unsigned long long requestAt;	// when the current request's first byte arrived
+	unsigned long long readAt;	// when its last byte arrived
+	unsigned long long sendAt;	// when the first byte of its reply went out
+	unsigned long long cipherNs;	// nanoseconds spent ciphering it so far
+};
+
+/**********************************************************
+// PARSER FUNCTIONS
+// ********************************************************/
+
+// parserInit
+//
+// description: readies a parser for a newly accepted
+//				connection
+//
+// @param		parser - the parser to set up
+// @param		allowedOps - OP_ flags this daemon accepts
+// @param		stats - where to count requests, or NULL
+// @param		keys - the key cache, or NULL if key references
+//				are not served
+// @param		admit - the admission limits, or NULL
+//..........................................................
+void parserInit(struct otpParser* parser, int allowedOps, struct otpStats* stats, struct otpKeyCache* keys, struct otpAdmission* admit)
+{
+	memset(parser, 0, sizeof(*parser));
+	parser->state = PARSE_HANDSHAKE;
+	parser->allowedOps = allowedOps;
+	parser->stats = stats;
+	parser->keys = keys;
+	parser->admit = admit;
+	parser->acceptedAt = stats ? statsNow() : 0;
+}
+
+// parserCipher
+//
+// description: cipherBlock(), split across cipherSplit's
+//				threads if the block is large, and timed for
+//				the stats
+//
+// @param		parser - the parser
+// @param		out - the message characters, replaced by the
+//				result
+// @param		key - the key characters
+// @param		n - the number of characters
+//..........................................................
+void parserCipher(struct otpParser* parser, char* out, const char* key, size_t n)
+{
+	unsigned long long start;
+
+	if (parser->stats == NULL)
+	{
+		splitCipher(cipherSplit, parser->op, out, key, n);
+		return;
+	}
+	start = statsNow();
+	splitCipher(cipherSplit, parser->op, out, key, n);
+	parser->cipherNs += statsNow() - start;
+}
+
+// parserBegin
+//
+// description: stamps the first byte of a request, and for
+//				the first request of a connection records how
+//				long the connection waited for it
+//
+// @param		parser - the parser
+//..........................................................
+void parserBegin(struct otpParser* parser)
+{
+	if (parser->stats == NULL)
+	{
+		return;
+	}
+	parser->requestAt = statsNow();
+	if (parser->acceptedAt != 0)
+	{
+		statsPhase(parser->stats, STATS_ACCEPT, parser->requestAt - parser->acceptedAt);
+		parser->acceptedAt = 0;
+	}
+}
+
+// parserRead
+//
+// description: whether every byte of the current request
+//				has been read
+//
+// @param		parser - the parser
+// @return		1 if so, else 0
+//..........................................................
+int parserRead(struct otpParser* parser)
+{
+	return parser->state >= PARSE_DONE || (parser->state == PARSE_FLUSH && parser->remaining == 0 && parser->skip == 0);
+}
+
+// parserRecord
+//
+// description: counts a finished request whose reply is out
+//				and records the time of each of its phases
+//
+// @param		parser - the parser
+// @param		bytes - message bytes ciphered
+//..........................................................
+void parserRecord(struct otpParser* parser, unsigned long long bytes)
+{
+	int rejected = parser->state == PARSE_REJECTED;
+
+	if (parser->stats == NULL)
+	{
+		return;
+	}
+	if (parser->busy)
+	{
+		statsBusy(parser->stats, parser->op);				// refused before any work, so no phases either
+		parser->requestAt = parser->readAt = parser->sendAt = 0;
+		return;
+	}
+	statsRequest(parser->stats, parser->op, rejected, rejected ? 0 : bytes);
+	if (parser->requestAt != 0 && parser->readAt != 0)
+	{
+		statsPhase(parser->stats, STATS_RECEIVE, parser->readAt - parser->requestAt);
+	}
+	if (!rejected)
+	{
+		statsPhase(parser->stats, STATS_CIPHER, parser->cipherNs);
+	}
+	if (parser->sendAt != 0)
+	{
+		statsPhase(parser->stats, STATS_SEND, statsNow() - parser->sendAt);
+	}
+	parser->requestAt = parser->readAt = parser->sendAt = 0;
+	parser->cipherNs = 0;
+}
+
+// parserDropKey
+//
+// description: unpins the referenced key, if any
+//
+// @param		parser - the parser
+//..........................................................
+void parserDropKey(struct otpParser* parser)
+{
+	if (parser->key != NULL)
+	{
+		keyRelease(parser->keys, parser->key);
+		parser->key = NULL;
+		parser->keyData = NULL;
+		parser->sentLedger = NULL;
+	}
+}
+
+// parserFree
+//
+// description: releases the parser's message buffer
+//
+// @param		parser - the parser to clean up
+//..........................................................
+void parserFree(struct otpParser* parser)
+{
+	parserDropKey(parser);
+	admitReturn(parser->admit, parser->messageCap);
+	free(parser->message);
+	parser->message = NULL;
+	parser->messageCap = 0;
+}
+
+// parserStoreMessage
+//
+// description: appends characters to a text framing
+//				message, growing the buffer as needed
+//
+// @param		parser - the parser
+// @param		data - the message characters
+// @param		n - how many
+// @return		0 on success, 1 if the buffer cannot grow
+//				within the byte limit, -1 if memory ran out
+//..........................................................
+int parserStoreMessage(struct otpParser* parser, const char* data, size_t n)
+{
+	size_t newCap;
+	char* newMessage;
+
+	while (parser->messageCap - parser->messageLen < n)
+	{
+		newCap = parser->messageCap ? parser->messageCap * 2 : BUFFERSIZE;
+		if (!admitBytes(parser->admit, newCap - parser->messageCap))
+		{
+			return 1;
+		}
+		newMessage = realloc(parser->message, newCap);
+		if (newMessage == NULL)
+		{
+			admitReturn(parser->admit, newCap - parser->messageCap);
+			return -1;
+		}
+		parser->message = newMessage;
+		parser->messageCap = newCap;
+	}
+	memcpy(parser->message + parser->messageLen, data, n);
+	parser->messageLen += n;
+	return 0;
+}
+
+// parserSetReplyHeader
+//
+// description: queues a binary reply header
+//
+// @param		parser - the parser
+// @param		version - the version the server will speak
+// @param		status - an OTP_ status; OTP_BUSY also carries
+//				the retry-after, OTP_OK for a key reference the
+//				key offset used (version 4), and OTP_OK for a
+//				checked request is followed by its resume token
+// @param		replyLen - the number of reply bytes to follow
+//..........................................................
+void parserSetReplyHeader(struct otpParser* parser, int version, int status, unsigned long long replyLen)
+{
+	struct otpHeader reply;
+	struct otpHeader request;
+
+	if (unpackHeader(parser->header, &request) < 0)
+	{
+		request.requestId = 0;							// a header that cannot be read is answered as request 0
+	}
+	reply.version = version;
+	reply.code = status;
+	reply.requestId = request.requestId;
+	reply.messageLen = replyLen;
+	reply.keyLen = 0;
+	if (status == OTP_BUSY && parser->admit)
+	{
+		reply.keyLen = parser->admit->retryAfterMs;
+	}
+	else if (status == OTP_OK && parser->key != NULL && version >= 4)
+	{
+		reply.keyLen = parser->keyOffset;
+	}
+	packHeader(parser->replyHeader, &reply);
+	parser->replyHeaderLen = OTP_HEADER_SIZE;
+	parser->replyHeaderSent = 0;
+	if (status == OTP_OK && parser->checked)
+	{
+		memcpy(parser->replyHeader + OTP_HEADER_SIZE, parser->token, OTP_TOKEN_SIZE);
+		parser->replyHeaderLen += OTP_TOKEN_SIZE;
+	}
+}
+
+// parserNextChunk
+//
+// description: moves a binary request on to its next
+//				message chunk, or to skipping the unused key
+//				bytes once the whole message has been read
+//
+// @param		parser - the parser
+//..........................................................
+void parserNextChunk(struct otpParser* parser)
+{
+	parser->messageLen = 0;
+	parser->keyLen = 0;
+	parser->keyHeld = 0;
+	parser->replySent = 0;
+	parser->crc = 0;
+
+	if (parser->remaining > 0)
+	{
+		parser->state = PARSE_CHUNK;
+	}
+	else
+	{
+		parser->skipState = PARSE_DONE;
+		parser->state = parser->skip > 0 ? PARSE_SKIP : PARSE_DONE;
+	}
+}
+
+// parserSkipBody
+//
+// description: skips the rest of a binary request's body,
+//				the chunk trailers of a checked request
+//				included, then settles in a final state
+//
+// @param		parser - the parser, with the request's
+//				requestLen and checked set
+// @param		messageLen - message bytes still to come
+// @param		keyLen - key bytes still to come
+// @param		finalState - PARSE_DONE or PARSE_REJECTED
+//..........................................................
+void parserSkipBody(struct otpParser* parser, unsigned long long messageLen, unsigned long long keyLen, int finalState)
+{
+	unsigned long long chunks = parser->requestLen / OTP_CHUNK + (parser->requestLen % OTP_CHUNK != 0);
+	unsigned long long trailers = parser->checked ? chunks * OTP_TRAILER_SIZE : 0;
+
+	parser->skip = messageLen + keyLen + trailers;
+	parser->skipState = finalState;
+	parser->state = parser->skip > 0 ? PARSE_SKIP : finalState;
+	if (messageLen + keyLen < messageLen || parser->skip < trailers)	// lengths that wrap leave no way to find the next header
+	{
+		parser->state = PARSE_ERROR;
+	}
+}
+
+// parserBadHeader
+//
+// description: refuses a request whose header cannot be
+//				read with OTP_BAD and ends the connection, as
+//				there is no telling where its body ends
+//
+// @param		parser - the parser
+//..........................................................
+void parserBadHeader(struct otpParser* parser)
+{
+	parser->ending = 1;
+	parserSetReplyHeader(parser, OTP_VERSION, OTP_BAD, 0);
+	parser->skipState = PARSE_REJECTED;
+	parser->state = PARSE_REJECTED;
+}
+
+// parserTextBusy
+//
+// description: queues a text request's busy reply: the busy
+//				sentinel and the retry-after
+//
+// @param		parser - the parser
+//..........................................................
+void parserTextBusy(struct otpParser* parser)
+{
+	parser->replyHeaderLen = snprintf(parser->replyHeader, sizeof(parser->replyHeader), "%s%u",
+		BUSY_FAIL, parser->admit ? parser->admit->retryAfterMs : 0);
+	parser->state = PARSE_REJECTED;
+}
+
+// parserRefuseEarly
+//
+// description: ends an overloaded connection's request as
+//				soon as its code word or binary header is in,
+//				without reading its body. A binary request has
+//				its busy reply queued already; a text one gets
+//				it now instead of after the end sentinel.
+//
+// @param		parser - an overloaded parser
+// @return		1 if a reply is queued, else 0 if the request
+//				never got that far
+//..........................................................
+int parserRefuseEarly(struct otpParser* parser)
+{
+	if (parser->state == PARSE_DRAIN && parser->busy)
+	{
+		parserTextBusy(parser);
+	}
+	else if (parser->binary && parser->replyHeaderLen > 0)
+	{
+		parser->state = PARSE_REJECTED;
+	}
+	else
+	{
+		return 0;
+	}
+	parser->ending = 1;									// nothing more is read on this connection
+	return 1;
+}
+
+// parserStartBinary
+//
+// description: checks a complete binary request header,
+//				queues the reply header and allocates the one
+//				chunk the request will need, or the batch it
+//				is gathered in when it is to be split
+//
+// @param		parser - the parser
+//..........................................................
+void parserStartBinary(struct otpParser* parser)
+{
+	struct otpHeader request;
+	int version;
+	int status = OTP_OK;
+	int keyRef;
+	int reserved = 0;
+	size_t chunk, batch;
+
+	if (unpackHeader(parser->header, &request) < 0)
+	{
+		parserBadHeader(parser);
+		return;
+	}
+	version = request.version < OTP_VERSION ? request.version : OTP_VERSION;
+	keyRef = (request.code & OP_KEY_REF) != 0;
+	parser->checked = (request.code & OP_CHECKED) != 0;
+	parser->resume = (request.code & OP_RESUME) != 0;
+	parser->op = request.code & ~OP_FLAGS;
+	parser->requestLen = request.messageLen;
+	parser->chunks = 0;
+	parser->crc = 0;
+	memset(parser->token, 0, OTP_TOKEN_SIZE);			// requests that carry their key need no token
+
+	if (request.version < 1)
+	{
+		status = OTP_BAD_VERSION;
+	}
+	else if (request.code == OP_END && request.version >= 2)
+	{
+		// acknowledge the end of stream; the connection finishes once the ack is out
+		parser->ending = 1;
+		parserSetReplyHeader(parser, version, OTP_OK, 0);
+		parserSkipBody(parser, request.messageLen, request.keyLen, PARSE_DONE);
+		return;
+	}
+	else if (parser->overloaded)
+	{
+		status = OTP_BUSY;
+		parser->ending = 1;						// a connection over the limit gets no further requests
+	}
+	else if ((parser->op != OP_ENC && parser->op != OP_DEC) || (parser->op & parser->allowedOps) == 0 ||
+		(keyRef && (request.version < 3 || request.keyLen <= 8 || request.keyLen > (unsigned long long)(OTP_KEY_REF_MAX + parser->resume * OTP_TOKEN_SIZE))) ||
+		(parser->checked && request.version < 5) || (parser->resume && (!keyRef || !parser->checked || request.keyLen <= 8 + OTP_TOKEN_SIZE)))
+	{
+		status = OTP_REJECTED;
+	}
+	else if (keyRef && parser->keys == NULL)
+	{
+		status = OTP_NO_KEY;
+	}
+	else if (!keyRef && request.keyLen < request.messageLen)
+	{
+		status = OTP_KEY_SHORT;
+	}
+
+	chunk = request.messageLen < OTP_CHUNK ? request.messageLen : OTP_CHUNK;
+	if (parser->checked)
+	{
+		chunk += OTP_TRAILER_SIZE;						// room for the reply trailer behind the chunk
+	}
+	parser->batch = OTP_CHUNK;
+	if (status == OTP_OK && cipherSplit != NULL && !parser->checked && request.messageLen >= SPLIT_MIN)
+	{
+		batch = request.messageLen < SPLIT_BATCH ? request.messageLen : SPLIT_BATCH;
+		if ((keyRef ? batch : 2 * batch) <= parser->messageCap ||
+			admitBytes(parser->admit, (keyRef ? batch : 2 * batch) - parser->messageCap))
+		{
+			parser->batch = batch;						// else no room within the byte limit: a chunk at a time
+			chunk = keyRef ? batch : 2 * batch;
+			reserved = 1;
+		}
+	}
+	if (status == OTP_OK && !reserved && chunk > parser->messageCap && !admitBytes(parser->admit, chunk - parser->messageCap))
+	{
+		status = OTP_BUSY;						// no room for the chunk within the byte limit
+	}
+
+	if (status != OTP_OK)
+	{
+		// refuse right away, but read the body so the client is never reset mid-send
+		parser->busy = status == OTP_BUSY;
+		parserSetReplyHeader(parser, version, status, 0);
+		parserSkipBody(parser, request.messageLen, request.keyLen, PARSE_REJECTED);
+		return;
+	}
+
+	if (chunk > parser->messageCap)				// the last request's chunk is reused when it is big enough
+	{
+		free(parser->message);
+		parser->message = malloc(chunk);
+		parser->messageCap = chunk;
+		if (parser->message == NULL)
+		{
+			admitReturn(parser->admit, chunk);
+			parser->messageCap = 0;
+			parser->state = PARSE_ERROR;
+			return;
+		}
+	}
+
+	parser->remaining = request.messageLen;
+	if (keyRef)
+	{
+		parser->keyRefLen = 0;					// the reply header waits until the key is found
+		parser->keyRefWant = request.keyLen;
+		parser->state = PARSE_KEY_REF;
+		return;
+	}
+	parser->skip = request.keyLen - request.messageLen;
+	parserSetReplyHeader(parser, version, OTP_OK, request.messageLen);
+	parserNextChunk(parser);
+}
+
+// parserStartKeyRef
+//
+// description: looks up the key a complete key reference
+//				names and, for an encryption with a ledger,
+//				reserves its range unless a resume token
+//				shows it was reserved already, then queues the
+//				reply header and goes on to the message, or
+//				refuses the request and skips the message
+//
+// @param		parser - the parser
+//..........................................................
+void parserStartKeyRef(struct otpParser* parser)
+{
+	struct otpHeader request;
+	struct otpLedger* ledger;
+	char id[OTP_KEY_ID_MAX + 1];
+	unsigned long long offset;
+	int version;
+	int status = OTP_OK;
+
+	if (unpackHeader(parser->header, &request) < 0)
+	{
+		parserBadHeader(parser);
+		return;
+	}
+	version = request.version < OTP_VERSION ? request.version : OTP_VERSION;
+
+	if ((parser->resume ? unpackResumeRef(parser->keyRef, parser->keyRefLen, &offset, parser->token, id) :
+		unpackKeyRef(parser->keyRef, parser->keyRefLen, &offset, id)) < 0)
+	{
+		status = OTP_NO_KEY;
+	}
+	else if ((parser->key = keyAcquire(parser->keys, id)) == NULL)
+	{
+		status = OTP_NO_KEY;
+	}
+	else if (parser->resume && !keyTokenCovers(parser->keys, parser->op, id, parser->token, offset, request.messageLen))
+	{
+		status = OTP_NO_RESUME;
+	}
+	else if (!parser->resume && parser->op == OP_ENC && parser->keys->ledgerFD >= 0)
+	{
+		ledger = keyLedger(parser->keys, parser->key);
+		status = ledger ? ledgerReserve(ledger, offset, request.messageLen, parser->key->length, &offset) : OTP_KEY_USED;
+	}
+	if (status == OTP_OK && (offset > parser->key->length || request.messageLen > parser->key->length - offset))
+	{
+		status = OTP_KEY_SHORT;						// every request, resumed ones too: the key file may have shrunk since
+	}
+	if (status == OTP_OK && parser->checked && parser->op == OP_ENC && parser->keys->ledgerFD >= 0 &&
+		(parser->sentLedger = keyLedger(parser->keys, parser->key)) == NULL)
+	{
+		status = OTP_KEY_USED;
+	}
+	if (status != OTP_OK)
+	{
+		parserDropKey(parser);
+	}
+
+	if (status != OTP_OK)
+	{
+		parserSetReplyHeader(parser, version, status, 0);
+		parserSkipBody(parser, request.messageLen, 0, PARSE_REJECTED);
+		return;
+	}
+
+	parser->keyData = parser->key->data + offset;
+	parser->keyOffset = offset;
+	if (parser->checked && !parser->resume)
+	{
+		keyToken(parser->keys, parser->op, id, offset, request.messageLen, parser->token);
+	}
+	parser->skip = 0;
+	parserSetReplyHeader(parser, version, OTP_OK, request.messageLen);
+	parserNextChunk(parser);
+}
+
+// parserChunkSize
+//
+// description: the size of the binary chunk being read, a
+//				whole batch when the request is split
+//
+// @param		parser - the parser
+// @return		the chunk size
+//..........................................................
+size_t parserChunkSize(struct otpParser* parser)
+{
+	return parser->remaining < parser->batch ? parser->remaining : parser->batch;
+}
+
+// parserChunkEnd
+//
+// description: where the message chunk on the wire ends in
+//				the chunk being read. A batch takes several
+//				in-band chunks, each followed by its key; a
+//				key reference's message comes in one piece.
+//
+// @param		parser - the parser
+// @return		the message characters the chunk holds once
+//				the wire chunk has been read
+//..........................................................
+size_t parserChunkEnd(struct otpParser* parser)
+{
+	size_t size = parserChunkSize(parser);
+
+	if (parser->keyData != NULL || parser->keyHeld + OTP_CHUNK > size)
+	{
+		return size;
+	}
+	return parser->keyHeld + OTP_CHUNK;
+}
+
+// parserChunkRead
+//
+// description: moves on once a binary chunk has been read
+//				and combined: to sending it back, or for a
+//				checked request to reading its trailer first
+//
+// @param		parser - the parser
+//..........................................................
+void parserChunkRead(struct otpParser* parser)
+{
+	parser->remaining -= parser->messageLen;
+	parser->trailerLen = 0;
+	parser->state = parser->checked ? PARSE_TRAILER : PARSE_FLUSH;
+}
+
+// parserCheckChunk
+//
+// description: checks a complete chunk trailer against the
+//				chunk as it was read, and for an encryption
+//				with a ledger records the chunk there. If both
+//				hold, the reply trailer is put behind the
+//				combined chunk so the two go out together; if
+//				not, the request ends in PARSE_ERROR with the
+//				chunk unanswered.
+//
+// @param		parser - the parser
+//..........................................................
+void parserCheckChunk(struct otpParser* parser)
+{
+	unsigned int seq, crc;
+
+	unpackTrailer(parser->trailer, &seq, &crc);
+	if (crc != parser->crc || (parser->chunks > 0 && seq != parser->seq))	// the first chunk sets the count
+	{
+		parser->state = PARSE_ERROR;
+		return;
+	}
+	if (parser->sentLedger != NULL && ledgerSend(parser->sentLedger,
+		parser->keyOffset + (parser->requestLen - parser->remaining - parser->keyLen), (unsigned int)parser->keyLen, crc) != OTP_OK)
+	{
+		parser->state = PARSE_ERROR;				// a resumed chunk with another message, or no record of it
+		return;
+	}
+	packTrailer(parser->message + parser->keyLen, seq, crc32c(0, parser->message, parser->keyLen));
+	parser->keyLen += OTP_TRAILER_SIZE;
+	parser->seq = seq + 1;
+	parser->chunks++;
+	parser->state = PARSE_FLUSH;
+}
+
+// parserSettle
+//
+// description: counts a request once it is complete and its
+//				whole reply has been sent, and readies a binary
+//				connection for its next request. The chunk
+//				buffer is kept for the next request.
+//
+// @param		parser - the parser
+//..........................................................
+void parserSettle(struct otpParser* parser)
+{
+	if (parser->counted || (parser->state != PARSE_DONE && parser->state != PARSE_REJECTED) ||
+		parser->replyHeaderSent < parser->replyHeaderLen || parser->replySent < parser->keyLen)
+	{
+		return;
+	}
+	if (parser->op != OP_END)
+	{
+		parserRecord(parser, parser->binary ? parser->requestLen : parser->messageLen);
+	}
+	if (!parser->binary || parser->ending)
+	{
+		parser->counted = 1;							// the connection ends with this request
+		return;
+	}
+	parserDropKey(parser);
+	parser->busy = 0;
+	parser->state = PARSE_HANDSHAKE;
+	parser->headerLen = 0;
+	parser->replyHeaderLen = 0;
+	parser->replyHeaderSent = 0;
+	parser->messageLen = 0;
+	parser->keyLen = 0;
+	parser->replySent = 0;
+	parser->remaining = 0;
+	parser->skip = 0;
+	parser->requests++;
+}
+
+// parserIdle
+//
+// description: whether the connection is between requests,
+//				where the client may hang up: before the
+//				first byte, or between binary requests
+//
+// @param		parser - the parser
+// @return		1 if idle, else 0
+//..........................................................
+int parserIdle(struct otpParser* parser)
+{
+	return parser->state == PARSE_HANDSHAKE && parser->headerLen == 0;
+}
+
+// parserWant
+//
+// description: how many bytes the parser can take now
+//
+// @param		parser - the parser
+// @return		the most bytes parserFeed will accept; 0 if
+//				the ready reply must be sent first, or the
+//				request is complete
+//..........................................................
+size_t parserWant(struct otpParser* parser)
+{
+	switch (parser->state)
+	{
+		case PARSE_HANDSHAKE:
+			return 2 - parser->headerLen;
+		case PARSE_HEADER:
+			return OTP_HEADER_SIZE - parser->headerLen;
+		case PARSE_CHUNK:
+			return parserChunkEnd(parser) - parser->messageLen;
+		case PARSE_CHUNK_KEY:
+			return parser->messageLen - (parser->batch > OTP_CHUNK ? parser->keyHeld : parser->keyLen);
+		case PARSE_SKIP:
+			return parser->skip < BUFFERSIZE ? parser->skip : BUFFERSIZE;
+		case PARSE_KEY_REF:
+			return parser->keyRefWant - parser->keyRefLen;
+		case PARSE_TRAILER:
+			return OTP_TRAILER_SIZE - parser->trailerLen;
+		case PARSE_KEY:
+			if (parser->messageLen - parser->keyLen > BUFFERSIZE)
+			{
+				return parser->messageLen - parser->keyLen;		// the rest of the key, in as few blocks as the caller likes
+			}
+			break;
+		case PARSE_FLUSH:
+		case PARSE_DONE:
+		case PARSE_REJECTED:
+		case PARSE_ERROR:
+			return 0;
+	}
+	return BUFFERSIZE;								// text framing: any amount
+}
+
+// parserFeedText
+//
+// description: runs the text framing state machine over
+//				one character
+//
+// @param		parser - the parser
+// @param		c - the next character from the client
+//..........................................................
+void parserFeedText(struct otpParser* parser, char c)
+{
+	int stored;
+
+	switch (parser->state)
+	{
+		case PARSE_MESSAGE:
+			if (c == MID_SENTINEL[0])
+			{
+				parser->state = PARSE_MID;
+			}
+			else if ((stored = parserStoreMessage(parser, &c, 1)) < 0)
+			{
+				parser->state = PARSE_ERROR;
+			}
+			else if (stored > 0)
+			{
+				parser->busy = 1;							// over the byte limit: refuse once it is all read
+				parser->state = PARSE_DRAIN;
+			}
+			break;
+
+		case PARSE_MID:
+			parser->state = (c == MID_SENTINEL[1]) ? PARSE_KEY : PARSE_ERROR;
+			break;
+
+		case PARSE_KEY:
+			if (c == END_SENTINEL[0])
+			{
+				parser->state = PARSE_END;
+			}
+			else if (parser->keyLen < parser->messageLen)		// extra key characters are ignored
+			{
+				parser->message[parser->keyLen] = cipherChar(parser->op, parser->message[parser->keyLen], c);
+				parser->keyLen++;
+			}
+			break;
+
+		case PARSE_END:
+			if (c != END_SENTINEL[1] || parser->keyLen < parser->messageLen)	// malformed, or key too short
+			{
+				parser->state = PARSE_ERROR;
+			}
+			else
+			{
+				parser->state = PARSE_DONE;
+			}
+			break;
+
+		case PARSE_DRAIN:
+			if (parser->lastDrain == END_SENTINEL[0] && c == END_SENTINEL[1] && parser->busy)
+			{
+				parserTextBusy(parser);
+			}
+			else if (parser->lastDrain == END_SENTINEL[0] && c == END_SENTINEL[1])
+			{
+				memcpy(parser->replyHeader, CON_FAIL, 1);		// the reply is just the connection fail sentinel
+				parser->replyHeaderLen = 1;
+				parser->state = PARSE_REJECTED;
+			}
+			parser->lastDrain = c;
+			break;
+	}
+}
+
+// parserFeed
+//
+// description: runs the state machine over the next piece
+//				of a request
+//
+// @param		parser - the connection's parser
+// @param		data - bytes received from the client
+// @param		n - the number of bytes in data, no more
+//				than parserWant() allowed
+// @return		the parser state afterwards. PARSE_DONE,
+//				PARSE_REJECTED and PARSE_ERROR are final;
+//				anything else means more input is needed.
+//..........................................................
+int parserFeed(struct otpParser* parser, const char* data, size_t n)
+{
+	size_t i = 0;
+	size_t take;
+	const char* span;
+	int stored;
+
+	while (i < n && parser->state < PARSE_DONE)
+	{
+		take = n - i;
+		if (parserIdle(parser))
+		{
+			parserBegin(parser);
+		}
+		switch (parser->state)
+		{
+			case PARSE_HANDSHAKE:
+				parser->header[parser->headerLen++] = data[i++];
+				if (parser->headerLen == 2)
+				{
+					if (memcmp(parser->header, OTP_MAGIC, 2) == 0)
+					{
+						parser->binary = 1;
+						parser->state = PARSE_HEADER;
+					}
+					else if (parser->binary)
+					{
+						parser->state = PARSE_ERROR;		// no text request after binary ones
+					}
+					else
+					{
+						if (memcmp(parser->header, ENC_CLIENT, 2) == 0)
+						{
+							parser->op = OP_ENC;
+						}
+						else if (memcmp(parser->header, DEC_CLIENT, 2) == 0)
+						{
+							parser->op = OP_DEC;
+						}
+						parser->busy = parser->overloaded;
+						parser->state = (parser->op & parser->allowedOps) && !parser->busy ? PARSE_MESSAGE : PARSE_DRAIN;
+					}
+				}
+				break;
+
+			case PARSE_HEADER:
+				if (take > (size_t)(OTP_HEADER_SIZE - parser->headerLen))
+				{
+					take = OTP_HEADER_SIZE - parser->headerLen;
+				}
+				memcpy(parser->header + parser->headerLen, data + i, take);
+				parser->headerLen += take;
+				i += take;
+				if (parser->headerLen == OTP_HEADER_SIZE)
+				{
+					parserStartBinary(parser);
+				}
+				break;
+
+			case PARSE_CHUNK:
+				if (take > parserChunkEnd(parser) - parser->messageLen)
+				{
+					take = parserChunkEnd(parser) - parser->messageLen;
+				}
+				memcpy(parser->message + parser->messageLen, data + i, take);
+				if (parser->checked)
+				{
+					parser->crc = crc32c(parser->crc, data + i, take);
+				}
+				parser->messageLen += take;
+				i += take;
+				if (parser->messageLen == parserChunkSize(parser) && parser->keyData != NULL)
+				{
+					parserCipher(parser, parser->message, parser->keyData, parser->messageLen);	// the key is already here
+					parser->keyData += parser->messageLen;
+					parser->keyLen = parser->messageLen;
+					parserChunkRead(parser);
+				}
+				else if (parser->messageLen == parserChunkEnd(parser))
+				{
+					parser->state = PARSE_CHUNK_KEY;
+				}
+				break;
+
+			case PARSE_KEY_REF:
+				if (take > parser->keyRefWant - parser->keyRefLen)
+				{
+					take = parser->keyRefWant - parser->keyRefLen;
+				}
+				memcpy(parser->keyRef + parser->keyRefLen, data + i, take);
+				parser->keyRefLen += take;
+				i += take;
+				if (parser->keyRefLen == parser->keyRefWant)
+				{
+					parserStartKeyRef(parser);
+				}
+				break;
+
+			case PARSE_CHUNK_KEY:
+				if (parser->batch > OTP_CHUNK)
+				{
+					if (take > parser->messageLen - parser->keyHeld)
+					{
+						take = parser->messageLen - parser->keyHeld;
+					}
+					memcpy(parser->message + parser->batch + parser->keyHeld, data + i, take);	// held until the batch is in
+					parser->keyHeld += take;
+					i += take;
+					if (parser->keyHeld == parserChunkSize(parser))
+					{
+						parserCipher(parser, parser->message, parser->message + parser->batch, parser->keyHeld);
+						parser->keyLen = parser->keyHeld;
+						parserChunkRead(parser);
+					}
+					else if (parser->keyHeld == parser->messageLen)
+					{
+						parser->state = PARSE_CHUNK;
+					}
+					break;
+				}
+				if (take > parser->messageLen - parser->keyLen)
+				{
+					take = parser->messageLen - parser->keyLen;
+				}
+				if (parser->checked)
+				{
+					parser->crc = crc32c(parser->crc, data + i, take);	// before the key is combined away
+				}
+				parserCipher(parser, parser->message + parser->keyLen, data + i, take);
+				parser->keyLen += take;
+				i += take;
+				if (parser->keyLen == parser->messageLen)
+				{
+					parserChunkRead(parser);
+				}
+				break;
+
+			case PARSE_TRAILER:
+				if (take > (size_t)(OTP_TRAILER_SIZE - parser->trailerLen))
+				{
+					take = OTP_TRAILER_SIZE - parser->trailerLen;
+				}
+				memcpy(parser->trailer + parser->trailerLen, data + i, take);
+				parser->trailerLen += take;
+				i += take;
+				if (parser->trailerLen == OTP_TRAILER_SIZE)
+				{
+					parserCheckChunk(parser);
+				}
+				break;
+
+			case PARSE_SKIP:
+				if (take > parser->skip)
+				{
+					take = parser->skip;
+				}
+				parser->skip -= take;
+				i += take;
+				if (parser->skip == 0)
+				{
+					parser->state = parser->skipState;
+				}
+				break;
+
+			case PARSE_MESSAGE:
+				span = memchr(data + i, MID_SENTINEL[0], take);		// store the message up to the sentinel in one block
+				if (span != NULL)
+				{
+					take = span - (data + i);
+				}
+				if (take == 0)
+				{
+					parserFeedText(parser, data[i++]);			// the sentinel
+					break;
+				}
+				if ((stored = parserStoreMessage(parser, data + i, take)) < 0)
+				{
+					parser->state = PARSE_ERROR;
+				}
+				else if (stored > 0)
+				{
+					parser->busy = 1;							// over the byte limit: refuse once it is all read
+					parser->state = PARSE_DRAIN;
+				}
+				i += take;
+				break;
+
+			case PARSE_KEY:
+				if (take > parser->messageLen - parser->keyLen)
+				{
+					take = parser->messageLen - parser->keyLen;
+				}
+				span = memchr(data + i, END_SENTINEL[0], take);		// combine the key up to the sentinel in one block
+				if (span != NULL)
+				{
+					take = span - (data + i);
+				}
+				if (take == 0)
+				{
+					parserFeedText(parser, data[i++]);			// the sentinel, or key beyond the message
+					break;
+				}
+				parserCipher(parser, parser->message + parser->keyLen, data + i, take);
+				parser->keyLen += take;
+				i += take;
+				break;
+
+			case PARSE_FLUSH:
+				return parser->state;				// callers must not feed past parserWant()
+
+			default:
+				parserFeedText(parser, data[i++]);
+		}
+		if (parser->readAt == 0 && parser->requestAt != 0 && parserRead(parser))
+		{
+			parser->readAt = statsNow();
+		}
+		parserSettle(parser);
+	}
+	return parser->state;
+}
+
+// parserReply
+//
+// description: the next piece of reply that is ready to
+//				send: first any reply header, then the
+//				combined message characters. A checked
+//				chunk is held until its trailer matched
+//				and it was recorded, in PARSE_FLUSH
+//
+// @param		parser - the parser
+// @param		data - set to the bytes to send
+// @return		the number of bytes ready, 0 if none
+//..........................................................
+size_t parserReply(struct otpParser* parser, const char** data)
+{
+	if (parser->replyHeaderSent < parser->replyHeaderLen)
+	{
+		*data = parser->replyHeader + parser->replyHeaderSent;
+		return parser->replyHeaderLen - parser->replyHeaderSent;
+	}
+	if (parser->checked && parser->state != PARSE_FLUSH)
+		return 0;
+	*data = parser->message + parser->replySent;
+	return parser->keyLen - parser->replySent;
+}
+
+// parserReplySent
+//
+// description: records that n bytes from parserReply went
+//				out. Once a binary chunk has been sent in
+//				full, the parser moves on to the next one.
+//
+// @param		parser - the parser
+// @param		n - the number of bytes sent
+//..........................................................
+void parserReplySent(struct otpParser* parser, size_t n)
+{
+	if (parser->sendAt == 0 && parser->stats != NULL && n > 0)
+	{
+		parser->sendAt = statsNow();
+	}
+	if (parser->replyHeaderSent < parser->replyHeaderLen)
+	{
+		parser->replyHeaderSent += n;
+	}
+	else
+	{
+		parser->replySent += n;
+		if (parser->state == PARSE_FLUSH && parser->replySent == parser->keyLen)
+		{
+			parserNextChunk(parser);
+		}
+	}
+	parserSettle(parser);
+}
+
+// parserFinished
+//
+// description: whether the request is complete and its
+//				whole reply has been sent. Binary connections
+//				finish once OP_END has been acknowledged, or
+//				end when the client hangs up while parserIdle().
+//
+// @param		parser - the parser
+// @return		1 if finished, else 0
+//..........................................................
+int parserFinished(struct otpParser* parser)
+{
+	const char* data;
+	return parser->state >= PARSE_DONE && parserReply(parser, &data) == 0;
+}
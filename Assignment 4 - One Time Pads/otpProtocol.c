@@ -0,0 +1,371 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpProtocol.c - the length-prefixed binary otp protocol, shared by the daemons and the
+//				clients.
+//
+//				The first two bytes a client sends pick the framing. ENC_CLIENT or DEC_CLIENT selects
+//				the original text framing (version 0). OTP_MAGIC selects the binary framing, and the
+//				header's version byte carries the highest version the client speaks. The server answers
+//				with the version it will use, which is never higher than the client's.
+//
+//				Request:	[ header | message chunk 0 | key chunk 0 | message chunk 1 | key chunk 1 | ... ]
+//				Reply:		[ header | reply (messageLen bytes, only when the status is OTP_OK)           ]
+//
+//				Header (OTP_HEADER_SIZE bytes, integers in network byte order):
+//				[ magic "OT" | version | op / status | request id | message length | key length	]
+//				[ 2 bytes    | 1 byte  | 1 byte      | 4 bytes    | 8 bytes        | 8 bytes		]
+//
+//				Message and key travel in interleaved chunks of at most OTP_CHUNK bytes, each key chunk
+//				the same length as the message chunk before it, so the server can combine a chunk and
+//				send it back without holding more than one chunk. Key bytes beyond the message length
+//				follow the last chunk and are skipped.
+//
+//				Version 2 adds an explicit end of stream. A client that has no more requests sends a
+//				header with OP_END and both lengths 0. The server answers with an OTP_OK header with the
+//				same request id and no body, then shuts down its side, so the client knows every reply
+//				has been delivered and the server knows the client is done, without either side timing
+//				the send queue. Clients only send OP_END once a reply has shown the server speaks
+//				version 2; older servers end the connection when the client hangs up.
+//
+//				Version 3 adds key references, for daemons that hold the key files themselves. A request
+//				whose op has the OP_KEY_REF bit set sends, in place of key bytes, the key's id and the
+//				offset in that key to start from; the message then follows in one piece:
+//
+//				Request:	[ header | key offset (8 bytes) | key id (key length - 8 bytes) | message ]
+//
+//				A key id is 1 to OTP_KEY_ID_MAX letters, digits, '.', '_' or '-', not starting with '.',
+//				so it can only name a file directly inside the daemon's key directory. An id the daemon
+//				does not have gets OTP_NO_KEY, and a key that ends before offset + message length gets
+//				OTP_KEY_SHORT.
+//
+//				Version 4 adds key ledgers (see otpLedger.c), for daemons that record which stretches of
+//				their keys have been used. An encryption may ask for the key offset OTP_KEY_NEXT, the
+//				first byte after everything used so far; an encryption whose range overlaps one used
+//				before gets OTP_KEY_USED. The OTP_OK reply to any key reference then carries the offset
+//				actually used in its key length field, which is what decrypting the reply will need.
+//
+//				Version 5 adds checked requests, for long transfers that have to outlive a dropped
+//				connection. When the op has the OP_CHECKED bit set, each message chunk (with its key
+//				chunk, when the request carries key bytes) is followed by a trailer holding the chunk's
+//				sequence number and the CRC-32C of the chunk's message and key bytes. The client picks the
+//				first sequence number, and each later one is one more. The OTP_OK reply header is
+//				followed by a resume token, and each reply chunk by a trailer with the same sequence number
+//				and the CRC-32C of the reply bytes. A chunk whose trailer does not match ends the
+//				connection before any of its reply is sent, so every reply chunk that arrives with a good
+//				trailer is final.
+//
+//				Request:	[ header | (key reference) | message chunk 0 | (key chunk 0) | trailer 0 | ... ]
+//				Reply:		[ header | resume token | reply chunk 0 | trailer 0 | reply chunk 1 | ...     ]
+//				Trailer:	[ sequence number (4 bytes) | CRC-32C (4 bytes) ]
+//
+//				A client that loses the connection reconnects and sends the rest of the message as a new
+//				request, starting at the first chunk it has no good reply for, with the key from the same
+//				place (for a key reference, the offset that much further on) and that chunk's sequence
+//				number. A ledger would refuse that range, so a resumed encryption by key reference also
+//				sets OP_RESUME and sends back its token, which the daemon signed over the key id and the
+//				range it handed out (see otpKeys.c). Other requests get a token of zeros and need none.
+//
+//				Request:	[ header | key offset (8 bytes) | resume token | key id | chunks and trailers ]
+//				Token:		[ range offset (8 bytes) | range length (8 bytes) | signature (16 bytes) ]
+//
+//				A token that does not check out, or a range it does not cover, gets OTP_NO_RESUME.
+//
+//				Any version may be answered OTP_BUSY when the daemon is over its admission limits (see
+//				otpAdmit.c). The reply's key length field, otherwise 0, then holds how many milliseconds
+//				the client should wait before it tries again. The text framing's equivalent is BUSY_FAIL
+//				followed by the same number in decimal.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <endian.h>
+
+/**********************************************************
+// PROTOCOL GLOBALS
+// ********************************************************/
+
+#define OTP_MAGIC		"OT"	// the code word that selects the binary framing
+#define OTP_VERSION		5		// the highest protocol version spoken here
+#define OTP_HEADER_SIZE	24		// size of a request or reply header
+#define OTP_CHUNK		65536	// largest message chunk on the wire
+#define OTP_TRAILER_SIZE	8	// a checked chunk's sequence number and CRC-32C, version 5
+#define OTP_TOKEN_SIZE	32		// a resume token, version 5
+
+// operations
+// ......................
+#define OP_ENC			1		// encryption, ENC_CLIENT in the text framing
+#define OP_DEC			2		// decryption, DEC_CLIENT in the text framing
+#define OP_END			3		// end of stream, version 2 and up
+#define OP_KEY_REF		0x80	// flag: the key is a reference to a key held by the daemon, version 3 and up
+#define OP_CHECKED		0x40	// flag: chunks carry sequence numbers and checksums, version 5 and up
+#define OP_RESUME		0x20	// flag: the key reference carries a resume token, version 5 and up
+#define OP_FLAGS		(OP_KEY_REF | OP_CHECKED | OP_RESUME)
+
+// key references
+// ......................
+#define OTP_KEY_ID_MAX	255		// longest key id
+#define OTP_KEY_REF_MAX	(8 + OTP_KEY_ID_MAX)	// largest key reference on the wire
+#define OTP_RESUME_REF_MAX	(OTP_KEY_REF_MAX + OTP_TOKEN_SIZE)	// largest one with a resume token
+#define OTP_KEY_NEXT	(~0ULL)	// key offset: the next unused one in the daemon's ledger, version 4 and up
+
+// reply status
+// ......................
+#define OTP_OK			0		// the reply follows
+#define OTP_REJECTED	1		// this daemon does not serve the requested operation
+#define OTP_BAD_VERSION	2		// the requested protocol version is not spoken here
+#define OTP_KEY_SHORT	3		// the key is shorter than the message
+#define OTP_NO_KEY		4		// the referenced key id is not held by this daemon
+#define OTP_BUSY		5		// the daemon is overloaded; retry after keyLen milliseconds
+#define OTP_KEY_USED	6		// part of the key range has encrypted something before
+#define OTP_NO_RESUME	7		// the resume token is not valid for the range asked for
+#define OTP_BAD			8		// the request header could not be read; the connection ends
+
+// otpHeader
+// ......................
+struct otpHeader
+{
+	int version;						// protocol version
+	int code;							// OP_ in requests, OTP_ status in replies
+	unsigned int requestId;				// chosen by the client, echoed in the reply
+	unsigned long long messageLen;		// message bytes in a request, reply bytes in a reply
+	unsigned long long keyLen;			// key bytes in a request; in a reply 0, OTP_BUSY's retry-after ms,
+										// or the key offset used (version 4 key references)
+};
+
+/**********************************************************
+// PROTOCOL FUNCTIONS
+// ********************************************************/
+
+// packHeader
+//
+// description: writes a header in wire format
+//
+// @param		buf - OTP_HEADER_SIZE bytes to write into
+// @param		header - the header to write
+//..........................................................
+void packHeader(char* buf, const struct otpHeader* header)
+{
+	unsigned int requestId = htobe32(header->requestId);
+	unsigned long long messageLen = htobe64(header->messageLen);
+	unsigned long long keyLen = htobe64(header->keyLen);
+
+	memcpy(buf, OTP_MAGIC, 2);
+	buf[2] = (char)header->version;
+	buf[3] = (char)header->code;
+	memcpy(buf + 4, &requestId, 4);
+	memcpy(buf + 8, &messageLen, 8);
+	memcpy(buf + 16, &keyLen, 8);
+}
+
+// unpackHeader
+//
+// description: reads a header from wire format
+//
+// @param		buf - OTP_HEADER_SIZE bytes to read
+// @param		header - the header to fill in
+// @return		0 on success, -1 if the magic is wrong
+//..........................................................
+int unpackHeader(const char* buf, struct otpHeader* header)
+{
+	unsigned int requestId;
+	unsigned long long messageLen;
+	unsigned long long keyLen;
+
+	if (memcmp(buf, OTP_MAGIC, 2) != 0)
+	{
+		return -1;
+	}
+	memcpy(&requestId, buf + 4, 4);
+	memcpy(&messageLen, buf + 8, 8);
+	memcpy(&keyLen, buf + 16, 8);
+
+	header->version = (unsigned char)buf[2];
+	header->code = (unsigned char)buf[3];
+	header->requestId = be32toh(requestId);
+	header->messageLen = be64toh(messageLen);
+	header->keyLen = be64toh(keyLen);
+	return 0;
+}
+
+// statusMessage
+//
+// description: describes a reply status for error text
+//
+// @param		status - an OTP_ status
+// @return		a short description
+//..........................................................
+const char* statusMessage(int status)
+{
+	switch (status)
+	{
+		case OTP_OK:			return "ok";
+		case OTP_REJECTED:		return "connection rejected";
+		case OTP_BAD_VERSION:	return "protocol version not supported";
+		case OTP_KEY_SHORT:		return "key is too short";
+		case OTP_NO_KEY:		return "unknown key id";
+		case OTP_BUSY:			return "server busy";
+		case OTP_KEY_USED:		return "key range already used";
+		case OTP_NO_RESUME:		return "resume token not accepted";
+		case OTP_BAD:			return "malformed request header";
+	}
+	return "unknown status";
+}
+
+// validKeyId
+//
+// description: checks that a key id can only name a file
+//				directly inside a key directory
+//
+// @param		id - the key id
+// @param		len - its length
+// @return		1 if valid, else 0
+//..........................................................
+int validKeyId(const char* id, size_t len)
+{
+	size_t i;
+
+	if (len < 1 || len > OTP_KEY_ID_MAX || id[0] == '.')
+	{
+		return 0;
+	}
+	for (i = 0; i < len; i++)
+	{
+		if (!((id[i] >= 'A' && id[i] <= 'Z') || (id[i] >= 'a' && id[i] <= 'z') || (id[i] >= '0' && id[i] <= '9') ||
+			id[i] == '.' || id[i] == '_' || id[i] == '-'))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// packKeyRef
+//
+// description: writes a key reference in wire format
+//
+// @param		buf - OTP_KEY_REF_MAX bytes to write into
+// @param		offset - where in the key to start
+// @param		id - a valid key id
+// @return		the size of the reference
+//..........................................................
+size_t packKeyRef(char* buf, unsigned long long offset, const char* id)
+{
+	unsigned long long wireOffset = htobe64(offset);
+	size_t len = strlen(id);
+
+	memcpy(buf, &wireOffset, 8);
+	memcpy(buf + 8, id, len);
+	return 8 + len;
+}
+
+// unpackKeyRef
+//
+// description: reads a key reference from wire format
+//
+// @param		buf - the reference
+// @param		len - its size
+// @param		offset - receives the key offset
+// @param		id - receives the key id, OTP_KEY_ID_MAX + 1
+//				bytes, nul terminated
+// @return		0 on success, -1 if the id is not valid
+//..........................................................
+int unpackKeyRef(const char* buf, size_t len, unsigned long long* offset, char* id)
+{
+	unsigned long long wireOffset;
+
+	if (len < 8 || !validKeyId(buf + 8, len - 8))
+	{
+		return -1;
+	}
+	memcpy(&wireOffset, buf, 8);
+	*offset = be64toh(wireOffset);
+	memcpy(id, buf + 8, len - 8);
+	id[len - 8] = '\0';
+	return 0;
+}
+
+// packResumeRef
+//
+// description: writes a key reference with a resume token
+//				in wire format
+//
+// @param		buf - OTP_RESUME_REF_MAX bytes to write into
+// @param		offset - where in the key to start
+// @param		token - the OTP_TOKEN_SIZE byte token
+// @param		id - a valid key id
+// @return		the size of the reference
+//..........................................................
+size_t packResumeRef(char* buf, unsigned long long offset, const char* token, const char* id)
+{
+	unsigned long long wireOffset = htobe64(offset);
+	size_t len = strlen(id);
+
+	memcpy(buf, &wireOffset, 8);
+	memcpy(buf + 8, token, OTP_TOKEN_SIZE);
+	memcpy(buf + 8 + OTP_TOKEN_SIZE, id, len);
+	return 8 + OTP_TOKEN_SIZE + len;
+}
+
+// unpackResumeRef
+//
+// description: reads a key reference with a resume token
+//				from wire format
+//
+// @param		buf - the reference
+// @param		len - its size
+// @param		offset - receives the key offset
+// @param		token - receives the OTP_TOKEN_SIZE byte token
+// @param		id - receives the key id, OTP_KEY_ID_MAX + 1
+//				bytes, nul terminated
+// @return		0 on success, -1 if the id is not valid
+//..........................................................
+int unpackResumeRef(const char* buf, size_t len, unsigned long long* offset, char* token, char* id)
+{
+	char plain[OTP_KEY_REF_MAX];
+
+	if (len < 8 + OTP_TOKEN_SIZE || len - OTP_TOKEN_SIZE > sizeof(plain))
+	{
+		return -1;
+	}
+	memcpy(plain, buf, 8);
+	memcpy(plain + 8, buf + 8 + OTP_TOKEN_SIZE, len - 8 - OTP_TOKEN_SIZE);
+	memcpy(token, buf + 8, OTP_TOKEN_SIZE);
+	return unpackKeyRef(plain, len - OTP_TOKEN_SIZE, offset, id);
+}
+
+// packTrailer
+//
+// description: writes a checked chunk's trailer
+//
+// @param		buf - OTP_TRAILER_SIZE bytes to write into
+// @param		seq - the chunk's sequence number
+// @param		crc - the CRC-32C of its bytes
+//..........................................................
+void packTrailer(char* buf, unsigned int seq, unsigned int crc)
+{
+	unsigned int wireSeq = htobe32(seq);
+	unsigned int wireCrc = htobe32(crc);
+
+	memcpy(buf, &wireSeq, 4);
+	memcpy(buf + 4, &wireCrc, 4);
+}
+
+// unpackTrailer
+//
+// description: reads a checked chunk's trailer
+//
+// @param		buf - the OTP_TRAILER_SIZE byte trailer
+// @param		seq - receives the sequence number
+// @param		crc - receives the CRC-32C
+//..........................................................
+void unpackTrailer(const char* buf, unsigned int* seq, unsigned int* crc)
+{
+	unsigned int wireSeq, wireCrc;
+
+	memcpy(&wireSeq, buf, 4);
+	memcpy(&wireCrc, buf + 4, 4);
+	*seq = be32toh(wireSeq);
+	*crc = be32toh(wireCrc);
+}
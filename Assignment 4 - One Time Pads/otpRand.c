@@ -0,0 +1,311 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpRand.c - the random key character generators used by keygen (and measured by otp_bench).
+//				Two sources are offered:
+//
+//				[x]		fast - xoshiro256**, a small-state generator that produces a 64-bit word in a few
+//						cycles. It is seeded through splitmix64, either from the kernel or from a fixed
+//						seed so a key can be generated again.
+//				[x]		secure - the kernel CSPRNG through getrandom(), for keys that have to be
+//						unpredictable and not just well spread.
+//
+//				Each 64-bit word becomes 12 key characters without bias. The word is read as a fraction
+//				of 2^64 and multiplied by 27 twelve times; the part that spills over the top each time is
+//				the next base 27 digit, so every character costs one multiply and no division. Those 12
+//				digits are exactly floor(word * 27^12 / 2^64), and, as in Lemire's range reduction, that
+//				value is uniform once words whose remaining fraction is below 2^64 mod 27^12 are thrown
+//				away (0.7% of them). Digit 26 is SPACE.
+//
+//				For the fast source, randSeedBlock() gives every block of a key its own stream, taken
+//				from consecutive splitmix64 outputs of the seed, so the key depends only on the seed and
+//				the block size - not on how many threads filled the blocks or in what order.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <stdint.h>
+#include <errno.h>
+#include <sys/random.h>
+
+/**********************************************************
+// RANDOM GLOBALS
+// ********************************************************/
+
+// generator sources
+// ......................
+#define RAND_FAST		0		// xoshiro256**
+#define RAND_SECURE		1		// getrandom()
+#define RAND_SOURCES	2
+
+#define RAND_SCRATCH	4096	// bytes of kernel randomness fetched per getrandom() call
+
+#define RAND_DIGITS		12							// base 27 digits taken from each word
+#define RAND_REJECT		135198567475658854ULL		// 2^64 mod 27^12, the smallest accepted remainder
+#define RAND_GOLDEN		0x9E3779B97F4A7C15ULL				// the splitmix64 increment
+
+const char* randSourceNames[RAND_SOURCES] = { "fast", "secure" };
+const char randAlphabet[27] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+// otpRand
+// ......................
+struct otpRand
+{
+	uint64_t s[4];				// xoshiro256** state, never all zero
+};
+
+/**********************************************************
+// RANDOM FUNCTIONS
+// ********************************************************/
+
+// randRotate
+//
+// description: rotates a word left
+//
+// @param		x - the word
+// @param		k - bits to rotate by, 1-63
+// @return		the rotated word
+//..........................................................
+static inline uint64_t randRotate(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+// randNext
+//
+// description: returns the next word of a xoshiro256** stream
+//
+// @param		rng - the generator
+// @return		64 random bits
+//..........................................................
+static inline uint64_t randNext(struct otpRand* rng)
+{
+	uint64_t* s = rng->s;
+	uint64_t result = randRotate(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = randRotate(s[3], 45);
+	return result;
+}
+
+// randSeed
+//
+// description: fills a generator's state from one seed word
+//				with splitmix64, so nearby seeds still give
+//				unrelated streams
+//
+// @param		rng - the generator
+// @param		seed - any 64-bit value
+//..........................................................
+void randSeed(struct otpRand* rng, uint64_t seed)
+{
+	uint64_t z;
+	int i;
+
+	for (i = 0; i < 4; i++)
+	{
+		z = (seed += RAND_GOLDEN);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		rng->s[i] = z ^ (z >> 31);
+	}
+}
+
+// randSeedBlock
+//
+// description: seeds a generator for one block of a key.
+//				Block b takes splitmix64 outputs 4b+1 to 4b+4
+//				of the seed, so no two blocks share a state.
+//
+// @param		rng - the generator
+// @param		seed - the key's seed
+// @param		block - the block's index in the key
+//..........................................................
+void randSeedBlock(struct otpRand* rng, uint64_t seed, uint64_t block)
+{
+	randSeed(rng, seed + block * 4 * RAND_GOLDEN);
+}
+
+// randJump
+//
+// description: advances a generator by 2^128 words, which
+//				gives each thread a stream no other thread will
+//				reach
+//
+// @param		rng - the generator
+//..........................................................
+void randJump(struct otpRand* rng)
+{
+	static const uint64_t jump[4] = { 0x180EC6D33CFD0ABAULL, 0xD5A61266F0C9392CULL, 0xA9582618E03FC9AAULL, 0x39ABDC4529B1661CULL };
+	uint64_t s[4] = { 0, 0, 0, 0 };
+	int i, b, k;
+
+	for (i = 0; i < 4; i++)
+	{
+		for (b = 0; b < 64; b++)
+		{
+			if (jump[i] & (1ULL << b))
+			{
+				for (k = 0; k < 4; k++)
+				{
+					s[k] ^= rng->s[k];
+				}
+			}
+			randNext(rng);
+		}
+	}
+	memcpy(rng->s, s, sizeof(s));
+}
+
+// randSystem
+//
+// description: fills a buffer from the kernel CSPRNG
+//
+// @param		buffer - the buffer
+// @param		length - bytes to fill
+// @return		0, or -1 if getrandom() failed
+//..........................................................
+int randSystem(void* buffer, size_t length)
+{
+	char* out = buffer;
+	ssize_t got;
+
+	while (length > 0)
+	{
+		got = getrandom(out, length, 0);
+		if (got < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		out += got;
+		length -= got;
+	}
+	return 0;
+}
+
+// randEntropy
+//
+// description: returns a seed word from the kernel, falling
+//				back to the clock and process id if getrandom()
+//				is not available
+//
+// @return		a seed word
+//..........................................................
+uint64_t randEntropy()
+{
+	uint64_t seed;
+	struct timespec now;
+
+	if (randSystem(&seed, sizeof(seed)) == 0)
+	{
+		return seed;
+	}
+	clock_gettime(CLOCK_REALTIME, &now);
+	return ((uint64_t)now.tv_sec << 32) ^ (uint64_t)now.tv_nsec ^ ((uint64_t)getpid() << 16);
+}
+
+// randDigits
+//
+// description: writes the 12 base 27 digits of a word as key
+//				characters, most significant first
+//
+// @param		out - where the 12 characters go
+// @param		word - 64 random bits
+// @return		1 if the word is accepted, 0 if the characters
+//				are biased and must be thrown away
+//..........................................................
+static inline int randDigits(char* out, uint64_t word)
+{
+	unsigned __int128 product;
+	int i;
+
+	for (i = 0; i < RAND_DIGITS; i++)
+	{
+		product = (unsigned __int128)word * 27;
+		out[i] = randAlphabet[(int)(product >> 64)];
+		word = (uint64_t)product;
+	}
+	return word >= RAND_REJECT;
+}
+
+// randFill
+//
+// description: fills a buffer with random key characters
+//
+// @param		source - RAND_FAST or RAND_SECURE
+// @param		rng - the generator (RAND_FAST only)
+// @param		out - the buffer
+// @param		n - characters to write
+// @return		0, or -1 if the kernel CSPRNG failed
+//..........................................................
+int randFill(int source, struct otpRand* rng, char* out, size_t n)
+{
+	uint64_t scratch[RAND_SCRATCH / sizeof(uint64_t)];
+	size_t used = 0;
+	size_t fetched = 0;
+	size_t done = 0;
+	char tail[RAND_DIGITS];
+	char* dest;
+	uint64_t word;
+
+	if (source == RAND_FAST)
+	{
+		while (n - done >= RAND_DIGITS)				// the hot loop: one word, twelve characters
+		{
+			if (randDigits(out + done, randNext(rng)))	// a well predicted branch lets the words overlap
+			{
+				done += RAND_DIGITS;
+			}
+		}
+	}
+
+	while (done < n)
+	{
+		if (source == RAND_FAST)
+		{
+			word = randNext(rng);
+		}
+		else
+		{
+			if (used == fetched)					// refill the scratch with about what is still needed
+			{
+				fetched = (n - done) / RAND_DIGITS + 2;
+				if (fetched > RAND_SCRATCH / sizeof(uint64_t))
+				{
+					fetched = RAND_SCRATCH / sizeof(uint64_t);
+				}
+				if (randSystem(scratch, fetched * sizeof(uint64_t)) < 0)
+				{
+					return -1;
+				}
+				used = 0;
+			}
+			word = scratch[used++];
+		}
+
+		dest = (n - done >= RAND_DIGITS) ? out + done : tail;	// a short tail keeps the leading digits
+		if (randDigits(dest, word))
+		{
+			if (dest == tail)
+			{
+				memcpy(out + done, tail, n - done);
+				done = n;
+			}
+			else
+			{
+				done += RAND_DIGITS;
+			}
+		}
+	}
+	return 0;
+}
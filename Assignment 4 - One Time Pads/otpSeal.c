@@ -0,0 +1,530 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpSeal.c - the optional authenticated, encrypted transport (--psk file). With it, every byte
+//				a client and daemon exchange, in either framing, travels in ChaCha20-Poly1305 records, so
+//				plaintext and key no longer cross the socket in the clear and a peer without the shared
+//				key can neither read nor forge traffic.
+//
+//				Both sides hold the same pre-shared key file (any 16 or more bytes; keygen 64 > otp.psk
+//				makes one). On connecting each side sends a 32-byte random hello, and each direction
+//				gets its own session key, HMAC-SHA256(psk, label | client hello | server hello). A
+//				fresh server hello on every connection means a recorded session cannot be replayed
+//				against the daemon. Records are:
+//
+//				[ length 	| ciphertext 	| tag 		]
+//				[ 4 bytes	| length bytes	| 16 bytes	]
+//
+//				with the big-endian length (at most SEAL_RECORD) as associated data and the record's
+//				sequence number as the nonce. A record that fails to open ends the connection.
+//
+//				sealRecv(), sealSend() and sealWritev() stand in for recv(), send() and writev() and work
+//				on blocking and non-blocking sockets alike; with a NULL seal they are those calls. A
+//				non-blocking sender that gets a short write keeps the rest of its record in the seal, so
+//				its caller must wait for POLLOUT while sealPending() is non-zero and sealFlush() it.
+//
+//				Uses OpenSSL's libcrypto; link with -lcrypto.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <sys/random.h>
+#include <sys/uio.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+/**********************************************************
+// SEAL GLOBALS
+// ********************************************************/
+
+#define SEAL_HELLO		32		// random bytes each side sends first
+#define SEAL_TAG		16		// Poly1305 tag size
+#define SEAL_LENGTH		4		// record length prefix
+#define SEAL_RECORD		16384	// largest plaintext in one record
+#define SEAL_FRAME		(SEAL_LENGTH + SEAL_RECORD + SEAL_TAG)
+#define SEAL_PSK_MIN	16		// shortest pre-shared key accepted
+
+// otpSeal
+// ......................
+struct otpSeal
+{
+	int server;						// 1 on the daemon's side
+	unsigned char psk[EVP_MAX_MD_SIZE];	// the pre-shared key, hashed down if it was long
+	size_t pskLen;
+	unsigned char mine[SEAL_HELLO];	// our hello
+	unsigned char theirs[SEAL_HELLO];	// the peer's hello
+	size_t theirsLen;				// how much of it has arrived
+	int keyed;						// 1 once both hellos are in and the keys derived
+	EVP_CIPHER_CTX* sealCtx;		// our direction
+	EVP_CIPHER_CTX* openCtx;		// the peer's direction
+	unsigned long long sendSeq;		// records sealed
+	unsigned long long recvSeq;		// records opened
+	unsigned char in[2 * SEAL_FRAME];	// received bytes not yet opened
+	size_t inLen;
+	unsigned char plain[SEAL_RECORD];	// an opened record not yet returned
+	size_t plainOff, plainLen;
+	unsigned char out[SEAL_FRAME];	// a sealed record not yet written
+	size_t outOff, outLen;
+};
+
+/**********************************************************
+// SEAL FUNCTIONS
+// ********************************************************/
+
+// sealLoadKey
+//
+// description: reads a pre-shared key file, less a trailing
+//				newline, exiting with 1 if it is unreadable or
+//				too short
+//
+// @param		path - the key file
+// @param		length - receives the key length
+// @return		the key, on the heap
+//..........................................................
+unsigned char* sealLoadKey(const char* path, size_t* length)
+{
+	FILE* fp = fopen(path, "r");
+	unsigned char* key = malloc(4096);
+
+	if (fp == NULL || key == NULL)
+	{
+		fprintf(stderr, "%sERROR opening the pre-shared key %s%s\n", RED, path, NRM);
+		exit(1);
+	}
+	*length = fread(key, 1, 4096, fp);
+	fclose(fp);
+	while (*length > 0 && (key[*length - 1] == '\n' || key[*length - 1] == '\r'))
+	{
+		(*length)--;
+	}
+	if (*length < SEAL_PSK_MIN)
+	{
+		fprintf(stderr, "%sERROR, the pre-shared key %s must be at least %d bytes%s\n", RED, path, SEAL_PSK_MIN, NRM);
+		exit(1);
+	}
+	return key;
+}
+
+// sealDerive
+//
+// description: derives both session keys once both hellos
+//				are in
+//
+// @param		seal - the seal
+// @return		0, or -1 if libcrypto failed
+//..........................................................
+int sealDerive(struct otpSeal* seal)
+{
+	unsigned char input[8 + 2 * SEAL_HELLO];
+	unsigned char key[EVP_MAX_MD_SIZE];
+	unsigned int keyLen;
+	const unsigned char* clientHello = seal->server ? seal->theirs : seal->mine;
+	const unsigned char* serverHello = seal->server ? seal->mine : seal->theirs;
+	int direction;
+	EVP_CIPHER_CTX* ctx;
+
+	memcpy(input + 8, clientHello, SEAL_HELLO);
+	memcpy(input + 8 + SEAL_HELLO, serverHello, SEAL_HELLO);
+	for (direction = 0; direction < 2; direction++)
+	{
+		memcpy(input, direction == 0 ? "otp c2s " : "otp s2c ", 8);
+		ctx = (direction == 0) == !seal->server ? seal->sealCtx : seal->openCtx;	// clients seal c2s, servers s2c
+		if (HMAC(EVP_sha256(), seal->psk, (int)seal->pskLen, input, sizeof(input), key, &keyLen) == NULL ||
+			EVP_CipherInit_ex(ctx, EVP_chacha20_poly1305(), NULL, key, NULL, ctx == seal->sealCtx) != 1)
+		{
+			OPENSSL_cleanse(key, sizeof(key));
+			return -1;
+		}
+	}
+	OPENSSL_cleanse(key, sizeof(key));
+	seal->keyed = 1;
+	return 0;
+}
+
+// sealClose
+//
+// description: frees a seal and wipes its keys. Does not
+//				close the socket.
+//
+// @param		seal - the seal, or NULL
+//..........................................................
+void sealClose(struct otpSeal* seal)
+{
+	if (seal != NULL)
+	{
+		EVP_CIPHER_CTX_free(seal->sealCtx);
+		EVP_CIPHER_CTX_free(seal->openCtx);
+		OPENSSL_cleanse(seal, sizeof(*seal));
+		free(seal);
+	}
+}
+
+// sealOpen
+//
+// description: starts the sealed transport on a connected
+//				socket by sending our hello. A client then
+//				blocks for the daemon's hello, so it can send
+//				at once; the daemon takes the client's hello
+//				with its first sealRecv().
+//
+// @param		socketFD - the connected socket
+// @param		psk - the pre-shared key
+// @param		pskLen - its length
+// @param		server - 1 on the daemon's side
+// @return		the seal, or NULL if the hello exchange failed
+//..........................................................
+struct otpSeal* sealOpen(int socketFD, const unsigned char* psk, size_t pskLen, int server)
+{
+	struct otpSeal* seal = calloc(1, sizeof(struct otpSeal));
+	unsigned int digestLen;
+	ssize_t n;
+
+	if (seal == NULL)
+	{
+		return NULL;
+	}
+	seal->server = server;
+	seal->sealCtx = EVP_CIPHER_CTX_new();
+	seal->openCtx = EVP_CIPHER_CTX_new();
+	if (pskLen > sizeof(seal->psk))									// HMAC-SHA256 hashes keys over its 64-byte block just so
+	{
+		EVP_Digest(psk, pskLen, seal->psk, &digestLen, EVP_sha256(), NULL);
+		seal->pskLen = digestLen;
+	}
+	else
+	{
+		memcpy(seal->psk, psk, pskLen);
+		seal->pskLen = pskLen;
+	}
+	if (seal->sealCtx == NULL || seal->openCtx == NULL || getrandom(seal->mine, SEAL_HELLO, 0) != SEAL_HELLO ||
+		send(socketFD, seal->mine, SEAL_HELLO, MSG_NOSIGNAL | MSG_DONTWAIT) != SEAL_HELLO)	// a new socket always has room
+	{
+		sealClose(seal);
+		return NULL;
+	}
+
+	while (!server && seal->theirsLen < SEAL_HELLO)
+	{
+		n = recv(socketFD, seal->theirs + seal->theirsLen, SEAL_HELLO - seal->theirsLen, 0);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			sealClose(seal);
+			return NULL;
+		}
+		seal->theirsLen += n;
+	}
+	if (!server && sealDerive(seal) < 0)
+	{
+		sealClose(seal);
+		return NULL;
+	}
+	return seal;
+}
+
+// sealNonce
+//
+// description: the nonce for a record: four zero bytes and
+//				the big-endian sequence number
+//
+// @param		nonce - receives 12 bytes
+// @param		seq - the record's sequence number
+//..........................................................
+void sealNonce(unsigned char* nonce, unsigned long long seq)
+{
+	int i;
+
+	memset(nonce, 0, 4);
+	for (i = 0; i < 8; i++)
+	{
+		nonce[4 + i] = (unsigned char)(seq >> (56 - 8 * i));
+	}
+}
+
+// sealFlush
+//
+// description: writes out what is left of the last sealed
+//				record
+//
+// @param		seal - the seal, or NULL
+// @param		socketFD - the socket
+// @param		flags - send() flags, e.g. MSG_DONTWAIT
+// @return		0 once nothing is pending, -1 with errno set
+//				(EAGAIN if the socket is full)
+//..........................................................
+int sealFlush(struct otpSeal* seal, int socketFD, int flags)
+{
+	ssize_t n;
+
+	while (seal != NULL && seal->outOff < seal->outLen)
+	{
+		n = send(socketFD, seal->out + seal->outOff, seal->outLen - seal->outOff, flags | MSG_NOSIGNAL);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		seal->outOff += n;
+	}
+	return 0;
+}
+
+// sealPending
+//
+// description: bytes of sealed output not yet written
+//
+// @param		seal - the seal, or NULL
+// @return		the count
+//..........................................................
+size_t sealPending(struct otpSeal* seal)
+{
+	return seal != NULL ? seal->outLen - seal->outOff : 0;
+}
+
+// sealWritev
+//
+// description: writev() through the seal. Seals up to
+//				SEAL_RECORD bytes of the gather list into one
+//				record and writes as much of it as the socket
+//				takes; the rest stays pending.
+//
+// @param		seal - the seal, or NULL for plain writev()
+// @param		socketFD - the socket
+// @param		iov - the regions to send
+// @param		count - the number of regions
+// @param		flags - send() flags, e.g. MSG_DONTWAIT
+// @return		plaintext bytes taken, or -1 with errno set
+//..........................................................
+ssize_t sealWritev(struct otpSeal* seal, int socketFD, const struct iovec* iov, int count, int flags)
+{
+	unsigned char nonce[12];
+	size_t take = 0, piece;
+	int written, i;
+
+	if (seal == NULL)
+	{
+		return writev(socketFD, iov, count);
+	}
+	if (sealFlush(seal, socketFD, flags) < 0)
+	{
+		return -1;
+	}
+	if (!seal->keyed)
+	{
+		errno = ENOTCONN;
+		return -1;
+	}
+	for (i = 0; i < count; i++)
+	{
+		take += iov[i].iov_len;
+	}
+	if (take > SEAL_RECORD)
+	{
+		take = SEAL_RECORD;
+	}
+	if (take == 0)
+	{
+		return 0;
+	}
+
+	// seal the record: the length is the associated data
+	seal->out[0] = (unsigned char)(take >> 24);
+	seal->out[1] = (unsigned char)(take >> 16);
+	seal->out[2] = (unsigned char)(take >> 8);
+	seal->out[3] = (unsigned char)take;
+	sealNonce(nonce, seal->sendSeq++);
+	if (EVP_EncryptInit_ex(seal->sealCtx, NULL, NULL, NULL, nonce) != 1 ||
+		EVP_EncryptUpdate(seal->sealCtx, NULL, &written, seal->out, SEAL_LENGTH) != 1)
+	{
+		errno = EIO;
+		return -1;
+	}
+	seal->outLen = SEAL_LENGTH;
+	for (i = 0; i < count && seal->outLen < SEAL_LENGTH + take; i++)
+	{
+		piece = iov[i].iov_len < SEAL_LENGTH + take - seal->outLen ? iov[i].iov_len : SEAL_LENGTH + take - seal->outLen;
+		if (EVP_EncryptUpdate(seal->sealCtx, seal->out + seal->outLen, &written, iov[i].iov_base, (int)piece) != 1)
+		{
+			errno = EIO;
+			return -1;
+		}
+		seal->outLen += written;
+	}
+	if (EVP_EncryptFinal_ex(seal->sealCtx, seal->out + seal->outLen, &written) != 1 ||
+		EVP_CIPHER_CTX_ctrl(seal->sealCtx, EVP_CTRL_AEAD_GET_TAG, SEAL_TAG, seal->out + seal->outLen + written) != 1)
+	{
+		errno = EIO;
+		return -1;
+	}
+	seal->outLen += written + SEAL_TAG;
+	seal->outOff = 0;
+
+	if (sealFlush(seal, socketFD, flags) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+	{
+		return -1;
+	}
+	return (ssize_t)take;
+}
+
+// sealSend
+//
+// description: send() through the seal; see sealWritev()
+//
+// @param		seal - the seal, or NULL for plain send()
+// @param		socketFD - the socket
+// @param		data - the bytes to send
+// @param		n - how many
+// @param		flags - send() flags
+// @return		plaintext bytes taken, or -1 with errno set
+//..........................................................
+ssize_t sealSend(struct otpSeal* seal, int socketFD, const void* data, size_t n, int flags)
+{
+	struct iovec iov;
+
+	if (seal == NULL)
+	{
+		return send(socketFD, data, n, flags);
+	}
+	iov.iov_base = (void*)data;
+	iov.iov_len = n;
+	return sealWritev(seal, socketFD, &iov, 1, flags);
+}
+
+// sealUnwrap
+//
+// description: opens the first record in the input buffer
+//				if the whole of it has arrived
+//
+// @param		seal - the seal
+// @return		1 if a record was opened, 0 if it is still
+//				arriving, -1 if it failed to authenticate
+//..........................................................
+int sealUnwrap(struct otpSeal* seal)
+{
+	unsigned char nonce[12];
+	size_t length, frame;
+	int written, final;
+
+	if (seal->inLen < SEAL_LENGTH)
+	{
+		return 0;
+	}
+	length = ((size_t)seal->in[0] << 24) | ((size_t)seal->in[1] << 16) | ((size_t)seal->in[2] << 8) | seal->in[3];
+	if (length == 0 || length > SEAL_RECORD)
+	{
+		return -1;
+	}
+	frame = SEAL_LENGTH + length + SEAL_TAG;
+	if (seal->inLen < frame)
+	{
+		return 0;
+	}
+
+	sealNonce(nonce, seal->recvSeq++);
+	if (EVP_DecryptInit_ex(seal->openCtx, NULL, NULL, NULL, nonce) != 1 ||
+		EVP_DecryptUpdate(seal->openCtx, NULL, &written, seal->in, SEAL_LENGTH) != 1 ||
+		EVP_DecryptUpdate(seal->openCtx, seal->plain, &written, seal->in + SEAL_LENGTH, (int)length) != 1 ||
+		EVP_CIPHER_CTX_ctrl(seal->openCtx, EVP_CTRL_AEAD_SET_TAG, SEAL_TAG, seal->in + SEAL_LENGTH + length) != 1 ||
+		EVP_DecryptFinal_ex(seal->openCtx, seal->plain + written, &final) != 1)
+	{
+		return -1;
+	}
+	seal->plainOff = 0;
+	seal->plainLen = written + final;
+	seal->inLen -= frame;
+	memmove(seal->in, seal->in + frame, seal->inLen);
+	return 1;
+}
+
+// sealRecv
+//
+// description: recv() through the seal. Returns bytes of an
+//				opened record, reading and opening the next
+//				record first if none are left. EOF is only
+//				clean between records.
+//
+// @param		seal - the seal, or NULL for plain recv()
+// @param		socketFD - the socket
+// @param		data - where to put the bytes
+// @param		n - the most to return
+// @param		flags - recv() flags, e.g. MSG_DONTWAIT
+// @return		bytes returned, 0 at EOF, or -1 with errno set:
+//				EAGAIN if no whole record has arrived on a
+//				non-blocking socket, EBADMSG if one failed to
+//				authenticate
+//..........................................................
+ssize_t sealRecv(struct otpSeal* seal, int socketFD, void* data, size_t n, int flags)
+{
+	ssize_t charsRead;
+	int opened;
+
+	if (seal == NULL)
+	{
+		return recv(socketFD, data, n, flags);
+	}
+
+	while (seal->plainOff == seal->plainLen)
+	{
+		if (seal->keyed && (opened = sealUnwrap(seal)) != 0)
+		{
+			if (opened < 0)
+			{
+				errno = EBADMSG;
+				return -1;
+			}
+			break;
+		}
+
+		// read the peer's hello, or more of the next record
+		if (!seal->keyed)
+		{
+			charsRead = recv(socketFD, seal->theirs + seal->theirsLen, SEAL_HELLO - seal->theirsLen, flags);
+		}
+		else
+		{
+			charsRead = recv(socketFD, seal->in + seal->inLen, sizeof(seal->in) - seal->inLen, flags);
+		}
+		if (charsRead < 0)
+		{
+			return -1;
+		}
+		if (charsRead == 0)
+		{
+			if (seal->inLen == 0 && (seal->keyed || seal->theirsLen == 0))
+			{
+				return 0;
+			}
+			errno = EPROTO;								// cut off inside a hello or record
+			return -1;
+		}
+		if (!seal->keyed)
+		{
+			seal->theirsLen += charsRead;
+			if (seal->theirsLen == SEAL_HELLO && sealDerive(seal) < 0)
+			{
+				errno = EIO;
+				return -1;
+			}
+		}
+		else
+		{
+			seal->inLen += charsRead;
+		}
+	}
+
+	if (n > seal->plainLen - seal->plainOff)
+	{
+		n = seal->plainLen - seal->plainOff;
+	}
+	memcpy(data, seal->plain + seal->plainOff, n);
+	seal->plainOff += n;
+	return (ssize_t)n;
+}
@@ -0,0 +1,1337 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpServer.c - shared listener and process management for otp_enc_d, otp_dec_d and otp_d.
+//				It is included directly by the daemons (the same way smallsh includes its helpers), after
+//				they have defined their colors, transmission sentinels and error(). A daemon serves the
+//				operations in its config's ops flags; the parser picks each request's operation from its
+//				code word or header, so otp_d serves both from one pool.
+//
+//				Three ways of running the daemon are supported:
+//
+//				[x]		worker pool (default) - a fixed number of workers is forked up front. They all
+//						accept on one shared listening socket, so a connection goes to whichever worker is
+//						free, and each serves connections one after another in a loop. The parent only
+//						watches its workers and restarts any that die.
+//
+//				[x]		fork per connection (--fork) - the original model, where the parent accepts and
+//						forks a new child for every connection.
+//
+//				[x]		event loop (--event-loop[=threads]) - one process with one or more epoll threads.
+//						Sockets are non-blocking and every connection is just an otpParser plus its
+//						message, so idle or slow clients cost memory instead of whole processes.
+//
+//				[x]		io_uring (--io-uring[=threads]) - the event loop's model, with each thread queueing
+//						its accepts, receives, sends and closes on an io_uring instead of making a syscall
+//						for every step (see otpUring.c). Runs the event loop if the kernel has no io_uring.
+//
+//				Every mode ends a transaction the same way: once the reply is queued the write side is shut
+//				down, which pushes the last segment out with the FIN instead of leaving it to Nagle, and
+//				the kernel finishes delivering it after close(). Nothing spins on the send queue. The
+//				event loop, which costs nothing to wait, also holds the socket until the client hangs up.
+//				--linger sets SO_LINGER on every connection, for daemons that want close() to block until
+//				the reply is acknowledged (or, with 0, to reset instead of leaving TIME_WAIT behind).
+//
+//				A worker or fork child serves one connection at a time, so a client that goes quiet would
+//				hold it for good. --idle-timeout seconds (IDLE_TIMEOUT by default, 0 for none) bounds how
+//				long a blocking read or write on a connection may wait; past it the connection is closed.
+//				A persistent binary connection idle between requests is closed the same way. The event
+//				loop closes a connection that has had no event for as long, so idle clients, and ones that
+//				never hang up after their reply, cannot keep their --max-conns slots either.
+//
+//				Every mode counts finished requests per operation, and times the phases of each request,
+//				in shared memory (see otpStats.c); kill -USR1 the daemon's pid to print the totals. The
+//				parent also counts the children it reaps, by exit status and lifetime (see otpChildren.c).
+//				--metrics port also serves every metric over HTTP in the Prometheus text format, from a
+//				small process of its own listening on 127.0.0.1 only, so scrapes never touch a worker and
+//				the metrics are not exposed beyond the host.
+//
+//				Admission control (see otpAdmit.c) bounds the load a daemon takes on. --max-conns caps
+//				the connections served at once and --max-bytes the request bytes held in memory, across
+//				every worker; clients over either limit are answered busy, with the --retry-after time,
+//				instead of queueing without bound, or in fork mode forking without bound. --backlog sets
+//				how many connections may wait in each listening socket's accept queue.
+//
+//				--cipher-threads n splits the cipher work of a large message across n threads (see
+//				otpSplit.c), so one big request is not held to one core. Text requests are split as their
+//				key arrives; unchecked binary requests, key references included, of SPLIT_MIN bytes or more
+//				are gathered SPLIT_BATCH bytes at a time so each batch can be split (see otpParse.c).
+//				Checked binary requests are still ciphered a chunk at a time and are not split. It applies
+//				to the worker pool and fork modes only, where a connection has its process to itself;
+//				--event-loop and --io-uring ignore it, since their threads already share a core among many
+//				connections. Blocking connections then read into a buffer of SPLIT_BUFFER bytes, so the
+//				parser gets blocks large enough to split.
+//
+//				The daemon listens on a TCP port or, given unix:/path or @name instead, on a Unix domain
+//				socket (see otpEndpoint.c), which every worker or thread shares. A Unix socket serves only
+//				clients running as the daemon's own user or a user named with --allow-uid, checked with
+//				SO_PEERCRED on every connection. --psk file wraps every connection, on either kind of
+//				endpoint, in the authenticated encryption of otpSeal.c; clients must use the same file.
+//
+//				--keys dir serves key reference requests from the key files in dir (see otpKeys.c), so
+//				clients that share the daemon's keys send only a key id and offset instead of the key.
+//				--ledger dir also records every range of a key that encrypts something in a ledger file
+//				in dir (see otpLedger.c), refuses to encrypt with any of it again, and hands out the next
+//				unused offset to clients that ask for it. Every worker, thread and restart shares the
+//				same files.
+//
+//				A daemon with --keys gives a pad away to anyone who can send it a request: encrypting a
+//				message of all 'A's returns the key itself. So --keys is only served beyond this host with
+//				--psk. Without it, a TCP daemon with --keys listens on 127.0.0.1 only, and a unix:/path or
+//				@name one serves only its own user and the --allow-uid users, as always.
+//
+//				Syntax: daemon listening_port|unix:/path|@name [-w workers] [--fork] [--event-loop[=threads]] [--io-uring[=threads]]
+//						[--linger seconds] [--idle-timeout seconds] [--keys dir] [--ledger dir] [--metrics port] [--max-conns n] [--max-bytes n] [--retry-after ms]
+//						[--backlog n] [--cipher-threads n] [--allow-uid uid] [--psk file]
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+
+#include "otpParse.c"
+#include "otpChildren.c"
+#include "otpEndpoint.c"
+#include "otpSeal.c"
+
+/**********************************************************
+// SERVER GLOBALS
+// ********************************************************/
+
+#define LISTEN_BACKLOG	64		// default number of connections that may queue on each listening socket
+#define REFUSE_TIMEOUT	100		// ms a refused client gets to send its request's start and read its busy reply
+#define IDLE_TIMEOUT	30		// default seconds a blocking read or write, or an event loop connection, may wait
+#define MIN_WORKERS		5		// the assignment requires at least five concurrent connections
+#define MAX_WORKERS		256		// upper bound on the size of the worker pool
+#define METRICS_TIMEOUT	2		// seconds a metrics scraper has to send its request
+#define SPLIT_BUFFER	(4 * 1024 * 1024)	// receive buffer of a blocking connection with --cipher-threads
+#define MAX_ALLOW_UIDS	16		// users --allow-uid can name
+
+// serverConfig
+// ......................
+struct serverConfig
+{
+	int port;					// port to listen on, 0 for a unix: endpoint
+	struct otpEndpoint endpoint;	// where to listen
+	int workers;				// number of pre-forked workers in the pool
+	int forkPerConnection;		// 1 = fork a child for every connection instead of using the pool
+	int eventThreads;			// > 0 = run that many epoll threads instead of the pool
+	int uringThreads;			// > 0 = run that many io_uring threads instead of the pool
+	int ops;					// OP_ flags this daemon serves
+	int linger;					// SO_LINGER seconds for connections, or -1 to leave it off
+	int idleTimeout;			// seconds a blocking or event loop connection may wait on its client, or 0 for ever
+	char* keyDir;				// the key directory for key references, or NULL
+	char* ledgerDir;			// the key ledger directory, or NULL
+	int metricsPort;			// loopback port for the metrics endpoint, or 0 for none
+	long long maxConnections;	// connections served at once, or 0 for no limit
+	long long maxBytes;			// request bytes held at once, or 0 for no limit
+	int retryAfterMs;			// retry-after sent to refused clients
+	int backlog;				// accept queue length per listener, or 0 for the mode's default
+	int cipherThreads;			// threads ciphering each large message, 1 for no splitting
+	uid_t allowUids[MAX_ALLOW_UIDS];	// users besides the daemon's own a unix: endpoint serves
+	int allowCount;				// how many
+	char* pskFile;				// the pre-shared key for sealed connections, or NULL
+	int loopback;				// 1 to listen on 127.0.0.1 only, for --keys without --psk
+};
+
+int serverOps;					// OP_ flags this daemon serves, set by runServer
+int serverLinger = -1;			// SO_LINGER seconds for connections, set by runServer
+struct otpStats* serverStats;	// request counters shared by every worker, set by runServer
+struct otpKeyCache* serverKeys;	// this process's key cache, or NULL without --keys, set by runServer
+struct otpAdmission* serverAdmit;	// admission limits shared by every worker, set by runServer
+int serverMetricsFD = -1;		// the metrics listener, or -1 without --metrics, set by runServer
+pid_t serverMetricsPid = -1;	// the metrics process, set by spawnMetrics
+struct serverConfig* serverConfig;	// the configuration, set by runServer
+unsigned char* serverPsk;		// the pre-shared key, or NULL without --psk, set by runServer
+size_t serverPskLen;			// its length
+
+/**********************************************************
+// SERVER FUNCTIONS
+// ********************************************************/
+
+// serverUsage
+//
+// description: prints the daemon syntax to stderr and exits
+//
+// @param		prog - the name the daemon was run as
+//..........................................................
+void serverUsage(const char* prog)
+{
+	fprintf(stderr,"%sUSAGE: %s%s port|unix:/path|@name [-w workers] [--fork] [--event-loop[=threads]] [--io-uring[=threads]]%s\n", RED, CYN, prog, NRM);
+	fprintf(stderr,"%s       %s%*s [--linger seconds] [--idle-timeout seconds] [--keys dir] [--ledger dir] [--metrics port]%s\n", RED, CYN, (int)strlen(prog) + 5, "", NRM);
+	fprintf(stderr,"%s       %s%*s [--max-conns n] [--max-bytes n] [--retry-after ms] [--backlog n] [--cipher-threads n]%s\n", RED, CYN, (int)strlen(prog) + 5, "", NRM);
+	fprintf(stderr,"%s       %s%*s [--allow-uid uid] [--psk file]%s\n", RED, CYN, (int)strlen(prog) + 5, "", NRM);
+	exit(1);
+}
+
+// parseServerArgs
+//
+// description: reads the port and the server options from
+//				the command line into config. The worker
+//				count defaults to the number of online cores,
+//				but never less than MIN_WORKERS.
+//
+// @param		argc - the number of arguments passed
+// @param		argv - the arguments passed
+// @param		config - the configuration to fill in
+//..........................................................
+void parseServerArgs(int argc, char* argv[], struct serverConfig* config)
+{
+	static struct option longOptions[] =
+	{
+		{ "workers",	required_argument,	0, 'w' },
+		{ "fork",		no_argument,		0, 'f' },
+		{ "event-loop",	optional_argument,	0, 'e' },
+		{ "io-uring",	optional_argument,	0, 'U' },
+		{ "linger",		required_argument,	0, 'l' },
+		{ "idle-timeout",	required_argument,	0, 'i' },
+		{ "keys",		required_argument,	0, 'k' },
+		{ "ledger",		required_argument,	0, 'L' },
+		{ "metrics",	required_argument,	0, 'm' },
+		{ "max-conns",	required_argument,	0, 'C' },
+		{ "max-bytes",	required_argument,	0, 'B' },
+		{ "retry-after",	required_argument,	0, 'R' },
+		{ "backlog",	required_argument,	0, 'b' },
+		{ "cipher-threads",	required_argument,	0, 't' },
+		{ "allow-uid",	required_argument,	0, 'u' },
+		{ "psk",		required_argument,	0, 'P' },
+		{ 0, 0, 0, 0 }
+	};
+	int opt;
+	long cores;
+
+	// defaults
+	// ......................
+	cores = sysconf(_SC_NPROCESSORS_ONLN);							// one worker per core
+	config->workers = (cores > MIN_WORKERS) ? (int)cores : MIN_WORKERS;
+	config->forkPerConnection = 0;
+	config->eventThreads = 0;
+	config->uringThreads = 0;
+	config->linger = -1;
+	config->idleTimeout = IDLE_TIMEOUT;
+	config->keyDir = NULL;
+	config->ledgerDir = NULL;
+	config->metricsPort = 0;
+	config->maxConnections = 0;
+	config->maxBytes = 0;
+	config->retryAfterMs = ADMIT_RETRY_MS;
+	config->backlog = 0;
+	config->cipherThreads = 1;
+	config->allowCount = 0;
+	config->pskFile = NULL;
+	config->loopback = 0;
+
+	while ((opt = getopt_long(argc, argv, "w:fl:i:k:L:m:C:B:R:b:t:u:P:", longOptions, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 'w':
+				config->workers = atoi(optarg);
+				if (config->workers < 1 || config->workers > MAX_WORKERS)
+				{
+					fprintf(stderr,"%sSERVER: ERROR, workers must be between 1 and %d%s\n", RED, MAX_WORKERS, NRM);
+					exit(1);
+				}
+				break;
+			case 'f':
+				config->forkPerConnection = 1;
+				break;
+			case 'e':
+				config->eventThreads = optarg ? atoi(optarg) : (cores > 0 ? (int)cores : 1);
+				if (config->eventThreads < 1 || config->eventThreads > MAX_WORKERS)
+				{
+					fprintf(stderr,"%sSERVER: ERROR, event loop threads must be between 1 and %d%s\n", RED, MAX_WORKERS, NRM);
+					exit(1);
+				}
+				break;
+			case 'U':
+				config->uringThreads = optarg ? atoi(optarg) : (cores > 0 ? (int)cores : 1);
+				if (config->uringThreads < 1 || config->uringThreads > MAX_WORKERS)
+				{
+					fprintf(stderr,"%sSERVER: ERROR, io_uring threads must be between 1 and %d%s\n", RED, MAX_WORKERS, NRM);
+					exit(1);
+				}
+				break;
+			case 'l':
+				config->linger = atoi(optarg);
+				if (config->linger < 0)
+				{
+					fprintf(stderr,"%sSERVER: ERROR, linger must be 0 or more seconds%s\n", RED, NRM);
+					exit(1);
+				}
+				break;
+			case 'i':
+				config->idleTimeout = atoi(optarg);
+				if (config->idleTimeout < 0)
+				{
+					fprintf(stderr,"%sSERVER: ERROR, idle timeout must be 0 or more seconds%s\n", RED, NRM);
+					exit(1);
+				}
+				break;
+			case 'k':
+				config->keyDir = optarg;
+				break;
+			case 'L':
+				config->ledgerDir = optarg;
+				break;
+			case 'm':
+				config->metricsPort = atoi(optarg);
+				if (config->metricsPort < 1 || config->metricsPort > 65535)
+				{
+					fprintf(stderr,"%sSERVER: ERROR, the metrics port must be between 1 and 65535%s\n", RED, NRM);
+					exit(1);
+				}
+				break;
+			case 'C':
+				config->maxConnections = atoll(optarg);
+				if (config->maxConnections < 1)
+				{
+					fprintf(stderr,"%sSERVER: ERROR, max-conns must be at least 1%s\n", RED, NRM);
+					exit(1);
+				}
+				break;
+			case 'B':
+				config->maxBytes = atoll(optarg);
+				if (config->maxBytes < OTP_CHUNK)
+				{
+					fprintf(stderr,"%sSERVER: ERROR, max-bytes must be at least %d%s\n", RED, OTP_CHUNK, NRM);
+					exit(1);
+				}
+				break;
+			case 'R':
+				config->retryAfterMs = atoi(optarg);
+				if (config->retryAfterMs < 0)
+				{
+					fprintf(stderr,"%sSERVER: ERROR, retry-after must be 0 or more milliseconds%s\n", RED, NRM);
+					exit(1);
+				}
+				break;
+			case 'b':
+				config->backlog = atoi(optarg);
+				if (config->backlog < 1)
+				{
+					fprintf(stderr,"%sSERVER: ERROR, backlog must be at least 1%s\n", RED, NRM);
+					exit(1);
+				}
+				break;
+			case 't':
+				config->cipherThreads = atoi(optarg);
+				if (config->cipherThreads < 1 || config->cipherThreads > SPLIT_MAX_THREADS)
+				{
+					fprintf(stderr,"%sSERVER: ERROR, cipher threads must be between 1 and %d%s\n", RED, SPLIT_MAX_THREADS, NRM);
+					exit(1);
+				}
+				break;
+			case 'u':
+				if (config->allowCount == MAX_ALLOW_UIDS || atoi(optarg) < 0)
+				{
+					fprintf(stderr,"%sSERVER: ERROR, allow-uid takes up to %d uids%s\n", RED, MAX_ALLOW_UIDS, NRM);
+					exit(1);
+				}
+				config->allowUids[config->allowCount++] = (uid_t)atoi(optarg);
+				break;
+			case 'P':
+				config->pskFile = optarg;
+				break;
+			default:
+				serverUsage(argv[0]);
+		}
+	}
+
+	// the port, unix:/path or @name is the one remaining positional argument
+	// ......................
+	if (optind >= argc || endpointParse(argv[optind], &config->endpoint) < 0)
+	{
+		serverUsage(argv[0]);
+	}
+	config->port = config->endpoint.port;
+	if (config->uringThreads > 0 && config->pskFile != NULL)
+	{
+		fprintf(stderr,"%sSERVER: ERROR, --io-uring cannot be used with --psk%s\n", RED, NRM);
+		exit(1);
+	}
+	if (config->ledgerDir != NULL && config->keyDir == NULL)
+	{
+		fprintf(stderr,"%sSERVER: ERROR, --ledger needs --keys%s\n", RED, NRM);
+		exit(1);
+	}
+	if (config->keyDir != NULL && config->pskFile == NULL && config->endpoint.family != AF_UNIX)
+	{
+		config->loopback = 1;									// the keys would be readable by any host that can connect
+		fprintf(stderr,"%sSERVER: --keys without --psk listens on 127.0.0.1 only%s\n", CYN, NRM);
+	}
+	if (config->cipherThreads > 1 && (config->eventThreads > 0 || config->uringThreads > 0))
+	{
+		fprintf(stderr,"%sSERVER: --cipher-threads is ignored with --event-loop and --io-uring%s\n", CYN, NRM);
+	}
+}
+
+// openListenSocketOn
+//
+// description: creates a socket bound to port on one
+//				address and flips it on for listening. Any
+//				failure here is a start up error, so the
+//				daemon exits.
+//
+// @param		address - the address to bind, in network
+//				byte order
+// @param		port - the port to listen on
+// @param		reusePort - 1 to set SO_REUSEPORT so several
+//				sockets can share the port
+// @param		backlog - how many connections may queue
+// @return		listenSocketFD - the listening socket
+//..........................................................
+int openListenSocketOn(in_addr_t address, int port, int reusePort, int backlog)
+{
+	int listenSocketFD;
+	int on = 1;
+	struct sockaddr_in serverAddress;
+
+	// set up address struct
+	// ......................
+	memset((char *)&serverAddress, '\0', sizeof(serverAddress)); 	// Clear out the address struct
+	serverAddress.sin_family = AF_INET; 							// Create a network-capable socket
+	serverAddress.sin_port = htons(port); 							// Store the port number
+	serverAddress.sin_addr.s_addr = address; 						// The address clients may reach this process on
+
+	// set up the socket
+	// ......................
+	listenSocketFD = socket(AF_INET, SOCK_STREAM, 0); 				// Create the socket
+	if (listenSocketFD < 0)											// ensure socket is working
+	{
+		error("ERROR opening socket");
+	}
+	setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));	// don't trip over TIME_WAIT from a previous run
+	if (reusePort && setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+	{
+		error("ERROR setting SO_REUSEPORT");
+	}
+
+	// enable the socket to begin listening
+	// ......................
+	if (bind(listenSocketFD, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0) // Connect socket to port
+	{
+		error("ERROR on binding");															// send error message if unsuccessful
+	}
+	if (listen(listenSocketFD, backlog) < 0) 										// Flip the socket on
+	{
+		error("ERROR on listen");
+	}
+
+	return listenSocketFD;
+}
+
+// openUnixListener
+//
+// description: creates the listening Unix domain socket. A
+//				socket file left by a daemon that is gone is
+//				replaced; one a live daemon answers on is an
+//				error. The file is left open to every user, as
+//				SO_PEERCRED decides who is served. An @name
+//				socket has no file, and bind() itself refuses
+//				a name that is still in use.
+//
+// @param		endpoint - the unix: or @name endpoint
+// @param		backlog - how many connections may queue
+// @return		the listening socket
+//..........................................................
+int openUnixListener(struct otpEndpoint* endpoint, int backlog)
+{
+	struct sockaddr_un* address = (struct sockaddr_un*)&endpoint->address;
+	struct stat st;
+	int listenSocketFD;
+	int probeFD;
+
+	if (!endpoint->abstract && lstat(address->sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+	{
+		probeFD = endpointConnect(endpoint);
+		if (probeFD >= 0)
+		{
+			fprintf(stderr, "%sSERVER: ERROR, a daemon is already listening on %s%s\n", RED, endpoint->name, NRM);
+			exit(1);
+		}
+		unlink(address->sun_path);
+	}
+
+	listenSocketFD = endpointSocket(endpoint);
+	if (listenSocketFD < 0)
+	{
+		error("ERROR opening socket");
+	}
+	if (bind(listenSocketFD, (struct sockaddr*)address, endpoint->addressLen) < 0)
+	{
+		if (errno == EADDRINUSE && endpoint->abstract)
+		{
+			fprintf(stderr, "%sSERVER: ERROR, a daemon is already listening on %s%s\n", RED, endpoint->name, NRM);
+			exit(1);
+		}
+		error("ERROR on binding");
+	}
+	if (!endpoint->abstract)
+	{
+		chmod(address->sun_path, 0666);
+	}
+	if (listen(listenSocketFD, backlog) < 0)
+	{
+		error("ERROR on listen");
+	}
+	return listenSocketFD;
+}
+
+// openServerListener
+//
+// description: a listening socket for the worker pool, the
+//				fork loop or one event loop or io_uring thread.
+//				Each of those threads opens its own TCP socket
+//				with reusePort set, and the kernel spreads
+//				connections over them with SO_REUSEPORT; the
+//				pool and the fork loop open one, which all
+//				their processes share. TCP sockets listen on
+//				loopback only when config->loopback is set. A
+//				unix: or @name endpoint has one socket, which
+//				every caller shares.
+//
+// @param		config - the server configuration
+// @param		reusePort - 1 to set SO_REUSEPORT on TCP sockets
+// @param		backlog - how many connections may queue
+// @return		the listening socket
+//..........................................................
+int openServerListener(struct serverConfig* config, int reusePort, int backlog)
+{
+	static int unixListener = -1;
+
+	if (config->endpoint.family != AF_UNIX)
+	{
+		return openListenSocketOn(config->loopback ? htonl(INADDR_LOOPBACK) : INADDR_ANY, config->port, reusePort, backlog);
+	}
+	if (unixListener < 0)
+	{
+		unixListener = openUnixListener(&config->endpoint, backlog);
+	}
+	return unixListener;
+}
+
+// allowPeer
+//
+// description: decides whether to serve a newly accepted
+//				connection. TCP clients always are; a unix: or
+//				@name client only if SO_PEERCRED shows it runs
+//				as the daemon's user or an --allow-uid one.
+//
+// @param		socketFD - the accepted socket
+// @return		1 to serve it, 0 to close it unanswered
+//..........................................................
+int allowPeer(int socketFD)
+{
+	struct ucred peer;
+	socklen_t peerLen = sizeof(peer);
+	int i;
+
+	if (serverConfig->endpoint.family != AF_UNIX)
+	{
+		return 1;
+	}
+	if (getsockopt(socketFD, SOL_SOCKET, SO_PEERCRED, &peer, &peerLen) < 0)
+	{
+		fprintf(stderr, "%sSERVER: ERROR reading the peer's credentials: %s%s\n", RED, strerror(errno), NRM);
+		return 0;
+	}
+	if (peer.uid == geteuid())
+	{
+		return 1;
+	}
+	for (i = 0; i < serverConfig->allowCount; i++)
+	{
+		if (peer.uid == serverConfig->allowUids[i])
+		{
+			return 1;
+		}
+	}
+	fprintf(stderr, "%sSERVER: ERROR, uid %d (pid %d) is not allowed on %s%s\n", RED, (int)peer.uid, (int)peer.pid, serverConfig->endpoint.name, NRM);
+	return 0;
+}
+
+// sendReply
+//
+// description: sends the part of the reply the parser has
+//				ready
+//
+// @param		socketFD - the connected socket
+// @param		seal - the connection's seal, or NULL
+// @param		parser - the connection's parser
+// @param		blocking - 1 to send all of it, 0 to send only
+//				what the socket takes without blocking
+// @return		0 on success, -1 on a socket error
+//..........................................................
+int sendReply(int socketFD, struct otpSeal* seal, struct otpParser* parser, int blocking)
+{
+	const char* data;
+	size_t n;
+	ssize_t charsWritten;
+
+	while ((n = parserReply(parser, &data)) > 0)
+	{
+		charsWritten = sealSend(seal, socketFD, data, n, MSG_NOSIGNAL | (blocking ? 0 : MSG_DONTWAIT));
+		if (charsWritten < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (!blocking && (errno == EAGAIN || errno == EWOULDBLOCK))
+			{
+				return 0;
+			}
+			return -1;
+		}
+		parserReplySent(parser, charsWritten);
+	}
+	if (sealFlush(seal, socketFD, blocking ? 0 : MSG_DONTWAIT) < 0 &&		// the last sealed record, too
+		(blocking || (errno != EAGAIN && errno != EWOULDBLOCK)))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+// configureConnection
+//
+// description: applies the connection options to a newly
+//				accepted socket. Nagle is turned off on TCP:
+//				a binary reply goes out as a header and then
+//				its body, and on a persistent connection Nagle
+//				would hold the body back until the client's
+//				delayed ACK for the header, about 40ms per
+//				request.
+//
+// @param		socketFD - the accepted socket
+//..........................................................
+void configureConnection(int socketFD)
+{
+	struct linger linger;
+	int on = 1;
+
+	if (serverConfig->endpoint.family == AF_INET)
+	{
+		setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+
+	if (serverLinger >= 0)
+	{
+		linger.l_onoff = 1;
+		linger.l_linger = serverLinger;
+		setsockopt(socketFD, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	}
+}
+
+// limitIdle
+//
+// description: gives a blocking connection --idle-timeout
+//				for each read and write, so a client that stops
+//				sending or reading cannot hold its worker or
+//				child for ever
+//
+// @param		socketFD - the accepted socket
+//..........................................................
+void limitIdle(int socketFD)
+{
+	struct timeval timeout = { serverConfig->idleTimeout, 0 };
+
+	if (serverConfig->idleTimeout > 0)
+	{
+		setsockopt(socketFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(socketFD, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	}
+}
+
+// finishConnection
+//
+// description: ends a blocking transaction once the reply
+//				is queued: shuts down the write side, so the
+//				client reads the reply and then EOF, and
+//				discards any input already waiting, which
+//				would otherwise turn the close into a reset
+//				that destroys the reply. The caller closes;
+//				the kernel finishes sending in the background
+//				unless --linger asked close() to wait.
+//
+// @param		socketFD - the connected socket
+//..........................................................
+void finishConnection(int socketFD)
+{
+	char buffer[BUFFERSIZE];
+	ssize_t charsRead;
+
+	shutdown(socketFD, SHUT_WR);
+	do
+	{
+		charsRead = recv(socketFD, buffer, sizeof(buffer), MSG_DONTWAIT);	// discard anything after the request
+	}
+	while (charsRead > 0 || (charsRead < 0 && errno == EINTR));
+}
+
+// serveConnection
+//
+// description: handles one whole connection on a blocking
+//				socket: one text transaction, or binary
+//				requests until the client hangs up. Feeds
+//				what the client sends to a parser and streams
+//				back the reply as it becomes ready. While a
+//				request is still
+//				arriving, sends only block when the parser
+//				cannot go on without them (a full binary
+//				chunk), so text framing clients that only read
+//				once they have sent everything cannot deadlock
+//				us. Errors are reported to stderr and end only
+//				this transaction, so the daemon keeps running.
+//				With --psk, all of it goes through a seal.
+//
+// @param		establishedConnectionFD - the accepted socket
+// @param		overloaded - 1 if the connection is over the
+//				admission limit, and only gets told to retry
+//..........................................................
+void serveConnection(int establishedConnectionFD, int overloaded)
+{
+	static char* splitBuffer = NULL;		// this process's receive buffer for splitting, kept for its next connection
+	struct otpParser parser;
+	char chunkBuffer[OTP_CHUNK];
+	char* buffer = chunkBuffer;
+	size_t bufferSize = sizeof(chunkBuffer);
+	int charsRead;
+	size_t want;
+	int state = PARSE_HANDSHAKE;
+	struct otpSeal* seal = NULL;
+
+	if (serverPsk != NULL && (seal = sealOpen(establishedConnectionFD, serverPsk, serverPskLen, 1)) == NULL)
+	{
+		fprintf(stderr, "%sSERVER: ERROR starting the sealed transport%s\n", RED, NRM);
+		return;
+	}
+	if (cipherSplit != NULL && !overloaded)
+	{
+		if (splitBuffer == NULL)
+		{
+			splitBuffer = malloc(SPLIT_BUFFER);
+		}
+		if (splitBuffer != NULL)
+		{
+			buffer = splitBuffer;
+			bufferSize = SPLIT_BUFFER;
+		}
+	}
+	parserInit(&parser, serverOps, serverStats, serverKeys, serverAdmit);
+	parser.overloaded = overloaded;
+
+	while (!parserFinished(&parser) && state != PARSE_ERROR)
+	{
+		// Send whatever part of the reply is ready
+		// ......................
+		want = parserWant(&parser);
+		if (sendReply(establishedConnectionFD, seal, &parser, want == 0) < 0)
+		{
+			fprintf(stderr, "%sSERVER: ERROR writing to socket%s\n", RED, NRM);
+			sealClose(seal);
+			parserFree(&parser);
+			return;
+		}
+		if (want == 0)
+		{
+			continue;
+		}
+
+		// Get the next piece of the request from the client
+		// ......................
+		if (want > bufferSize)
+		{
+			want = bufferSize;
+		}
+		charsRead = sealRecv(seal, establishedConnectionFD, buffer, want, 0); 	// Read the client's message from the socket
+		if (charsRead < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			fprintf(stderr, "%sSERVER: ERROR reading from socket%s%s\n", RED, errno == EBADMSG ? ", a record failed to authenticate" :
+				errno == EAGAIN || errno == EWOULDBLOCK ? ", the client went idle" : "", NRM);
+			sealClose(seal);
+			parserFree(&parser);
+			return;
+		}
+		if (charsRead == 0)													// the client hung up
+		{
+			if (!parserIdle(&parser) &&												// hanging up between requests is a clean end
+				(parser.state != PARSE_SKIP || parser.skipState != PARSE_REJECTED))	// a refused client may stop sending
+			{
+				fprintf(stderr, "%sSERVER: ERROR, client disconnected mid-transmission%s\n", RED, NRM);
+			}
+			sealClose(seal);
+			parserFree(&parser);
+			return;
+		}
+		state = parserFeed(&parser, buffer, charsRead);
+	}
+
+	if (state == PARSE_ERROR)
+	{
+		fprintf(stderr, "%sSERVER: ERROR, malformed request%s\n", RED, NRM);
+		statsMalformed(serverStats);
+	}
+	else
+	{
+		sealFlush(seal, establishedConnectionFD, 0);
+		finishConnection(establishedConnectionFD);
+		if (state == PARSE_REJECTED && !parser.busy)
+		{
+			fprintf(stderr, "%sSERVER: ERROR, client handshake unsuccessful%s\n", RED, NRM);
+		}
+	}
+	sealClose(seal);
+	parserFree(&parser);
+}
+
+// workerLoop
+//
+// description: the body of a pool worker. Accepts
+//				connections on the one listening socket the
+//				pool shares, opened by runWorkerPool without
+//				SO_REUSEPORT, so a connection goes to
+//				whichever worker is free, and serves them one
+//				at a time, forever.
+//
+// @param		listenSocketFD - the pool's listening socket
+// @param		index - this worker's place in the pool,
+//				which picks its stats slot
+//..........................................................
+void workerLoop(int listenSocketFD, int index)
+{
+	int establishedConnectionFD;
+	socklen_t sizeOfClientInfo;
+	struct sockaddr_in clientAddress;
+	int admitted;
+
+	signal(SIGPIPE, SIG_IGN);				// a client that hangs up early must not kill the worker
+	statsBind(serverStats, index);
+
+	while (1)
+	{
+		sizeOfClientInfo = sizeof(clientAddress);
+		establishedConnectionFD = accept(listenSocketFD, (struct sockaddr *)&clientAddress, &sizeOfClientInfo);
+		if (establishedConnectionFD < 0)
+		{
+			if (errno != EINTR && errno != ECONNABORTED)
+			{
+				fprintf(stderr, "%sSERVER: ERROR on accept: %s%s\n", RED, strerror(errno), NRM);
+			}
+			continue;
+		}
+
+		if (!allowPeer(establishedConnectionFD))
+		{
+			close(establishedConnectionFD);
+			continue;
+		}
+		configureConnection(establishedConnectionFD);
+		limitIdle(establishedConnectionFD);
+		statsConnection(serverStats);
+		admitted = admitConnection(serverAdmit);
+		serveConnection(establishedConnectionFD, !admitted);		// handle the whole transaction
+		close(establishedConnectionFD); 	// Close the existing socket connecting the client to the worker
+		if (admitted)
+		{
+			admitLeave(serverAdmit);
+		}
+	}
+}
+
+// spawnWorker
+//
+// description: forks a pool worker that serves the given
+//				listening socket
+//
+// @param		listenSocketFD - the pool's listening socket
+// @param		index - the worker's place in the pool
+// @return		spawnPid - the pid of the new worker, or -1
+//..........................................................
+pid_t spawnWorker(int listenSocketFD, int index)
+{
+	pid_t spawnPid = fork();
+
+	if (spawnPid < 0)
+	{
+		fprintf(stderr, "%sSERVER: ERROR forking worker: %s%s\n", RED, strerror(errno), NRM);
+	}
+	else if (spawnPid == 0)
+	{
+		prctl(PR_SET_PDEATHSIG, SIGTERM);		// workers go away with the daemon
+		signal(SIGUSR1, SIG_IGN);				// only the parent prints the stats
+		childUnblock();
+		workerLoop(listenSocketFD, index);
+		exit(0);
+	}
+	childTrack(&serverChildren, spawnPid, CHILD_WORKER, index);
+	return spawnPid;
+}
+
+// serveMetrics
+//
+// description: answers one HTTP request on the metrics
+//				endpoint. GET /metrics (or /) gets every metric
+//				in the Prometheus text exposition format;
+//				anything else gets a 404.
+//
+// @param		socketFD - the scraper's connection
+//..........................................................
+void serveMetrics(int socketFD)
+{
+	char request[BUFFERSIZE];
+	size_t received = 0;
+	ssize_t charsRead;
+	struct timeval timeout = { METRICS_TIMEOUT, 0 };
+	char* body = NULL;
+	size_t bodyLen = 0;
+	FILE* out;
+	int found;
+
+	// read the request line and headers; a slow or silent scraper is dropped
+	// ......................
+	setsockopt(socketFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	while (received < sizeof(request) - 1)
+	{
+		charsRead = recv(socketFD, request + received, sizeof(request) - 1 - received, 0);
+		if (charsRead < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (charsRead <= 0)
+		{
+			return;
+		}
+		received += charsRead;
+		request[received] = '\0';
+		if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+		{
+			break;
+		}
+	}
+	request[received] = '\0';
+	found = strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0;
+
+	// build the body, then send it with its headers
+	// ......................
+	out = open_memstream(&body, &bodyLen);
+	if (out == NULL)
+	{
+		return;
+	}
+	if (found)
+	{
+		statsExpose(serverStats, out);
+		admitExpose(serverAdmit, out);
+	}
+	else
+	{
+		fprintf(out, "not found\n");
+	}
+	fclose(out);
+	dprintf(socketFD, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+		found ? "200 OK" : "404 Not Found", bodyLen);
+	send(socketFD, body, bodyLen, MSG_NOSIGNAL);
+	free(body);
+	shutdown(socketFD, SHUT_WR);
+}
+
+// spawnMetrics
+//
+// description: forks the process that serves the metrics
+//				endpoint, one scrape at a time. It only reads
+//				the shared counters, so it never slows a
+//				worker down.
+//..........................................................
+void spawnMetrics()
+{
+	int socketFD;
+
+	serverMetricsPid = fork();
+	if (serverMetricsPid < 0)
+	{
+		fprintf(stderr, "%sSERVER: ERROR forking the metrics process: %s%s\n", RED, strerror(errno), NRM);
+	}
+	else if (serverMetricsPid == 0)
+	{
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		signal(SIGUSR1, SIG_IGN);
+		signal(SIGPIPE, SIG_IGN);
+		childUnblock();
+		while (1)
+		{
+			socketFD = accept(serverMetricsFD, NULL, NULL);
+			if (socketFD < 0)
+			{
+				continue;
+			}
+			serveMetrics(socketFD);
+			close(socketFD);
+		}
+	}
+	childTrack(&serverChildren, serverMetricsPid, CHILD_METRICS, 0);
+}
+
+// childExited
+//
+// description: accounts for one reaped child: records its
+//				exit status and lifetime, and restarts the
+//				metrics process if it was the one
+//
+// @param		deadPid - the reaped child
+// @param		childExitMethod - its status from waitpid()
+// @return		the child's CHILD_ kind
+//..........................................................
+int childExited(pid_t deadPid, int childExitMethod)
+{
+	struct otpChild child;
+
+	childReaped(serverStats, deadPid, childExitMethod, &child);
+	if (deadPid == serverMetricsPid)
+	{
+		fprintf(stderr, "%sSERVER: metrics process %d died, restarting it%s\n", RED, (int)deadPid, NRM);
+		spawnMetrics();
+		return CHILD_METRICS;
+	}
+	return child.kind;
+}
+
+// runWorkerPool
+//
+// description: opens the pool's listener, forks the
+//				workers, and then waits on them, restarting any
+//				worker that dies. Every worker accepts on the
+//				one listener, so a connection is taken by
+//				whichever worker is free rather than queued
+//				behind a busy one, and none is stranded when a
+//				worker dies. A worker that cannot be forked is
+//				tried again every second until it is.
+//
+// @param		config - the server configuration
+//..........................................................
+void runWorkerPool(struct serverConfig* config)
+{
+	int listenSocketFD;
+	pid_t workers[MAX_WORKERS];
+	pid_t deadPid;
+	int childExitMethod;
+	int missing;
+	int i;
+
+	// bind the listener before forking, so port errors are reported at start up
+	listenSocketFD = openServerListener(config, 0, config->backlog ? config->backlog : LISTEN_BACKLOG);
+	for (i = 0; i < config->workers; i++)
+	{
+		workers[i] = -1;
+	}
+
+	// start missing workers, and restart workers as they die
+	while (1)
+	{
+		missing = 0;
+		for (i = 0; i < config->workers; i++)
+		{
+			if (workers[i] < 0)
+			{
+				workers[i] = spawnWorker(listenSocketFD, i);
+				missing += workers[i] < 0;
+			}
+		}
+
+		deadPid = waitpid(-1, &childExitMethod, missing ? WNOHANG : 0);
+		if (deadPid == 0 || (deadPid < 0 && errno == ECHILD))
+		{
+			sleep(1);										// back off before the next attempt
+			continue;
+		}
+		if (deadPid < 0)
+		{
+			if (errno == EINTR)
+			{
+				statsPoll(serverStats);
+				continue;
+			}
+			error("SERVER: waitpid error");
+		}
+
+		if (childExited(deadPid, childExitMethod) == CHILD_METRICS)
+		{
+			continue;
+		}
+		for (i = 0; i < config->workers; i++)
+		{
+			if (workers[i] == deadPid)
+			{
+				fprintf(stderr, "%sSERVER: worker %d died, restarting it%s\n", RED, (int)deadPid, NRM);
+				workers[i] = -1;							// forked again at the top of the loop
+				break;
+			}
+		}
+	}
+}
+
+// refuseConnection
+//
+// description: tells a client over the connection limit to
+//				retry, without forking. Only the code word or
+//				binary header is read, within REFUSE_TIMEOUT in
+//				all, then the busy reply is sent and the
+//				connection closed with the body unread, so a
+//				refused client that goes on uploading cannot
+//				hold up the accept loop. The client finds the
+//				busy reply when its sending fails.
+//
+// @param		establishedConnectionFD - the accepted socket
+//..........................................................
+void refuseConnection(int establishedConnectionFD)
+{
+	struct timeval timeout = { 0, REFUSE_TIMEOUT * 1000 };
+	unsigned long long deadline = statsNow() + REFUSE_TIMEOUT * 1000000ULL;
+	unsigned long long now;
+	struct otpParser parser;
+	struct otpSeal* seal = NULL;
+	char buffer[OTP_HEADER_SIZE];
+	ssize_t charsRead;
+
+	setsockopt(establishedConnectionFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(establishedConnectionFD, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	if (serverPsk != NULL && (seal = sealOpen(establishedConnectionFD, serverPsk, serverPskLen, 1)) == NULL)
+	{
+		return;
+	}
+	parserInit(&parser, serverOps, serverStats, serverKeys, serverAdmit);
+	parser.overloaded = 1;
+
+	// read the code word, or the header, and no further
+	while ((parser.state == PARSE_HANDSHAKE || parser.state == PARSE_HEADER) && (now = statsNow()) < deadline)
+	{
+		timeout.tv_usec = (deadline - now) / 1000 + 1;
+		setsockopt(establishedConnectionFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		charsRead = sealRecv(seal, establishedConnectionFD, buffer, parserWant(&parser), 0);
+		if (charsRead < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (charsRead <= 0)
+		{
+			break;
+		}
+		parserFeed(&parser, buffer, charsRead);
+	}
+
+	if (parserRefuseEarly(&parser) && sendReply(establishedConnectionFD, seal, &parser, 1) == 0)
+	{
+		parserSettle(&parser);
+		finishConnection(establishedConnectionFD);
+	}
+	sealClose(seal);
+	parserFree(&parser);
+}
+
+// reapChildren
+//
+// description: collects every child that has exited,
+//				giving back each connection child's admission
+//..........................................................
+void reapChildren()
+{
+	pid_t deadPid;
+	int childExitMethod;
+
+	while ((deadPid = waitpid(-1, &childExitMethod, WNOHANG)) > 0)
+	{
+		if (childExited(deadPid, childExitMethod) != CHILD_METRICS)
+		{
+			admitLeave(serverAdmit);
+		}
+	}
+}
+
+#include "otpEvent.c"
+#include "otpUring.c"
+
+// runForkPerConnection
+//
+// description: the original server loop. Accepts on a
+//				single listening socket and forks a new
+//				child to handle each connection. The loop
+//				polls the listener and a SIGCHLD signalfd, so
+//				children are reaped as they exit even while no
+//				one connects, and reaps once more before each
+//				admission decision, so the connection count is
+//				never stale when it matters.
+//
+// @param		config - the server configuration
+//..........................................................
+void runForkPerConnection(struct serverConfig* config)
+{
+	int listenSocketFD;
+	int establishedConnectionFD;
+	socklen_t sizeOfClientInfo;
+	struct sockaddr_in clientAddress;
+	pid_t spawnPid;
+	struct pollfd watched[2];
+
+	listenSocketFD = openServerListener(config, 0, config->backlog ? config->backlog : LISTEN_BACKLOG);
+	setNonBlocking(listenSocketFD);
+	watched[0].fd = listenSocketFD;
+	watched[0].events = POLLIN;
+	watched[1].fd = childSignals();
+	watched[1].events = POLLIN;
+
+	while(1)
+	{
+		// Wait for a connection or an exited child
+		// ......................
+		if (poll(watched, 2, -1) < 0)
+		{
+			if (errno == EINTR)																					// SIGUSR1 asked for the stats
+			{
+				statsPoll(serverStats);
+				continue;
+			}
+			error("SERVER: poll error");
+		}
+		if (watched[1].revents & POLLIN)
+		{
+			childDrain(watched[1].fd);
+			reapChildren();
+		}
+		if (!(watched[0].revents & POLLIN))
+		{
+			continue;
+		}
+
+		// Accept the connection; another may have been reset before we got to it
+		// ......................
+		sizeOfClientInfo = sizeof(clientAddress); 																// Get the size of the address for the client that will connect
+		establishedConnectionFD = accept(listenSocketFD, (struct sockaddr *)&clientAddress, &sizeOfClientInfo); // Accept
+		if (establishedConnectionFD < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+			error("ERROR on accept");																			// send error message if unsuccessful
+		}
+
+		// Admit the connection, or tell the client to retry
+		// ......................
+		if (!allowPeer(establishedConnectionFD))
+		{
+			close(establishedConnectionFD);
+			continue;
+		}
+		configureConnection(establishedConnectionFD);
+		reapChildren();
+		if (!admitConnection(serverAdmit))
+		{
+			statsConnection(serverStats);
+			refuseConnection(establishedConnectionFD);
+			close(establishedConnectionFD);
+			continue;
+		}
+
+		// Fork new process
+		// ......................
+		spawnPid = fork();
+		if(spawnPid < 0)														// out of processes: the client may retry later
+		{
+			fprintf(stderr, "%sSERVER: ERROR forking: %s%s\n", RED, strerror(errno), NRM);
+			admitLeave(serverAdmit);
+			refuseConnection(establishedConnectionFD);
+		}
+		else if (spawnPid == 0)																	// Child Process is spawned
+		{
+			signal(SIGUSR1, SIG_IGN);
+			childUnblock();
+			close(listenSocketFD);
+			statsConnection(serverStats);
+			limitIdle(establishedConnectionFD);
+			serveConnection(establishedConnectionFD, 0);
+			close(establishedConnectionFD); 							// Close the existing socket connecting the client to the child
+			exit(0);													// exit the child process; the parent gives back its admission
+		}
+		childTrack(&serverChildren, spawnPid, CHILD_CONNECTION, 0);
+		close(establishedConnectionFD); 						// Close the existing socket connecting the client to the parent
+	}
+	close(listenSocketFD); 										// Close the listening socket
+}
+
+// runServer
+//
+// description: starts the daemon in the configured mode.
+//				Does not return.
+//
+// @param		config - the server configuration
+//..........................................................
+void runServer(struct serverConfig* config)
+{
+	serverConfig = config;
+	serverOps = config->ops;
+	serverLinger = config->linger;
+	if (config->pskFile != NULL)
+	{
+		serverPsk = sealLoadKey(config->pskFile, &serverPskLen);
+	}
+	serverStats = statsOpen();					// mapped before any fork, so every worker shares it
+	if (serverStats == NULL)
+	{
+		error("SERVER: ERROR mapping the stats");
+	}
+	statsListen();
+	statsBind(serverStats, 0);					// fork per connection children count in slot 0
+	serverAdmit = admitOpen(config->maxConnections, config->maxBytes, config->retryAfterMs);
+	if (serverAdmit == NULL)
+	{
+		error("SERVER: ERROR mapping the admission gauges");
+	}
+	if (config->metricsPort > 0)
+	{
+		serverMetricsFD = openListenSocketOn(htonl(INADDR_LOOPBACK), config->metricsPort, 0, LISTEN_BACKLOG);
+		spawnMetrics();
+	}
+	if (config->cipherThreads > 1 && config->eventThreads == 0 && config->uringThreads == 0)
+	{
+		cipherSplit = splitOpen(config->cipherThreads);	// each worker or child starts its threads on its first large message
+	}
+	if (config->keyDir != NULL)
+	{
+		serverKeys = keyCacheOpen(config->keyDir, config->ledgerDir);	// each forked worker gets its own copy, empty
+		if (serverKeys == NULL)
+		{
+			error("SERVER: ERROR opening the key or ledger directory");
+		}
+	}
+
+	if (config->uringThreads > 0)
+	{
+		runUringLoop(config);
+	}
+	else if (config->eventThreads > 0)
+	{
+		runEventLoop(config);
+	}
+	else if (config->forkPerConnection)
+	{
+		runForkPerConnection(config);
+	}
+	else
+	{
+		runWorkerPool(config);
+	}
+}
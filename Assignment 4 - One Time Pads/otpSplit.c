@@ -0,0 +1,220 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpSplit.c - runs one large cipher block across a team of threads. The block is cut into one
+//				slice per thread, each starting on a SPLIT_ALIGN boundary so every slice but the last runs
+//				whole vector steps, and the calling thread ciphers a slice itself while the helpers do the
+//				rest. The cipher works on each character alone, so the result is byte for byte the one
+//				cipherBlock() gives for the whole block.
+//
+//				Blocks under SPLIT_MIN are not worth waking anyone for and go straight to cipherBlock(), as
+//				does any block while the team is already busy with another. The helper threads are started
+//				on the first block that is split, in the process that splits it, so a daemon can set up its
+//				team before forking and every worker or connection child starts its own only if it ever
+//				gets a large message.
+//
+//				Expects cipherBlock() from otpCipher.c.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <pthread.h>
+
+/**********************************************************
+// SPLIT GLOBALS
+// ********************************************************/
+
+#define SPLIT_MIN			(256 * 1024)	// smallest block that is split
+#define SPLIT_BATCH			(1024 * 1024)	// binary message characters the parser gathers per block
+#define SPLIT_ALIGN			64				// slice boundaries, a multiple of every kernel's step
+#define SPLIT_MAX_THREADS	64				// largest team
+
+// otpSplit
+// ......................
+struct otpSplit
+{
+	int threads;				// threads sharing a block, the caller included
+	pid_t owner;				// the process the helpers run in, or 0 before they are started
+	pthread_mutex_t lock;		// guards everything below
+	pthread_cond_t posted;		// a block was posted
+	pthread_cond_t finished;	// the last slice of a block finished
+	int busy;					// 1 while a block is being ciphered
+	int op;						// the block: OP_ENC or OP_DEC
+	char* message;				// the block: message characters, replaced by the result
+	const char* key;			// the block: key characters
+	size_t n;					// the block: number of characters
+	size_t slice;				// characters per slice, the last one excepted
+	int next;					// the next slice to take
+	int pending;				// slices not finished yet
+};
+
+struct otpSplit* cipherSplit = NULL;	// the team parserCipher() uses, or NULL to cipher on one thread
+
+/**********************************************************
+// SPLIT FUNCTIONS
+// ********************************************************/
+
+// splitOpen
+//
+// description: sets up a team. No thread is started until
+//				the first block is split.
+//
+// @param		threads - threads to share each block, 2 to
+//				SPLIT_MAX_THREADS, the caller included
+// @return		the team, or NULL if out of memory
+//..........................................................
+struct otpSplit* splitOpen(int threads)
+{
+	struct otpSplit* split = calloc(1, sizeof(struct otpSplit));
+
+	if (split != NULL)
+	{
+		split->threads = threads;
+	}
+	return split;
+}
+
+// splitTake
+//
+// description: ciphers slices of the posted block until none
+//				are left. Called with the lock held; returns
+//				with it held.
+//
+// @param		split - the team
+//..........................................................
+void splitTake(struct otpSplit* split)
+{
+	int op;
+	char* message;
+	const char* key;
+	size_t start, n;
+
+	while (split->next < split->threads)
+	{
+		op = split->op;
+		start = split->next++ * split->slice;
+		message = split->message + start;
+		key = split->key + start;
+		n = start >= split->n ? 0 : (split->n - start < split->slice ? split->n - start : split->slice);
+		pthread_mutex_unlock(&split->lock);
+
+		cipherBlock(op, message, key, n);
+
+		pthread_mutex_lock(&split->lock);
+		if (--split->pending == 0)
+		{
+			pthread_cond_signal(&split->finished);
+		}
+	}
+}
+
+// splitHelper
+//
+// description: a helper thread. Waits for blocks and takes
+//				slices of each one, forever.
+//
+// @param		arg - the team
+//..........................................................
+void* splitHelper(void* arg)
+{
+	struct otpSplit* split = arg;
+
+	pthread_mutex_lock(&split->lock);
+	while (1)
+	{
+		while (split->next >= split->threads)
+		{
+			pthread_cond_wait(&split->posted, &split->lock);
+		}
+		splitTake(split);
+	}
+	return NULL;
+}
+
+// splitStart
+//
+// description: starts the helpers in this process. A team
+//				inherited over fork() has no helpers in the
+//				child, so its state is set up afresh.
+//
+// @param		split - the team
+// @return		0, or -1 if no helper could be started
+//..........................................................
+int splitStart(struct otpSplit* split)
+{
+	pthread_t thread;
+	int started = 0;
+	int i;
+
+	pthread_mutex_init(&split->lock, NULL);
+	pthread_cond_init(&split->posted, NULL);
+	pthread_cond_init(&split->finished, NULL);
+	split->busy = 0;
+	split->next = split->threads;						// nothing to take
+	split->pending = 0;
+	for (i = 1; i < split->threads; i++)
+	{
+		if (pthread_create(&thread, NULL, splitHelper, split) == 0)
+		{
+			pthread_detach(thread);
+			started++;
+		}
+	}
+	split->owner = getpid();
+	if (started == 0)
+	{
+		fprintf(stderr, "%sSPLIT: ERROR starting cipher threads, ciphering on one thread%s\n", RED, NRM);
+		split->threads = 1;
+		return -1;
+	}
+	split->threads = started + 1;						// share blocks among the threads that did start
+	return 0;
+}
+
+// splitCipher
+//
+// description: cipherBlock() over n characters, split across
+//				the team if the block is large enough and the
+//				team is free
+//
+// @param		split - the team, or NULL
+// @param		op - OP_ENC or OP_DEC
+// @param		message - the message, overwritten with the reply
+// @param		key - n key characters
+// @param		n - the number of characters
+//..........................................................
+void splitCipher(struct otpSplit* split, int op, char* message, const char* key, size_t n)
+{
+	if (split == NULL || n < SPLIT_MIN || split->threads < 2 ||
+		(split->owner != getpid() && splitStart(split) < 0))
+	{
+		cipherBlock(op, message, key, n);
+		return;
+	}
+
+	pthread_mutex_lock(&split->lock);
+	if (split->busy)									// another thread's block has the team
+	{
+		pthread_mutex_unlock(&split->lock);
+		cipherBlock(op, message, key, n);
+		return;
+	}
+	split->busy = 1;
+	split->op = op;
+	split->message = message;
+	split->key = key;
+	split->n = n;
+	split->slice = ((n + split->threads - 1) / split->threads + SPLIT_ALIGN - 1) / SPLIT_ALIGN * SPLIT_ALIGN;	// the slices must cover all n
+	split->pending = split->threads;
+	split->next = 0;
+	pthread_cond_broadcast(&split->posted);
+
+	splitTake(split);									// the caller works too
+	while (split->pending > 0)
+	{
+		pthread_cond_wait(&split->finished, &split->lock);
+	}
+	split->busy = 0;
+	pthread_mutex_unlock(&split->lock);
+}
@@ -0,0 +1,467 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpStats.c - the daemons' metrics registry. It lives in one shared anonymous mapping made
+//				before any worker is forked, split into one slot per pool worker or event loop thread, so
+//				every writer has its own cache lines. Writers add to their slot with relaxed atomic adds
+//				and never take a lock; the atomics only matter for fork per connection children, which
+//				all share slot 0. Readers sum the slots when they report.
+//
+//				Each slot holds, per operation, the requests answered, refused, refused busy and the
+//				message bytes ciphered, plus malformed requests, accepted connections, and a log2 latency histogram
+//				for each phase of a request:
+//
+//				[x]		accept - from accept() returning to the connection's first request byte
+//				[x]		receive - from a request's first byte to its last
+//				[x]		cipher - time spent in the cipher kernel for the request
+//				[x]		send - from the first reply byte handed to the socket to the last
+//
+//				The daemon parent also counts the children it reaps (see otpChildren.c), by how they
+//				ended, with a histogram of how long they lived.
+//
+//				Bucket k of a histogram counts durations of 2^k to 2^(k+1) - 1 nanoseconds, found with one
+//				count-leading-zeros, so recording is a clock read and three adds.
+//
+//				The totals can be read two ways: SIGUSR1 prints a summary to stdout (the handler only sets
+//				a flag; the daemon's main loop prints the next time its blocking call is interrupted), and
+//				statsExpose() writes every metric in the Prometheus text exposition format, for the
+//				--metrics endpoint.
+//
+//				Expects OP_ENC and OP_DEC from otpProtocol.c.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <signal.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/**********************************************************
+// STATS GLOBALS
+// ********************************************************/
+
+// operation slots
+// ......................
+#define STATS_ENC		0		// encryption requests
+#define STATS_DEC		1		// decryption requests
+#define STATS_OTHER		2		// requests for an unknown operation
+#define STATS_OPS		3
+
+// request phases
+// ......................
+#define STATS_ACCEPT	0		// accept() to the first request byte
+#define STATS_RECEIVE	1		// first request byte to the last
+#define STATS_CIPHER	2		// time in the cipher kernel
+#define STATS_SEND		3		// first reply byte sent to the last
+#define STATS_PHASES	4
+
+// child exit slots
+#define STATS_EXIT_OK		0		// exited with status 0
+#define STATS_EXIT_ERROR	1		// exited with any other status
+#define STATS_EXIT_SIGNAL	2		// killed by a signal
+#define STATS_EXITS			3
+
+#define STATS_SLOTS		256		// writer slots, one per pool worker or event loop thread
+#define STATS_BUCKETS	40		// log2 nanosecond buckets, up to about 18 minutes
+#define STATS_FIRST_LE	10		// the first bucket bound exposed, 2^10 ns
+
+const char* statsOpNames[STATS_OPS] = { "enc", "dec", "other" };
+const char* statsPhaseNames[STATS_PHASES] = { "accept", "receive", "cipher", "send" };
+const char* statsExitNames[STATS_EXITS] = { "ok", "error", "signal" };
+
+// otpOpStats
+// ......................
+struct otpOpStats
+{
+	unsigned long long requests;	// requests completed and answered
+	unsigned long long rejected;	// requests refused (wrong operation, short key, bad version)
+	unsigned long long bytes;		// message bytes ciphered
+	unsigned long long busy;		// requests refused busy by admission control
+};
+
+// otpHistogram
+// ......................
+struct otpHistogram
+{
+	unsigned long long bucket[STATS_BUCKETS];	// observations per log2 nanosecond bucket
+	unsigned long long sum;			// total nanoseconds observed
+};
+
+// otpSlot
+// ......................
+struct otpSlot
+{
+	struct otpOpStats op[STATS_OPS];
+	unsigned long long malformed;	// connections dropped for a malformed request
+	unsigned long long connections;	// connections accepted
+	struct otpHistogram phase[STATS_PHASES];
+	unsigned long long exits[STATS_EXITS];	// children reaped, by how they ended
+	struct otpHistogram lifetime;	// how long reaped children lived
+} __attribute__((aligned(64)));
+
+// otpStats
+// ......................
+struct otpStats
+{
+	struct otpSlot slot[STATS_SLOTS];
+};
+
+volatile sig_atomic_t statsRequested = 0;	// set by SIGUSR1
+__thread struct otpSlot* statsMine;			// this thread's slot, set by statsBind
+
+/**********************************************************
+// STATS FUNCTIONS
+// ********************************************************/
+
+// statsOpen
+//
+// description: maps zeroed counters that stay shared with
+//				every process forked afterwards. Pages of
+//				slots nobody writes to are never touched.
+//
+// @return		the counters, or NULL if the mapping failed
+//..........................................................
+struct otpStats* statsOpen()
+{
+	void* stats = mmap(NULL, sizeof(struct otpStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	return stats == MAP_FAILED ? NULL : stats;
+}
+
+// statsBind
+//
+// description: picks the slot the calling thread writes to
+//
+// @param		stats - the counters, or NULL
+// @param		index - a pool worker or event loop thread
+//				number; fork per connection children use 0
+//..........................................................
+void statsBind(struct otpStats* stats, int index)
+{
+	statsMine = stats ? &stats->slot[index % STATS_SLOTS] : NULL;
+}
+
+// statsNow
+//
+// description: reads the monotonic clock
+//
+// @return		nanoseconds from an arbitrary start
+//..........................................................
+static inline unsigned long long statsNow()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// statsAdd
+//
+// description: adds to one counter of the caller's slot
+//
+// @param		counter - the counter
+// @param		n - the amount
+//..........................................................
+static inline void statsAdd(unsigned long long* counter, unsigned long long n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// statsSlotOf
+//
+// description: the counter slot for an operation
+//
+// @param		op - an OP_ code
+// @return		one of the STATS_ operation slots
+//..........................................................
+int statsSlotOf(int op)
+{
+	return op == OP_ENC ? STATS_ENC : (op == OP_DEC ? STATS_DEC : STATS_OTHER);
+}
+
+// statsRequest
+//
+// description: counts one finished request
+//
+// @param		stats - the counters, or NULL to count nothing
+// @param		op - the operation the client asked for
+// @param		rejected - 1 if the request was refused
+// @param		bytes - message bytes ciphered
+//..........................................................
+void statsRequest(struct otpStats* stats, int op, int rejected, unsigned long long bytes)
+{
+	struct otpOpStats* counters;
+
+	if (stats == NULL || statsMine == NULL)
+	{
+		return;
+	}
+	counters = &statsMine->op[statsSlotOf(op)];
+	statsAdd(rejected ? &counters->rejected : &counters->requests, 1);
+	if (bytes > 0)
+	{
+		statsAdd(&counters->bytes, bytes);
+	}
+}
+
+// statsBusy
+//
+// description: counts one request refused busy
+//
+// @param		stats - the counters, or NULL to count nothing
+// @param		op - the operation the client asked for
+//..........................................................
+void statsBusy(struct otpStats* stats, int op)
+{
+	if (stats != NULL && statsMine != NULL)
+	{
+		statsAdd(&statsMine->op[statsSlotOf(op)].busy, 1);
+	}
+}
+
+// statsObserve
+//
+// description: records one duration in a histogram
+//
+// @param		histogram - the histogram
+// @param		ns - the duration in nanoseconds
+//..........................................................
+void statsObserve(struct otpHistogram* histogram, unsigned long long ns)
+{
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+	if (bucket >= STATS_BUCKETS)
+	{
+		bucket = STATS_BUCKETS - 1;
+	}
+	statsAdd(&histogram->bucket[bucket], 1);
+	statsAdd(&histogram->sum, ns);
+}
+
+// statsPhase
+//
+// description: records how long one phase of a request took
+//
+// @param		stats - the counters, or NULL to record nothing
+// @param		phase - one of the STATS_ phases
+// @param		ns - the duration in nanoseconds
+//..........................................................
+void statsPhase(struct otpStats* stats, int phase, unsigned long long ns)
+{
+	if (stats != NULL && statsMine != NULL)
+	{
+		statsObserve(&statsMine->phase[phase], ns);
+	}
+}
+
+// statsChild
+//
+// description: counts one reaped child and records how long
+//				it lived
+//
+// @param		stats - the counters, or NULL to count nothing
+// @param		exit - one of the STATS_EXIT_ slots
+// @param		ns - the child's lifetime in nanoseconds
+//..........................................................
+void statsChild(struct otpStats* stats, int exit, unsigned long long ns)
+{
+	if (stats != NULL && statsMine != NULL)
+	{
+		statsAdd(&statsMine->exits[exit], 1);
+		statsObserve(&statsMine->lifetime, ns);
+	}
+}
+
+// statsMalformed
+//
+// description: counts one connection dropped for a
+//				malformed request
+//
+// @param		stats - the counters, or NULL to count nothing
+//..........................................................
+void statsMalformed(struct otpStats* stats)
+{
+	if (stats != NULL && statsMine != NULL)
+	{
+		statsAdd(&statsMine->malformed, 1);
+	}
+}
+
+// statsConnection
+//
+// description: counts one accepted connection
+//
+// @param		stats - the counters, or NULL to count nothing
+//..........................................................
+void statsConnection(struct otpStats* stats)
+{
+	if (stats != NULL && statsMine != NULL)
+	{
+		statsAdd(&statsMine->connections, 1);
+	}
+}
+
+// statsLoad
+//
+// description: reads one counter of every slot and sums it
+//
+// @param		stats - the counters
+// @param		offset - the counter's byte offset in a slot
+// @return		the total
+//..........................................................
+unsigned long long statsLoad(struct otpStats* stats, size_t offset)
+{
+	unsigned long long total = 0;
+	int i;
+
+	for (i = 0; i < STATS_SLOTS; i++)
+	{
+		total += __atomic_load_n((unsigned long long*)((char*)&stats->slot[i] + offset), __ATOMIC_RELAXED);
+	}
+	return total;
+}
+
+#define STATS_TOTAL(stats, field)	statsLoad(stats, offsetof(struct otpSlot, field))
+
+// statsExposeHistogram
+//
+// description: writes the bucket, sum and count series of
+//				one histogram, summed over every slot
+//
+// @param		stats - the counters
+// @param		out - where to write
+// @param		name - the metric name
+// @param		labels - the series' labels, or "" for none
+// @param		offset - the histogram's byte offset in a slot
+//..........................................................
+void statsExposeHistogram(struct otpStats* stats, FILE* out, const char* name, const char* labels, size_t offset)
+{
+	unsigned long long cumulative = 0;
+	const char* comma = labels[0] ? "," : "";
+	int b;
+
+	for (b = 0; b < STATS_BUCKETS; b++)
+	{
+		cumulative += statsLoad(stats, offset + offsetof(struct otpHistogram, bucket[b]));
+		if (b >= STATS_FIRST_LE - 1 && b < STATS_BUCKETS - 1)		// bucket b ends just below 2^(b+1) ns
+		{
+			fprintf(out, "%s_bucket{%s%sle=\"%.12g\"} %llu\n", name, labels, comma, (double)(1ULL << (b + 1)) / 1e9, cumulative);
+		}
+	}
+	fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, comma, cumulative);
+	fprintf(out, "%s_sum{%s} %.9f\n", name, labels, statsLoad(stats, offset + offsetof(struct otpHistogram, sum)) / 1e9);
+	fprintf(out, "%s_count{%s} %llu\n", name, labels, cumulative);
+}
+
+// statsExpose
+//
+// description: writes every metric in the Prometheus text
+//				exposition format. Histogram buckets are
+//				cumulative, with bounds in seconds.
+//
+// @param		stats - the counters
+// @param		out - where to write
+//..........................................................
+void statsExpose(struct otpStats* stats, FILE* out)
+{
+	char labels[32];
+	int i;
+
+	fprintf(out, "# HELP otp_requests_total Requests answered, by operation.\n# TYPE otp_requests_total counter\n");
+	for (i = 0; i < STATS_OPS; i++)
+	{
+		fprintf(out, "otp_requests_total{op=\"%s\"} %llu\n", statsOpNames[i], STATS_TOTAL(stats, op[i].requests));
+	}
+	fprintf(out, "# HELP otp_rejected_total Requests refused, by operation.\n# TYPE otp_rejected_total counter\n");
+	for (i = 0; i < STATS_OPS; i++)
+	{
+		fprintf(out, "otp_rejected_total{op=\"%s\"} %llu\n", statsOpNames[i], STATS_TOTAL(stats, op[i].rejected));
+	}
+	fprintf(out, "# HELP otp_bytes_total Message bytes ciphered, by operation.\n# TYPE otp_bytes_total counter\n");
+	for (i = 0; i < STATS_OPS; i++)
+	{
+		fprintf(out, "otp_bytes_total{op=\"%s\"} %llu\n", statsOpNames[i], STATS_TOTAL(stats, op[i].bytes));
+	}
+	fprintf(out, "# HELP otp_busy_total Requests refused busy by admission control, by operation.\n# TYPE otp_busy_total counter\n");
+	for (i = 0; i < STATS_OPS; i++)
+	{
+		fprintf(out, "otp_busy_total{op=\"%s\"} %llu\n", statsOpNames[i], STATS_TOTAL(stats, op[i].busy));
+	}
+	fprintf(out, "# HELP otp_malformed_total Connections dropped for a malformed request.\n# TYPE otp_malformed_total counter\n");
+	fprintf(out, "otp_malformed_total %llu\n", STATS_TOTAL(stats, malformed));
+	fprintf(out, "# HELP otp_connections_total Connections accepted.\n# TYPE otp_connections_total counter\n");
+	fprintf(out, "otp_connections_total %llu\n", STATS_TOTAL(stats, connections));
+
+	fprintf(out, "# HELP otp_phase_seconds Time spent in each phase of a request.\n# TYPE otp_phase_seconds histogram\n");
+	for (i = 0; i < STATS_PHASES; i++)
+	{
+		snprintf(labels, sizeof(labels), "phase=\"%s\"", statsPhaseNames[i]);
+		statsExposeHistogram(stats, out, "otp_phase_seconds", labels, offsetof(struct otpSlot, phase[i]));
+	}
+
+	fprintf(out, "# HELP otp_children_exited_total Child processes reaped, by how they ended.\n# TYPE otp_children_exited_total counter\n");
+	for (i = 0; i < STATS_EXITS; i++)
+	{
+		fprintf(out, "otp_children_exited_total{status=\"%s\"} %llu\n", statsExitNames[i], STATS_TOTAL(stats, exits[i]));
+	}
+	fprintf(out, "# HELP otp_child_lifetime_seconds How long reaped child processes lived.\n# TYPE otp_child_lifetime_seconds histogram\n");
+	statsExposeHistogram(stats, out, "otp_child_lifetime_seconds", "", offsetof(struct otpSlot, lifetime));
+}
+
+// statsSignal
+//
+// description: the SIGUSR1 handler; asks for a dump
+//
+// @param		signo - the signal number
+//..........................................................
+void statsSignal(int signo)
+{
+	(void)signo;
+	statsRequested = 1;
+}
+
+// statsListen
+//
+// description: installs the SIGUSR1 handler. It is installed
+//				without SA_RESTART, so the daemon's blocking
+//				call returns EINTR and the daemon can print.
+//..........................................................
+void statsListen()
+{
+	struct sigaction action;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = statsSignal;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGUSR1, &action, NULL);
+}
+
+// statsPoll
+//
+// description: prints the request counters to stdout if
+//				SIGUSR1 has arrived since the last call
+//
+// @param		stats - the counters
+//..........................................................
+void statsPoll(struct otpStats* stats)
+{
+	int i;
+
+	if (stats == NULL || !__atomic_exchange_n(&statsRequested, 0, __ATOMIC_RELAXED))
+	{
+		return;
+	}
+	printf("%sSERVER: stats%s\n", GRN, NRM);
+	printf("%s%-6s %14s %14s %14s %18s%s\n", GRN, "op", "requests", "rejected", "busy", "bytes", NRM);
+	for (i = 0; i < STATS_OPS; i++)
+	{
+		printf("%s%-6s %s%14llu %14llu %14llu %18llu%s\n", GRN, statsOpNames[i], CYN, STATS_TOTAL(stats, op[i].requests),
+			STATS_TOTAL(stats, op[i].rejected), STATS_TOTAL(stats, op[i].busy), STATS_TOTAL(stats, op[i].bytes), NRM);
+	}
+	printf("%s%-6s %s%14llu%s\n", GRN, "bad", CYN, STATS_TOTAL(stats, malformed), NRM);
+	printf("%s%-6s %s%14llu %14llu %14llu%s  %s(children ok, error, signal)%s\n", GRN, "exits", CYN, STATS_TOTAL(stats, exits[STATS_EXIT_OK]),
+		STATS_TOTAL(stats, exits[STATS_EXIT_ERROR]), STATS_TOTAL(stats, exits[STATS_EXIT_SIGNAL]), NRM, GRN, NRM);
+	fflush(stdout);
+}
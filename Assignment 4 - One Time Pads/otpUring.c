@@ -0,0 +1,752 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otpUring.c - the --io-uring server mode. Like the event loop (otpEvent.c), each thread owns
+//				a listener and drives every connection it accepts through an otpParser, but instead of
+//				waiting for readiness and then making a recv() or send() call per step, it queues the
+//				steps themselves on an io_uring and collects their results, one io_uring_enter() per
+//				batch for every connection on the thread:
+//
+//				[x]		accept - one multishot accept per listener stays armed for the life of the thread
+//				[x]		recv - into a ring of receive buffers registered with the kernel, which picks one
+//						when data arrives, so an idle connection holds no buffer. Each connection has at
+//						most one recv queued, for no more than the parser wants, which keeps the parser's
+//						flow control; the buffer goes back to the ring as soon as it has been fed.
+//				[x]		send - straight from the parser's reply, one send per connection at a time. The
+//						last piece of a reply is linked to a shutdown(SHUT_WR), so the kernel half closes
+//						the connection as soon as it is out without another trip through the thread.
+//				[x]		close - queued once the client has hung up and nothing else is in flight.
+//
+//				The ring is set up with raw syscalls, so no library is needed. The mode is built when the
+//				kernel headers have <linux/io_uring.h>; if the running kernel refuses to set up a ring
+//				(too old, or io_uring disabled by sysctl or seccomp) the daemon says so and runs the event
+//				loop instead. --psk is not supported, since the seal does its own socket I/O.
+//
+//				Included by otpServer.c, after otpEvent.c.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#if __has_include(<linux/io_uring.h>)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/**********************************************************
+// URING GLOBALS
+// ********************************************************/
+
+#define URING_ENTRIES	256			// submission queue entries per thread
+#define URING_BUFS		64			// receive buffers per thread, a power of two
+#define URING_BUF_SIZE	16384		// bytes per receive buffer
+#define URING_GROUP		0			// the receive buffers' group id
+
+// request tags, in the low bits of each request's user_data above the connection pointer
+// ......................
+#define URING_ACCEPT	0			// the listener's multishot accept
+#define URING_RECV		1
+#define URING_SEND		2
+#define URING_SHUTDOWN	3
+#define URING_CLOSE		4
+#define URING_CHILD		5			// a multishot poll of the SIGCHLD signalfd
+#define URING_TAGS		7
+
+// otpRing
+// ......................
+struct otpRing
+{
+	int fd;							// the io_uring
+	int listenSocketFD;				// the thread's listener
+	int childFD;					// the SIGCHLD signalfd, if this thread claimed it, else -1
+	unsigned* sqHead;				// submission queue, shared with the kernel
+	unsigned* sqTail;
+	unsigned sqMask;
+	unsigned sqEntries;
+	unsigned sqLocal;				// our tail, published on submit
+	struct io_uring_sqe* sqes;
+	unsigned* cqHead;				// completion queue, shared with the kernel
+	unsigned* cqTail;
+	unsigned cqMask;
+	struct io_uring_cqe* cqes;
+	struct io_uring_buf_ring* bufRing;	// the registered receive buffers
+	unsigned short bufTail;
+	char* bufs;
+	struct uringConn* starved;		// connections whose recv found no free buffer
+};
+
+// uringConn
+// ......................
+struct uringConn
+{
+	int fd;							// the client socket
+	int phase;						// CONN_READING or CONN_CLOSING, as in the event loop
+	int admitted;					// 1 if the connection counts against --max-conns
+	int inflight;					// requests queued on the ring for it
+	int receiving;					// 1 while a recv is queued
+	int sending;					// 1 while a send is queued
+	int shutdownQueued;				// 1 once shutdown(SHUT_WR) is queued or done
+	int dead;						// 1 once it is to be closed
+	struct uringConn* nextStarved;
+	struct otpParser parser;		// this connection's request parser
+};
+
+/**********************************************************
+// URING FUNCTIONS
+// ********************************************************/
+
+// ringRecycle
+//
+// description: hands a receive buffer back to the kernel
+//
+// @param		ring - the ring
+// @param		bid - the buffer's id
+//..........................................................
+void ringRecycle(struct otpRing* ring, unsigned short bid)
+{
+	struct io_uring_buf* buf = &ring->bufRing->bufs[ring->bufTail & (URING_BUFS - 1)];
+
+	buf->addr = (unsigned long)(ring->bufs + (size_t)bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	ring->bufTail++;
+	__atomic_store_n(&ring->bufRing->tail, ring->bufTail, __ATOMIC_RELEASE);
+}
+
+// ringOpen
+//
+// description: sets up an io_uring and registers its
+//				receive buffers. Single issuer and deferred
+//				task work are asked for where the kernel has
+//				them, since only the owning thread uses it and
+//				always waits for completions.
+//
+// @param		ring - the ring to set up
+// @param		listenSocketFD - the thread's listener
+// @return		0, or -1 with errno set if the kernel refused
+//..........................................................
+int ringOpen(struct otpRing* ring, int listenSocketFD)
+{
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	size_t sqSize, cqSize;
+	char* sq;
+	char* cq;
+	unsigned i;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->listenSocketFD = listenSocketFD;
+	ring->childFD = -1;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring->fd < 0 && errno == EINVAL)								// a kernel before 6.1
+	{
+		memset(&params, 0, sizeof(params));
+		ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	}
+	if (ring->fd < 0)
+	{
+		return -1;
+	}
+
+	// map the queues
+	sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+	}
+	sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	cq = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq :
+		mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED)
+	{
+		close(ring->fd);
+		return -1;
+	}
+	ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+	ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+	ring->sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sqEntries = params.sq_entries;
+	ring->sqLocal = *ring->sqTail;
+	for (i = 0; i < params.sq_entries; i++)
+	{
+		((unsigned*)(sq + params.sq_off.array))[i] = i;		// submission slots are used in order
+	}
+	ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+	ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	// register the receive buffers
+	ring->bufRing = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+	if (ring->bufRing == MAP_FAILED || ring->bufs == NULL)
+	{
+		close(ring->fd);
+		return -1;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)ring->bufRing;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_GROUP;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)		// 5.19 and later
+	{
+		close(ring->fd);
+		return -1;
+	}
+	for (i = 0; i < URING_BUFS; i++)
+	{
+		ringRecycle(ring, i);
+	}
+	return 0;
+}
+
+// uringProbe
+//
+// description: whether the running kernel can set up a ring
+//				with registered receive buffers, checked with a
+//				one entry ring that is thrown away
+//
+// @return		0, or -1 with errno set if not
+//..........................................................
+int uringProbe()
+{
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	void* bufRing;
+	int fd, saved, result;
+
+	memset(&params, 0, sizeof(params));
+	fd = syscall(__NR_io_uring_setup, 1, &params);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	bufRing = mmap(NULL, sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)bufRing;
+	reg.ring_entries = 1;
+	result = bufRing == MAP_FAILED ? -1 : syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+	saved = errno;
+	close(fd);
+	if (bufRing != MAP_FAILED)
+	{
+		munmap(bufRing, sizeof(struct io_uring_buf));
+	}
+	errno = saved;
+	return result < 0 ? -1 : 0;
+}
+
+// ringSubmit
+//
+// description: submits every queued request and, if asked,
+//				waits for at least one completion, in one
+//				io_uring_enter()
+//
+// @param		ring - the ring
+// @param		wait - completions to wait for, 0 or 1
+// @return		0, or -1 with errno set
+//..........................................................
+int ringSubmit(struct otpRing* ring, unsigned wait)
+{
+	unsigned queued;
+
+	__atomic_store_n(ring->sqTail, ring->sqLocal, __ATOMIC_RELEASE);
+	queued = ring->sqLocal - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+	if (queued == 0 && wait == 0)
+	{
+		return 0;
+	}
+	if (syscall(__NR_io_uring_enter, ring->fd, queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+// ringGet
+//
+// description: the next free submission entry, cleared.
+//				If the queue is full what is in it is
+//				submitted first.
+//
+// @param		ring - the ring
+// @return		the entry
+//..........................................................
+struct io_uring_sqe* ringGet(struct otpRing* ring)
+{
+	struct io_uring_sqe* sqe;
+
+	while (ring->sqLocal - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries)
+	{
+		if (ringSubmit(ring, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		{
+			error("SERVER: ERROR submitting to the io_uring");
+		}
+	}
+	sqe = &ring->sqes[ring->sqLocal & ring->sqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqLocal++;
+	return sqe;
+}
+
+// uringTag
+//
+// description: a request's user_data: the connection it is
+//				for, or NULL, and what it is
+//
+// @param		conn - the connection, or NULL
+// @param		tag - one of the URING_ tags
+// @return		the user_data
+//..........................................................
+unsigned long long uringTag(struct uringConn* conn, int tag)
+{
+	return (unsigned long long)(unsigned long)conn | tag;
+}
+
+// uringArmAccept
+//
+// description: queues the listener's multishot accept
+//
+// @param		ring - the ring
+//..........................................................
+void uringArmAccept(struct otpRing* ring)
+{
+	struct io_uring_sqe* sqe = ringGet(ring);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = ring->listenSocketFD;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = uringTag(NULL, URING_ACCEPT);
+}
+
+// uringArmChild
+//
+// description: queues a multishot poll of the SIGCHLD
+//				signalfd
+//
+// @param		ring - the ring
+//..........................................................
+void uringArmChild(struct otpRing* ring)
+{
+	struct io_uring_sqe* sqe = ringGet(ring);
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = ring->childFD;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = uringTag(NULL, URING_CHILD);
+}
+
+// uringLastPiece
+//
+// description: whether sending n more reply bytes finishes
+//				the connection's reply for good
+//
+// @param		parser - the connection's parser
+// @param		n - the bytes about to be sent
+// @return		1 if so, else 0
+//..........................................................
+int uringLastPiece(struct otpParser* parser, size_t n)
+{
+	return parser->state >= PARSE_DONE &&
+		n == (parser->replyHeaderLen - parser->replyHeaderSent) + (parser->keyLen - parser->replySent);
+}
+
+// uringKill
+//
+// description: marks a connection to be closed. A recv or
+//				send still in flight is cut short, so it
+//				completes and the close can follow; a queued
+//				shutdown finishes on its own.
+//
+// @param		conn - the connection
+//..........................................................
+void uringKill(struct uringConn* conn)
+{
+	conn->dead = 1;
+	if (conn->receiving || conn->sending)
+	{
+		shutdown(conn->fd, SHUT_RDWR);
+	}
+}
+
+// uringPump
+//
+// description: queues whatever a connection can do next:
+//				the next piece of reply if none is being sent,
+//				a recv if the parser wants input (or, once the
+//				reply is out, to wait for the client to hang
+//				up), or the close once it is dead and idle
+//
+// @param		ring - the ring
+// @param		conn - the connection
+//..........................................................
+void uringPump(struct otpRing* ring, struct uringConn* conn)
+{
+	struct io_uring_sqe* sqe;
+	const char* data;
+	size_t n, want = 0;
+
+	if (conn->dead)
+	{
+		if (conn->inflight == 0)
+		{
+			sqe = ringGet(ring);
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = conn->fd;
+			sqe->user_data = uringTag(conn, URING_CLOSE);
+			conn->inflight++;
+		}
+		return;
+	}
+
+	if (conn->phase == CONN_READING && !conn->sending)
+	{
+		n = parserReply(&conn->parser, &data);
+		if (n > 0)
+		{
+			sqe = ringGet(ring);
+			sqe->opcode = IORING_OP_SEND;
+			sqe->fd = conn->fd;
+			sqe->addr = (unsigned long)data;
+			sqe->len = n;
+			sqe->msg_flags = MSG_NOSIGNAL;
+			sqe->user_data = uringTag(conn, URING_SEND);
+			conn->sending = 1;
+			conn->inflight++;
+			if (uringLastPiece(&conn->parser, n) && !conn->shutdownQueued)
+			{
+				sqe->msg_flags |= MSG_WAITALL;					// the kernel retries until all of it is out, and
+				sqe->flags |= IOSQE_IO_LINK;					// only a failed or short send cancels the shutdown
+				sqe = ringGet(ring);
+				sqe->opcode = IORING_OP_SHUTDOWN;
+				sqe->fd = conn->fd;
+				sqe->len = SHUT_WR;
+				sqe->user_data = uringTag(conn, URING_SHUTDOWN);
+				conn->shutdownQueued = 1;
+				conn->inflight++;
+			}
+		}
+		else if (parserFinished(&conn->parser))
+		{
+			if (conn->parser.state == PARSE_REJECTED && !conn->parser.busy)
+			{
+				fprintf(stderr, "%sSERVER: ERROR, client handshake unsuccessful%s\n", RED, NRM);
+			}
+			conn->phase = CONN_CLOSING;				// the reply is out: wait for the client's EOF
+			if (!conn->shutdownQueued)
+			{
+				sqe = ringGet(ring);
+				sqe->opcode = IORING_OP_SHUTDOWN;
+				sqe->fd = conn->fd;
+				sqe->len = SHUT_WR;
+				sqe->user_data = uringTag(conn, URING_SHUTDOWN);
+				conn->shutdownQueued = 1;
+				conn->inflight++;
+			}
+		}
+	}
+
+	if (!conn->receiving && (conn->phase == CONN_CLOSING || (want = parserWant(&conn->parser)) > 0))
+	{
+		sqe = ringGet(ring);
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = conn->fd;
+		sqe->len = conn->phase == CONN_CLOSING || want > URING_BUF_SIZE ? URING_BUF_SIZE : want;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_GROUP;
+		sqe->user_data = uringTag(conn, URING_RECV);
+		conn->receiving = 1;
+		conn->inflight++;
+	}
+}
+
+// uringAccept
+//
+// description: sets up a newly accepted connection and
+//				queues its first recv
+//
+// @param		ring - the ring
+// @param		establishedConnectionFD - the accepted socket
+//..........................................................
+void uringAccept(struct otpRing* ring, int establishedConnectionFD)
+{
+	struct uringConn* conn;
+
+	if (!allowPeer(establishedConnectionFD))
+	{
+		close(establishedConnectionFD);
+		return;
+	}
+	configureConnection(establishedConnectionFD);
+	statsConnection(serverStats);
+
+	conn = calloc(1, sizeof(*conn));
+	if (conn == NULL)
+	{
+		fprintf(stderr, "%sSERVER: ERROR allocating connection%s\n", RED, NRM);
+		close(establishedConnectionFD);
+		return;
+	}
+	conn->fd = establishedConnectionFD;
+	conn->phase = CONN_READING;
+	conn->admitted = admitConnection(serverAdmit);
+	parserInit(&conn->parser, serverOps, serverStats, serverKeys, serverAdmit);
+	conn->parser.overloaded = !conn->admitted;		// over --max-conns: it only gets told to retry
+	uringPump(ring, conn);
+}
+
+// uringReceived
+//
+// description: handles a finished recv: feeds the data to
+//				the parser, or discards it once the reply is
+//				out, and gives the buffer back
+//
+// @param		ring - the ring
+// @param		conn - the connection
+// @param		cqe - the completion
+// @return		1 if no buffer was free, and the connection
+//				now waits on the starved list, else 0
+//..........................................................
+int uringReceived(struct otpRing* ring, struct uringConn* conn, struct io_uring_cqe* cqe)
+{
+	unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+	conn->receiving = 0;
+	if (cqe->res == -ENOBUFS && !conn->dead)				// every buffer is in use: try again after this batch
+	{
+		conn->nextStarved = ring->starved;
+		ring->starved = conn;
+		return 1;
+	}
+	if (cqe->res < 0 && cqe->res != -EINTR && cqe->res != -EAGAIN && !conn->dead)
+	{
+		fprintf(stderr, "%sSERVER: ERROR reading from socket%s\n", RED, NRM);
+		uringKill(conn);
+	}
+	else if (cqe->res == 0 && !conn->dead)
+	{
+		if (conn->phase == CONN_READING && !parserIdle(&conn->parser) &&
+			(conn->parser.state != PARSE_SKIP || conn->parser.skipState != PARSE_REJECTED))
+		{
+			fprintf(stderr, "%sSERVER: ERROR, client disconnected mid-transmission%s\n", RED, NRM);
+		}
+		uringKill(conn);
+	}
+	else if (cqe->res > 0 && conn->phase == CONN_READING && !conn->dead &&
+		parserFeed(&conn->parser, ring->bufs + (size_t)bid * URING_BUF_SIZE, cqe->res) == PARSE_ERROR)
+	{
+		fprintf(stderr, "%sSERVER: ERROR, malformed request%s\n", RED, NRM);
+		statsMalformed(serverStats);
+		uringKill(conn);
+	}
+	if (cqe->flags & IORING_CQE_F_BUFFER)
+	{
+		ringRecycle(ring, bid);
+	}
+	return 0;
+}
+
+// uringComplete
+//
+// description: handles one completion
+//
+// @param		ring - the ring
+// @param		cqe - the completion
+//..........................................................
+void uringComplete(struct otpRing* ring, struct io_uring_cqe* cqe)
+{
+	struct uringConn* conn = (struct uringConn*)(unsigned long)(cqe->user_data & ~(unsigned long long)URING_TAGS);
+
+	switch (cqe->user_data & URING_TAGS)
+	{
+		case URING_ACCEPT:
+			if (cqe->res >= 0)
+			{
+				uringAccept(ring, cqe->res);
+			}
+			else if (cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECONNABORTED)
+			{
+				fprintf(stderr, "%sSERVER: ERROR on accept: %s%s\n", RED, strerror(-cqe->res), NRM);
+			}
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+			{
+				uringArmAccept(ring);
+			}
+			return;
+		case URING_CHILD:
+			childDrain(ring->childFD);
+			reapChildren();
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+			{
+				uringArmChild(ring);
+			}
+			return;
+		case URING_RECV:
+			conn->inflight--;
+			if (uringReceived(ring, conn, cqe))
+			{
+				return;							// pumped again after this batch
+			}
+			uringPump(ring, conn);
+			return;
+		case URING_SEND:
+			conn->sending = 0;
+			if (cqe->res > 0)
+			{
+				parserReplySent(&conn->parser, cqe->res);
+			}
+			else if (cqe->res != -EINTR && cqe->res != -EAGAIN && !conn->dead)
+			{
+				fprintf(stderr, "%sSERVER: ERROR writing to socket%s\n", RED, NRM);
+				uringKill(conn);
+			}
+			break;
+		case URING_SHUTDOWN:
+			if (cqe->res == -ECANCELED)
+			{
+				conn->shutdownQueued = 0;			// the linked send was short
+			}
+			break;
+		case URING_CLOSE:
+			if (conn->admitted)
+			{
+				admitLeave(serverAdmit);
+			}
+			parserFree(&conn->parser);
+			free(conn);
+			return;
+	}
+	conn->inflight--;
+	uringPump(ring, conn);
+}
+
+// uringThread
+//
+// description: one io_uring thread. Sets up its ring, arms
+//				the accept (and, in the one thread that claims
+//				it, the SIGCHLD poll), then submits and reaps in
+//				one io_uring_enter() per batch, forever.
+//
+// @param		arg - the thread's listening socket
+//..........................................................
+void* uringThread(void* arg)
+{
+	struct otpRing ring;
+	struct io_uring_cqe cqe;
+	struct uringConn* conn;
+	unsigned head;
+
+	statsBind(serverStats, __atomic_fetch_add(&eventThreadCount, 1, __ATOMIC_RELAXED));
+	if (ringOpen(&ring, (int)(long)arg) < 0)
+	{
+		error("SERVER: ERROR setting up an io_uring");
+	}
+	uringArmAccept(&ring);
+	ring.childFD = __atomic_exchange_n(&eventChildFD, -1, __ATOMIC_RELAXED);
+	if (ring.childFD >= 0)
+	{
+		uringArmChild(&ring);
+	}
+
+	while (1)
+	{
+		if (ringSubmit(&ring, 1) < 0)
+		{
+			if (errno == EINTR)
+			{
+				statsPoll(serverStats);					// SIGUSR1 asked for the stats
+				continue;
+			}
+			if (errno != EAGAIN && errno != EBUSY)		// completions to reap first
+			{
+				error("SERVER: io_uring_enter error");
+			}
+		}
+
+		head = *ring.cqHead;
+		while (head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE))
+		{
+			cqe = ring.cqes[head & ring.cqMask];
+			__atomic_store_n(ring.cqHead, ++head, __ATOMIC_RELEASE);	// the slot is free once copied
+			uringComplete(&ring, &cqe);
+		}
+
+		// every buffer has been given back by now
+		while (ring.starved != NULL)
+		{
+			conn = ring.starved;
+			ring.starved = conn->nextStarved;
+			conn->nextStarved = NULL;
+			uringPump(&ring, conn);
+		}
+	}
+	return NULL;
+}
+
+// runUringLoop
+//
+// description: opens one listener per thread and runs an
+//				io_uring loop on each, like runEventLoop().
+//				If the kernel will not set up a ring the event
+//				loop runs instead. The calling thread runs the
+//				first loop, so this does not return. Each thread
+//				sets up its own ring, which only it submits to.
+//
+// @param		config - the server configuration
+//..........................................................
+void runUringLoop(struct serverConfig* config)
+{
+	int listeners[MAX_WORKERS];
+	pthread_t thread;
+	int i;
+
+	if (uringProbe() < 0)
+	{
+		fprintf(stderr, "%sSERVER: io_uring unavailable (%s), running the event loop instead%s\n", RED, strerror(errno), NRM);
+		config->eventThreads = config->uringThreads;
+		runEventLoop(config);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	eventChildFD = childSignals();				// blocked before any thread starts, so every thread inherits the mask
+
+	// bind every listener first, so port errors are reported at start up
+	for (i = 0; i < config->uringThreads; i++)
+	{
+		listeners[i] = openServerListener(config, 1, config->backlog ? config->backlog : SOMAXCONN);
+	}
+	for (i = 1; i < config->uringThreads; i++)
+	{
+		if (pthread_create(&thread, NULL, uringThread, (void*)(long)listeners[i]) != 0)
+		{
+			error("SERVER: ERROR creating io_uring thread");
+		}
+	}
+	uringThread((void*)(long)listeners[0]);
+}
+
+#else
+
+// runUringLoop
+//
+// description: built without <linux/io_uring.h>: runs the
+//				event loop instead
+//
+// @param		config - the server configuration
+//..........................................................
+void runUringLoop(struct serverConfig* config)
+{
+	fprintf(stderr, "%sSERVER: built without io_uring, running the event loop instead%s\n", RED, NRM);
+	config->eventThreads = config->uringThreads;
+	runEventLoop(config);
+}
+
+#endif
@@ -0,0 +1,1568 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otp_bench.c - the load generator for the otp daemons. -c client threads send requests for
+//				-d seconds and every request's latency is recorded, so a run reports both throughput and
+//				the latency distribution. There are two framings and two ways of pacing:
+//
+//				[x]		text (default) - every request is a connection of its own in the text framing:
+//						connect, send, read the reply until the server closes. This measures the whole
+//						connection cost, e.g. --fork against the worker pool.
+//				[x]		binary (--binary) - each client keeps one connection open and sends binary
+//						requests on it one after another, which measures the request path alone.
+//
+//				[x]		closed loop (default) - each client sends its next request as soon as the last
+//						reply is in, so the daemon sets the pace and the run finds its peak throughput.
+//				[x]		open loop (-r rate) - requests are sent on a fixed schedule of rate per second
+//						over all clients, whatever the daemon does. Latency is measured from when a request
+//						was due, not from when it was sent, so a daemon that falls behind is charged for
+//						the queueing it causes instead of hiding it (coordinated omission).
+//
+//				Latencies go into a log-linear histogram in the style of HdrHistogram: 128 sub-buckets
+//				for every power of two of nanoseconds, so every value is kept to within 1.6% and a whole
+//				run fits in a few kilobytes per client. The report gives min, mean, p50, p90, p99, p99.9
+//				and max; --json prints the same as one JSON object, for scripts and CI to compare runs.
+//				Requests the daemon refuses busy (see otpAdmit.c) are counted apart from failures and
+//				left out of the latencies, which are only ever those of served requests.
+//
+//				Syntax: otp_bench port|unix:/path|@name [-c clients] [-d seconds] [-s messagesize] [--dec]
+//						[--binary] [-r rate] [--json] [-p pid] [--psk file]
+//
+//				Given unix:/path or @name it drives a daemon on a Unix domain socket, and with --psk file every
+//				connection is sealed (see otpSeal.c), so both transports can be measured against plain
+//				TCP with the same load.
+//
+//				With -p the daemon's CPU time (the process and its children) is sampled before and after
+//				the run, and reported with the benchmark's own CPU time as CPU-seconds per 10k
+//				requests.
+//
+//				With --cipher it instead measures the cipher kernel at every instruction set level the
+//				CPU supports, in GB/s of message encrypted and decrypted in memory, over a -s byte block
+//				(OTP_CHUNK bytes, the daemons' chunk, by default) for -d seconds per level. No daemon is needed. With -c threads the best level is then run
+//				again with each block split across that many threads, as the daemons' --cipher-threads
+//				does (see otpSplit.c), after checking the split result is the same.
+//
+//				Syntax: otp_bench --cipher [-c threads] [-d seconds] [-s blocksize]
+//
+//				With --keygen it measures keygen's generators instead: every source (fast xoshiro256**
+//				and the secure getrandom one) fills -s byte blocks for -d seconds, first on one thread and
+//				then on -c threads, and the key characters produced are reported in GB/s.
+//
+//				Syntax: otp_bench --keygen [-c threads] [-d seconds] [-s blocksize]
+//
+//				With --parse it drives the daemons' request parser (otpParse.c) in memory, the way the
+//				servers do, with no sockets. It first checks it: random messages of sizes around every
+//				chunk boundary are encrypted and decrypted again through it in both framings, fed in
+//				random pieces, and must come back unchanged; then PARSE_MUTATIONS damaged requests (flipped
+//				bytes, stray sentinels, cut short, stretched, absurd lengths) must each leave it in a
+//				proper state. Every input comes from a fixed seed, so a failure can be replayed, and a
+//				build with -fsanitize=address also checks every access it makes. It then reports how many
+//				-s character requests per second each framing parses over -d seconds, in JSON with --json
+//				to track it from run to run. With -c threads the parser splits its cipher work across that
+//				many threads, as under the daemons' --cipher-threads, and the round trips add messages large
+//				enough to be gathered in batches. otp_fuzz.c is the parser's fuzz target.
+//
+//				Syntax: otp_bench --parse [-c threads] [-d seconds] [-s messagesize] [--json]
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+/**********************************************************
+// GLOBALS
+// ********************************************************/
+
+// message colors
+// ......................
+#define RED  "\x1B[31m"		// red text
+#define GRN  "\x1B[32m"		// green text
+#define CYN  "\x1B[36m"		// cyan text
+#define NRM  "\x1B[0m"		// normal text
+
+// transmission variables
+// ......................
+#define CON_FAIL 		"*"		// a sentinel which indicates that the client-server handshake was unsuccessful
+#define ENC_CLIENT 		"!!"	// a sentinel which indicates that the client requests encryption
+#define DEC_CLIENT 		"$$"	// a sentinel which indicates that the client requests decryption
+#define MID_SENTINEL	"##"	// a sentinel which separates the message from the key
+#define END_SENTINEL	"@@"	// a sentinel which indicates the end of transmission
+#define BUSY_FAIL		"%"		// a sentinel which indicates that the server is overloaded
+#define BUFFERSIZE		1024	// size of the buffer
+#define MAX_CLIENTS		256		// upper bound on concurrent client threads
+#define REPLY_TIMEOUT	5000	// ms a request may stall before it counts as failed
+#define PARSE_MUTATIONS	200000	// damaged requests fed to the parser by --parse
+#define CIPHER_BATCH	(1 << 20)	// bytes --cipher ciphers between looks at the clock
+
+// request outcomes
+// ......................
+#define REQ_FAILED		0		// a socket error, a short reply or a refusal
+#define REQ_OK			1		// the whole reply arrived
+#define REQ_BUSY		2		// the daemon answered busy
+
+// latency histogram layout
+// ......................
+#define LAT_SUB_BITS	7						// 2^7 sub-buckets per power of two, i.e. within 1/64
+#define LAT_SUB			(1 << LAT_SUB_BITS)
+#define LAT_HALF		(LAT_SUB / 2)
+#define LAT_MAX_BITS	40						// values are capped at 2^40 ns, about 18 minutes
+#define LAT_BUCKETS		((LAT_MAX_BITS - LAT_SUB_BITS + 2) * LAT_HALF)
+
+#include "otpParse.c"
+#include "otpRand.c"
+#include "otpEndpoint.c"
+#include "otpSeal.c"
+
+// benchmark settings shared by every client thread
+// ......................
+struct otpEndpoint daemonEndpoint;	// where the daemon listens
+unsigned char* benchPsk = NULL;		// the pre-shared key with --psk, else NULL
+size_t benchPskLen;					// its length
+char* request;						// the full request every client sends
+int requestSize;					// the size of request in bytes
+int replySize;						// the least number of bytes in a correct reply
+int binaryMode = 0;					// 1 = binary requests on persistent connections
+double interval = 0;				// open loop: seconds between one client's requests, 0 = closed loop
+double benchStart;					// when the clients were started
+int clientCount;					// the number of client threads
+volatile int running = 1;			// cleared when the benchmark time is up
+
+// latencyHist
+// ......................
+struct latencyHist
+{
+	unsigned long long count[LAT_BUCKETS];	// requests per bucket
+	unsigned long long total;		// requests recorded
+	double sum;						// nanoseconds recorded, for the mean
+	unsigned long long min;			// smallest latency, in ns
+	unsigned long long max;			// largest latency, in ns
+};
+
+// keygenStats
+// ......................
+struct keygenStats
+{
+	int source;						// RAND_FAST or RAND_SECURE
+	size_t size;					// bytes per block
+	struct otpRand rng;				// this thread's stream
+	double bytes;					// key characters generated
+};
+
+// clientStats
+// ......................
+struct clientStats
+{
+	int index;						// the client's number, which staggers its open loop schedule
+	int socketFD;					// binary: the persistent connection, or -1
+	struct otpSeal* seal;			// binary: its sealed transport with --psk
+	long requests;					// completed requests
+	long failures;					// requests that errored or got a short reply
+	long busy;						// requests the daemon refused busy
+	struct latencyHist latency;		// latency of the completed requests
+};
+
+/**********************************************************
+// HELPER FUNCTIONS
+// ********************************************************/
+
+// error
+//
+// description: Error function used for reporting issues
+//
+// @param		msg - an error message to report
+//..........................................................
+void error(const char *msg)
+{
+	fprintf(stderr, "%s", RED);		// change text color to red
+	perror(msg); 					// send an error message to standard error
+	fprintf(stderr, "%s", NRM);		// change text color to normal
+	exit(1);
+}
+
+// nowSeconds
+//
+// description: reads the monotonic clock
+//
+// @return		the current time in seconds
+//..........................................................
+double nowSeconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// latIndex
+//
+// description: the histogram bucket a latency falls in.
+//				Values below LAT_SUB have a bucket each; above
+//				that, each power of two is split into LAT_HALF
+//				buckets by the value's top LAT_SUB_BITS bits.
+//
+// @param		ns - the latency in nanoseconds
+// @return		the bucket
+//..........................................................
+int latIndex(unsigned long long ns)
+{
+	int shift;
+
+	if (ns < LAT_SUB)
+	{
+		return (int)ns;
+	}
+	if (ns >= 1ULL << LAT_MAX_BITS)
+	{
+		ns = (1ULL << LAT_MAX_BITS) - 1;
+	}
+	shift = 63 - __builtin_clzll(ns) - (LAT_SUB_BITS - 1);
+	return shift * LAT_HALF + (int)(ns >> shift);
+}
+
+// latValue
+//
+// description: the highest latency that falls in a bucket
+//
+// @param		index - the bucket
+// @return		the latency in nanoseconds
+//..........................................................
+unsigned long long latValue(int index)
+{
+	int shift;
+
+	if (index < LAT_SUB)
+	{
+		return index;
+	}
+	shift = index / LAT_HALF - 1;
+	return ((unsigned long long)(index % LAT_HALF + LAT_HALF + 1) << shift) - 1;
+}
+
+// latRecord
+//
+// description: adds one latency to a histogram
+//
+// @param		hist - the histogram
+// @param		ns - the latency in nanoseconds
+//..........................................................
+void latRecord(struct latencyHist* hist, unsigned long long ns)
+{
+	hist->count[latIndex(ns)]++;
+	if (hist->total == 0 || ns < hist->min)
+	{
+		hist->min = ns;
+	}
+	if (ns > hist->max)
+	{
+		hist->max = ns;
+	}
+	hist->total++;
+	hist->sum += ns;
+}
+
+// latMerge
+//
+// description: adds one histogram into another
+//
+// @param		into - the histogram to add to
+// @param		from - the histogram to add
+//..........................................................
+void latMerge(struct latencyHist* into, const struct latencyHist* from)
+{
+	int i;
+
+	if (from->total == 0)
+	{
+		return;
+	}
+	for (i = 0; i < LAT_BUCKETS; i++)
+	{
+		into->count[i] += from->count[i];
+	}
+	if (into->total == 0 || from->min < into->min)
+	{
+		into->min = from->min;
+	}
+	if (from->max > into->max)
+	{
+		into->max = from->max;
+	}
+	into->total += from->total;
+	into->sum += from->sum;
+}
+
+// latPercentile
+//
+// description: the latency at or below which a given share
+//				of the requests completed
+//
+// @param		hist - the histogram
+// @param		percent - the percentile, 0-100
+// @return		the latency in nanoseconds, 0 if empty
+//..........................................................
+unsigned long long latPercentile(const struct latencyHist* hist, double percent)
+{
+	unsigned long long want = (unsigned long long)(percent / 100.0 * hist->total + 0.999999);
+	unsigned long long seen = 0;
+	unsigned long long value;
+	int i;
+
+	if (want < 1)
+	{
+		want = 1;
+	}
+	for (i = 0; i < LAT_BUCKETS; i++)
+	{
+		seen += hist->count[i];
+		if (seen >= want)
+		{
+			value = latValue(i);
+			return value < hist->max ? value : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+// processCpuSeconds
+//
+// description: reads the user and system time a process has
+//				used, plus that of its reaped children
+//
+// @param		pid - the process
+// @param		ppid - receives its parent's pid
+// @return		CPU seconds, or 0 if it cannot be read
+//..........................................................
+double processCpuSeconds(int pid, int* ppid)
+{
+	char path[64];
+	char stat[1024];
+	char* fields;
+	FILE* fp;
+	unsigned long utime, stime;
+	long cutime, cstime;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+	{
+		return 0;
+	}
+	if (fgets(stat, sizeof(stat), fp) == NULL || (fields = strrchr(stat, ')')) == NULL)	// skip "pid (comm)"
+	{
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+	if (sscanf(fields + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld",
+		ppid, &utime, &stime, &cutime, &cstime) != 5)
+	{
+		return 0;
+	}
+	return (double)(utime + stime + cutime + cstime) / sysconf(_SC_CLK_TCK);
+}
+
+// daemonCpuSeconds
+//
+// description: the CPU time a daemon has used: the process
+//				itself, its reaped children, and its live
+//				children (the worker pool)
+//
+// @param		pid - the daemon's pid
+// @return		CPU seconds
+//..........................................................
+double daemonCpuSeconds(int pid)
+{
+	DIR* proc;
+	struct dirent* entry;
+	int ppid, child;
+	double total;
+
+	total = processCpuSeconds(pid, &ppid);
+	proc = opendir("/proc");
+	if (proc == NULL)
+	{
+		return total;
+	}
+	while ((entry = readdir(proc)) != NULL)
+	{
+		child = atoi(entry->d_name);
+		if (child > 0 && child != pid)
+		{
+			double seconds = processCpuSeconds(child, &ppid);
+			if (ppid == pid)
+			{
+				total += seconds;
+			}
+		}
+	}
+	closedir(proc);
+	return total;
+}
+
+// selfCpuSeconds
+//
+// description: the CPU time this benchmark has used
+//
+// @return		CPU seconds
+//..........................................................
+double selfCpuSeconds()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// buildRequest
+//
+// description: builds a request in the otp text framing
+//				with a message and key of messageSize
+//				characters each
+//
+// @param		sentinel - ENC_CLIENT or DEC_CLIENT
+// @param		messageSize - characters in the message
+//..........................................................
+void buildRequest(const char* sentinel, int messageSize)
+{
+	int i;
+
+	requestSize = 2 + messageSize + 2 + messageSize + 2;
+	request = malloc(requestSize + 1);
+	if (request == NULL)
+	{
+		error("BENCH: ERROR allocating request");
+	}
+
+	memcpy(request, sentinel, 2);
+	for (i = 0; i < messageSize; i++)
+	{
+		request[2 + i] = 'A' + (i % 26);						// plaintext
+		request[4 + messageSize + i] = 'Z' - (i % 26);			// key
+	}
+	memcpy(&request[2 + messageSize], MID_SENTINEL, 2);
+	memcpy(&request[4 + 2*messageSize], END_SENTINEL, 2);
+	request[requestSize] = '\0';
+	replySize = messageSize;
+}
+
+// buildBinaryRequest
+//
+// description: builds a binary framing request with a
+//				message and key of messageSize characters each
+//
+// @param		op - OP_ENC or OP_DEC
+// @param		messageSize - characters in the message
+//..........................................................
+void buildBinaryRequest(int op, int messageSize)
+{
+	struct otpHeader header;
+	int i;
+
+	requestSize = OTP_HEADER_SIZE + 2 * messageSize;
+	request = malloc(requestSize);
+	if (request == NULL)
+	{
+		error("BENCH: ERROR allocating request");
+	}
+
+	header.version = OTP_VERSION;
+	header.code = op;
+	header.requestId = 0;
+	header.messageLen = messageSize;
+	header.keyLen = messageSize;
+	packHeader(request, &header);
+	for (i = 0; i < messageSize; i++)
+	{
+		request[OTP_HEADER_SIZE + i] = 'A' + (i % 26);							// plaintext
+		request[OTP_HEADER_SIZE + messageSize + i] = 'Z' - (i % 26);			// key
+	}
+	replySize = OTP_HEADER_SIZE + messageSize;
+}
+
+// connectDaemon
+//
+// description: opens a connection to the daemon, sealed
+//				with --psk
+//
+// @param		seal - receives the connection's seal, or NULL
+// @return		the socket, or -1
+//..........................................................
+int connectDaemon(struct otpSeal** seal)
+{
+	int socketFD;
+	int on = 1;
+	struct timeval timeout = { 5, 0 };
+
+	*seal = NULL;
+	socketFD = endpointSocket(&daemonEndpoint);
+	if (socketFD < 0)
+	{
+		return -1;
+	}
+	setsockopt(socketFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));	// a stuck reply counts as a failure
+	if (daemonEndpoint.family == AF_INET)
+	{
+		setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+	if (connect(socketFD, (struct sockaddr*)&daemonEndpoint.address, daemonEndpoint.addressLen) < 0 ||
+		(benchPsk != NULL && (*seal = sealOpen(socketFD, benchPsk, benchPskLen, 0)) == NULL))
+	{
+		close(socketFD);
+		return -1;
+	}
+	return socketFD;
+}
+
+// sendRequest
+//
+// description: sends the whole request
+//
+// @param		socketFD - the connection
+// @param		seal - its seal, or NULL
+// @return		0, or -1 on a socket error
+//..........................................................
+int sendRequest(int socketFD, struct otpSeal* seal)
+{
+	int sent = 0;
+	int n;
+
+	while (sent < requestSize)
+	{
+		n = sealSend(seal, socketFD, request + sent, requestSize - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+		{
+			return -1;
+		}
+		sent += n;
+	}
+	return 0;
+}
+
+// dropConnection
+//
+// description: closes a client's persistent connection
+//
+// @param		stats - the client, which owns the connection
+//..........................................................
+void dropConnection(struct clientStats* stats)
+{
+	close(stats->socketFD);
+	sealClose(stats->seal);
+	stats->socketFD = -1;
+	stats->seal = NULL;
+}
+
+// runBinaryRequest
+//
+// description: sends one binary request on the client's
+//				connection, opening it first if need be, and
+//				reads the whole reply. The reply is read while
+//				the request is still going out, as otp_enc
+//				does: the daemon stops reading until its reply
+//				chunks are taken, so a large request sent
+//				whole first would fill both socket buffers
+//				and stall, on a Unix socket long before TCP.
+//				The connection is dropped on any error and
+//				opened again by the next request.
+//
+// @param		stats - the client, which owns the connection
+// @return		one of the REQ_ outcomes
+//..........................................................
+int runBinaryRequest(struct clientStats* stats)
+{
+	char buffer[OTP_CHUNK];
+	struct otpHeader reply;
+	struct pollfd pfd;
+	int sent = 0;
+	int received = 0;
+	int want, n;
+
+	if (stats->socketFD < 0 && (stats->socketFD = connectDaemon(&stats->seal)) < 0)
+	{
+		return REQ_FAILED;
+	}
+	pfd.fd = stats->socketFD;
+	while (received < replySize)
+	{
+		pfd.events = POLLIN | (sent < requestSize || sealPending(stats->seal) > 0 ? POLLOUT : 0);
+		if (poll(&pfd, 1, REPLY_TIMEOUT) <= 0)
+		{
+			dropConnection(stats);
+			return REQ_FAILED;
+		}
+
+		// send as much of the request as the socket takes
+		if (pfd.revents & POLLOUT)
+		{
+			n = sent < requestSize ?
+				sealSend(stats->seal, stats->socketFD, request + sent, requestSize - sent, MSG_NOSIGNAL | MSG_DONTWAIT) :
+				sealFlush(stats->seal, stats->socketFD, MSG_DONTWAIT);
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				dropConnection(stats);
+				return REQ_FAILED;
+			}
+			sent += n > 0 ? n : 0;
+		}
+
+		// read every reply byte that has arrived
+		while (received < replySize && (pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+		{
+			want = replySize - received;
+			if (received < OTP_HEADER_SIZE)
+			{
+				want = OTP_HEADER_SIZE - received;					// the header lands at the start of the buffer
+			}
+			n = sealRecv(stats->seal, stats->socketFD, buffer + (received < OTP_HEADER_SIZE ? received : 0), want < (int)sizeof(buffer) ? want : (int)sizeof(buffer), MSG_DONTWAIT);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			{
+				break;
+			}
+			if (n <= 0)
+			{
+				dropConnection(stats);
+				return REQ_FAILED;
+			}
+			received += n;
+			if (received == OTP_HEADER_SIZE && (unpackHeader(buffer, &reply) < 0 || reply.code != OTP_OK))
+			{
+				dropConnection(stats);						// refused: busy, or the daemon is the wrong one
+				return reply.code == OTP_BUSY ? REQ_BUSY : REQ_FAILED;
+			}
+		}
+	}
+	return REQ_OK;
+}
+
+// runOneConnection
+//
+// description: connects to the daemon, sends the request
+//				and reads the reply until the server closes
+//
+// @return		one of the REQ_ outcomes
+//..........................................................
+int runOneConnection()
+{
+	int socketFD;
+	int received = 0;
+	int n;
+	char buffer[BUFFERSIZE];
+	struct otpSeal* seal;
+
+	socketFD = connectDaemon(&seal);
+	if (socketFD < 0)
+	{
+		return REQ_FAILED;
+	}
+	if (sendRequest(socketFD, seal) < 0)
+	{
+		close(socketFD);
+		sealClose(seal);
+		return REQ_FAILED;
+	}
+	while ((n = sealRecv(seal, socketFD, buffer + (received > 0), sizeof(buffer) - 1, 0)) > 0)	// keep the reply's first byte
+	{
+		received += n;
+	}
+
+	close(socketFD);
+	sealClose(seal);
+	if (received > 0 && buffer[0] == BUSY_FAIL[0])
+	{
+		return REQ_BUSY;
+	}
+	return received >= replySize ? REQ_OK : REQ_FAILED;
+}
+
+// waitUntil
+//
+// description: sleeps until a point on the monotonic clock
+//
+// @param		when - the time, in nowSeconds() seconds
+//..........................................................
+void waitUntil(double when)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)when;
+	ts.tv_nsec = (long)((when - ts.tv_sec) * 1e9);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0 && running)
+	{
+	}
+}
+
+// clientThread
+//
+// description: runs requests until the benchmark time is
+//				up: back to back in a closed loop, or every
+//				interval seconds in an open loop, where the
+//				clients' schedules are staggered so the
+//				requests arrive evenly. Each latency is taken
+//				from when the request was due.
+//
+// @param		arg - this thread's clientStats
+//..........................................................
+void* clientThread(void* arg)
+{
+	struct clientStats* stats = arg;
+	double due = benchStart + interval * stats->index / clientCount;
+	double now;
+	int outcome;
+
+	while (running)
+	{
+		now = nowSeconds();
+		if (interval > 0)
+		{
+			if (due > now)
+			{
+				waitUntil(due);
+				if (!running)
+				{
+					break;
+				}
+			}
+		}
+		else
+		{
+			due = now;
+		}
+
+		outcome = binaryMode ? runBinaryRequest(stats) : runOneConnection();
+		if (outcome == REQ_OK)
+		{
+			stats->requests++;
+			latRecord(&stats->latency, (unsigned long long)((nowSeconds() - due) * 1e9));
+		}
+		else if (outcome == REQ_BUSY)
+		{
+			stats->busy++;
+		}
+		else
+		{
+			stats->failures++;
+		}
+		due += interval;
+	}
+	if (stats->socketFD >= 0)
+	{
+		dropConnection(stats);
+	}
+	return NULL;
+}
+
+// cipherThroughput
+//
+// description: runs one kernel over a block again and again,
+//				reading the clock only after each CIPHER_BATCH
+//				bytes, so small blocks time the kernel and not
+//				clock_gettime
+//
+// @param		split - the team to split each block across, or
+//				NULL to run the kernel on this thread
+// @param		op - OP_ENC or OP_DEC
+// @param		block - the message block, overwritten
+// @param		key - the key block
+// @param		size - bytes in each block
+// @param		duration - seconds to run for
+// @return		throughput in GB/s
+//..........................................................
+double cipherThroughput(struct otpSplit* split, int op, char* block, const char* key, size_t size, int duration)
+{
+	double start = nowSeconds();
+	double elapsed;
+	long rounds = 0;
+	long batch = size < CIPHER_BATCH ? CIPHER_BATCH / size : 1;
+	long i;
+
+	do
+	{
+		for (i = 0; i < batch; i++)
+		{
+			splitCipher(split, op, block, key, size);
+		}
+		rounds += batch;
+		elapsed = nowSeconds() - start;
+	}
+	while (elapsed < duration);
+
+	return rounds * (double)size / elapsed / 1e9;
+}
+
+// runCipherBench
+//
+// description: checks every supported kernel level against
+//				the scalar kernel, then reports its encryption
+//				and decryption throughput. With more than one
+//				thread the best level is also run split.
+//
+// @param		size - bytes in the block
+// @param		duration - seconds per level and operation
+// @param		threads - threads for the split run, 1 for none
+// @return		0, or 1 if a kernel gave a wrong result
+//..........................................................
+int runCipherBench(size_t size, int duration, int threads)
+{
+	struct otpSplit* split = NULL;
+	int best = CIPHER_SCALAR;
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+	char* plain = malloc(size);
+	char* key = malloc(size);
+	char* expected = malloc(size);
+	char* block = malloc(size);
+	int level, op, wrong = 0;
+	size_t i;
+
+	if (plain == NULL || key == NULL || expected == NULL || block == NULL)
+	{
+		error("BENCH: ERROR allocating cipher blocks");
+	}
+	srand(1);
+	for (i = 0; i < size; i++)
+	{
+		plain[i] = alphabet[rand() % 27];
+		key[i] = alphabet[rand() % 27];
+	}
+
+	for (level = 0; level <= CIPHER_LEVELS; level++)
+	{
+		if (level == CIPHER_LEVELS)							// the extra round: the best level, split
+		{
+			if (threads < 2 || (split = splitOpen(threads)) == NULL)
+			{
+				break;
+			}
+			cipherUse(best);
+			printf("%s%-8s", GRN, "split");
+		}
+		else if (!cipherSupported(level))
+		{
+			printf("%s%-8s%s not supported by this CPU%s\n", GRN, cipherLevelNames[level], CYN, NRM);
+			continue;
+		}
+		else
+		{
+			best = level;
+			cipherUse(level);
+			printf("%s%-8s", GRN, cipherLevelNames[level]);
+		}
+		for (op = OP_ENC; op <= OP_DEC; op++)
+		{
+			memcpy(expected, plain, size);						// check the kernel against the scalar one
+			cipherScalar(op, expected, key, size);
+			memcpy(block, plain, size);
+			splitCipher(split, op, block, key, size);
+			if (memcmp(block, expected, size) != 0)
+			{
+				printf("%s%s: WRONG RESULT ", RED, op == OP_ENC ? "enc" : "dec");
+				wrong = 1;
+				continue;
+			}
+			printf("%s%s: %s%7.2f GB/s  ", GRN, op == OP_ENC ? "enc" : "dec", CYN, cipherThroughput(split, op, block, key, size, duration));
+		}
+		if (split != NULL)
+		{
+			printf("%s(%s on %d threads)", GRN, cipherLevelNames[best], split->threads);
+		}
+		printf("%s\n", NRM);
+	}
+
+	free(plain);
+	free(key);
+	free(expected);
+	free(block);
+	return wrong;
+}
+
+// keygenThread
+//
+// description: fills one block with key characters again
+//				and again until the time is up
+//
+// @param		arg - the thread's keygenStats
+//..........................................................
+void* keygenThread(void* arg)
+{
+	struct keygenStats* stats = arg;
+	char* block = malloc(stats->size);
+
+	if (block == NULL)
+	{
+		error("BENCH: ERROR allocating keygen block");
+	}
+	while (running)
+	{
+		if (randFill(stats->source, &stats->rng, block, stats->size) < 0)
+		{
+			error("BENCH: ERROR reading getrandom");
+		}
+		stats->bytes += stats->size;
+	}
+	free(block);
+	return NULL;
+}
+
+// runKeygenBench
+//
+// description: reports the throughput of every keygen
+//				source on one thread and on several
+//
+// @param		threads - threads for the parallel run
+// @param		size - bytes in each block
+// @param		duration - seconds per source and thread count
+// @return		0
+//..........................................................
+int runKeygenBench(int threads, size_t size, int duration)
+{
+	pthread_t thread[MAX_CLIENTS];
+	struct keygenStats stats[MAX_CLIENTS];
+	struct otpRand rng;
+	double start, elapsed, bytes;
+	int source, count, i;
+
+	randSeed(&rng, randEntropy());
+	for (source = 0; source < RAND_SOURCES; source++)
+	{
+		printf("%s%-8s", GRN, randSourceNames[source]);
+		for (count = 1; count <= threads; count = (count == threads) ? threads + 1 : threads)
+		{
+			memset(stats, 0, sizeof(stats));
+			running = 1;
+			start = nowSeconds();
+			for (i = 0; i < count; i++)
+			{
+				stats[i].source = source;
+				stats[i].size = size;
+				stats[i].rng = rng;
+				randJump(&rng);
+				if (pthread_create(&thread[i], NULL, keygenThread, &stats[i]) != 0)
+				{
+					error("BENCH: ERROR creating keygen thread");
+				}
+			}
+			sleep(duration);
+			running = 0;
+			bytes = 0;
+			for (i = 0; i < count; i++)
+			{
+				pthread_join(thread[i], NULL);
+				bytes += stats[i].bytes;
+			}
+			elapsed = nowSeconds() - start;
+			printf("%s%d thread%s: %s%7.2f GB/s  ", GRN, count, count == 1 ? "" : "s", CYN, bytes / elapsed / 1e9);
+		}
+		printf("%s\n", NRM);
+	}
+	return 0;
+}
+
+// parseRequest
+//
+// description: writes one well formed request for the
+//				parser in either framing. Binary requests
+//				interleave message and key chunks and follow
+//				them with the unused key.
+//
+// @param		binary - 1 for the binary framing
+// @param		op - OP_ENC or OP_DEC
+// @param		message - the message
+// @param		key - the key, at least n characters
+// @param		n - message characters
+// @param		keyLen - key characters to send
+// @param		requestId - the binary request id
+// @param		out - room for parseRequestSize() bytes
+// @return		the size of the request
+//..........................................................
+size_t parseRequest(int binary, int op, const char* message, const char* key, size_t n, size_t keyLen, unsigned int requestId, char* out)
+{
+	struct otpHeader header;
+	size_t at = 0, done, chunk;
+
+	if (!binary)
+	{
+		memcpy(out, op == OP_ENC ? ENC_CLIENT : DEC_CLIENT, 2);
+		memcpy(out + 2, message, n);
+		memcpy(out + 2 + n, MID_SENTINEL, 2);
+		memcpy(out + 4 + n, key, keyLen);
+		memcpy(out + 4 + n + keyLen, END_SENTINEL, 2);
+		return 6 + n + keyLen;
+	}
+	header.version = OTP_VERSION;
+	header.code = op;
+	header.requestId = requestId;
+	header.messageLen = n;
+	header.keyLen = keyLen;
+	packHeader(out, &header);
+	at = OTP_HEADER_SIZE;
+	for (done = 0; done < n; done += chunk)
+	{
+		chunk = n - done < OTP_CHUNK ? n - done : OTP_CHUNK;
+		memcpy(out + at, message + done, chunk);
+		memcpy(out + at + chunk, key + done, chunk);
+		at += 2 * chunk;
+	}
+	memcpy(out + at, key + n, keyLen - n);
+	return at + keyLen - n;
+}
+
+// parseDrive
+//
+// description: feeds a request to a parser the way a server
+//				would, in pieces of random size up to
+//				parserWant(), sending every reply piece as
+//				soon as it is ready
+//
+// @param		parser - the parser
+// @param		data - the request bytes
+// @param		n - how many
+// @param		maxPiece - the largest piece to feed at once
+// @param		seed - rand_r() state for the piece sizes, or
+//				NULL to always feed maxPiece
+// @param		out - receives up to outCap reply bytes
+// @param		outCap - the size of out
+// @param		outLen - receives the number of reply bytes,
+//				including any beyond outCap
+// @return		the parser's state once it wants no more
+//				input or the request has all been fed
+//..........................................................
+int parseDrive(struct otpParser* parser, const char* data, size_t n, size_t maxPiece, unsigned int* seed,
+	char* out, size_t outCap, size_t* outLen)
+{
+	const char* reply;
+	size_t fed = 0, want, piece, ready;
+
+	*outLen = 0;
+	while (1)
+	{
+		while ((ready = parserReply(parser, &reply)) > 0)
+		{
+			if (*outLen < outCap)
+			{
+				memcpy(out + *outLen, reply, ready < outCap - *outLen ? ready : outCap - *outLen);
+			}
+			*outLen += ready;
+			parserReplySent(parser, ready);
+		}
+		want = parserWant(parser);
+		if (fed == n || want == 0)
+		{
+			return parser->state;
+		}
+		piece = seed ? 1 + rand_r(seed) % maxPiece : maxPiece;
+		piece = piece < want ? piece : want;
+		piece = piece < n - fed ? piece : n - fed;
+		parserFeed(parser, data + fed, piece);
+		fed += piece;
+	}
+}
+
+// parseRoundTrip
+//
+// description: encrypts a random message through the parser
+//				and decrypts the reply through it again, fed in
+//				random pieces, and checks both replies against
+//				the scalar kernel and the original message
+//
+// @param		binary - 1 for the binary framing
+// @param		n - message characters
+// @param		seed - rand_r() state
+// @param		buf - room for requests and replies of n
+//				characters
+// @return		1 if the round trip held, else 0
+//..........................................................
+int parseRoundTrip(int binary, size_t n, unsigned int* seed, char* buf)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+	struct otpParser parser;
+	struct otpHeader header;
+	size_t keyLen = n + rand_r(seed) % 100;			// keys longer than the message must work too
+	char* plain = buf;
+	char* key = plain + n;
+	char* expected = key + keyLen;
+	char* request = expected + n;
+	char* reply = request + OTP_HEADER_SIZE + n + keyLen + 6;
+	size_t replyCap = OTP_HEADER_SIZE + n;
+	size_t size, replyLen, skip = binary ? OTP_HEADER_SIZE : 0;
+	int op, state, ok = 1;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+	{
+		plain[i] = alphabet[rand_r(seed) % 27];
+	}
+	for (i = 0; i < keyLen; i++)
+	{
+		key[i] = alphabet[rand_r(seed) % 27];
+	}
+	memcpy(expected, plain, n);
+	for (op = OP_ENC; op <= OP_DEC; op++)				// expected holds the plaintext, then the ciphertext
+	{
+		cipherScalar(op, expected, key, n);
+		size = parseRequest(binary, op, op == OP_ENC ? plain : reply + skip, key, n, keyLen, op, request);
+		parserInit(&parser, OP_ENC | OP_DEC, NULL, NULL, NULL);
+		state = parseDrive(&parser, request, size, 1 + rand_r(seed) % (2 * OTP_CHUNK), seed, reply, replyCap, &replyLen);
+		parserFree(&parser);
+		if (binary)
+		{
+			ok = ok && state == PARSE_HANDSHAKE && replyLen == replyCap && unpackHeader(reply, &header) == 0 &&
+				header.code == OTP_OK && header.requestId == (unsigned int)op;
+		}
+		else
+		{
+			ok = ok && state == PARSE_DONE && replyLen == n;
+		}
+		ok = ok && memcmp(reply + skip, op == OP_ENC ? expected : plain, n) == 0;
+	}
+	return ok;
+}
+
+// parseMutate
+//
+// description: damages a request: flips bytes, plants
+//				sentinels, cuts it short, repeats a stretch, or
+//				fills binary length fields with extreme values
+//
+// @param		data - the request, with room for twice its size
+// @param		n - its size
+// @param		seed - rand_r() state
+// @return		the new size
+//..........................................................
+size_t parseMutate(char* data, size_t n, unsigned int* seed)
+{
+	static const char planted[] = "!$#@%*OT";
+	int rounds = 1 + rand_r(seed) % 4;
+	size_t at, len;
+
+	while (rounds-- > 0 && n > 0)
+	{
+		at = rand_r(seed) % n;
+		switch (rand_r(seed) % 5)
+		{
+			case 0:
+				data[at] = (char)rand_r(seed);
+				break;
+			case 1:
+				data[at] = planted[rand_r(seed) % (sizeof(planted) - 1)];
+				break;
+			case 2:
+				n = at;
+				break;
+			case 3:
+				len = rand_r(seed) % (n - at) + 1;
+				memmove(data + at + len, data + at, n - at);
+				n += len;
+				break;
+			case 4:
+				if (n >= OTP_HEADER_SIZE)
+				{
+					memset(data + 8 + (rand_r(seed) % 2) * 8, rand_r(seed) % 2 ? 0xFF : 0x7F, 1 + rand_r(seed) % 8);
+				}
+				break;
+		}
+	}
+	return n;
+}
+
+// parseThroughput
+//
+// description: feeds the same well formed request to the
+//				parser again and again, in OTP_CHUNK byte
+//				pieces as a receive loop would
+//
+// @param		binary - 1 for the binary framing, on one
+//				persistent connection
+// @param		request - the request
+// @param		size - its size
+// @param		reply - room for its reply
+// @param		replyCap - the size of reply
+// @param		duration - seconds to run for
+// @return		requests parsed per second
+//..........................................................
+double parseThroughput(int binary, const char* request, size_t size, char* reply, size_t replyCap, int duration)
+{
+	struct otpParser parser;
+	double start = nowSeconds();
+	double elapsed;
+	size_t replyLen;
+	long rounds = 0;
+
+	parserInit(&parser, OP_ENC | OP_DEC, NULL, NULL, NULL);
+	do
+	{
+		if (!binary)
+		{
+			parserFree(&parser);
+			parserInit(&parser, OP_ENC | OP_DEC, NULL, NULL, NULL);
+		}
+		if (parseDrive(&parser, request, size, OTP_CHUNK, NULL, reply, replyCap, &replyLen) >= PARSE_REJECTED)
+		{
+			error("BENCH: ERROR, the parser refused a well formed request");
+		}
+		rounds++;
+		elapsed = nowSeconds() - start;
+	}
+	while (elapsed < duration);
+	parserFree(&parser);
+
+	return rounds / elapsed;
+}
+
+// runParseBench
+//
+// description: checks the request parser, then measures it.
+//				Round trips of random messages of many sizes,
+//				in both framings and fed in random pieces, must
+//				come back as they went in; PARSE_MUTATIONS
+//				damaged requests must each end cleanly, in any
+//				state, with no more reply than input allows
+//				(build with -fsanitize=address to check memory
+//				too). Then each framing parses -s character
+//				requests for -d seconds.
+//
+// @param		size - message characters per timed request
+// @param		duration - seconds per framing
+// @param		jsonMode - 1 to print the results as JSON
+// @param		threads - threads to split the cipher work
+//				across, 1 for none
+// @return		0, or 1 if a check failed
+//..........................................................
+int runParseBench(size_t size, int duration, int jsonMode, int threads)
+{
+	static const size_t sizes[] = { 0, 1, 2, 3, 63, 64, 1000, OTP_CHUNK - 1, OTP_CHUNK, OTP_CHUNK + 1, 3 * OTP_CHUNK + 17,
+		SPLIT_MIN, SPLIT_BATCH + 5 * OTP_CHUNK + 3, 2 * SPLIT_BATCH };
+	struct otpParser parser;
+	unsigned int seed = 1;
+	size_t sizeCount = sizeof(sizes) / sizeof(sizes[0]) - (threads > 1 ? 0 : 3);	// the batch sizes only matter when split
+	size_t maxSize = size > sizes[sizeCount - 1] + OTP_CHUNK ? size : sizes[sizeCount - 1] + OTP_CHUNK;
+	char* buf = malloc(8 * maxSize + 1024);
+	char* request;
+	size_t n, replyLen, requestSize;
+	long outcomes[PARSE_ERROR + 1] = { 0 };
+	long trips = 0, failed = 0, broken = 0;
+	double rate[2];
+	int binary, state, i;
+
+	if (buf == NULL)
+	{
+		error("BENCH: ERROR allocating parser buffers");
+	}
+	if (threads > 1 && (cipherSplit = splitOpen(threads)) == NULL)
+	{
+		error("BENCH: ERROR allocating the cipher threads");
+	}
+
+	// round trips
+	// ......................
+	for (binary = 0; binary <= 1; binary++)
+	{
+		for (i = 0; i < (int)sizeCount * 8; i++)
+		{
+			failed += !parseRoundTrip(binary, sizes[i % sizeCount], &seed, buf);
+			trips++;
+		}
+	}
+
+	// damaged requests
+	// ......................
+	request = buf + 4 * maxSize;
+	for (i = 0; i < PARSE_MUTATIONS; i++)
+	{
+		binary = rand_r(&seed) % 2;
+		n = rand_r(&seed) % 300;
+		memset(buf, 'A' + rand_r(&seed) % 26, n + 300);
+		requestSize = parseRequest(binary, OP_ENC + rand_r(&seed) % 2, buf, buf, n, n + rand_r(&seed) % 3, i, request);
+		requestSize = parseMutate(request, requestSize, &seed);
+		parserInit(&parser, OP_ENC | OP_DEC, NULL, NULL, NULL);
+		state = parseDrive(&parser, request, requestSize, 1 + rand_r(&seed) % 64, &seed, buf, 2 * maxSize, &replyLen);
+		broken += state < 0 || state > PARSE_ERROR || replyLen > requestSize + OTP_HEADER_SIZE * (requestSize / OTP_HEADER_SIZE + 1);
+		if (state == PARSE_HANDSHAKE && parser.requests > 0)
+		{
+			state = PARSE_DONE;								// a binary connection waiting for its next request
+		}
+		outcomes[state >= 0 && state <= PARSE_ERROR ? state : PARSE_ERROR]++;
+		parserFree(&parser);
+	}
+
+	// throughput
+	// ......................
+	for (n = 0; n < size; n++)
+	{
+		buf[n] = 'A' + n % 26;
+		buf[size + n] = 'Z' - n % 26;
+	}
+	for (binary = 0; binary <= 1; binary++)
+	{
+		requestSize = parseRequest(binary, OP_ENC, buf, buf + size, size, size, 0, request);
+		rate[binary] = parseThroughput(binary, request, requestSize, buf + 2 * size, OTP_HEADER_SIZE + size, duration);
+	}
+
+	if (jsonMode)
+	{
+		printf("{\"parser\": {\"message_size\": %zu, \"round_trips\": %ld, \"round_trip_failures\": %ld, \"mutations\": %d, \"mutation_failures\": %ld, ",
+			size, trips, failed, PARSE_MUTATIONS, broken);
+		printf("\"text_requests_per_sec\": %.1f, \"text_mb_per_sec\": %.3f, \"binary_requests_per_sec\": %.1f, \"binary_mb_per_sec\": %.3f}}\n",
+			rate[0], rate[0] * size / 1e6, rate[1], rate[1] * size / 1e6);
+	}
+	else
+	{
+		printf("%sround trips: %s%ld%s, %s%ld failed%s\n", GRN, CYN, trips, GRN, failed ? RED : CYN, failed, NRM);
+		printf("%sdamaged requests: %s%d%s, %s%ld broken%s  %s(done %ld, rejected %ld, error %ld, wanting more %ld)%s\n", GRN, CYN, PARSE_MUTATIONS, GRN,
+			broken ? RED : CYN, broken, NRM, GRN, outcomes[PARSE_DONE], outcomes[PARSE_REJECTED], outcomes[PARSE_ERROR],
+			(long)PARSE_MUTATIONS - outcomes[PARSE_DONE] - outcomes[PARSE_REJECTED] - outcomes[PARSE_ERROR], NRM);
+		for (binary = 0; binary <= 1; binary++)
+		{
+			printf("%s%-8s%s%12.0f requests/s  %10.1f MB/s%s\n", GRN, binary ? "binary" : "text", CYN, rate[binary], rate[binary] * size / 1e6, NRM);
+		}
+	}
+	free(buf);
+	return failed || broken;
+}
+
+// printLatency
+//
+// description: prints one latency figure
+//
+// @param		label - what it is
+// @param		ns - the latency in nanoseconds
+//..........................................................
+void printLatency(const char* label, double ns)
+{
+	printf("%s%s: %s%.1fus%s  ", GRN, label, CYN, ns / 1e3, NRM);
+}
+
+// printJson
+//
+// description: prints the results of a run as one JSON
+//				object, latencies in microseconds
+//
+// @param		op - OP_ENC or OP_DEC
+// @param		messageSize - characters per message
+// @param		rate - the open loop rate, or 0
+// @param		elapsed - seconds the run took
+// @param		requests - completed requests
+// @param		failures - failed requests
+// @param		busy - requests refused busy
+// @param		latency - the merged histogram
+// @param		selfCpu - the benchmark's CPU seconds
+// @param		daemonCpu - the daemon's CPU seconds, or -1
+//..........................................................
+void printJson(int op, int messageSize, double rate, double elapsed, long requests, long failures, long busy,
+	const struct latencyHist* latency, double selfCpu, double daemonCpu)
+{
+	printf("{\"framing\": \"%s\", \"transport\": \"%s%s\", \"op\": \"%s\", \"loop\": \"%s\", \"clients\": %d, \"message_size\": %d, ",
+		binaryMode ? "binary" : "text", daemonEndpoint.family == AF_UNIX ? "unix" : "tcp", benchPsk != NULL ? "+psk" : "",
+		op == OP_ENC ? "enc" : "dec", rate > 0 ? "open" : "closed", clientCount, messageSize);
+	printf("\"target_rate\": %.1f, \"seconds\": %.3f, \"requests\": %ld, \"failures\": %ld, \"busy\": %ld, ", rate, elapsed, requests, failures, busy);
+	printf("\"requests_per_sec\": %.1f, \"message_mb_per_sec\": %.3f, ", requests / elapsed, requests * (double)messageSize / elapsed / 1e6);
+	printf("\"latency_us\": {\"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}, ",
+		latency->min / 1e3, latency->total ? latency->sum / latency->total / 1e3 : 0.0, latPercentile(latency, 50) / 1e3,
+		latPercentile(latency, 90) / 1e3, latPercentile(latency, 99) / 1e3, latPercentile(latency, 99.9) / 1e3, latency->max / 1e3);
+	printf("\"bench_cpu_sec\": %.3f, \"daemon_cpu_sec\": ", selfCpu);
+	if (daemonCpu >= 0)
+	{
+		printf("%.3f}\n", daemonCpu);
+	}
+	else
+	{
+		printf("null}\n");
+	}
+}
+
+/**********************************************************
+// MAIN FUNCTION
+// ********************************************************/
+
+int main(int argc, char *argv[])
+{
+	static struct option longOptions[] =
+	{
+		{ "clients",	required_argument,	0, 'c' },
+		{ "duration",	required_argument,	0, 'd' },
+		{ "size",		required_argument,	0, 's' },
+		{ "dec",		no_argument,		0, 'D' },
+		{ "cipher",		no_argument,		0, 'C' },
+		{ "keygen",		no_argument,		0, 'K' },
+		{ "parse",		no_argument,		0, 'X' },
+		{ "pid",		required_argument,	0, 'p' },
+		{ "binary",		no_argument,		0, 'b' },
+		{ "rate",		required_argument,	0, 'r' },
+		{ "json",		no_argument,		0, 'j' },
+		{ "psk",		required_argument,	0, 'P' },
+		{ 0, 0, 0, 0 }
+	};
+	int opt;
+	int clients = 5;
+	int duration = 5;
+	int messageSize = 64;
+	int cipherMode = 0;
+	int clientsSet = 0;
+	int sizeSet = 0;
+	int keygenMode = 0;
+	int parseMode = 0;
+	int jsonMode = 0;
+	int daemonPid = 0;
+	int op = OP_ENC;
+	double rate = 0;
+	double daemonCpu = 0, selfCpu = 0;
+	const char* unit;
+	pthread_t threads[MAX_CLIENTS];
+	struct clientStats* stats;
+	struct latencyHist* latency;
+	long requests = 0;
+	long failures = 0;
+	long busy = 0;
+	double elapsed;
+	int i;
+
+	// input validation
+	// ......................
+	while ((opt = getopt_long(argc, argv, "c:d:s:DCKXp:br:jP:", longOptions, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 'c': clients = atoi(optarg); clientsSet = 1; break;
+			case 'd': duration = atoi(optarg); break;
+			case 's': messageSize = atoi(optarg); sizeSet = 1; break;
+			case 'D': op = OP_DEC; break;
+			case 'C': cipherMode = 1; break;
+			case 'K': keygenMode = 1; break;
+			case 'X': parseMode = 1; break;
+			case 'p': daemonPid = atoi(optarg); break;
+			case 'b': binaryMode = 1; break;
+			case 'r': rate = atof(optarg); if (rate <= 0) { optind = argc + 1; } break;
+			case 'j': jsonMode = 1; break;
+			case 'P': benchPsk = sealLoadKey(optarg, &benchPskLen); break;
+			default:  optind = argc + 1;
+		}
+	}
+	if (cipherMode && !sizeSet)
+	{
+		messageSize = OTP_CHUNK;						// what the daemons cipher at a time
+	}
+	if (cipherMode && optind == argc && duration >= 1 && messageSize >= 1 && clients >= 1 && clients <= SPLIT_MAX_THREADS)
+	{
+		return runCipherBench(messageSize, duration, clientsSet ? clients : 1);
+	}
+	if (keygenMode && optind == argc && clients >= 1 && clients <= MAX_CLIENTS && duration >= 1 && messageSize >= 1)
+	{
+		return runKeygenBench(clients, messageSize, duration);
+	}
+	if (parseMode && optind == argc && duration >= 1 && messageSize >= 0 && clients >= 1 && clients <= SPLIT_MAX_THREADS)
+	{
+		return runParseBench(messageSize, duration, jsonMode, clientsSet ? clients : 1);
+	}
+	if (optind != argc - 1 || clients < 1 || clients > MAX_CLIENTS || duration < 1 || messageSize < 1 ||
+		endpointParse(argv[optind], &daemonEndpoint) < 0)
+	{
+		fprintf(stderr,"%sUSAGE: %s%s port|unix:/path|@name [-c clients] [-d seconds] [-s messagesize] [--dec] [--binary] [-r rate] [--json] [-p pid] [--psk file]%s\n", RED, CYN, argv[0], NRM);
+		fprintf(stderr,"%s       %s%s --cipher [-c threads] [-d seconds] [-s blocksize]%s\n", RED, CYN, argv[0], NRM);
+		fprintf(stderr,"%s       %s%s --keygen [-c threads] [-d seconds] [-s blocksize]%s\n", RED, CYN, argv[0], NRM);
+		fprintf(stderr,"%s       %s%s --parse [-c threads] [-d seconds] [-s messagesize] [--json]%s\n", RED, CYN, argv[0], NRM);
+		exit(1);
+	}
+
+	if (binaryMode)
+	{
+		buildBinaryRequest(op, messageSize);
+	}
+	else
+	{
+		buildRequest(op == OP_ENC ? ENC_CLIENT : DEC_CLIENT, messageSize);
+	}
+	unit = binaryMode ? "requests" : "connections";
+	clientCount = clients;
+	interval = rate > 0 ? clients / rate : 0;
+	stats = calloc(clients, sizeof(*stats));				// a histogram per client, so none is shared
+	latency = calloc(1, sizeof(*latency));
+	if (stats == NULL || latency == NULL)
+	{
+		error("BENCH: ERROR allocating client stats");
+	}
+
+	// run the clients for the requested time
+	// ......................
+	if (daemonPid > 0)
+	{
+		daemonCpu = daemonCpuSeconds(daemonPid);
+	}
+	selfCpu = selfCpuSeconds();
+	benchStart = nowSeconds();
+	for (i = 0; i < clients; i++)
+	{
+		stats[i].index = i;
+		stats[i].socketFD = -1;
+		if (pthread_create(&threads[i], NULL, clientThread, &stats[i]) != 0)
+		{
+			error("BENCH: ERROR creating client thread");
+		}
+	}
+	sleep(duration);
+	running = 0;
+	for (i = 0; i < clients; i++)
+	{
+		pthread_join(threads[i], NULL);
+		requests += stats[i].requests;
+		failures += stats[i].failures;
+		busy += stats[i].busy;
+		latMerge(latency, &stats[i].latency);
+	}
+	elapsed = nowSeconds() - benchStart;
+	selfCpu = selfCpuSeconds() - selfCpu;
+	if (daemonPid > 0)
+	{
+		daemonCpu = daemonCpuSeconds(daemonPid) - daemonCpu;
+	}
+
+	// report
+	// ......................
+	if (jsonMode)
+	{
+		printJson(op, messageSize, rate, elapsed, requests, failures, busy, latency, selfCpu, daemonPid > 0 ? daemonCpu : -1);
+		free(request);
+		return failures > 0;
+	}
+	printf("%sclients: %s%d%s  message size: %s%d%s  seconds: %s%.2f%s", GRN, CYN, clients, GRN, CYN, messageSize, GRN, CYN, elapsed, NRM);
+	printf("%s  transport: %s%s%s%s", GRN, CYN, daemonEndpoint.family == AF_UNIX ? "unix" : "tcp", benchPsk != NULL ? "+psk" : "", NRM);
+	if (rate > 0)
+	{
+		printf("%s  open loop at: %s%.1f/sec%s", GRN, CYN, rate, NRM);
+	}
+	printf("\n%s%s: %s%ld%s  failures: %s%ld%s  busy: %s%ld%s  %s/sec: %s%.1f%s\n", GRN, unit, CYN, requests, GRN, CYN, failures, GRN, CYN, busy, GRN, unit, CYN, requests / elapsed, NRM);
+	if (requests > 0)
+	{
+		printLatency("min", latency->min);
+		printLatency("mean", latency->sum / latency->total);
+		printLatency("p50", latPercentile(latency, 50));
+		printLatency("p90", latPercentile(latency, 90));
+		printf("\n");
+		printLatency("p99", latPercentile(latency, 99));
+		printLatency("p99.9", latPercentile(latency, 99.9));
+		printLatency("max", latency->max);
+		printf("\n");
+		printf("%sbench CPU: %s%.2fs%s  (%s%.3f%s CPU-s per 10k %s)%s\n", GRN, CYN, selfCpu, GRN, CYN, selfCpu * 10000 / requests, GRN, unit, NRM);
+	}
+	if (daemonPid > 0 && requests > 0)
+	{
+		printf("%sdaemon CPU: %s%.2fs%s  (%s%.3f%s CPU-s per 10k %s)%s\n", GRN, CYN, daemonCpu, GRN, CYN, daemonCpu * 10000 / requests, GRN, unit, NRM);
+	}
+
+	free(stats);
+	free(latency);
+	free(request);
+	return failures > 0;
+}
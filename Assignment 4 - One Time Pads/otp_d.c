@@ -0,0 +1,106 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otp_d.c
+//
+//		[x]		This program performs exactly like otp_enc_d and otp_dec_d, in syntax and usage, but serves
+//				both otp_enc and otp_dec on one port. Each request is encrypted or decrypted according to
+//				its own code word (text framing) or header opcode (binary framing), so one worker pool,
+//				one set of buffers and one cipher kernel replace the two daemon fleets. Requests are
+//				counted separately per operation; kill -USR1 the daemon to print the counts, or scrape
+//				them with --metrics port.
+//
+//		[x]		Use this syntax for otp_d: otp_d listening_port [options], with the same options as the
+//				other daemons.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+/**********************************************************
+// HEADER 1
+// ********************************************************/
+
+// header 2
+// ......................
+
+// functionComment
+//
+// description: some description
+//
+// @param		parameter - 
+// @return		return - 
+//..........................................................
+
+#define _GNU_SOURCE					// struct ucred, for SO_PEERCRED on unix: endpoints
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h> 
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h> 
+#include <sys/ioctl.h>
+
+/**********************************************************
+// GLOBALS
+// ********************************************************/
+
+// message colors
+// ......................
+#define RED  "\x1B[31m"		// red text
+#define GRN  "\x1B[32m"		// green text
+#define CYN  "\x1B[36m"		// cyan text
+#define NRM  "\x1B[0m"		// normal text
+
+// transmission variables
+// ......................
+#define CON_FAIL 		"*"		// a sentinel which indicates that the client-server handshake was unsuccessful
+#define BUSY_FAIL 		"%"		// a sentinel, followed by a retry-after in ms, which indicates that the server is overloaded
+#define ENC_CLIENT 		"!!"	// a sentinel which indicates that the client requests encryption
+#define DEC_CLIENT 		"$$"	// a sentinel which indicates that the client requests decryption
+#define MID_SENTINEL	"##"	// a sentinel which separates the message from the key
+#define END_SENTINEL	"@@"	// a sentinel which indicates the end of transmission
+#define BUFFERSIZE		1024	// size of the buffer
+
+/**********************************************************
+// HELPER FUNCTIONS
+// ********************************************************/
+
+// error
+//
+// description: Error function used for reporting issues
+//				that can be shown with perror
+//
+// @param		msg - an error message to report
+//..........................................................
+void error(const char *msg)
+{ 
+	fprintf(stderr, "%s", RED);		// change text color to red
+	perror(msg);					// send an error message to standard error
+	fprintf(stderr, "%s", NRM);		// change text color to normal
+	exit(1); 
+}
+
+#include "otpServer.c"
+
+/**********************************************************
+// MAIN FUNCTION
+// ********************************************************/
+
+int main(int argc, char *argv[])
+{
+	struct serverConfig config;
+
+	// input validation
+	// ......................
+	parseServerArgs(argc, argv, &config);		// exits with the usage message on bad input
+
+	// listen for connections and serve them
+	// ......................
+	config.ops = OP_ENC | OP_DEC;				// serve otp_enc and otp_dec alike
+	runServer(&config);
+	return 0; 
+}
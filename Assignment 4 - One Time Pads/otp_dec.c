@@ -11,6 +11,10 @@
 //				same three ways. otp_dec should NOT be able to connect to otp_enc_d, even if it tries to connect 
 //				on the correct port - you'll need to have the programs reject each other, as described in otp_enc.
 //
+//		[x]		Like otp_enc, it uses the binary protocol unless --text is given, and takes --batch filelist,
+//				--key-id, --psk file, - to stream stdin, --container, --resume, and a unix:/path or @name in
+//				place of the port.
+//
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
 
 /**********************************************************
@@ -53,12 +57,12 @@
 // transmission variables
 // ......................
 #define CON_FAIL 		"*"		// a sentinel which indicates that the client-server handshake was unsuccessful
+#define BUSY_FAIL 		"%"		// a sentinel, followed by a retry-after in ms, which indicates that the server is overloaded
 #define ENC_CLIENT 		"!!"	// a sentinel which indicates that the client requests encryption
 #define DEC_CLIENT 		"$$"	// a sentinel which indicates that the client requests decryption
 #define MID_SENTINEL	"##"	// a sentinel which separates the plaintext from the key
 #define END_SENTINEL	"@@"	// a sentinel which indicates the end of transmission
 #define BUFFERSIZE		1024	// size of the buffer
-#define	MAX_TRANS		262144	// maximum size of a transmission
 
 /**********************************************************
 // HELPER FUNCTIONS
@@ -78,59 +82,7 @@ void error(const char *msg)
 	exit(1); 
 }
 
-// checkFile
-//
-// description: checks to ensure file exists, can be
-//				opened, and for ANY bad characters. if
-//				there are any, it sends an error text to 
-//				stderr, sets the exit value to 1, and
-//				terminates the program. Also returns the
-//				size of the file.
-//
-// @param		fileName - the file to check
-// @return 		fileSize - the size of the file
-//..........................................................
-int checkFile(char* fileName)
-{ 
-	// initialize variables
-	FILE* fp;											// file pointer
-	struct stat st;										// stat struct
-	int i;												// iterator
-	char testChar;										// character to test against accepted values
-
-	// load file into stat structure
-	if (stat(fileName, &st) < 0)						// send error if the file is non-existant
-	{
-		fprintf(stderr,"%sCLIENT: ERROR %s does not exist%s\n", RED, fileName, NRM);
-		exit(1);
-	}
-
-	// open the file
-	fp = fopen(fileName, "r");							// send error if file does not open
-	if (fp == NULL)
-	{
-		fprintf(stderr,"%sCLIENT: ERROR opening %s%s\n", RED, fileName, NRM);
-		exit(1);
-	}
-
-	// validate that the file contains only accepted characters
-	for(i=0; i<st.st_size-1; i++)
-	{
-		testChar = fgetc(fp);
-
-		if( ((testChar < 'A') || (testChar > 'Z')) && (testChar != ' ') )
-		{
-			fprintf(stderr,"%sCLIENT: ERROR invalid characters in %s%s\n", RED, fileName, NRM);
-			exit(1);
-		}
-	}
-
-	// close the file
-	fclose(fp);
-
-	// return the file size
-	return st.st_size;
-}
+#include "otpClient.c"
 
 /**********************************************************
 // MAIN FUNCTION
@@ -140,160 +92,109 @@ int main(int argc, char *argv[])
 {
 	// initialize variables
 	// ......................
-	FILE* plainTextFP;
-	FILE* keyFP;
+	struct clientConfig config;
+	struct otpJob job;
+	struct otpJob* jobs;
+	struct otpStream stream;
+	struct otpContainer container;
+	struct otpContainer keyContainer;
+	size_t jobCount;
 	int socketFD;
-	int portNumber;
-	int charsWritten;
-	int charsRead;
-	int plainTextFileSize;
-	int keyFileSize;
-	int transmissionSize;
-	struct sockaddr_in serverAddress;
-	struct hostent* serverHostInfo;
-	char* buffer;
 
 	// input validation
 	// ......................
-	if (argc < 4) 
-	{ 
-		fprintf(stderr,"%sUSAGE: %s%s ciphertext key port%s\n", RED, CYN, argv[0], NRM);	 // Check usage & args
-		exit(1); 
-	}
+	parseClientArgs(argc, argv, &config, "ciphertext");							// Check usage & args
 
-	// file validation
+	// batch mode: every job in the list down one connection
 	// ......................
-	plainTextFileSize = checkFile(argv[1]);										// get the size of the plain text file
-	// printf("THE PLAIN TEXT FILE SIZE IS: %d\n", plainTextFileSize-1);		// print file size
-
-	keyFileSize = checkFile(argv[2]);											// get the size of the key file
-	// printf("THE KEY FILE SIZE IS: %d\n", keyFileSize-1);						// print file size
-
-	if(plainTextFileSize > keyFileSize)											// exit with error if the key is too short to decrypt the message
+	if (config.batchFile != NULL)
 	{
-		fprintf(stderr,"%sCLIENT: ERROR, key is too short to decrypt message%s\n", RED, NRM);
-		exit(1);
+		jobs = loadJobs(config.batchFile, config.keyIds, &jobCount);
+		socketFD = connectToServer(&config);
+		runBinaryJobs(socketFD, OP_DEC, jobs, jobCount, NULL, config.endpoint.name);
+		close(socketFD);
+		return 0;
 	}
 
-	// allocate buffer:
+	// stream mode: stdin in blocks, each reply to stdout as it comes back
 	// ......................
-
-	// 	Buffer Contents:
-	//	[ code word 	| plain text 	| middle sentinel 	| key 			| end sentinel  | null terminator	]
-	//	[ 2 chars   	| file size  	| 2 chars         	| file size 	| 2 chars 		| 1 char 			]
-	//	(2*(plainTextFileSize) + 7) BYTES
-
-	transmissionSize = (2*plainTextFileSize)+7;					// get the buffer size needed to send a full transmission
-	// printf("SIZE OF FILE: %d\n", plainTextFileSize);
-	buffer = calloc(transmissionSize, sizeof(char));			// allocate memory for and 0-initialize the buffer
-	// printf("SIZE OF BUFFER: %d\n", sizeof(*buffer));
-
-	// set up server address struct
-	// ......................
-	memset((char*)&serverAddress, '\0', sizeof(serverAddress)); // Clear out the address struct
-	portNumber = atoi(argv[3]); 								// Get the port number, convert to an integer from a string
-	serverAddress.sin_family = AF_INET; 						// Create a network-capable socket
-	serverAddress.sin_port = htons(portNumber); 				// Store the port number
-	serverHostInfo = gethostbyname("localhost"); 				// Convert the machine name into a special form of address
-	if (serverHostInfo == NULL)
-	{ 
-		fprintf(stderr, "%sCLIENT: ERROR, no such host%s\n", RED, NRM); 
-		exit(1); 
+	if (config.stream)
+	{
+		streamOpen(&stream, &config);
+		socketFD = connectToServer(&config);
+		runBinaryJobs(socketFD, OP_DEC, NULL, 0, &stream, config.endpoint.name);
+		close(socketFD);
+		return 0;
 	}
-	memcpy((char*)&serverAddress.sin_addr.s_addr, (char*)serverHostInfo->h_addr, serverHostInfo->h_length); // Copy in the address
 
-	// set up the socket
+	// container mode: every record in one request, the reply a container with the same index
 	// ......................
-	socketFD = socket(AF_INET, SOCK_STREAM, 0); 				// Create the socket
-	if (socketFD < 0)											// ensure socket is working
+	memset(&job, 0, sizeof(job));
+	if (config.resume)												// checked, and resumed from the last good chunk if the connection drops
 	{
-		error("CLIENT: ERROR opening socket");
+		if (config.container)
+		{
+			containerJob(&config, &job, &container, &keyContainer);
+		}
+		else
+		{
+			job.messageFile = config.messageFile;
+			job.keyFile = config.keyFile;
+			job.keyRef = config.keyIds;
+		}
+		runCheckedJob(&config, OP_DEC, &job);
+		return 0;
 	}
-	
-	// connect to server
-	// ......................
-	if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) // Connect socket to address
+	if (config.container)
 	{
-		error("CLIENT: ERROR connecting");
+		containerJob(&config, &job, &container, &keyContainer);
+		socketFD = connectToServer(&config);
+		runBinaryJobs(socketFD, OP_DEC, &job, 1, NULL, config.endpoint.name);
+		close(socketFD);
+		return 0;
 	}
 
-	// Open Files
+	// key reference: the daemon holds the key, so only the message is read
 	// ......................
-	plainTextFP = fopen(argv[1], "r");				// open plaintext file
-	if (plainTextFP == NULL)
-	{
-		error("CLIENT: ERROR opening plainText file");
-	}
-	keyFP = fopen(argv[2], "r");					// open key file
-	if (keyFP == NULL)
+	if (config.keyIds)
 	{
-		error("CLIENT: ERROR opening key file");
+		job.messageFile = config.messageFile;
+		job.keyFile = config.keyFile;
+		job.keyRef = 1;
+		socketFD = connectToServer(&config);
+		runBinaryJobs(socketFD, OP_DEC, &job, 1, NULL, config.endpoint.name);
+		close(socketFD);
+		return 0;
 	}
 
-	// Put the full transmission into the buffer
-	// ......................
-	memset(buffer, '\0', transmissionSize);							// Clear out the buffer array
-	strcat(buffer, DEC_CLIENT);										// Put the DEC_CLIENT sentinel into the buffer for handshake
-	fgets(&buffer[2], plainTextFileSize, plainTextFP); 				// Put the plain text into the buffer
-	buffer[strcspn(buffer, "\n")] = '\0'; 							// Remove the trailing \n that fgets adds
-	strcat(buffer, MID_SENTINEL);									// Put the MID_SENTINEL into the buffer
-	fgets(&buffer[3+plainTextFileSize], plainTextFileSize, keyFP); 	// Put the key into the buffer
-	buffer[strcspn(buffer, "\n")] = '\0'; 							// Remove the trailing \n that fgets adds
-	strcat(buffer, END_SENTINEL);									// Put the END_SENTINEL into the buffer
-	// printf("WHATS IN THE BUFFER: %s\n", buffer);					// See what's in the buffer (TESTING)
-
-	// Close Files
+	// file validation
 	// ......................
-	fclose(plainTextFP);							// close plaintext file
-	fclose(keyFP);									// close key file
+	job.message = mapFile(config.messageFile, &job.messageLen, &job.messageMapped);		// map and check the cipher text file
+	job.key = mapFile(config.keyFile, &job.keyLen, &job.keyMapped);				// map and check the key file
 
-	// Send message to server
-	// ......................
-	charsWritten = send(socketFD, buffer, transmissionSize, 0); 				// Write to the server
-	if (charsWritten < 0) 														// error message if no characters written
-	{
-		error("CLIENT: ERROR writing to socket");
-	}
-	if (charsWritten < transmissionSize)										// error message if size is too small
+	if (job.messageLen > job.keyLen)											// exit with error if the key is too short to decrypt the message
 	{
-		printf("CLIENT: WARNING: Not all data written to socket!\n");
+		fprintf(stderr,"%sCLIENT: ERROR, key is too short to decrypt message%s\n", RED, NRM);
+		exit(1);
 	}
 
-	// check to make sure full message is sent
+	// connect to server
 	// ......................
-	int checkSend = -5;  							// Holds amount of bytes remaining in send buffer
-	do
-	{
-		ioctl(socketFD, TIOCOUTQ, &checkSend);  	// Check the send buffer for this socket
-		// printf("checkSend: %d\n", checkSend);  	// Out of curiosity, check how many remaining bytes there are
-	}
-	while (checkSend > 0);  						// Loop forever until send buffer for this socket is empty
-	if (checkSend < 0)  							// Check if we actually stopped the loop because of an error
-	{
-		error("CLIENT: ioctl error");
-	}
+	socketFD = connectToServer(&config);
 
-	// Get return message from server
+	// send the request, writing the decrypted message to stdout as it streams in
 	// ......................
-	memset(buffer, '\0', transmissionSize); 									// Clear out the buffer again for reuse
-	charsRead = recv(socketFD, buffer, transmissionSize - 1, 0); 				// Read data from the socket, leaving \0 at end
-	if (charsRead < 0)
-	{	
-		error("CLIENT: ERROR reading from socket");
+	if (config.textFraming)
+	{
+		runTextRequest(socketFD, DEC_CLIENT, job.message, job.key, job.messageLen, config.endpoint.name);
 	}
-	else if (strcmp(buffer, CON_FAIL) == 0)
+	else
 	{
-		fprintf(stderr, "%sCLIENT: ERROR, connection rejected on port %d%s\n", RED, portNumber, NRM); 
-		exit(2);
+		runBinaryJobs(socketFD, OP_DEC, &job, 1, NULL, config.endpoint.name);
 	}
-	printf("%s\n", buffer);														// decrypted message from the server
-
-	// free buffer
-	// ......................
-	free(buffer);
 
 	// close socket
 	// ......................
-	close(socketFD); 															// Close the socket
-	
-}
\ No newline at end of file
+	close(socketFD); 														// Close the socket
+	return 0;
+}
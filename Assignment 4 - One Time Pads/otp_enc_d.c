@@ -67,6 +67,8 @@
 // @return		return - 
 //..........................................................
 
+#define _GNU_SOURCE					// struct ucred, for SO_PEERCRED on unix: endpoints
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -91,12 +93,12 @@
 // transmission variables
 // ......................
 #define CON_FAIL 		"*"		// a sentinel which indicates that the client-server handshake was unsuccessful
+#define BUSY_FAIL 		"%"		// a sentinel, followed by a retry-after in ms, which indicates that the server is overloaded
 #define ENC_CLIENT 		"!!"	// a sentinel which indicates that the client requests encryption
 #define DEC_CLIENT 		"$$"	// a sentinel which indicates that the client requests decryption
 #define MID_SENTINEL	"##"	// a sentinel which separates the plaintext from the key
 #define END_SENTINEL	"@@"	// a sentinel which indicates the end of transmission
 #define BUFFERSIZE		1024	// size of the buffer
-#define	MAX_TRANS		262144	// maximum size of a transmission
 
 /**********************************************************
 // HELPER FUNCTIONS
@@ -117,202 +119,23 @@ void error(const char *msg)
 	exit(1); 
 }
 
+#include "otpServer.c"
+
 /**********************************************************
 // MAIN FUNCTION
 // ********************************************************/
 
 int main(int argc, char *argv[])
 {
-	// initialize variables
-	// ......................
-	int listenSocketFD;
-	int establishedConnectionFD;
-	int portNumber;
-	int charsRead;
-	int i;								// iterator
-	int message;
-	int key;
-	int result;
-	char* keyStr;
-	socklen_t sizeOfClientInfo;
-	char transmission[MAX_TRANS];
-	char buffer[BUFFERSIZE];
-	struct sockaddr_in serverAddress, clientAddress;
-	pid_t spawnPid;
-	int childExitMethod;
+	struct serverConfig config;
 
 	// input validation
 	// ......................
-	if (argc < 2)
-	{ 
-		fprintf(stderr,"%sUSAGE: %s%s port%s\n", RED, CYN, argv[0], NRM);  // Check usage & args
-		exit(1); 
-	}
-
-	// set up address struct
-	// ......................
-	memset((char *)&serverAddress, '\0', sizeof(serverAddress)); 	// Clear out the address struct
-	portNumber = atoi(argv[1]); 									// Get the port number, convert to an integer from a string
-	serverAddress.sin_family = AF_INET; 							// Create a network-capable socket
-	serverAddress.sin_port = htons(portNumber); 					// Store the port number
-	serverAddress.sin_addr.s_addr = INADDR_ANY; 					// Any address is allowed for connection to this process
-
-	// set up the socket
-	// ......................
-	listenSocketFD = socket(AF_INET, SOCK_STREAM, 0); 				// Create the socket
-	if (listenSocketFD < 0)											// ensure socket is working
-	{
-		error("ERROR opening socket");
-	}
+	parseServerArgs(argc, argv, &config);		// exits with the usage message on bad input
 
-	// enable the socket to begin listening
+	// listen for connections and serve them
 	// ......................
-	if (bind(listenSocketFD, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0) // Connect socket to port
-	{
-		error("ERROR on binding");															// send error message if unsuccessful
-	}
-	listen(listenSocketFD, 5); 																// Flip the socket on - it can now receive up to 5 connections
-
-////////////////////BEGINWHILELOOP???//////////////////////////////////////////	
-
-	while(1)
-	{
-		// Accept a connection, blocking if one is not available until one connects
-		// ......................
-		sizeOfClientInfo = sizeof(clientAddress); 																// Get the size of the address for the client that will connect
-		establishedConnectionFD = accept(listenSocketFD, (struct sockaddr *)&clientAddress, &sizeOfClientInfo); // Accept
-		if (establishedConnectionFD < 0)																		// send error message if unsuccessful
-		{
-			error("ERROR on accept");
-		}
-
-	////////////////////FORK???//////////////////////////////////////////	
-		// Fork new process
-		// ......................
-		spawnPid = -5;
-		childExitMethod = -5;
-		spawnPid = fork();
-		if(spawnPid < 0)
-		{
-			error("SERVER: Fork Error");
-		}
-		else if (spawnPid == 0)																	// Child Process is spawned
-		{
-			// Get the message from the client
-			// ......................
-			memset(transmission, '\0', MAX_TRANS);												// Clear the transmission buffer
-
-			// while the end sentinel is not found, keep reading into transmission
-			while ( strstr(transmission, END_SENTINEL) == NULL )
-			{
-				memset(buffer, '\0', BUFFERSIZE);												// Clear the buffer
-				charsRead = recv(establishedConnectionFD, buffer, BUFFERSIZE - 1, 0); 			// Read the client's message from the socket
-				if (charsRead < 0)																// Send error message if nothing is read
-				{
-					error("ERROR reading from socket");
-				}
-				strcat(transmission, buffer);													// add the contents of the buffer into the transmission
-				// printf("SERVER: Transmission is %d chars long\n", strlen(transmission));		// TESTING report length of transmission
-			}
-			// printf("SERVER: I received this from the client: \"%s\"\n", transmission);		// TESTING report what was read
-
-			// verify that the client is otp_enc
-			// ......................
-			if(strstr(transmission, ENC_CLIENT) == NULL)										// if the client is not otp_enc, end the communication
-			{
-				// Send unsuccessful message to the client
-				// ......................
-				charsRead = send(establishedConnectionFD, CON_FAIL, 1, 0);	// Send connection fail sentinel to client
-				if (charsRead < 0)											// send error message if nothing is read
-				{
-					error("ERROR writing to socket");
-				}
-
-				// check to make sure full message is sent
-				// ......................
-				int checkSend = -5;  										// Holds amount of bytes remaining in send buffer
-				do
-				{
-					ioctl(establishedConnectionFD, TIOCOUTQ, &checkSend);  	// Check the send buffer for this socket
-					// printf("checkSend: %d\n", checkSend);  				// Out of curiosity, check how many remaining bytes there are
-				}
-				while (checkSend > 0);  									// Loop forever until send buffer for this socket is empty
-				if (checkSend < 0)											// Check if we actually stopped the loop because of an error
-				{
-					error("ioctl error");
-				}
-
-				close(establishedConnectionFD); 							// Close the existing socket which is connected to the client			
-
-				fprintf(stderr, "%sSERVER: ERROR, client handshake unsuccessful%s\n", RED, NRM); 	// have the server send an error message
-				exit(1);																			// exit the child process
-			}
-
-			// encrypt the plaintext
-			// ......................
-			keyStr = strstr(transmission, MID_SENTINEL) + 2;						// find the key address string in the tranmission buffer
-			i=2;																	// starting after the sentinel,
-			while(transmission[i] != '#')											// iterate through the message and encrypt it
-			{
-				message = transmission[i];											// set the next plaintext message character
-				key = keyStr[i-2];													// set the next key character
-
-				if (message == ' ')
-				{
-					message = '[';
-				}
-				if (key == ' ')
-				{
-					key = '[';
-				}
-
-				message = message - 'A';
-				key = key - 'A';
-
-				result = (message+key)%27+'A';										// calculate the encryption of characters
-
-				if (result == '[')
-				{
-					result = ' ';
-				}
-
-				// printf("ENC: (%c + %c)mod27 = %c\n", message, key, result);
-
-				transmission[i] = result;											// set the transmission to be sent back to the encrypted character
-				// printf("%c + %c = %c\n", message, key, result);					// TESTING print out the encryption
-				i++;																// move to the next character
-			}
-			transmission[i] = '\0';													// add a null terminator to the tranmission to be sent back
-			// printf("i = %d\n", i);												// TESTING print the total number of characters encrypted
-
-			// Send the encrypted message back to the client
-			// ......................
-			charsRead = send(establishedConnectionFD, &transmission[2], i, 0);		// Send encrypted message back
-			if (charsRead < 0)														// send error message if nothing is read
-			{
-				error("ERROR writing to socket");
-			}
-
-			// check to make sure full message is sent
-			// ......................
-			int checkSend = -5;  										// Holds amount of bytes remaining in send buffer
-			do
-			{
-				ioctl(establishedConnectionFD, TIOCOUTQ, &checkSend);  	// Check the send buffer for this socket
-				// printf("checkSend: %d\n", checkSend);  				// Out of curiosity, check how many remaining bytes there are
-			}
-			while (checkSend > 0);  									// Loop forever until send buffer for this socket is empty
-			if (checkSend < 0)											// Check if we actually stopped the loop because of an error
-			{
-				error("ioctl error");
-			}
-
-			close(establishedConnectionFD); 							// Close the existing socket connecting the client to the child
-			exit(0);													// exit the child process
-		}
-		waitpid(spawnPid, &childExitMethod, WNOHANG);			// don't wait for the child to exit before setting up new sockets
-		close(establishedConnectionFD); 						// Close the existing socket connecting the client to the parent
-	}
-	close(listenSocketFD); 										// Close the listening socket
+	config.ops = OP_ENC;						// only serve otp_enc
+	runServer(&config);
 	return 0; 
-}
\ No newline at end of file
+}
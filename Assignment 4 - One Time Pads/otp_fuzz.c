@@ -0,0 +1,417 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otp_fuzz.c - a fuzz target for the daemons' request parser (otpParse.c). It feeds one
+//				connection's worth of input to parserFeed() in pieces whose sizes come from the input
+//				itself, sends every reply piece as soon as it is ready, and aborts if the parser ever
+//				leaves its states, stalls wanting nothing with no reply to send, answers with more
+//				than the input allows, or keeps byte limit reservations once freed. Built with
+//				-fsanitize=address, or under a fuzzer that instruments it, every access is checked too.
+//
+//				Input:	[ options (1 byte) | piece seed (1 byte) | what the client sends ... ]
+//
+//				Option bits: 0x01 the connection is refused busy, 0x02 a byte limit of two chunks,
+//				0x04 the cipher split across two threads (see otpSplit.c), 0x08 encryption only. The
+//				high four bits set the largest piece, 1 << n bytes, so 0x00 feeds a byte at a time.
+//
+//				The parser holds one key, k1, of FUZZ_KEY characters, so key references can name it,
+//				and signs resume tokens with a fixed secret, so a seed can carry a valid one. There is
+//				no ledger.
+//
+//				[x] LLVMFuzzerTestOneInput() - the libFuzzer entry point, built with
+//					clang -g -O1 -fsanitize=fuzzer,address -DOTP_LIBFUZZER -o otp_fuzz otp_fuzz.c -lpthread -lcrypto
+//				[x] otp_fuzz [file...] - runs each file, or standard input, once: for AFL
+//					(afl-fuzz -i fuzz_seeds -o findings -- ./otp_fuzz @@), or to replay a crash or the
+//					seed corpus with any compiler
+//				[x] otp_fuzz --seeds dir - writes the seed corpus: valid text, binary, key reference,
+//					checked and resumed requests, as in fuzz_seeds
+//
+//				otp_bench --parse stays the parser's throughput measurement and round trip check.
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/**********************************************************
+// GLOBALS
+// ********************************************************/
+
+// message colors
+// ......................
+#define RED  "\x1B[31m"		// red text
+#define GRN  "\x1B[32m"		// green text
+#define CYN  "\x1B[36m"		// cyan text
+#define NRM  "\x1B[0m"		// normal text
+
+// transmission variables
+// ......................
+#define CON_FAIL 		"*"		// a sentinel which indicates that the client-server handshake was unsuccessful
+#define ENC_CLIENT 		"!!"	// a sentinel which indicates that the client requests encryption
+#define DEC_CLIENT 		"$$"	// a sentinel which indicates that the client requests decryption
+#define MID_SENTINEL	"##"	// a sentinel which separates the message from the key
+#define END_SENTINEL	"@@"	// a sentinel which indicates the end of transmission
+#define BUSY_FAIL		"%"		// a sentinel which indicates that the server is overloaded
+#define BUFFERSIZE		1024	// size of the buffer
+
+#include "otpParse.c"
+
+// fuzz options
+// ......................
+#define FUZZ_OVERLOADED	0x01	// the connection is refused busy
+#define FUZZ_LIMITED	0x02	// a byte limit of FUZZ_LIMIT
+#define FUZZ_SPLIT		0x04	// cipher split across two threads
+#define FUZZ_ENC_ONLY	0x08	// the daemon serves encryption only
+#define FUZZ_LIMIT		(2 * OTP_CHUNK)	// the byte limit with FUZZ_LIMITED
+#define FUZZ_KEY		(SPLIT_BATCH + 3 * OTP_CHUNK)	// characters in key k1
+#define FUZZ_INPUT		(1 << 24)	// largest input the standalone driver reads
+
+struct otpKeyCache* fuzzKeys = NULL;		// holds k1
+struct otpAdmission* fuzzAdmit = NULL;		// counts reservations, limited or not
+struct otpSplit* fuzzSplit = NULL;			// the team for FUZZ_SPLIT
+
+/**********************************************************
+// FUNCTIONS
+// ********************************************************/
+
+// fuzzFail
+//
+// description: reports a broken invariant and aborts, so
+//				the fuzzer keeps the input
+//
+// @param		what - the invariant
+// @param		parser - the parser
+//..........................................................
+void fuzzFail(const char* what, struct otpParser* parser)
+{
+	fprintf(stderr, "%sFUZZ: ERROR, %s (state %d)%s\n", RED, what, parser->state, NRM);
+	abort();
+}
+
+// fuzzSetUp
+//
+// description: makes the key cache, with k1 written to a
+//				scratch directory, mapped, and the directory
+//				removed again; the admission gauges; and the
+//				split team. Runs once.
+//..........................................................
+void fuzzSetUp(void)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+	char dir[] = "/tmp/otp_fuzz.XXXXXX";
+	char path[sizeof(dir) + 8];
+	char* key = malloc(FUZZ_KEY);
+	struct otpKey* k1;
+	int fd;
+	size_t i;
+
+	if (key == NULL || mkdtemp(dir) == NULL)
+	{
+		perror("FUZZ: ERROR making the key directory");
+		exit(1);
+	}
+	for (i = 0; i < FUZZ_KEY; i++)
+	{
+		key[i] = alphabet[(i * 7 + i / 27) % 27];
+	}
+	snprintf(path, sizeof(path), "%s/k1", dir);
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 || write(fd, key, FUZZ_KEY) != FUZZ_KEY)
+	{
+		perror("FUZZ: ERROR writing the key");
+		exit(1);
+	}
+	close(fd);
+	free(key);
+
+	fuzzKeys = keyCacheOpen(dir, NULL);
+	if (fuzzKeys == NULL || (k1 = keyAcquire(fuzzKeys, "k1")) == NULL)
+	{
+		fprintf(stderr, "%sFUZZ: ERROR loading the key%s\n", RED, NRM);
+		exit(1);
+	}
+	keyRelease(fuzzKeys, k1);							// stays mapped in the cache
+	memset(fuzzKeys->secret, 0x5A, KEY_SECRET);			// tokens the seeds carry stay valid
+	unlink(path);
+	rmdir(dir);
+
+	fuzzAdmit = admitOpen(0, 0, 100);
+	fuzzSplit = splitOpen(2);
+	if (fuzzAdmit == NULL || fuzzSplit == NULL)
+	{
+		fprintf(stderr, "%sFUZZ: ERROR allocating%s\n", RED, NRM);
+		exit(1);
+	}
+}
+
+// LLVMFuzzerTestOneInput
+//
+// description: runs one input through a fresh parser, as
+//				one connection, and checks it behaved
+//
+// @param		data - the options, piece seed and request
+//				bytes
+// @param		size - how many
+// @return		0
+//..........................................................
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	struct otpParser parser;
+	const char* reply;
+	const char* input = (const char*)data + 2;
+	unsigned int seed;
+	unsigned long long replyLen = 0, replyMax;
+	size_t n, fed = 0, want, piece, ready, maxPiece;
+	int options;
+
+	if (size < 2)
+	{
+		return 0;
+	}
+	if (fuzzKeys == NULL)
+	{
+		fuzzSetUp();
+	}
+	options = data[0];
+	seed = data[1];
+	maxPiece = (size_t)1 << (options >> 4);
+	n = size - 2;
+	replyMax = n + (unsigned long long)(OTP_HEADER_SIZE + OTP_TOKEN_SIZE) * (n / OTP_HEADER_SIZE + 1);
+
+	fuzzAdmit->maxBytes = options & FUZZ_LIMITED ? FUZZ_LIMIT : 0;
+	fuzzAdmit->bytes = 0;
+	cipherSplit = options & FUZZ_SPLIT ? fuzzSplit : NULL;
+	parserInit(&parser, options & FUZZ_ENC_ONLY ? OP_ENC : OP_ENC | OP_DEC, NULL, fuzzKeys, fuzzAdmit);
+	parser.overloaded = (options & FUZZ_OVERLOADED) != 0;
+
+	while (1)
+	{
+		while ((ready = parserReply(&parser, &reply)) > 0)
+		{
+			piece = 1 + rand_r(&seed) % maxPiece;		// sends go out in pieces too
+			piece = piece < ready ? piece : ready;
+			replyLen += piece;
+			parserReplySent(&parser, piece);
+		}
+		if (parser.state < PARSE_HANDSHAKE || parser.state > PARSE_ERROR)
+		{
+			fuzzFail("the parser left its states", &parser);
+		}
+		if (replyLen > replyMax)
+		{
+			fuzzFail("more reply than the input allows", &parser);
+		}
+		if (parserFinished(&parser) || fed == n)
+		{
+			break;
+		}
+		if ((want = parserWant(&parser)) == 0)
+		{
+			fuzzFail("the parser wants nothing and has nothing to send", &parser);
+		}
+		piece = 1 + rand_r(&seed) % maxPiece;
+		piece = piece < want ? piece : want;
+		piece = piece < n - fed ? piece : n - fed;
+		parserFeed(&parser, input + fed, piece);
+		fed += piece;
+	}
+
+	parserFree(&parser);
+	if (fuzzAdmit->bytes != 0)
+	{
+		fuzzFail("byte limit reservations outlived the parser", &parser);
+	}
+	return 0;
+}
+
+#ifndef OTP_LIBFUZZER
+
+// seedWrite
+//
+// description: writes one seed file: the options, a piece
+//				seed and the request
+//
+// @param		dir - the corpus directory
+// @param		name - the file name
+// @param		options - the option byte
+// @param		request - the request bytes
+// @param		n - how many
+//..........................................................
+void seedWrite(const char* dir, const char* name, int options, const char* request, size_t n)
+{
+	char path[4096];
+	FILE* file;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ((file = fopen(path, "wb")) == NULL)
+	{
+		perror("FUZZ: ERROR writing a seed");
+		exit(1);
+	}
+	fputc(options, file);
+	fputc(0x5A, file);
+	fwrite(request, 1, n, file);
+	fclose(file);
+}
+
+// seedHeader
+//
+// description: packs a binary request header
+//
+// @param		buf - where it goes
+// @param		version - the protocol version
+// @param		code - the op and its flags
+// @param		messageLen - the message length
+// @param		keyLen - the key length, or key reference size
+// @return		OTP_HEADER_SIZE
+//..........................................................
+size_t seedHeader(char* buf, int version, int code, unsigned long long messageLen, unsigned long long keyLen)
+{
+	struct otpHeader header;
+
+	header.version = version;
+	header.code = code;
+	header.requestId = 7;
+	header.messageLen = messageLen;
+	header.keyLen = keyLen;
+	packHeader(buf, &header);
+	return OTP_HEADER_SIZE;
+}
+
+// writeSeeds
+//
+// description: writes the seed corpus, one valid request
+//				of each kind
+//
+// @param		dir - the corpus directory, which must exist
+// @return		0
+//..........................................................
+int writeSeeds(const char* dir)
+{
+	static const char message[] = "HELLO WORLD";
+	static const char key[] = "XMCKLQWERTYZ";
+	char request[1024];
+	char token[OTP_TOKEN_SIZE];
+	size_t n, at;
+	unsigned int crc;
+
+	fuzzSetUp();
+	n = (size_t)snprintf(request, sizeof(request), "%s%s%s%s%s", ENC_CLIENT, message, MID_SENTINEL, key, END_SENTINEL);
+	seedWrite(dir, "text_enc", 0x40, request, n);
+	seedWrite(dir, "text_busy", 0x41, request, n);
+	n = (size_t)snprintf(request, sizeof(request), "%s%s%s%s%s", DEC_CLIENT, message, MID_SENTINEL, key, END_SENTINEL);
+	seedWrite(dir, "text_dec", 0x00, request, n);
+
+	// in-band key, two pipelined requests and the end of stream
+	at = seedHeader(request, 2, OP_ENC, sizeof(message) - 1, sizeof(key) - 1);
+	memcpy(request + at, message, sizeof(message) - 1);
+	memcpy(request + at + sizeof(message) - 1, key, sizeof(key) - 1);
+	at += sizeof(message) - 1 + sizeof(key) - 1;
+	at += seedHeader(request + at, 2, OP_DEC, 3, 3);
+	memcpy(request + at, "ABCXYZ", 6);
+	at += 6;
+	at += seedHeader(request + at, 2, OP_END, 0, 0);
+	seedWrite(dir, "binary_pipelined", 0x30, request, at);
+
+	// key reference
+	at = seedHeader(request, 4, OP_ENC | OP_KEY_REF, sizeof(message) - 1, 8 + 2);
+	at += packKeyRef(request + at, 100, "k1");
+	memcpy(request + at, message, sizeof(message) - 1);
+	seedWrite(dir, "keyref_enc", 0x70, request, at + sizeof(message) - 1);
+
+	// checked, key in band
+	at = seedHeader(request, 5, OP_ENC | OP_CHECKED, sizeof(message) - 1, sizeof(message) - 1);
+	memcpy(request + at, message, sizeof(message) - 1);
+	memcpy(request + at + sizeof(message) - 1, key, sizeof(message) - 1);
+	crc = crc32c(0, request + at, 2 * (sizeof(message) - 1));
+	at += 2 * (sizeof(message) - 1);
+	packTrailer(request + at, 0, crc);
+	seedWrite(dir, "checked_enc", 0x50, request, at + OTP_TRAILER_SIZE);
+
+	// checked key reference, and its resumption from the start of the range its token signs
+	at = seedHeader(request, 5, OP_ENC | OP_KEY_REF | OP_CHECKED, sizeof(message) - 1, 8 + 2);
+	at += packKeyRef(request + at, 0, "k1");
+	memcpy(request + at, message, sizeof(message) - 1);
+	packTrailer(request + at + sizeof(message) - 1, 0, crc32c(0, message, sizeof(message) - 1));
+	seedWrite(dir, "checked_keyref", 0x60, request, at + sizeof(message) - 1 + OTP_TRAILER_SIZE);
+
+	keyToken(fuzzKeys, OP_ENC, "k1", 0, sizeof(message) - 1, token);
+	at = seedHeader(request, 5, OP_ENC | OP_KEY_REF | OP_CHECKED | OP_RESUME, sizeof(message) - 1, 8 + OTP_TOKEN_SIZE + 2);
+	at += packResumeRef(request + at, 0, token, "k1");
+	memcpy(request + at, message, sizeof(message) - 1);
+	packTrailer(request + at + sizeof(message) - 1, 0, crc32c(0, message, sizeof(message) - 1));
+	seedWrite(dir, "resume_keyref", 0x60, request, at + sizeof(message) - 1 + OTP_TRAILER_SIZE);
+
+	// a resumption whose signed range runs past the end of k1, as after the key file shrank
+	keyToken(fuzzKeys, OP_ENC, "k1", FUZZ_KEY - 4, sizeof(message) - 1, token);
+	at = seedHeader(request, 5, OP_ENC | OP_KEY_REF | OP_CHECKED | OP_RESUME, sizeof(message) - 1, 8 + OTP_TOKEN_SIZE + 2);
+	at += packResumeRef(request + at, FUZZ_KEY - 4, token, "k1");
+	memcpy(request + at, message, sizeof(message) - 1);
+	packTrailer(request + at + sizeof(message) - 1, 0, crc32c(0, message, sizeof(message) - 1));
+	seedWrite(dir, "resume_short_key", 0x60, request, at + sizeof(message) - 1 + OTP_TRAILER_SIZE);
+	return 0;
+}
+
+// runFile
+//
+// description: runs one file, or standard input, as one
+//				input
+//
+// @param		name - the file, or NULL for standard input
+// @return		0, or 1 if it could not be read
+//..........................................................
+int runFile(const char* name)
+{
+	static uint8_t input[FUZZ_INPUT];
+	FILE* file = name ? fopen(name, "rb") : stdin;
+	size_t n;
+
+	if (file == NULL)
+	{
+		fprintf(stderr, "%sFUZZ: ERROR opening %s: %s%s\n", RED, name, strerror(errno), NRM);
+		return 1;
+	}
+	n = fread(input, 1, sizeof(input), file);
+	if (name != NULL)
+	{
+		fclose(file);
+	}
+	LLVMFuzzerTestOneInput(input, n);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	int failed = 0;
+	int i;
+
+	if (argc == 3 && strcmp(argv[1], "--seeds") == 0)
+	{
+		return writeSeeds(argv[2]);
+	}
+	if (argc == 1)
+	{
+		return runFile(NULL);
+	}
+	for (i = 1; i < argc; i++)
+	{
+		failed |= runFile(argv[i]);
+	}
+	if (!failed)
+	{
+		printf("%sran %s%d%s inputs%s\n", GRN, CYN, argc - 1, GRN, NRM);
+	}
+	return failed;
+}
+
+#endif
@@ -0,0 +1,532 @@
+/* ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CS344 - Operating Systems I
+//
+// Name:		Tucker Dane Walker
+// Description:	otp_pack - builds and reads the container files of otpContainer.c, which hold many messages
+//				and, optionally, the key slice for each, so a whole batch can be sent with
+//				otp_enc and otp_dec --container as one request. All error text goes to stderr.
+//
+//				[x] otp_pack pack [--key keyfile] [--offset N] [--lines] file... > container
+//					[x]	every file is one record, without its trailing newline, or with --lines every
+//						line of every file is one
+//					[x]	--key fills the key area with the key file's characters from offset N (default
+//						0) on, so each record's key slice starts where the one before it ended
+//				[x] otp_pack list container - prints each record's index, offset and length
+//				[x] otp_pack get container index... - prints the records asked for, one per line,
+//					straight from the index without reading the rest
+//				[x] otp_pack unpack container - prints every record, one per line
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////// */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+
+/**********************************************************
+// GLOBAL DEFINITIONS
+// ********************************************************/
+#define RED  "\x1B[31m"		// red text
+#define GRN  "\x1B[32m"		// green text
+#define CYN  "\x1B[36m"		// cyan text
+#define NRM  "\x1B[0m"		// normal text
+#define TRUE 1				// TRUE == 1
+#define FALSE 0				// FALSE == 0
+
+#define PACK_OUTPUT	(1 << 20)	// stdout buffer size
+
+#include "otpProtocol.c"
+#include "otpCipher.c"
+#include "otpContainer.c"
+
+// packConfig
+// ......................
+struct packConfig
+{
+	const char* command;		// pack, list, get or unpack
+	const char* keyFile;		// --key, or NULL
+	unsigned long long offset;	// --offset
+	int lines;					// --lines
+	char** operands;			// the arguments after the command
+	int operandCount;
+};
+
+// packBuffer
+// ......................
+struct packBuffer
+{
+	char* data;					// the data area being built
+	unsigned long long length;	// its size so far
+	unsigned long long size;	// its allocation
+	char* index;				// the index being built, in file format
+	unsigned long long count;	// records so far
+	unsigned long long slots;	// index entries allocated
+};
+
+/**********************************************************
+// FUNCTIONS
+// ********************************************************/
+
+// packGrow
+//
+// description: makes room for more bytes of data
+//
+// @param		buffer - the container being built
+// @param		extra - bytes needed past the current length
+// @return		1 on success, 0 when out of memory
+//..........................................................
+int packGrow(struct packBuffer* buffer, unsigned long long extra)
+{
+	unsigned long long size = buffer->size ? buffer->size : 65536;
+	char* data;
+
+	while (size - buffer->length < extra)
+	{
+		size *= 2;
+	}
+	if (size != buffer->size)
+	{
+		data = realloc(buffer->data, size);
+		if (data == NULL)
+		{
+			return 0;
+		}
+		buffer->data = data;
+		buffer->size = size;
+	}
+	return 1;
+}
+
+// packRecord
+//
+// description: adds a record that is already at the end of
+//				the data to the index
+//
+// @param		buffer - the container being built
+// @param		offset - where the record starts
+// @param		length - its size
+// @return		1 on success, 0 when out of memory
+//..........................................................
+int packRecord(struct packBuffer* buffer, unsigned long long offset, unsigned long long length)
+{
+	char* index;
+
+	if (buffer->count == buffer->slots)
+	{
+		buffer->slots = buffer->slots ? buffer->slots * 2 : 1024;
+		index = realloc(buffer->index, buffer->slots * CONTAINER_ENTRY);
+		if (index == NULL)
+		{
+			return 0;
+		}
+		buffer->index = index;
+	}
+	containerPackEntry(buffer->index + buffer->count * CONTAINER_ENTRY, offset, length);
+	buffer->count++;
+	return 1;
+}
+
+// packFile
+//
+// description: reads one input file onto the end of the
+//				data and indexes it as one record, or with
+//				lines as one record per line
+//
+// @param		buffer - the container being built
+// @param		fileName - the file
+// @param		lines - 1 for a record per line
+// @return		1 on success, 0 after reporting an error
+//..........................................................
+int packFile(struct packBuffer* buffer, const char* fileName, int lines)
+{
+	unsigned long long start = buffer->length, write, read, end;
+	ssize_t n;
+	char* newline;
+	FILE* file;
+
+	file = fopen(fileName, "r");
+	if (file == NULL)
+	{
+		fprintf(stderr, "%sERROR: opening %s: %s%s\n", RED, fileName, strerror(errno), NRM);
+		return 0;
+	}
+	do
+	{
+		if (!packGrow(buffer, 65536))
+		{
+			fprintf(stderr, "%sERROR: out of memory reading %s%s\n", RED, fileName, NRM);
+			fclose(file);
+			return 0;
+		}
+		n = fread(buffer->data + buffer->length, 1, buffer->size - buffer->length, file);
+		buffer->length += n;
+	} while (n > 0);
+	if (ferror(file))
+	{
+		fprintf(stderr, "%sERROR: reading %s%s\n", RED, fileName, NRM);
+		fclose(file);
+		return 0;
+	}
+	fclose(file);
+
+	if (!lines)
+	{
+		if (buffer->length > start && buffer->data[buffer->length - 1] == '\n')
+		{
+			buffer->length--;								// the newline is not part of the message
+		}
+		if (!cipherValid(buffer->data + start, buffer->length - start))
+		{
+			fprintf(stderr, "%sERROR: invalid characters in %s%s\n", RED, fileName, NRM);
+			return 0;
+		}
+		if (!packRecord(buffer, start, buffer->length - start))
+		{
+			fprintf(stderr, "%sERROR: out of memory indexing %s%s\n", RED, fileName, NRM);
+			return 0;
+		}
+		return 1;
+	}
+
+	// close up the newlines, so the records lie back to back
+	end = buffer->length;
+	for (read = write = start; read < end; read += n + 1)
+	{
+		newline = memchr(buffer->data + read, '\n', end - read);
+		n = newline ? newline - (buffer->data + read) : (ssize_t)(end - read);
+		if (!cipherValid(buffer->data + read, n))
+		{
+			fprintf(stderr, "%sERROR: invalid characters in %s%s\n", RED, fileName, NRM);
+			return 0;
+		}
+		memmove(buffer->data + write, buffer->data + read, n);
+		if (!packRecord(buffer, write, n))
+		{
+			fprintf(stderr, "%sERROR: out of memory indexing %s%s\n", RED, fileName, NRM);
+			return 0;
+		}
+		write += n;
+	}
+	buffer->length = write;
+	return 1;
+}
+
+// packKey
+//
+// description: maps the key file given with --key and
+//				checks that it holds length characters from
+//				the offset on
+//
+// @param		config - the parsed arguments
+// @param		length - size of the data area
+// @param		mapped - receives the size of the mapping
+// @return		the key, mapped read only, or NULL after
+//				reporting an error
+//..........................................................
+const char* packKey(struct packConfig* config, unsigned long long length, size_t* mapped)
+{
+	const char* key = "";
+	size_t keyLength;
+	struct stat st;
+	int fd;
+
+	*mapped = 0;
+	fd = open(config->keyFile, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		fprintf(stderr, "%sERROR: opening %s: %s%s\n", RED, config->keyFile, strerror(errno), NRM);
+		return NULL;
+	}
+	keyLength = st.st_size;
+	if (keyLength > 0)										// an empty file cannot be mapped
+	{
+		key = mmap(NULL, keyLength, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (key == MAP_FAILED)
+		{
+			fprintf(stderr, "%sERROR: mapping %s%s\n", RED, config->keyFile, NRM);
+			close(fd);
+			return NULL;
+		}
+		*mapped = keyLength;
+		if (key[keyLength - 1] == '\n')
+		{
+			keyLength--;									// the newline is not part of the key
+		}
+	}
+	close(fd);											// the mapping keeps the file open
+
+	if (config->offset > keyLength || length > keyLength - config->offset)
+	{
+		fprintf(stderr, "%sERROR: key '%s' is too short%s\n", RED, config->keyFile, NRM);
+	}
+	else if (!cipherValid(key + config->offset, length))
+	{
+		fprintf(stderr, "%sERROR: invalid characters in %s%s\n", RED, config->keyFile, NRM);
+	}
+	else
+	{
+		return key + config->offset;
+	}
+	if (*mapped > 0)
+	{
+		munmap((void*)key, *mapped);
+	}
+	return NULL;
+}
+
+// packContainer
+//
+// description: the pack command: writes a container of the
+//				input files to stdout
+//
+// @param		config - the parsed arguments
+// @return		the exit value
+//..........................................................
+int packContainer(struct packConfig* config)
+{
+	struct packBuffer buffer;
+	char header[CONTAINER_HEADER];
+	const char* key = NULL;
+	size_t keyMapped = 0;
+	int i, result = 0;
+
+	memset(&buffer, 0, sizeof(buffer));
+	for (i = 0; i < config->operandCount && result == 0; i++)
+	{
+		result = !packFile(&buffer, config->operands[i], config->lines);
+	}
+	if (result == 0 && config->keyFile != NULL)
+	{
+		key = packKey(config, buffer.length, &keyMapped);
+		result = (key == NULL);
+	}
+
+	if (result == 0)
+	{
+		containerPackHeader(header, key ? CONTAINER_KEYS : 0, buffer.count, buffer.length);
+		fwrite(header, 1, CONTAINER_HEADER, stdout);
+		fwrite(buffer.index, CONTAINER_ENTRY, buffer.count, stdout);
+		fwrite(buffer.data, 1, buffer.length, stdout);
+		if (key)
+		{
+			fwrite(key, 1, buffer.length, stdout);
+		}
+		if (fflush(stdout) != 0 || ferror(stdout))
+		{
+			fprintf(stderr, "%sERROR: writing the container to stdout: %s%s\n", RED, strerror(errno), NRM);
+			result = 1;
+		}
+	}
+
+	// garbage collection
+	if (keyMapped > 0)
+	{
+		munmap((void*)(key - config->offset), keyMapped);
+	}
+	free(buffer.data);
+	free(buffer.index);
+	return result;
+}
+
+// openContainer
+//
+// description: maps the container a read command names
+//
+// @param		fileName - the container
+// @param		container - receives it
+// @return		1 on success, 0 after reporting an error
+//..........................................................
+int openContainer(const char* fileName, struct otpContainer* container)
+{
+	switch (containerMap(fileName, container))
+	{
+		case CONTAINER_OK:
+			return 1;
+		case CONTAINER_NOT:
+			if (access(fileName, R_OK) < 0)
+			{
+				fprintf(stderr, "%sERROR: opening %s: %s%s\n", RED, fileName, strerror(errno), NRM);
+				return 0;
+			}
+			fprintf(stderr, "%sERROR: %s is not a container%s\n", RED, fileName, NRM);
+			return 0;
+		default:
+			fprintf(stderr, "%sERROR: %s is not a valid container%s\n", RED, fileName, NRM);
+			return 0;
+	}
+}
+
+// readContainer
+//
+// description: the list, get and unpack commands
+//
+// @param		config - the parsed arguments
+// @return		the exit value
+//..........................................................
+int readContainer(struct packConfig* config)
+{
+	struct otpContainer container;
+	unsigned long long i, offset, index;
+	const char* record;
+	size_t length;
+	char* end;
+	int j, result = 0;
+
+	if (!openContainer(config->operands[0], &container))
+	{
+		return 1;
+	}
+
+	if (strcmp(config->command, "list") == 0)
+	{
+		printf("%s%llu records, %llu characters%s%s\n", CYN, container.count, container.dataLen,
+			container.keys ? ", with keys" : "", NRM);
+		for (i = 0; i < container.count; i++)
+		{
+			record = containerRecord(&container, i, &length);
+			offset = record - container.data;
+			printf("%llu\t%llu\t%zu\n", i, offset, length);
+		}
+	}
+	else if (strcmp(config->command, "get") == 0)
+	{
+		for (j = 1; j < config->operandCount; j++)
+		{
+			errno = 0;
+			index = strtoull(config->operands[j], &end, 10);
+			if (errno != 0 || end == config->operands[j] || *end != '\0' || config->operands[j][0] == '-' ||
+				index >= container.count)
+			{
+				fprintf(stderr, "%sERROR: no record '%s' in %s%s\n", RED, config->operands[j], config->operands[0], NRM);
+				result = 1;
+				break;
+			}
+			record = containerRecord(&container, index, &length);
+			fwrite(record, 1, length, stdout);
+			putchar('\n');
+		}
+	}
+	else
+	{
+		for (i = 0; i < container.count; i++)
+		{
+			record = containerRecord(&container, i, &length);
+			fwrite(record, 1, length, stdout);
+			putchar('\n');
+		}
+	}
+
+	if (fflush(stdout) != 0 || ferror(stdout))
+	{
+		fprintf(stderr, "%sERROR: writing to stdout: %s%s\n", RED, strerror(errno), NRM);
+		result = 1;
+	}
+	munmap((void*)container.base, container.mapped);
+	return result;
+}
+
+// validateArguments
+//
+// description: parses the command, its options and operands
+//
+// @param		argc - the argument count
+// @param		argv - the arguments
+// @param		config - receives them
+// @return		1 if they are usable, else 0
+//..........................................................
+int validateArguments(int argc, char* argv[], struct packConfig* config)
+{
+	static struct option options[] =
+	{
+		{ "key",	required_argument,	NULL, 'k' },
+		{ "offset",	required_argument,	NULL, 'o' },
+		{ "lines",	no_argument,		NULL, 'l' },
+		{ NULL, 0, NULL, 0 }
+	};
+	char* end;
+	int option;
+
+	while ((option = getopt_long(argc, argv, "k:o:l", options, NULL)) != -1)
+	{
+		switch (option)
+		{
+			case 'k':
+				config->keyFile = optarg;
+				break;
+			case 'o':
+				errno = 0;
+				config->offset = strtoull(optarg, &end, 10);
+				if (errno != 0 || end == optarg || *end != '\0' || optarg[0] == '-')
+				{
+					fprintf(stderr, "%sERROR: --offset takes a key offset%s\n", RED, NRM);
+					return 0;
+				}
+				break;
+			case 'l':
+				config->lines = TRUE;
+				break;
+			default:
+				return 0;
+		}
+	}
+
+	if (optind < argc)
+	{
+		config->command = argv[optind++];
+	}
+	config->operands = argv + optind;
+	config->operandCount = argc - optind;
+	if (config->command == NULL ||
+		(strcmp(config->command, "pack") == 0 && config->operandCount >= 1) ||
+		(strcmp(config->command, "list") == 0 && config->operandCount == 1) ||
+		(strcmp(config->command, "get") == 0 && config->operandCount >= 2) ||
+		(strcmp(config->command, "unpack") == 0 && config->operandCount == 1))
+	{
+		if (config->command != NULL)
+		{
+			if (strcmp(config->command, "pack") != 0 && (config->keyFile != NULL || config->offset != 0 || config->lines))
+			{
+				fprintf(stderr, "%sERROR: --key, --offset and --lines only go with pack%s\n", RED, NRM);
+				return 0;
+			}
+			if (config->keyFile == NULL && config->offset != 0)
+			{
+				fprintf(stderr, "%sERROR: --offset needs --key%s\n", RED, NRM);
+				return 0;
+			}
+			return 1;
+		}
+	}
+
+	fprintf(stderr, "%sUsage: %s pack [--key keyfile [--offset N]] [--lines] file... > container%s\n", RED, argv[0], NRM);
+	fprintf(stderr, "%s       %s list container%s\n", RED, argv[0], NRM);
+	fprintf(stderr, "%s       %s get container index...%s\n", RED, argv[0], NRM);
+	fprintf(stderr, "%s       %s unpack container%s\n", RED, argv[0], NRM);
+	return 0;
+}
+
+/**********************************************************
+// MAIN
+// ********************************************************/
+
+int main(int argc, char* argv[])
+{
+	struct packConfig config;
+	static char output[PACK_OUTPUT];
+
+	memset(&config, 0, sizeof(config));
+	if (validateArguments(argc, argv, &config) == 0)
+	{
+		return 1;
+	}
+	setvbuf(stdout, output, _IOFBF, sizeof(output));
+
+	if (strcmp(config.command, "pack") == 0)
+	{
+		return packContainer(&config);
+	}
+	return readContainer(&config);
+}